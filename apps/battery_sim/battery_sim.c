@@ -56,6 +56,17 @@ unsigned int battery_get_cons_norm()
   return (((__BATTERY_INIT_CAP - battery_capacity) >> 15) & 0x000000FF);
 }
 
+unsigned long battery_energy(unsigned long cpu, unsigned long lpm,
+                             unsigned long transmit, unsigned long listen)
+{
+  unsigned long consumed;
+
+  consumed = cpu/1000*4 + lpm/1000000UL*20 + transmit/1000*20 + listen/1000*20; // ampere-ticks
+  consumed *=3; // watt-ticks
+  consumed *= __BATTERY_CONSUMPTION_FACTOR;
+  return consumed;
+}
+
 /**
  * Hurry up and update the battery value
  */
@@ -101,9 +112,7 @@ PROCESS_THREAD(battery_process, ev, data)
 
       PRINTF("[BATT] Ticks diff: CPU=%ld  LPM=%ld  TX=%ld  RX=%ld\n",
           diff.cpu, diff.lpm, diff.transmit, diff.listen);
-      consumed = diff.cpu/1000*4 + diff.lpm/1000000UL*20 + diff.transmit/1000*20 + diff.listen/1000*20; // ampere-ticks
-      consumed *=3; // watt-ticks
-      consumed *= __BATTERY_CONSUMPTION_FACTOR;
+      consumed = battery_energy(diff.cpu, diff.lpm, diff.transmit, diff.listen);
       battery_capacity -= consumed;
 
       if (battery_capacity < __NODE_OFF_THRESHOLD){
@@ -52,6 +52,13 @@ uint8_t battery_get_8bit();
  */
 unsigned int battery_get_cons_norm();
 
+/**
+ * Energy in Watt-ticks used in the given Energest times (in rtimer
+ * ticks) of CPU, LPM, radio transmit and listen.
+ */
+unsigned long battery_energy(unsigned long cpu, unsigned long lpm,
+                             unsigned long transmit, unsigned long listen);
+
 /**
  * Schedule an immediate (1 tick) update of the battery state
  */
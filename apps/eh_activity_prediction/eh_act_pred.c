@@ -5,17 +5,16 @@
 #include "eh_sched_interface.h"
 
 PROCESS(eh_act_pred, "Activity prediction for energy harvesting");
-AUTOSTART_PROCESSES(&eh_act_pred);
+
+// started by eh_sched_process when selected
+const struct eh_sched_driver eh_act_pred_driver = {"act_pred", &eh_act_pred};
 
 #ifndef EH_SET_POINT
 #define EH_SET_POINT 1061683200UL
 //#error "The energy harvesting set point needs to be pre-defined"
 #endif
 
-#define E_CONS_MAX  117964
-#define E_CONS_MIN  155
-uint32_t crt_max_allowed = -1;
-static uint8_t crt_max_allowed_8bit;
+static uint32_t crt_max_allowed = -1;
 
 unsigned int eh_act_pred_max_allowed()
 {
@@ -27,16 +26,6 @@ unsigned int eh_act_pred_max_allowed()
   }
 }
 
-uint32_t eh_sched_get_max_allowed()
-{
-  return crt_max_allowed;
-}
-
-uint8_t eh_sched_get_max_allowed_8bit()
-{
-  return (crt_max_allowed-E_CONS_MIN)*21/10000; // resolution is 461W-ticks
-}
-
 static uint32_t
 get_max_allowed(uint32_t eharv)
 {
@@ -70,20 +59,18 @@ PROCESS_THREAD(eh_act_pred, ev, data)
   static uint32_t eharv;
   PROCESS_BEGIN();
 
-  mallec_event = process_alloc_event();
   while (1){
     PROCESS_WAIT_EVENT();
 
     if (ev == eh_update_event){
+      rtimer_clock_t start = RTIMER_NOW();
       eharv = *(uint32_t*)data;
       
       // determine allowed econs
       get_max_allowed(eharv);
 
-      crt_max_allowed_8bit = eh_sched_get_max_allowed_8bit();
-
       // notify everyone
-      process_post(PROCESS_BROADCAST, mallec_event, &crt_max_allowed_8bit);
+      eh_sched_set_max_allowed(crt_max_allowed, start);
     }
   }
 
@@ -6,46 +6,265 @@
 #include "eh_opt_sched.h"
 #include "optimal_scheduler.h"
 #include "eh_sched_interface.h"
+#if OPTSCHED_OFFLOAD
+#include "dev/serial-line.h"
+#include "optsched_offload.h"
+#endif
+#if OPTSCHED_CHECKPOINT
+#include "optsched_checkpoint.h"
+#endif
 
 PROCESS(eh_optimal_sched, "Activity prediction for energy harvesting");
-AUTOSTART_PROCESSES(&eh_optimal_sched);
 
+// started by eh_sched_process when selected
+const struct eh_sched_driver eh_optimal_sched_driver = {"mallec", &eh_optimal_sched};
+
+/*
+ * With replanning enabled the rest of the cycle is re-solved
+ * in every harvesting slot from the measured battery level
+ * (optsched_replan), instead of only correcting the energy
+ * of the current battery slot.
+ */
+#ifdef EH_OPT_SCHED_CONF_REPLAN
+#define EH_OPT_SCHED_REPLAN EH_OPT_SCHED_CONF_REPLAN
+#else
+#define EH_OPT_SCHED_REPLAN 0
+#endif
+
+/*
+ * With OPTSCHED_CONF_SLICED the daily plan is computed a slice at
+ * a time, polling this process between slices so that the other
+ * processes get to run; the previous allowance stays in service
+ * until the new plan is ready.
+ */
+#if OPTSCHED_SLICED
+#define run_pending() optsched_busy()
+#else
+#define run_pending() 0
+#endif
 
-static uint8_t current_battery_slot;   // battery slot
-static uint8_t remaining_slots; // battery slot length
-static int32_t remaining_energy; // in the battery slot
+/*
+ * With OPTSCHED_CONF_OFFLOAD the plan of each cycle is asked from
+ * the planning service at the other end of the serial line (see
+ * optsched_offload.h), and only computed here when the reply doesn't
+ * come within EH_OPT_SCHED_CONF_OFFLOAD_TIMEOUT or is broken. The
+ * previous allowance stays in service meanwhile.
+ */
+#if OPTSCHED_OFFLOAD
+#ifdef EH_OPT_SCHED_CONF_OFFLOAD_TIMEOUT
+#define EH_OPT_SCHED_OFFLOAD_TIMEOUT EH_OPT_SCHED_CONF_OFFLOAD_TIMEOUT
+#else
+#define EH_OPT_SCHED_OFFLOAD_TIMEOUT (10*CLOCK_SECOND)
+#endif
+
+static struct etimer offload_timer;
+static uint8_t offload_pending;
+static uint16_t offload_seq;
+#define plan_pending() (offload_pending || run_pending())
+#else
+#define plan_pending() run_pending()
+#endif
+
+/*
+ * With OPTSCHED_CONF_CHECKPOINT each new plan is saved in flash for
+ * the day of eh_pred, and put back in service when the node restarts
+ * during that day, to be replanned from the battery level as when the
+ * scheduler is selected in the middle of a cycle.
+ */
+#if OPTSCHED_CHECKPOINT
+#if !EH_PRED_CHECKPOINT
+#error "The plan checkpoints need the day of the prediction, set EH_PRED_CONF_CHECKPOINT"
+#endif
+static uint8_t checkpoint_read;   // once after a restart
+static uint32_t plan_battery;     // level the plan being made is run from
+#endif
+
+/*
+ * The allowance tracks the battery level planned at the start of each
+ * harvesting slot (optsched_get_slot_plan()) with a PI
+ * controller: on top of the planned consumption, it spends
+ * KP/256 of the tracking error and KI/256 of its sum over the slots,
+ * per base period. The integral is only updated while the allowance
+ * is within [E_CONS_MIN, E_CONS_MAX], or when the error brings it
+ * back (anti-windup), and it is reset with each new plan (so in
+ * every slot with EH_OPT_SCHED_CONF_REPLAN).
+ *
+ * The default KP recovers an error over 64 base periods.
+ */
+#ifdef EH_OPT_SCHED_CONF_KP
+#define EH_OPT_SCHED_KP EH_OPT_SCHED_CONF_KP
+#else
+#define EH_OPT_SCHED_KP 4
+#endif
+
+#ifdef EH_OPT_SCHED_CONF_KI
+#define EH_OPT_SCHED_KI EH_OPT_SCHED_CONF_KI
+#else
+#define EH_OPT_SCHED_KI 1
+#endif
+
+/*
+ * Confidence, in percent, that the battery stays within the limits
+ * the plan keeps margins from (EH_OPT_SCHED_CONF_MARGINS, the
+ * OPTSCHED_MARGIN_ sides) when the harvest misses the prediction,
+ * judging by the past errors of the predictor. 50 plans up to the
+ * limits.
+ */
+#if OPTSCHED_RISK && EH_PRED_DEVIATION
+#ifdef EH_OPT_SCHED_CONF_CONFIDENCE
+#define EH_OPT_SCHED_CONFIDENCE EH_OPT_SCHED_CONF_CONFIDENCE
+#else
+#define EH_OPT_SCHED_CONFIDENCE 90
+#endif
+
+#ifdef EH_OPT_SCHED_CONF_MARGINS
+#define EH_OPT_SCHED_MARGINS EH_OPT_SCHED_CONF_MARGINS
+#else
+#define EH_OPT_SCHED_MARGINS OPTSCHED_MARGIN_LOW
+#endif
+#endif
+
+// bound of the integral, well past the point where it saturates
+#define TRACK_INTEGRAL_MAX 0x3FFFFFFFL
+
+/*
+ * Battery slot in service, from 1, or 0 after a new plan. It is
+ * only tracked to report the slot changes; the allowance is per
+ * base period and computed at the start of each harvesting slot.
+ */
+static uint8_t current_battery_slot;
+static int32_t track_integral; // sum of the tracking errors, Watt-ticks
 static uint32_t crt_max_allowed = -1;
-static uint8_t crt_max_allowed_8bit = -1;
 
-uint32_t eh_sched_get_max_allowed()
+/**
+ * Returns the allowance for the planned consumption @e_cons and the
+ * tracking error @error (measured minus planned level), updating
+ * the integral.
+ */
+static uint32_t track_plan(uint32_t e_cons, int32_t error)
 {
-  return crt_max_allowed;
+  int64_t integral, u;
+
+  integral = (int64_t)track_integral + error;
+  if (integral > TRACK_INTEGRAL_MAX) integral = TRACK_INTEGRAL_MAX;
+  if (integral < -TRACK_INTEGRAL_MAX) integral = -TRACK_INTEGRAL_MAX;
+
+  u = e_cons + (((int64_t)EH_OPT_SCHED_KP*error +
+                 (int64_t)EH_OPT_SCHED_KI*integral) >> 8);
+
+  if (u < E_CONS_MIN){
+    u = E_CONS_MIN;
+    if (error > 0) track_integral = integral;
+  }else if (u > E_CONS_MAX){
+    u = E_CONS_MAX;
+    if (error < 0) track_integral = integral;
+  }else{
+    track_integral = integral;
+  }
+  return u;
 }
 
-uint8_t eh_sched_get_max_allowed_8bit()
+static void print_plan_status()
 {
-  return (crt_max_allowed-E_CONS_MIN)*21/10000; // resolution is 461W-ticks
+  const OptschedStatus *status = optsched_get_status();
+
+  if (status->error != OPTSCHED_OK){
+    printf("Plan error %u in battery slot %u (slot %u), residual %lu\n",
+        status->error, status->battery_slot, status->harv_slot, status->residual);
+  }
+  if (status->fallback){
+    printf("Fallback plan in service, offset %ld\n", status->offset);
+  }
+  if (status->reservation){
+    printf("Reservation %u cannot be met\n", status->reservation - 1);
+  }
+#if OPTSCHED_RISK
+  if (status->margin){
+    printf("Margin %lu\n", status->margin);
+  }
+#endif
 }
 
-uint8_t eh_act_pred_max_allowed()
+/**
+ * Starts the cycle of a new plan.
+ */
+static void new_plan()
 {
-  if (crt_max_allowed == -1){
-    return 255;
-  }else{
-    // max is 2^20-1, so we scale down to 8bits
-    return crt_max_allowed >> 12;
-  }
+  current_battery_slot = 0;
+  track_integral = 0;
+#if OPTSCHED_CHECKPOINT
+  optsched_checkpoint_save(eh_pred_get_day(), plan_battery);
+#endif
+  printf("Number of battery slots in this cycle: %u\n", 
+      get_number_of_battery_slots());
+  print_plan_status();
+}
+
+/**
+ * Computes the plan of the cycle from @battery, a slice at a time
+ * with OPTSCHED_SLICED (the process is polled for the slices).
+ */
+static void run_plan(uint32_t battery, uint32_t min_e_cons)
+{
+#if OPTSCHED_CHECKPOINT
+  plan_battery = battery;
+#endif
+#if OPTSCHED_SLICED
+  optsched_start(battery,
+                 BATT_MAX,
+                 min_e_cons,
+                 0,   // run without offset correction
+                 eh_pred_get_cycle_prediction());
+  process_poll(&eh_optimal_sched);
+#else
+  optsched_run(battery,
+               BATT_MAX,
+               min_e_cons,
+               0,   // run without offset correction
+               eh_pred_get_cycle_prediction());
+  new_plan();
+#endif
 }
 
 PROCESS_THREAD(eh_optimal_sched, ev, data)
 {
   static uint32_t min_e_cons;
-  static uint32_t sum_eh_pred_in_slot;
+  /*
+   * Selected in the middle of a cycle (see eh_sched_select), so
+   * the plan has to catch up with the current slot first.
+   */
+  static uint8_t resume;
+  // a new plan came in service, the allowance has to follow
+  static uint8_t plan_in;
   PROCESS_BEGIN();
-  remaining_slots = 0;
+  track_integral = 0;
+  resume = 1;
+  plan_in = 0;
+
+  // the process is started again each time it is selected
+  if (mallec_plan_event == 0){
+    mallec_plan_event = process_alloc_event();
+  }
+#if OPTSCHED_SLICED
+  if (run_pending()){
+    // carry on with the run that was in progress when deselected
+    process_poll(&eh_optimal_sched);
+  }
+#endif
+#if OPTSCHED_OFFLOAD
+  if (offload_pending){
+    // the timer went with the process, wait the reply from now on
+    etimer_set(&offload_timer, EH_OPT_SCHED_OFFLOAD_TIMEOUT);
+  }
+#endif
 
-  // init mallec event
-  mallec_event = process_alloc_event();
+#if OPTSCHED_SLOT_GRID
+  optsched_set_slot_grid(eh_pred_get_slot_grid());
+#endif
+#ifdef EH_OPT_SCHED_CONFIDENCE
+  optsched_set_risk(EH_OPT_SCHED_CONFIDENCE, eh_pred_get_cycle_deviation(),
+                    EH_OPT_SCHED_MARGINS);
+#endif
 
   /*
    * min e cons is sending 1 packet/min
@@ -56,94 +275,203 @@ PROCESS_THREAD(eh_optimal_sched, ev, data)
   while (1){
     PROCESS_WAIT_EVENT();
 
+#if OPTSCHED_OFFLOAD
+    if (ev == serial_line_event_message && data != NULL && offload_pending){
+      switch (optsched_offload_input(data, eh_pred_get_cycle_prediction())){
+        case OPTSCHED_OFFLOAD_READY:
+          // as a sliced run, then work out the allowance when polled
+          offload_pending = 0;
+          etimer_stop(&offload_timer);
+          new_plan();
+          process_post(PROCESS_BROADCAST, mallec_plan_event, NULL);
+          plan_in = 1;
+          process_poll(&eh_optimal_sched);
+          break;
+        case OPTSCHED_OFFLOAD_ERROR:
+          printf("Offload failed, planning locally\n");
+          offload_pending = 0;
+          etimer_stop(&offload_timer);
+          run_plan(battery_get(), min_e_cons);
+          break;
+      }
+      continue;
+    }
+    if (ev == PROCESS_EVENT_TIMER && data == &offload_timer && offload_pending){
+      printf("Offload timed out, planning locally\n");
+      optsched_offload_cancel();
+      offload_pending = 0;
+      run_plan(battery_get(), min_e_cons);
+      continue;
+    }
+#endif
+
+#if EH_PRED_FORECAST
+    if (ev == eh_pred_forecast_event){
+      /*
+       * The prediction has changed: the rest of the plan is solved
+       * again from now, unless there is none yet or one is on the way
+       * (it reads the prediction as it is).
+       */
+      if (resume || plan_pending() || get_number_of_battery_slots() == 0){
+        continue;
+      }
+      optsched_replan(eh_pred_get_slot_number(),
+                      battery_get(),
+                      BATT_MAX,
+                      min_e_cons,
+                      eh_pred_get_cycle_prediction());
+      current_battery_slot = 0;
+      track_integral = 0;
+      print_plan_status();
+      // the allowance of the slot in progress, when polled
+      plan_in = 1;
+      process_poll(&eh_optimal_sched);
+      continue;
+    }
+#endif
+
+#if OPTSCHED_SLICED
+    if (ev == PROCESS_EVENT_POLL && run_pending()){
+      if (optsched_step() == OPTSCHED_BUSY){
+        // more to do, but let the other processes run first
+        process_poll(&eh_optimal_sched);
+        continue;
+      }
+      /*
+       * The new plan is in service. The run is started in slot 0 and
+       * is much shorter than a harvesting slot, so start the cycle
+       * and work out the allowance for the slot in progress.
+       */
+      new_plan();
+      process_post(PROCESS_BROADCAST, mallec_plan_event, NULL);
+      plan_in = 1;
+    }
+#endif
+
     /*
      * We need to listen for eh_update events
      * so that we can determine when we start
-     * a cycle
+     * a cycle. The allowance is otherwise only
+     * worked out again for a new plan, not for
+     * the other polls (steps of a run, ...).
      */
-    if (ev == eh_update_event){
+    if (ev == eh_update_event || (ev == PROCESS_EVENT_POLL && plan_in)){
       uint32_t current_battery;
-      uint8_t slot_id;
-      uint32_t e_cons_est_per_slot;
-      uint32_t b_i_est;
+      uint16_t slot_id;
+      uint8_t slot_offset;
+      OptschedSlotPlan slot_plan;
+      rtimer_clock_t start = RTIMER_NOW();
 
       slot_id = eh_pred_get_slot_number();
+      slot_offset = eh_pred_get_slot_offset();
       current_battery = battery_get();
 
-      if (slot_id == 0){
+      if (slot_id == 0 && slot_offset == 0 && ev == eh_update_event){
+#if OPTSCHED_MAX_RESERVATIONS
+        if (get_number_of_battery_slots() != 0){
+          // a day of the previous horizon is over
+          optsched_shift_reservations(SLOTS_PER_DAY);
+        }
+#endif
         // generate optimal schedule
-        optsched_run(current_battery,
-                     BATT_MAX,
-                     min_e_cons,
-                     0,   // run without offset correction
-                     eh_pred_get_cycle_prediction());
+#if OPTSCHED_OFFLOAD
+        if (!run_pending()){
+          optsched_offload_request(++offload_seq,
+                                   current_battery,
+                                   BATT_MAX,
+                                   min_e_cons,
+                                   eh_pred_get_cycle_prediction());
+          offload_pending = 1;
+          etimer_set(&offload_timer, EH_OPT_SCHED_OFFLOAD_TIMEOUT);
+#if OPTSCHED_CHECKPOINT
+          plan_battery = current_battery;
+#endif
+        }
+#else
+        run_plan(current_battery, min_e_cons);
+#endif
+        resume = 0;
+      }
+      else if (resume && ev == eh_update_event && !plan_pending()){
+#if OPTSCHED_CHECKPOINT
+        if (get_number_of_battery_slots() == 0 && !checkpoint_read){
+          // restarted, the plan of the day may be in flash
+          checkpoint_read = 1;
+          if (optsched_checkpoint_restore(eh_pred_get_day(),
+                                          eh_pred_get_cycle_prediction()) == 0){
+            printf("Plan restored, %u battery slots\n", get_number_of_battery_slots());
+          }
+        }
+#endif
+        if (get_number_of_battery_slots() == 0){
+          // no plan until the next cycle starts
+          eh_sched_set_max_allowed(E_CONS_MIN, start);
+          continue;
+        }
+        optsched_replan(slot_id,
+                        current_battery,
+                        BATT_MAX,
+                        min_e_cons,
+                        eh_pred_get_cycle_prediction());
         current_battery_slot = 0;
-        remaining_slots = 0;
-
-        // print the number of battery slots
-        printf("Number of battery slots in this cycle: %u\n", 
-            get_number_of_battery_slots());
+        track_integral = 0;
+        resume = 0;
       }
+#if EH_OPT_SCHED_REPLAN
+      else if (slot_offset == 0 && !plan_pending()){
+        optsched_replan(slot_id,
+                        current_battery,
+                        BATT_MAX,
+                        min_e_cons,
+                        eh_pred_get_cycle_prediction());
+        // the current battery slot now starts in this harvesting slot
+        current_battery_slot = 0;
+        track_integral = 0;
+        if (optsched_get_status()->fallback) print_plan_status();
+      }
+#endif
 
-      if (remaining_slots == 0){
-        // we are starting a new battery slot
-        current_battery_slot ++;
+      if (plan_pending()){
+        // keep the previous allowance until the new plan is ready
+        continue;
+      }
 
-        // OLD remaining_energy = get_battery_slot_total_e_cons(current_battery_slot);
-        sum_eh_pred_in_slot = 0;
+      if (optsched_get_slot_plan(slot_id, &slot_plan)){
+        // no plan until the next cycle starts
+        eh_sched_set_max_allowed(E_CONS_MIN, start);
+        continue;
+      }
 
-        // print the max e cons in this slot
-        printf("Total energy available in this slot: %lu\n", remaining_energy);
+      if (slot_plan.battery_slot != current_battery_slot){
+        // we are starting a new battery slot
+        current_battery_slot = slot_plan.battery_slot;
 
         printf("Slot type is %u\n", get_battery_slot_type(current_battery_slot));
-
-        // keep track of the next battery slot
-        remaining_slots = get_battery_slot_length(current_battery_slot);
-        printf("Next battery slot starts at %u\n", slot_id+remaining_slots);
+        printf("Next battery slot starts at %u\n",
+            get_battery_slot_start(current_battery_slot) +
+            get_battery_slot_length(current_battery_slot));
+        // a new plan may come in service in the middle of a slot
+        slot_offset = 0;
       }
+      if (plan_in){
+        // in service from the middle of the slot
+        plan_in = 0;
+        slot_offset = 0;
+      }
+
+      /*
+       * The planned level is only known at the start of a harvesting
+       * slot, the allowance is kept for the rest of the slot.
+       */
+      if (slot_offset == 0){
+        int32_t error = current_battery - slot_plan.battery;
 
-      // 1. determine batt(i) estimate
-      e_cons_est_per_slot = get_battery_slot_total_e_cons(current_battery_slot)/
-                            get_battery_slot_length(current_battery_slot);
-      b_i_est = get_battery_slot_start_level(current_battery_slot) + 
-                sum_eh_pred_in_slot -
-                e_cons_est_per_slot *
-                  (get_battery_slot_length(current_battery_slot) - remaining_slots);
-
-      // 2. adjust remaining energy to account for eh_pred and eh_cons errs
-      remaining_energy = e_cons_est_per_slot * remaining_slots +
-                         current_battery - b_i_est;
-
-      printf("Estimated %lu actual %lu.", b_i_est, current_battery);
-      printf("Slot start %lu, sum_eh_pred %lu, e_cons_p_s %lu\n",
-          get_battery_slot_start_level(current_battery_slot),
-          sum_eh_pred_in_slot,
-          e_cons_est_per_slot);
-
-
-      // determine allowed econs
-      if (remaining_energy < (int32_t)remaining_slots * E_CONS_MIN){
-        // not enough energy until the end of the battery slot
-        crt_max_allowed = E_CONS_MIN;
-      }else{
-        crt_max_allowed = remaining_energy/remaining_slots;
+        crt_max_allowed = track_plan(slot_plan.e_cons, error);
+        printf("Track slot %u: planned %lu actual %lu error %ld integral %ld e_cons_p_s %lu allowed %lu\n",
+            slot_id, slot_plan.battery, current_battery, error,
+            track_integral, slot_plan.e_cons, crt_max_allowed);
       }
-      crt_max_allowed_8bit = eh_sched_get_max_allowed_8bit();
-      printf("Allowed %lu =%ld/%u\n", crt_max_allowed, remaining_energy, remaining_slots);
-      process_post(PROCESS_BROADCAST, mallec_event, &crt_max_allowed_8bit);
-
-      /* --------------------- OLD ECONS ADAPTATION -------------- */
-#if 0
-      remaining_slots --;
-      remaining_energy -= crt_max_allowed;
-      // change the remaining e_cons accounting for prediction errors
-      remaining_energy += *(uint32_t*)data - eh_pred_get_slot(slot_id);
-#endif
-      /* -------------------------------------------------------- */
-
-      // 3. add the eh_pred to the tracking sum
-      sum_eh_pred_in_slot += eh_pred_get_cycle_prediction(); 
-      remaining_slots --;
+      eh_sched_set_max_allowed(crt_max_allowed, start);
     }
   }
 
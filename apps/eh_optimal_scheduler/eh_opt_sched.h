@@ -3,6 +3,13 @@
 
 PROCESS_NAME(eh_optimal_sched);
 
+/*
+ * Posted (broadcast) when a new plan is put in service
+ * with time-sliced planning (OPTSCHED_CONF_SLICED), or
+ * offloaded planning (OPTSCHED_CONF_OFFLOAD).
+ */
+process_event_t mallec_plan_event;
+
 /**
  * Returns the maximum allowed energy consumption
  * at this moment in time (in this current slot).
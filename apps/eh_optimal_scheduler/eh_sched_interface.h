@@ -1,8 +0,0 @@
-#ifndef __EH_SCHED_IFACE
-#define __EH_SCHED_IFACE
-
-uint32_t eh_sched_get_max_allowed();
-uint8_t eh_sched_get_max_allowed_8bit();
-
-process_event_t mallec_event;
-#endif
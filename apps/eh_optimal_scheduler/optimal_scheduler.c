@@ -1,147 +1,801 @@
 #include "optimal_scheduler_private.h"
 #include <stdio.h>
-
-// this will hold the estimated battery values
-// TODO it's quite likely that the number of battery slots will be 
-// half the number of harvesting slots (given that half of the cycle
-// it's dark).
+#include <string.h>
 
 #define PRINTF(FORMAT, args...) while(0){}
 //#define PRINTF printf
 
-static BatterySlot battery_slots[40];
-static uint8_t num_battery_slots;
+// this will hold the estimated battery values
+static OPTSCHED_THREAD BatterySlots battery_slots;
+static OPTSCHED_THREAD uint8_t num_battery_slots;
+// battery slots before this one are in the past (see optsched_replan)
+static OPTSCHED_THREAD uint8_t first_battery_slot;
+
+#if OPTSCHED_SLICED
+/*
+ * The plan in service, read by the getters, while a new one is
+ * computed in battery_slots by optsched_step.
+ */
+static OPTSCHED_THREAD BatterySlots plan_slots;
+static OPTSCHED_THREAD uint8_t plan_num_battery_slots;
+static OPTSCHED_THREAD uint8_t plan_first_battery_slot;
+
+// pass of the time-sliced run in progress, OPTSCHED_PASS_DONE if none
+static OPTSCHED_THREAD uint8_t sliced_pass = OPTSCHED_PASS_DONE;
+static OPTSCHED_THREAD uint32_t sliced_battery_start;
+static OPTSCHED_THREAD uint32_t sliced_battery_end;
+
+static OPTSCHED_THREAD OptschedStatus status;
+static OPTSCHED_THREAD OptschedStatus plan_status;
+
+static void publish_plan()
+{
+  memcpy(&plan_slots, &battery_slots, sizeof(plan_slots));
+  plan_num_battery_slots = num_battery_slots;
+  plan_first_battery_slot = first_battery_slot;
+  plan_status = status;
+  sliced_pass = OPTSCHED_PASS_DONE;
+}
+#else
+static OPTSCHED_THREAD OptschedStatus status;
+
+#define plan_slots battery_slots
+#define plan_num_battery_slots num_battery_slots
+#define plan_first_battery_slot first_battery_slot
+#define plan_status status
+#define publish_plan()
+#endif
 
 /**
- * The first pass determines the battery slots as periods of time
- * where the battery is monotonous (increasing, decreasing or constant).
- *
- * It also checks for some basic failures.
+ * Records an error of type @error in battery slot @index, with
+ * @residual the energy (in the scheduler unit) that is left over.
+ * Only the first error of a run is kept.
  */
-static int8_t optsched_first_pass(uint32_t batt_0, uint32_t e_min, uint32_t *harvested)
+static void report_error(uint8_t error, uint8_t index, uint32_t residual)
+{
+  PRINTF("Error %u in battery slot %u, residual %lu\n", error, index, residual);
+  if (status.error != OPTSCHED_OK) return;
+  status.error = error;
+  status.battery_slot = index + 1;
+  status.harv_slot = battery_slots.start_slot[index];
+  status.residual = from_unit(residual);
+}
+
+static void reset_status()
+{
+  memset(&status, 0, sizeof(status));
+}
+
+/*
+ * The slot grid covers a day and the prediction
+ * OPTSCHED_PREDICTION_DAYS, the rest of the horizon repeats them.
+ */
+#if OPTSCHED_HORIZON_DAYS > 1
+#define day_slot(I) ((I) % SLOTS_PER_DAY)
+#else
+#define day_slot(I) (I)
+#endif
+
+#if OPTSCHED_HORIZON_DAYS > OPTSCHED_PREDICTION_DAYS
+#define prediction_slot(I) ((I) % OPTSCHED_PREDICTION_SLOTS)
+#else
+#define prediction_slot(I) (I)
+#endif
+
+#if OPTSCHED_MAX_RESERVATIONS
+/*
+ * Reserved energy per harvesting slot of the window, in the scheduler
+ * unit; the entries with length 0 are free.
+ */
+typedef struct reservations{
+  uint32_t per_slot[OPTSCHED_MAX_RESERVATIONS];
+  optsched_slot_t start[OPTSCHED_MAX_RESERVATIONS];
+  optsched_slot_t length[OPTSCHED_MAX_RESERVATIONS];
+} Reservations;
+
+static OPTSCHED_THREAD Reservations reservations;
+
+// energy reserved by @held in harvesting slot @harv_slot of the horizon
+static uint32_t reserved_in(const Reservations *held, uint16_t harv_slot)
+{
+  uint8_t i;
+  uint32_t energy = 0;
+
+  for (i = 0; i < OPTSCHED_MAX_RESERVATIONS; i++){
+    if ((uint16_t)(harv_slot - held->start[i]) < held->length[i]){
+      energy += held->per_slot[i];
+    }
+  }
+  return energy;
+}
+
+#define reserved_energy(I) reserved_in(&reservations, (I))
+
+// whether any reservation is held, so that the walks can skip them
+static uint8_t reservations_held()
+{
+  uint8_t i;
+
+  for (i = 0; i < OPTSCHED_MAX_RESERVATIONS; i++){
+    if (reservations.length[i]) return 1;
+  }
+  return 0;
+}
+#else
+#define reserved_energy(I) 0
+#define reservations_held() 0
+#endif
+
+/*
+ * Predicted harvest of slot @I of the horizon, less the energy
+ * reserved in it, in the scheduler unit. It is negative when more is
+ * reserved than harvested.
+ */
+#define harvest(HARVESTED, I) ((int32_t)to_unit((HARVESTED)[prediction_slot(I)]) - \
+                               (int32_t)reserved_energy(I))
+// the same, without looking for reservations
+#define unreserved_harvest(HARVESTED, I) ((int32_t)to_unit((HARVESTED)[prediction_slot(I)]))
+
+#if OPTSCHED_RISK
+OPTSCHED_THREAD uint32_t optsched_margin_low, optsched_margin_high;
+
+static OPTSCHED_THREAD const uint32_t *risk_deviation;
+static OPTSCHED_THREAD uint8_t risk_margins;
+static OPTSCHED_THREAD uint8_t risk_z;
+static OPTSCHED_THREAD uint32_t risk_margin;   // of the last run
+static OPTSCHED_THREAD uint8_t risk_fixed;     // set by optsched_fix_margin(), not computed
+
+/*
+ * One-sided quantiles of the normal distribution, times 1.25 to turn
+ * the mean absolute error into a standard deviation, in 1/16.
+ */
+static const uint8_t risk_confidence[] = {50, 70, 80, 90, 95, 99};
+static const uint8_t risk_quantile[] = {0, 10, 17, 26, 33, 47, 62};
+
+void optsched_set_risk(uint8_t confidence, const uint32_t *deviation,
+                       uint8_t margins)
+{
+  uint8_t i;
+
+  for (i = 0; i < sizeof(risk_confidence); i++){
+    if (confidence <= risk_confidence[i]) break;
+  }
+  risk_z = risk_quantile[i];
+  risk_deviation = deviation;
+  risk_margins = margins;
+  risk_fixed = 0;
+}
+
+// integer square root, bit by bit
+static uint32_t isqrt(uint64_t n)
+{
+  uint64_t root = 0, bit = (uint64_t)1 << 62;
+
+  while (bit > n) bit >>= 2;
+  while (bit != 0){
+    if (n >= root + bit){
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    }else{
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+/**
+ * Applies the margin of the run to the limits, for a plan that
+ * starts at @batt_level. The passes cannot bring a start above
+ * PLAN_BATT_MAX down, so the high margin only covers the room left
+ * above it; a start below PLAN_BATT_MIN gets the fallback plan.
+ */
+static void apply_margins(uint32_t batt_level)
+{
+  optsched_margin_low = optsched_margin_high = 0;
+  if (risk_margins & OPTSCHED_MARGIN_LOW){
+    optsched_margin_low = risk_margin;
+  }
+  if (risk_margins & OPTSCHED_MARGIN_HIGH){
+    optsched_margin_high = batt_level < U_BATT_MAX ?
+                           min(risk_margin, U_BATT_MAX - batt_level) : 0;
+  }
+  status.margin = from_unit(max(optsched_margin_low, optsched_margin_high));
+}
+
+/**
+ * Sets the margin of a run from the deviation of the prediction
+ * over the horizon, in a walk over the harvesting slots.
+ */
+static void compute_margin()
 {
   uint16_t harv_i;
-  uint8_t batt_i = 0; // this represents the current battery slot
-  uint8_t crt_slot_type;
-  uint32_t harv_slot_e_cons;
+  uint64_t variance = 0;
+
+  if (risk_fixed) return;
+  risk_margin = 0;
+  if (risk_deviation != NULL && risk_z != 0 && risk_margins != 0){
+    for (harv_i = 0; harv_i < OPTSCHED_HORIZON_SLOTS; harv_i++){
+      uint32_t dev = to_unit(risk_deviation[prediction_slot(harv_i)]);
+      variance += (uint64_t)dev*dev;
+    }
+    risk_margin = ((uint64_t)isqrt(variance)*risk_z) >> 4;
+    risk_margin = min(risk_margin, U_BATT_CAPACITY/4);
+    PRINTF("Margin %lu\n", risk_margin);
+  }
+}
+
+// the margin of a run that starts at @batt_level
+static void set_margins(uint32_t batt_level)
+{
+  compute_margin();
+  apply_margins(batt_level);
+}
+
+#if OPTSCHED_OFFLOAD
+uint32_t optsched_get_margin(uint8_t *margins)
+{
+  compute_margin();
+  *margins = risk_margins;
+  return from_unit(risk_margin);
+}
+
+void optsched_fix_margin(uint32_t margin, uint8_t margins)
+{
+  risk_margin = to_unit(margin);
+  risk_margins = margins;
+  risk_fixed = 1;
+}
+#endif
+#else
+#define set_margins(BATT)
+#define apply_margins(BATT)
+#endif
+
+#if OPTSCHED_SLOT_GRID
+// base periods in each harvesting slot, NULL if they are all one
+static OPTSCHED_THREAD const uint8_t *slot_duration;
+
+void optsched_set_slot_grid(const uint8_t *duration)
+{
+  slot_duration = duration;
+}
+
+#define harv_slot_duration(I) (slot_duration ? slot_duration[day_slot(I)] : 1)
+#else
+#define harv_slot_duration(I) 1
+#endif
+
+/*
+ * Where the plan in service starts: the harvesting slot and the
+ * measured battery level the run or replan was given, and the
+ * prediction it was made from.
+ */
+static OPTSCHED_THREAD struct{
+  uint32_t *harvested;
+  uint32_t level;
+  uint16_t harv_slot;
+} plan_start;
+
+#if OPTSCHED_MAX_RESERVATIONS && !OPTSCHED_SLOT_TABLE
+/*
+ * The reservations the plan in service was made with. Without the slot
+ * table the plan is followed with them, as the table would have been
+ * filled, so that the ones taken since show as a shortfall.
+ */
+static OPTSCHED_THREAD Reservations plan_reservations;
+
+#define keep_plan_reservations() \
+  memcpy(&plan_reservations, &reservations, sizeof(plan_reservations))
+#define planned_harvest(HARVESTED, I) (unreserved_harvest(HARVESTED, I) - \
+                                       (int32_t)reserved_in(&plan_reservations, (I)))
+#else
+#define keep_plan_reservations()
+#define planned_harvest(HARVESTED, I) harvest(HARVESTED, I)
+#endif
+
+#if !OPTSCHED_SLOT_TABLE || OPTSCHED_MAX_RESERVATIONS
+/**
+ * Follows the plan in service from harvesting slot @harv_i, in battery
+ * slot *@batt_i, with the battery at @level, to the start of harvesting
+ * slot @harv_slot, the way build_slot_table() does: with the
+ * reservations of the plan if @as_planned, else with the ones held
+ * now. *@empty, if not NULL, is set when the battery runs out on the
+ * way. Leaves *@batt_i at the battery slot of @harv_slot and returns
+ * the level.
+ */
+static uint32_t follow_plan(uint16_t harv_i,
+                            uint8_t *batt_i,
+                            uint32_t level,
+                            uint16_t harv_slot,
+                            uint8_t as_planned,
+                            uint8_t *empty)
+{
+  uint8_t i = *batt_i;
+  uint32_t e_cons_per_period;
+
+  e_cons_per_period = plan_slots.total_e_cons[i]/batt_slot_duration(&plan_slots, i);
+  for (;; harv_i++){
+    while (i + 1 < plan_num_battery_slots &&
+           harv_i >= plan_slots.start_slot[i] + plan_slots.length[i]){
+      i++;
+      e_cons_per_period = plan_slots.total_e_cons[i]/batt_slot_duration(&plan_slots, i);
+    }
+    if (harv_i == harv_slot) break;
+    level += (as_planned ? planned_harvest(plan_start.harvested, harv_i) :
+                           harvest(plan_start.harvested, harv_i)) -
+             e_cons_per_period*harv_slot_duration(harv_i);
+    // the battery is clipped at its limits, the plan is not
+    if (level > U_BATT_MAX){
+      level = U_BATT_MAX;
+    }else if (level < U_BATT_MIN){
+      level = U_BATT_MIN;
+      if (empty) *empty = 1;
+    }
+  }
+  *batt_i = i;
+  return level;
+}
+#endif
+
+#if OPTSCHED_SLOT_TABLE
+/*
+ * The plan in service per harvesting slot: the battery slot and the
+ * expected level at the start of the slot, above U_BATT_MIN in units
+ * of 2^level_shift; and the rate of each battery slot per base period.
+ */
+static OPTSCHED_THREAD struct{
+  uint32_t e_cons[OPTSCHED_MAX_BATTERY_SLOTS];
+  uint16_t level[OPTSCHED_HORIZON_SLOTS];
+  uint8_t battery_slot[OPTSCHED_HORIZON_SLOTS];
+  uint8_t level_shift;
+} slot_table;
+
+// consumption per base period of battery slot @I of the plan in service
+#define plan_slot_rate(I) slot_table.e_cons[I]
+
+/**
+ * Fills the slot table from harvesting slot @harv_slot, where the
+ * battery is at @batt_level, until the end of the horizon, following
+ * the prediction @harvested and the battery slots from
+ * first_battery_slot. Called as the plan is published.
+ */
+static void build_slot_table(uint16_t harv_slot,
+                             uint32_t batt_level,
+                             uint32_t *harvested)
+{
+  uint8_t i;
+  uint16_t end_slot;
+  uint32_t e_cons_per_period;
+
+  plan_start.harvested = harvested;
+  plan_start.level = batt_level;
+  plan_start.harv_slot = harv_slot;
+
+  slot_table.level_shift = 0;
+  while ((U_BATT_CAPACITY >> slot_table.level_shift) > 0xFFFF){
+    slot_table.level_shift++;
+  }
+
+  for (i = first_battery_slot; i < num_battery_slots; i++){
+    e_cons_per_period = battery_slots.total_e_cons[i]/
+                        batt_slot_duration(&battery_slots, i);
+    slot_table.e_cons[i] = e_cons_per_period;
+    end_slot = battery_slots.start_slot[i] + battery_slots.length[i];
+    for (; harv_slot < end_slot; harv_slot++){
+      slot_table.battery_slot[harv_slot] = i;
+      slot_table.level[harv_slot] = (batt_level - U_BATT_MIN) >> slot_table.level_shift;
+      batt_level += harvest(harvested, harv_slot) -
+                    e_cons_per_period*harv_slot_duration(harv_slot);
+      // the battery is clipped at its limits, the plan is not
+      if (batt_level > U_BATT_MAX) batt_level = U_BATT_MAX;
+      else if (batt_level < U_BATT_MIN) batt_level = U_BATT_MIN;
+    }
+  }
+}
+#else
+/*
+ * Without the slot table, optsched_get_slot_plan() follows the plan in
+ * service from its start, and keeps its place so that slots asked in
+ * order cost a step.
+ */
+static OPTSCHED_THREAD struct{
+  uint32_t level;
+  uint16_t harv_slot;
+  uint8_t battery_slot;
+} slot_walk;
+
+// the rates are divided out as they are asked
+#define plan_slot_rate(I) (plan_slots.total_e_cons[I]/batt_slot_duration(&plan_slots, I))
+
+#define build_slot_table(HARV_SLOT, BATT_LEVEL, HARVESTED) do{ \
+    plan_start.harvested = (HARVESTED); \
+    plan_start.harv_slot = slot_walk.harv_slot = (HARV_SLOT); \
+    plan_start.level = slot_walk.level = (BATT_LEVEL); \
+    slot_walk.battery_slot = first_battery_slot; \
+    keep_plan_reservations(); \
+  } while(0)
+#endif
+
+/**
+ * Shifts the battery levels of the slots from @start_slot
+ * until the end of the cycle by @delta.
+ */
+static void shift_battery_slots(uint8_t start_slot, int32_t delta)
+{
+  for (;start_slot < num_battery_slots; start_slot++){
+    battery_slots.min_level[start_slot] += delta;
+    battery_slots.max_level[start_slot] += delta;
+  }
+}
+
+/**
+ * Battery slots @a and @a+1 of @s can be merged without breaking the
+ * monotony of the battery level if they have the same type or one
+ * of them is CONSTANT.
+ */
+#define can_merge(S, A) ((S)->type[A] == (S)->type[(A)+1] || \
+                         (S)->type[A] == BATT_SLOT_CONSTANT || \
+                         (S)->type[(A)+1] == BATT_SLOT_CONSTANT)
+
+/**
+ * Makes room in the full battery slot table @s by merging two
+ * neighbouring slots among the first @num (all of them finished).
+ *
+ * The pair that is merged is the shortest one (in time) whose merge keeps the
+ * battery level monotonous; the merged slot takes the type of the
+ * non-CONSTANT slot. Only if there is no such pair (slots alternate
+ * between charging and discharging) the shortest pair is merged and
+ * typed by the overall change of the level.
+ * This trades resolution in the plan for a bounded amount of memory.
+ */
+static void merge_battery_slots(BatterySlots *s, uint8_t num)
+{
+  uint8_t i, best = 0, best_monotonous = 0;
+  uint16_t best_duration = 0xFFFF;
+
+  for (i = 0; i + 1 < num; i++){
+    uint16_t duration = batt_slot_duration(s, i) +
+                        batt_slot_duration(s, i+1);
+    if (best_monotonous && !can_merge(s, i)) continue;
+    if ((!best_monotonous && can_merge(s, i)) || duration < best_duration){
+      best = i;
+      best_duration = duration;
+      best_monotonous = can_merge(s, i);
+    }
+  }
+  PRINTF("Merging battery slots %u and %u\n", best, best+1);
+
+  if (s->type[best] == BATT_SLOT_CONSTANT){
+    s->type[best] = s->type[best+1];
+  }else if (!best_monotonous){
+    // the end of a charging slot is its max, of a discharging one its min
+    uint32_t start, end;
+    start = (s->type[best] == BATT_SLOT_CHARGING) ?
+              s->min_level[best] : s->max_level[best];
+    end = (s->type[best+1] == BATT_SLOT_CHARGING) ?
+              s->max_level[best+1] : s->min_level[best+1];
+    s->type[best] = (end >= start) ? BATT_SLOT_CHARGING : BATT_SLOT_DISCHARGING;
+  }
+  s->length[best] += s->length[best+1];
+#if OPTSCHED_SLOT_GRID
+  s->duration[best] = best_duration;
+#endif
+  s->total_e_cons[best] += s->total_e_cons[best+1];
+  s->min_level[best] = min(s->min_level[best], s->min_level[best+1]);
+  s->max_level[best] = max(s->max_level[best], s->max_level[best+1]);
+
+  for (i = best+1; i + 1 < num; i++){
+    s->type[i] = s->type[i+1];
+    s->start_slot[i] = s->start_slot[i+1];
+    s->length[i] = s->length[i+1];
+#if OPTSCHED_SLOT_GRID
+    s->duration[i] = s->duration[i+1];
+#endif
+    s->min_level[i] = s->min_level[i+1];
+    s->max_level[i] = s->max_level[i+1];
+    s->total_e_cons[i] = s->total_e_cons[i+1];
+  }
+}
+
+/*
+ * State of the first pass, kept between the slices of a
+ * time-sliced run (see optsched_step).
+ */
+static OPTSCHED_THREAD struct{
+  uint32_t *harvested;
+  uint32_t e_min;
   uint32_t crt_batt_level;
+  uint16_t harv_i;
+  uint8_t batt_i;   // this represents the current battery slot
+} fp;
 
+static void optsched_first_pass_init(uint32_t batt_0, uint32_t e_min, uint32_t *harvested)
+{
   PRINTF("Running first pass\n");
 
-  crt_batt_level = batt_0;
+  fp.harvested = harvested;
+  fp.e_min = e_min;
+  fp.crt_batt_level = batt_0;
+  fp.harv_i = 0;
+  fp.batt_i = 0;
 
   // initialise the first battery slot
-  battery_slots[0].min_level = batt_0;
-  battery_slots[0].max_level = batt_0;
-  battery_slots[0].start_slot = 0;
-  battery_slots[0].length = 0;
-  battery_slots[0].total_e_cons = 0;
+  battery_slots.min_level[0] = batt_0;
+  battery_slots.max_level[0] = batt_0;
+  battery_slots.start_slot[0] = 0;
+  battery_slots.length[0] = 0;
+#if OPTSCHED_SLOT_GRID
+  battery_slots.duration[0] = 0;
+#endif
+  battery_slots.total_e_cons[0] = 0;
+}
+
+/**
+ * Runs the first pass over the harvesting slots up to @harv_end
+ * (excluded), continuing from where the previous call stopped.
+ *
+ * The battery slot being built is kept in locals and only written to
+ * the table when it ends (or the call returns), the reservations are
+ * only looked up when there are some, and on a slot grid the limits
+ * of a harvesting slot are only scaled by its duration when there is
+ * a grid, walked without day_slot().
+ */
+static void optsched_first_pass_step(uint16_t harv_end)
+{
+  uint16_t harv_i;
+  uint8_t batt_i = fp.batt_i;
+  uint8_t crt_slot_type;
+  int32_t harv_slot_e;
+  uint32_t harv_slot_e_cons;
+  uint32_t crt_batt_level = fp.crt_batt_level;
+  uint32_t *harvested = fp.harvested;
+  uint32_t e_min = fp.e_min;
+  uint32_t e_max = U_E_CONS_MAX;
+  uint8_t reserved = reservations_held();
+  // the battery slot being built
+  uint8_t slot_type = battery_slots.type[batt_i];
+  uint32_t slot_min = battery_slots.min_level[batt_i];
+  uint32_t slot_max = battery_slots.max_level[batt_i];
+  uint32_t slot_e_cons = battery_slots.total_e_cons[batt_i];
+#if OPTSCHED_SLOT_GRID
+  const uint8_t *grid = slot_duration;
+  uint16_t grid_i = day_slot(fp.harv_i);
+  uint16_t slot_periods = battery_slots.duration[batt_i];
+  uint8_t duration = 1;
+#endif
+
+  for (harv_i = fp.harv_i; harv_i < harv_end; harv_i ++){
+#if OPTSCHED_SLOT_GRID
+    if (grid){
+      duration = grid[grid_i];
+      e_max = U_E_CONS_MAX*duration;
+      e_min = fp.e_min*duration;
+      if (++grid_i == SLOTS_PER_DAY) grid_i = 0;
+    }
+#endif
 
-  for (harv_i = 0; harv_i < SLOTS_PER_DAY; harv_i ++){
+    harv_slot_e = reserved ? harvest(harvested, harv_i) :
+                             unreserved_harvest(harvested, harv_i);
     // determine the e consumption, based on the amount of e harvested
-    if (harvested[harv_i] >= E_CONS_MAX) {
+    if (harv_slot_e >= (int32_t)e_max) {
       crt_slot_type = BATT_SLOT_CHARGING;
-      harv_slot_e_cons = E_CONS_MAX;
+      harv_slot_e_cons = e_max;
     }else
-    if (harvested[harv_i] <= e_min) {
+    if (harv_slot_e <= (int32_t)e_min) {
       crt_slot_type = BATT_SLOT_DISCHARGING;
       harv_slot_e_cons = e_min;
     }else
     {
       crt_slot_type = BATT_SLOT_CONSTANT;
-      harv_slot_e_cons = harvested[harv_i];
+      harv_slot_e_cons = harv_slot_e;
     }
-    PRINTF("Slot %u, exp harvested %lu. Crt slot type: %u\n",
-        harv_i, harvested[harv_i], crt_slot_type);
+    PRINTF("Slot %u, exp harvested %ld. Crt slot type: %u\n",
+        harv_i, harv_slot_e, crt_slot_type);
 
     // check if a new battery slot must be created
-    if (harv_i > 0 && (crt_slot_type != battery_slots[batt_i].type)){
+    if (harv_i > 0 && (crt_slot_type != slot_type)){
+      battery_slots.type[batt_i] = slot_type;
+      battery_slots.min_level[batt_i] = slot_min;
+      battery_slots.max_level[batt_i] = slot_max;
+      battery_slots.total_e_cons[batt_i] = slot_e_cons;
+#if OPTSCHED_SLOT_GRID
+      battery_slots.duration[batt_i] = slot_periods;
+#endif
       // are we consuming/harvesting more than battery capacity?
-      if (batt_slot_capacity(&battery_slots[batt_i]) > BATT_CAPACITY){
-        // TODO handle failure
+      if (batt_slot_capacity(&battery_slots, batt_i) > PLAN_BATT_CAPACITY){
+        // the second pass has to bring it within the limits, or fail
+        report_error(OPTSCHED_ERR_CAPACITY, batt_i,
+                     batt_slot_capacity(&battery_slots, batt_i) - PLAN_BATT_CAPACITY);
       }
-      battery_slots[batt_i].length = harv_i - battery_slots[batt_i].start_slot;
-
-      // initialise the next slot
-      batt_i ++;
-      battery_slots[batt_i].min_level = crt_batt_level;
-      battery_slots[batt_i].max_level = crt_batt_level;
-      battery_slots[batt_i].start_slot = harv_i;
-      battery_slots[batt_i].length = 0;
-      battery_slots[batt_i].total_e_cons = 0;
+      battery_slots.length[batt_i] = harv_i - battery_slots.start_slot[batt_i];
+
+      // initialise the next slot, making room for it if the table is full
+      if (batt_i + 1 == OPTSCHED_MAX_BATTERY_SLOTS){
+        merge_battery_slots(&battery_slots, batt_i + 1);
+      }else{
+        batt_i ++;
+      }
+      slot_min = crt_batt_level;
+      slot_max = crt_batt_level;
+      battery_slots.start_slot[batt_i] = harv_i;
+      battery_slots.length[batt_i] = 0;
+#if OPTSCHED_SLOT_GRID
+      slot_periods = 0;
+#endif
+      slot_e_cons = 0;
     }
 
     // update the battery slot
-    battery_slots[batt_i].type = crt_slot_type;
+    slot_type = crt_slot_type;
     /*
      * TODO: there is a problem here because we use unsigned values,
      * if the battery level could reach negative values...
      */
-    crt_batt_level += harvested[harv_i] - harv_slot_e_cons;
-    if (crt_batt_level < battery_slots[batt_i].min_level){
-      battery_slots[batt_i].min_level = crt_batt_level;
+    crt_batt_level += harv_slot_e - harv_slot_e_cons;
+    if (crt_batt_level < slot_min){
+      slot_min = crt_batt_level;
     }
-    if (crt_batt_level > battery_slots[batt_i].max_level){
-      battery_slots[batt_i].max_level = crt_batt_level;
+    if (crt_batt_level > slot_max){
+      slot_max = crt_batt_level;
     }
-    battery_slots[batt_i].total_e_cons += harv_slot_e_cons;
+    slot_e_cons += harv_slot_e_cons;
+#if OPTSCHED_SLOT_GRID
+    slot_periods += duration;
+#endif
   }
 
+  battery_slots.type[batt_i] = slot_type;
+  battery_slots.min_level[batt_i] = slot_min;
+  battery_slots.max_level[batt_i] = slot_max;
+  battery_slots.total_e_cons[batt_i] = slot_e_cons;
+#if OPTSCHED_SLOT_GRID
+  battery_slots.duration[batt_i] = slot_periods;
+#endif
+  fp.harv_i = harv_i;
+  fp.batt_i = batt_i;
+  fp.crt_batt_level = crt_batt_level;
+}
+
+static void optsched_first_pass_finish()
+{
   // process the last battery slot
-  if (battery_slots[batt_i].length == 0){
-    battery_slots[batt_i].length = SLOTS_PER_DAY - battery_slots[batt_i].start_slot;
+  if (battery_slots.length[fp.batt_i] == 0){
+    battery_slots.length[fp.batt_i] = OPTSCHED_HORIZON_SLOTS - battery_slots.start_slot[fp.batt_i];
   }
 
-  num_battery_slots = batt_i + 1;
+  num_battery_slots = fp.batt_i + 1;
+}
+
+/**
+ * The first pass determines the battery slots as periods of time
+ * where the battery is monotonous (increasing, decreasing or constant).
+ *
+ * It also checks for some basic failures.
+ */
+static int8_t optsched_first_pass(uint32_t batt_0, uint32_t e_min, uint32_t *harvested)
+{
+  optsched_first_pass_init(batt_0, e_min, harvested);
+  optsched_first_pass_step(OPTSCHED_HORIZON_SLOTS);
+  optsched_first_pass_finish();
 
   return 0;
 }
 
+#if OPTSCHED_BATCH
+void optsched_merge_battery_slots(BatterySlots *slots, uint8_t num)
+{
+  merge_battery_slots(slots, num);
+}
+
+uint8_t optsched_first_pass_only(uint32_t battery_start, uint32_t min_e_cons,
+                                 uint32_t *harvest_prediction,
+                                 BatterySlots *slots, OptschedStatus *run_status)
+{
+  first_battery_slot = 0;
+  reset_status();
+  battery_start = to_unit(battery_start);
+  set_margins(battery_start);
+  optsched_first_pass(battery_start, to_unit(min_e_cons), harvest_prediction);
+  memcpy(slots, &battery_slots, sizeof(*slots));
+  *run_status = status;
+  return num_battery_slots;
+}
+#endif
+
+/**
+ * Energy distance of a battery slot from BATT_MAX (for overspent
+ * errors) or from BATT_MIN (for waste errors).
+ */
+static int32_t slot_min_delta(uint8_t slot, uint8_t err_type)
+{
+  if (err_type == BATT_ERROR_OVERSPENT)
+    return PLAN_BATT_MAX - battery_slots.max_level[slot];
+  return battery_slots.min_level[slot] - PLAN_BATT_MIN;
+}
+
+#if OPTSCHED_MIN_DELTA_INDEX
+/*
+ * Suffix minima of slot_min_delta(): min_delta_index[i] is the
+ * minimum over the slots from i to the end of the range it was
+ * built for.
+ *
+ * adjust_energy() walks the battery slots forwards and only changes
+ * a slot once it has queried it, so the entries after the current
+ * slot are never stale and building the index once per call replaces
+ * a scan of the remaining slots for every slot.
+ */
+static OPTSCHED_THREAD int32_t min_delta_index[OPTSCHED_MAX_BATTERY_SLOTS];
+
+static void build_min_delta_index(uint8_t start_slot, uint8_t end_slot, uint8_t err_type)
+{
+  uint8_t i;
+  if (start_slot >= end_slot) return;
+
+  i = end_slot - 1;
+  min_delta_index[i] = slot_min_delta(i, err_type);
+  while (i > start_slot){
+    int32_t delta;
+    i--;
+    delta = slot_min_delta(i, err_type);
+    min_delta_index[i] = min(delta, min_delta_index[i+1]);
+  }
+}
+
+/**
+ * Returns the minimum energy distance from BATT_MIN or _MAX
+ * over the battery slots [start_slot, end_slot).
+ *
+ * The current slot is read directly, it may have been shifted
+ * since the index was built; the rest comes from the index.
+ */
+static int32_t next_min_delta(uint8_t start_slot, uint8_t end_slot, uint8_t err_type)
+{
+  int32_t min_delta = slot_min_delta(start_slot, err_type);
+  if (start_slot+1 < end_slot && min_delta_index[start_slot+1] < min_delta){
+    min_delta = min_delta_index[start_slot+1];
+  }
+  return min_delta;
+}
+#else
+#define build_min_delta_index(START, END, TYPE)
+
 /**
  * This function searches the list of battery slots for
  * the slot that has the minimum energy distance from BATT_MIN or _MAX.
  *
- * - in Python, this function was generating a list. However, it 
- *   would imply that we need an additional list of deltas and indices,
- *   which could increase the memory usage beyond limits.
- * - we rely on the fact that these lists should be short so there
- *   shouldn't be a big impact on computation time
+ * Without the index this takes no memory, but it is O(n) per call
+ * and so the passes that use it are O(n^2) in battery slots.
  */
-static int32_t next_min_delta(start_slot, end_slot, err_type)
+static int32_t next_min_delta(uint8_t start_slot, uint8_t end_slot, uint8_t err_type)
 {
   int32_t min_delta;
-  if (err_type == BATT_ERROR_OVERSPENT)
-    min_delta = BATT_MAX - battery_slots[start_slot].max_level;
-  else if (err_type == BATT_ERROR_WASTE)
-    min_delta = battery_slots[start_slot].min_level - BATT_MIN;
+  min_delta = slot_min_delta(start_slot, err_type);
 
   for (start_slot++;start_slot < end_slot;start_slot++){
-    int32_t delta;
-    if (err_type == BATT_ERROR_OVERSPENT)
-      delta = BATT_MAX - battery_slots[start_slot].max_level;
-    else if (err_type == BATT_ERROR_WASTE)
-      delta = battery_slots[start_slot].min_level - BATT_MIN;
-
+    int32_t delta = slot_min_delta(start_slot, err_type);
     if (delta < min_delta) min_delta = delta;
   }
 
   return min_delta;
 }
+#endif
 
 /**
  * With a given error in energy storage (waste or overspent)
  * this algorithm will adjust the consumption between start_ and
  * end_ battery slots to recover the error.
  *
- * The key here is next_min_list, which represents, for each slot,
+ * The key here is next_min_delta, which represents, for each slot,
  * the maximum delta that can be recovered. Therefore, when 
  * analysing a slot, the algorithm determines how much of the error
  * can be recovered, by looking at next_min_list, get_slot_max_e_* and
  * of course, error.
  *
- * Returns the accumulated changes to the battery level in @batt_delta
+ * Returns the accumulated changes to the battery level in @batt_delta,
+ * and the part of @error that could not be recovered, 0 if none.
  */
-static int adjust_energy(uint8_t start_slot,
+static uint32_t adjust_energy(uint8_t start_slot,
                          uint8_t end_slot,
                          uint32_t e_min,
                          uint32_t error,
@@ -150,47 +804,54 @@ static int adjust_energy(uint8_t start_slot,
 {
   PRINTF("Adjust energy [%u, %u]\n", start_slot, end_slot);
 
+  build_min_delta_index(start_slot, end_slot, err_type);
+
   while (start_slot < end_slot){
     uint32_t recoverable;
     int32_t e_cons_change;
     
     // we can only recover in CONSTANT slots or ones opposite to the error
-    if ((battery_slots[start_slot].type == BATT_SLOT_CONSTANT) ||
-      (err_type == BATT_ERROR_OVERSPENT && (battery_slots[start_slot].type == BATT_SLOT_CHARGING)) ||
-      (err_type == BATT_ERROR_WASTE && (battery_slots[start_slot].type == BATT_SLOT_DISCHARGING)))
+    if ((battery_slots.type[start_slot] == BATT_SLOT_CONSTANT) ||
+      (err_type == BATT_ERROR_OVERSPENT && (battery_slots.type[start_slot] == BATT_SLOT_CHARGING)) ||
+      (err_type == BATT_ERROR_WASTE && (battery_slots.type[start_slot] == BATT_SLOT_DISCHARGING)))
     {
       switch (err_type){
         case BATT_ERROR_OVERSPENT:
-          recoverable = get_slot_max_e_decrease(&battery_slots[start_slot], e_min);
+          recoverable = get_slot_max_e_decrease(&battery_slots, start_slot, e_min);
           e_cons_change = min(error,
                             min(next_min_delta(start_slot, end_slot, err_type)
                             - *batt_delta, recoverable));
           break;
         case BATT_ERROR_WASTE:
-          recoverable = get_slot_max_e_increase(&battery_slots[start_slot]);
+          recoverable = get_slot_max_e_increase(&battery_slots, start_slot);
           e_cons_change = min(error,
                             min(next_min_delta(start_slot, end_slot, err_type)
                             + *batt_delta, recoverable));
           break;
+        default:
+          // no other error is recovered
+          recoverable = 0;
+          e_cons_change = 0;
+          break;
       }
       error -= e_cons_change;
       if (err_type == BATT_ERROR_OVERSPENT) e_cons_change = -e_cons_change;
       // update the total e consumption in the battery slot
-      battery_slots[start_slot].total_e_cons += e_cons_change;
+      battery_slots.total_e_cons[start_slot] += e_cons_change;
       // update the battery level in the slot - however, only the 
       // level at the end of the battery slot changes, not at the start
-      switch (battery_slots[start_slot].type){
+      switch (battery_slots.type[start_slot]){
         case BATT_SLOT_CHARGING:
           // last level is max, increase the start with the previous delta
-          battery_slots[start_slot].min_level += *batt_delta;
-          battery_slots[start_slot].max_level += *batt_delta;
-          battery_slots[start_slot].max_level -= e_cons_change;
+          battery_slots.min_level[start_slot] += *batt_delta;
+          battery_slots.max_level[start_slot] += *batt_delta;
+          battery_slots.max_level[start_slot] -= e_cons_change;
           break;
         case BATT_SLOT_DISCHARGING:
           // last level is min
-          battery_slots[start_slot].max_level += *batt_delta;
-          battery_slots[start_slot].min_level += *batt_delta;
-          battery_slots[start_slot].min_level -= e_cons_change;
+          battery_slots.max_level[start_slot] += *batt_delta;
+          battery_slots.min_level[start_slot] += *batt_delta;
+          battery_slots.min_level[start_slot] -= e_cons_change;
           break;
         case BATT_SLOT_CONSTANT:
           // constant slots can change type for non-zero changes
@@ -209,52 +870,55 @@ static int adjust_energy(uint8_t start_slot,
           }
           if (e_cons_change > 0){
             // slot will be decreasing, so start will be max and end, min
-            if (type_change) battery_slots[start_slot].type = BATT_SLOT_DISCHARGING;
-            battery_slots[start_slot].max_level += *batt_delta;
-            battery_slots[start_slot].min_level += *batt_delta;
-            battery_slots[start_slot].min_level -= e_cons_change;
+            if (type_change) battery_slots.type[start_slot] = BATT_SLOT_DISCHARGING;
+            battery_slots.max_level[start_slot] += *batt_delta;
+            battery_slots.min_level[start_slot] += *batt_delta;
+            battery_slots.min_level[start_slot] -= e_cons_change;
           }else{
             // slot will be increasing, from min to max levels
-            if (type_change) battery_slots[start_slot].type = BATT_SLOT_CHARGING;
-            battery_slots[start_slot].min_level += *batt_delta;
-            battery_slots[start_slot].max_level += *batt_delta;
-            battery_slots[start_slot].max_level -= e_cons_change;
+            if (type_change) battery_slots.type[start_slot] = BATT_SLOT_CHARGING;
+            battery_slots.min_level[start_slot] += *batt_delta;
+            battery_slots.max_level[start_slot] += *batt_delta;
+            battery_slots.max_level[start_slot] -= e_cons_change;
           }
           break;
           }
       }
       //PRINTF("Updated slot %u: delta_e=%ld, total_e_cons=%lu, min=%lu, max=%lu\n",
       //    start_slot, e_cons_change,
-      //    battery_slots[start_slot].total_e_cons,
-      //    battery_slots[start_slot].min_level,
-      //    battery_slots[start_slot].max_level);
+      //    battery_slots.total_e_cons[start_slot],
+      //    battery_slots.min_level[start_slot],
+      //    battery_slots.max_level[start_slot]);
 
       *batt_delta  -= e_cons_change;
-      // TODO this was here... WHY? battery_slots[start_slot].max_level += *batt_delta;
+      // TODO this was here... WHY? battery_slots.max_level[start_slot] += *batt_delta;
     }else{
       // if we are not making changes in this slot, we still
       // have to effect the ongoing battery changes
-      battery_slots[start_slot].min_level += *batt_delta;
-      battery_slots[start_slot].max_level += *batt_delta;
+      battery_slots.min_level[start_slot] += *batt_delta;
+      battery_slots.max_level[start_slot] += *batt_delta;
 
       //PRINTF("Updated slot %u, no e changes: min=%lu, max=%lu\n",
       //    start_slot,
-      //    battery_slots[start_slot].min_level,
-      //    battery_slots[start_slot].max_level);
+      //    battery_slots.min_level[start_slot],
+      //    battery_slots.max_level[start_slot]);
     }
 
-    if ((battery_slots[start_slot].type == err_type) && 
-       (max(batt_slot_wasted_e(&battery_slots[start_slot]),
-            batt_slot_missing_e(&battery_slots[start_slot]))
-          > (*batt_delta>=0?*batt_delta:-*batt_delta)))
-    {
-      /* we have a slot where we can't recover, but the changes made to e_cons
-       * have made the accumulated error too large
-       * TODO I'm wondering if this is a viable case. After all we are only
-       * recovering as allowed by (next_min_list - batt_delta).
-       */
-
-      // TODO this is where we signal an error
+    if (battery_slots.type[start_slot] == err_type){
+      // what is left over in the slot, of the error being recovered
+      int32_t left = (err_type == BATT_ERROR_OVERSPENT) ?
+                     (int32_t)batt_slot_missing_e(&battery_slots, start_slot) :
+                     (int32_t)batt_slot_wasted_e(&battery_slots, start_slot);
+      if (left > abs(*batt_delta)){
+        /* we have a slot where we can't recover, but the changes made to e_cons
+         * have made the accumulated error too large. The recovery is bounded
+         * by next_min_delta - batt_delta, so this should not happen, but the
+         * first one is reported with what is left over in the slot.
+         */
+        report_error(err_type == BATT_ERROR_OVERSPENT ?
+                       OPTSCHED_ERR_OVERSPENT : OPTSCHED_ERR_WASTE,
+                     start_slot, left);
+      }
     }
 
     start_slot ++;
@@ -263,108 +927,175 @@ static int adjust_energy(uint8_t start_slot,
   if (error > 0){
     // we failed, return an error
     PRINTF("Failed, error=%lu\n", error);
-    return -1;
   }
 
-  return 0;
+  return error;
 }
 
-/**
- * The second pass of the algorithm goes through all the slots
- * and fixes energy waste and overspending errors by increasing
- * or decreasing the energy consumption in the previous slots.
- *
- * It relies on the observation that recovery can only be done
- * as far ahead as the previous error of opposite type, otherwise
- * the changes would have conflicting results.
- *
- * Returns in the @batt_delta pointer the accumulated changes
- * to the battery value.
- * The changes to the energy consumption per slot are stored
- * in the global array.
+/*
+ * State of the second pass, kept between the slices of a
+ * time-sliced run (see optsched_step).
  */
-static int8_t optsched_second_pass(int32_t *batt_delta, uint32_t e_min)
-{
-  uint8_t list_start, index, max_err_index;
-  uint8_t crt_err_type;
+static OPTSCHED_THREAD struct{
+  uint32_t e_min;
   uint32_t max_err;
   int32_t tent_err;
+  int32_t batt_delta;
+  uint8_t list_start, index, max_err_index;
+  uint8_t crt_err_type;
+} sp;
 
+/**
+ * Adjusts the energy in battery slots [@start, @end) for the error
+ * found by the second pass, reporting what can't be recovered.
+ */
+static void second_pass_adjust(uint8_t start, uint8_t end)
+{
+  uint32_t residual;
+
+  residual = adjust_energy(start, end, sp.e_min,
+                           sp.max_err, sp.crt_err_type, &sp.batt_delta);
+  if (residual){
+    report_error(sp.crt_err_type == BATT_ERROR_OVERSPENT ?
+                   OPTSCHED_ERR_OVERSPENT : OPTSCHED_ERR_WASTE,
+                 sp.max_err_index, residual);
+  }
+}
+
+static void optsched_second_pass_init(uint8_t first, int32_t batt_delta, uint32_t e_min)
+{
   PRINTF("Starting second pass. %u battery slots\n", num_battery_slots);
 
-  list_start = index = 0;
-  crt_err_type = BATT_ERROR_UNSET;
-  *batt_delta = tent_err = max_err = 0;
-  while (index < num_battery_slots){
-    PRINTF("Slot %u type: %u, total_e_cons %lu, min_level %lu (>%lu), max_level %lu (<%lu), length %u, delta=%ld\n", 
-        index, battery_slots[index].type,
-        battery_slots[index].total_e_cons,
-        battery_slots[index].min_level, BATT_MIN,
-        battery_slots[index].max_level, BATT_MAX,
-        battery_slots[index].length,
-        *batt_delta);
-
-    // search for battery slots with errors
-    if (battery_slots[index].type == BATT_SLOT_CONSTANT){
-      index ++;
-      continue;
-    }
+  sp.e_min = e_min;
+  sp.batt_delta = batt_delta;
+  sp.list_start = sp.index = first;
+  sp.crt_err_type = BATT_ERROR_UNSET;
+  sp.tent_err = sp.max_err = 0;
+}
 
-    if (get_batt_error(&battery_slots[index], *batt_delta + tent_err) > 0){
-      PRINTF("Battery error > 0 in slot %u: %lu\n", index,
-          get_batt_error(&battery_slots[index], *batt_delta + tent_err));
-      if (crt_err_type == BATT_ERROR_UNSET){
-        crt_err_type = battery_slots[index].type;
-      }else{
-        if (crt_err_type !=
-              get_batt_error_type(&battery_slots[index], *batt_delta + tent_err))
-        {
-          // stop at error of opposite type bc. changes cannot be effected after
-          // adjust the energy usage in the slots up to the last max error
-          if (adjust_energy(list_start, max_err_index+1, e_min,
-                            max_err, crt_err_type, batt_delta))
-          {
-            // TODO report an error somehow
-          }
-        
-          // reset the state
-          crt_err_type = battery_slots[index].type;
-          list_start = index = max_err_index + 1;
-          max_err = tent_err = 0;
-          continue;
-        }
-      }
-    }
+/**
+ * Processes the next battery slot of the second pass.
+ * Returns 0 when there are no slots left.
+ */
+static uint8_t optsched_second_pass_step()
+{
+  uint8_t index = sp.index;
+
+  if (index >= num_battery_slots) return 0;
+
+  PRINTF("Slot %u type: %u, total_e_cons %lu, min_level %lu (>%lu), max_level %lu (<%lu), length %u, delta=%ld\n", 
+      index, battery_slots.type[index],
+      battery_slots.total_e_cons[index],
+      battery_slots.min_level[index], PLAN_BATT_MIN,
+      battery_slots.max_level[index], PLAN_BATT_MAX,
+      battery_slots.length[index],
+      sp.batt_delta);
+
+  // search for battery slots with errors
+  if (battery_slots.type[index] == BATT_SLOT_CONSTANT){
+    sp.index ++;
+    return 1;
+  }
 
-    // keep track of the maximum error and its index
-    if (get_batt_error(&battery_slots[index], *batt_delta) > max_err){
-      max_err = get_batt_error(&battery_slots[index], *batt_delta);
-      max_err_index = index;
-      tent_err = max_err;
-      if (crt_err_type == BATT_ERROR_WASTE){
-        tent_err = -tent_err;
+  if (get_batt_error(&battery_slots, index, sp.batt_delta + sp.tent_err) > 0){
+    PRINTF("Battery error > 0 in slot %u: %lu\n", index,
+        get_batt_error(&battery_slots, index, sp.batt_delta + sp.tent_err));
+    if (sp.crt_err_type == BATT_ERROR_UNSET){
+      sp.crt_err_type = battery_slots.type[index];
+    }else{
+      if (sp.crt_err_type !=
+            get_batt_error_type(&battery_slots, index, sp.batt_delta + sp.tent_err) &&
+          sp.max_err == 0){
+        /*
+         * No error in the list yet, so nothing to adjust before it:
+         * take the type of this one (restarting the list here would
+         * not move on). Eg waste left over in a discharging slot.
+         */
+        sp.crt_err_type = get_batt_error_type(&battery_slots, index,
+                                              sp.batt_delta + sp.tent_err);
+      }else if (sp.crt_err_type !=
+            get_batt_error_type(&battery_slots, index, sp.batt_delta + sp.tent_err))
+      {
+        // stop at error of opposite type bc. changes cannot be effected after
+        // adjust the energy usage in the slots up to the last max error
+        second_pass_adjust(sp.list_start, sp.max_err_index+1);
+      
+        // reset the state
+        sp.crt_err_type = battery_slots.type[index];
+        sp.list_start = sp.index = sp.max_err_index + 1;
+        sp.max_err = sp.tent_err = 0;
+        return 1;
       }
     }
+  }
 
-    index ++;
+  // keep track of the maximum error and its index
+  if (get_batt_error(&battery_slots, index, sp.batt_delta) > sp.max_err){
+    sp.max_err = get_batt_error(&battery_slots, index, sp.batt_delta);
+    sp.max_err_index = index;
+    sp.tent_err = sp.max_err;
+    if (sp.crt_err_type == BATT_ERROR_WASTE){
+      sp.tent_err = -sp.tent_err;
+    }
   }
 
+  sp.index ++;
+  return 1;
+}
+
+/**
+ * Fixes the errors left at the end of the list of slots.
+ * Returns the battery delta not reflected in the slots.
+ */
+static int32_t optsched_second_pass_finish()
+{
   // if there were unsolved errors by the end of the list...
-  if ((list_start < num_battery_slots) && max_err != 0)
-      //(get_batt_error(&battery_slots[num_battery_slots-1], *batt_delta + tent_err) > 0))
+  if ((sp.list_start < num_battery_slots) && sp.max_err != 0)
+      //(get_batt_error(&battery_slots, num_battery_slots-1, sp.batt_delta + sp.tent_err) > 0))
   {
-    if (adjust_energy(list_start, num_battery_slots, e_min,
-                      max_err, crt_err_type, batt_delta))
-    {
-      // TODO report an error somehow
-    }
+    second_pass_adjust(sp.list_start, num_battery_slots);
     /*
      * if we fix until the end of the list, it means that the 
      * batt_delta is applied to all the slots, so we can zero it.
      */
-    *batt_delta = 0;
+    sp.batt_delta = 0;
+  }else if (sp.batt_delta != 0){
+    /*
+     * the slots after the last adjustment still have the levels
+     * from before it; bring them up to date, the levels are read
+     * back by the node and by optsched_replan.
+     */
+    shift_battery_slots(sp.list_start, sp.batt_delta);
+    sp.batt_delta = 0;
   }
 
+  return sp.batt_delta;
+}
+
+/**
+ * The second pass of the algorithm goes through all the slots
+ * and fixes energy waste and overspending errors by increasing
+ * or decreasing the energy consumption in the previous slots.
+ *
+ * It relies on the observation that recovery can only be done
+ * as far ahead as the previous error of opposite type, otherwise
+ * the changes would have conflicting results.
+ *
+ * The pass starts at battery slot @first, with @batt_delta holding
+ * a change to the battery level that the slots from @first onwards
+ * have not seen yet (0 for a new plan).
+ *
+ * Returns in the @batt_delta pointer the accumulated changes
+ * to the battery value that are not reflected in the battery slots.
+ * The changes to the energy consumption per slot are stored
+ * in the global array.
+ */
+static int8_t optsched_second_pass(uint8_t first, int32_t *batt_delta, uint32_t e_min)
+{
+  optsched_second_pass_init(first, *batt_delta, e_min);
+  while (optsched_second_pass_step());
+  *batt_delta = optsched_second_pass_finish();
+
   return 0;
 }
 
@@ -373,7 +1104,10 @@ static int8_t optsched_second_pass(int32_t *batt_delta, uint32_t e_min)
  * from the initial battery level is eliminated, so that the
  * node achieves energy-neutral operation.
  */
-static int32_t optsched_offset_correction(uint32_t batt_0, uint32_t e_min, int32_t batt_delta)
+static int32_t optsched_offset_correction(uint8_t first,
+                                          uint32_t batt_0,
+                                          uint32_t e_min,
+                                          int32_t batt_delta)
 {
   /*
    * Determine the final offset. 
@@ -391,12 +1125,12 @@ static int32_t optsched_offset_correction(uint32_t batt_0, uint32_t e_min, int32
 
   PRINTF("Offset correction, index = %u, target = %lu, current = ", index, batt_0);
   // determine the offset from the final battery slot
-  if (battery_slots[index].type == BATT_SLOT_DISCHARGING){
-    offset = batt_0 - (battery_slots[index].min_level + batt_delta);
-    PRINTF("%lu ", battery_slots[index].min_level + batt_delta);
+  if (battery_slots.type[index] == BATT_SLOT_DISCHARGING){
+    offset = batt_0 - (battery_slots.min_level[index] + batt_delta);
+    PRINTF("%lu ", battery_slots.min_level[index] + batt_delta);
   }else{
-    offset = batt_0 - (battery_slots[index].max_level + batt_delta);
-    PRINTF("%lu ", battery_slots[index].max_level + batt_delta);
+    offset = batt_0 - (battery_slots.max_level[index] + batt_delta);
+    PRINTF("%lu ", battery_slots.max_level[index] + batt_delta);
   }
   PRINTF("offset = %ld\n", offset);
 
@@ -408,11 +1142,11 @@ static int32_t optsched_offset_correction(uint32_t batt_0, uint32_t e_min, int32
     uint32_t slot_start_value;
 
     // reduce the offset as much as possible in this slot
-    if (offset > 0 && is_increasing(&battery_slots[index])){
-      e_change = -min(offset, get_slot_max_e_decrease(&battery_slots[index], e_min));
-    }else if (offset < 0 && is_decreasing(&battery_slots[index])){
+    if (offset > 0 && is_increasing(&battery_slots, index)){
+      e_change = -min(offset, get_slot_max_e_decrease(&battery_slots, index, e_min));
+    }else if (offset < 0 && is_decreasing(&battery_slots, index)){
       // negative offset because e_decrease > 0 and offset < 0
-      e_change = min(-offset, get_slot_max_e_decrease(&battery_slots[index], e_min));
+      e_change = min(-offset, get_slot_max_e_decrease(&battery_slots, index, e_min));
     }
 
     offset += e_change;
@@ -430,7 +1164,7 @@ static int32_t optsched_offset_correction(uint32_t batt_0, uint32_t e_min, int32
      * because it's not needed anymore! :)
      */
     // change the consumption in this slot
-    battery_slots[index].total_e_cons += e_change;
+    battery_slots.total_e_cons[index] += e_change;
 
     
     if (offset == 0){
@@ -445,16 +1179,16 @@ static int32_t optsched_offset_correction(uint32_t batt_0, uint32_t e_min, int32
      * TODO We use the min or max battery level in these calculations,
      * however they may have changed in step 2.
      */
-    if (is_increasing(&battery_slots[index])){
-      slot_start_value = battery_slots[index].min_level;
+    if (is_increasing(&battery_slots, index)){
+      slot_start_value = battery_slots.min_level[index];
     }else{
-      slot_start_value = battery_slots[index].max_level;
+      slot_start_value = battery_slots.max_level[index];
     }
 
     if (offset > 0){
-      min_delta = min(BATT_MAX - slot_start_value, min_delta);
+      min_delta = min(PLAN_BATT_MAX - slot_start_value, min_delta);
     }else{
-      min_delta = min(slot_start_value - BATT_MIN, min_delta);
+      min_delta = min(slot_start_value - PLAN_BATT_MIN, min_delta);
     }
 
     // we can only recover up to min_delta, so don't try for more
@@ -462,67 +1196,146 @@ static int32_t optsched_offset_correction(uint32_t batt_0, uint32_t e_min, int32
 
     PRINTF("In slot %u, change=%ld, min_delta=%lu\n", index, e_change, min_delta);
     index --;
-  }while (index >= 0);
+  }while (index >= first);
 
   // we only return the final offset
   return offset;
 }
 
 /**
- * This step tries to increase the energy consumption
- * in min econs slots to @min_e, without changing
- * intermediate values unless necessary to avoid waste
- * or overspent. Therefore the difference will be in the
- * final offset
+ * Returns the first battery slot from @first on where the plan
+ * takes the battery below BATT_MIN, num_battery_slots if none.
  */
-static int8_t optsched_min_e_cons(uint32_t min_e)
+static uint8_t find_overspent_slot(uint8_t first)
 {
   uint8_t i;
-  uint32_t delta = 0; // overall additional E cons
+  for (i = first; i < num_battery_slots; i++){
+    if (battery_slots.min_level[i] < PLAN_BATT_MIN) break;
+  }
+  return i;
+}
 
-  for (i=0;i<num_battery_slots;i++){
-    int32_t change;
-    
-    /*
-     * we are increasing the energy consumption by a positive delta
-     * which will reduce the battery level in the remaining slots.
-     * we know that it doesn't create overspent errors because
-     * the change is no larger than the min delta
-     */
-    battery_slots[i].min_level -= delta;
-    battery_slots[i].max_level -= delta; // if min is ok, max is ok too
+/**
+ * Replaces battery slot @index with its fallback plan (see
+ * OptschedStatus), starting at @batt_level. The battery slots
+ * are kept, only their consumption and levels change.
+ *
+ * Returns the level at the end of the slot.
+ */
+static uint32_t fallback_battery_slot(uint8_t index,
+                                      uint32_t batt_level,
+                                      uint32_t e_min,
+                                      uint32_t *harvested)
+{
+  uint16_t end_slot, harv_i, periods = 0;
+  uint32_t e_cons = 0, e_cons_per_period;
+  uint32_t start_level = batt_level, min_level, max_level;
+  int64_t room;
+
+  end_slot = battery_slots.start_slot[index] + battery_slots.length[index];
+  for (harv_i = battery_slots.start_slot[index]; harv_i < end_slot; harv_i++){
+    uint8_t duration = harv_slot_duration(harv_i);
+    int32_t harv_slot_e = harvest(harvested, harv_i);
+    e_cons += min((uint32_t)max(harv_slot_e, (int32_t)(e_min*duration)), U_E_CONS_MAX*duration);
+  }
+  e_cons_per_period = e_cons/batt_slot_duration(&battery_slots, index);
 
-    /*
-     * how much should we change the econs?
-     * can't change more than the minimum offset from BATT_MIN
-     * in the remaining slots (including the current).
-     * we're not checking here the type of the slot, in CHARGING
-     * we ought to check against the max_level. however, CHARGING
-     * slots don't need change in min_e_cons, so it's ok
-     */
-    change = min(min_e*battery_slots[i].length - battery_slots[i].total_e_cons,
-                 next_min_delta(i, num_battery_slots, BATT_ERROR_WASTE)-delta);
-
-    // does this slot require changes?
-    if (change > 0){
-      // yes it does, and we know we can accommodate
-      battery_slots[i].total_e_cons += change;
-      delta += change;
-      // update slot-final value
-      switch (battery_slots[i].type){
-        case BATT_SLOT_CHARGING:
-          // slot-final is max_level
-          battery_slots[i].max_level -= change;
-          break;
-        case BATT_SLOT_DISCHARGING:
-        case BATT_SLOT_CONSTANT:
-          battery_slots[i].min_level -= change;
-          break;
+  /*
+   * No faster than the battery and the harvest so far can sustain.
+   * Below the low margin the harvest refills it first.
+   */
+  room = (int64_t)max(batt_level, U_BATT_MIN) - PLAN_BATT_MIN;
+  for (harv_i = battery_slots.start_slot[index]; harv_i < end_slot; harv_i++){
+    int32_t harv_slot_e = harvest(harvested, harv_i);
+    if (harv_slot_e < 0){
+      room = room > -harv_slot_e ? room + harv_slot_e : min(room, 0);
+    }else{
+      room += harv_slot_e;
+    }
+    periods += harv_slot_duration(harv_i);
+    if (room < (int64_t)(e_cons_per_period*periods)){
+      e_cons_per_period = room > 0 ? (uint32_t)room/periods : 0;
+    }
+  }
+  e_cons_per_period = max(e_cons_per_period, e_min);
+  e_cons = e_cons_per_period*batt_slot_duration(&battery_slots, index);
+
+  min_level = max_level = batt_level;
+  for (harv_i = battery_slots.start_slot[index]; harv_i < end_slot; harv_i++){
+    batt_level += harvest(harvested, harv_i) - e_cons_per_period*harv_slot_duration(harv_i);
+    if (batt_level < min_level) min_level = batt_level;
+    if (batt_level > max_level) max_level = batt_level;
+  }
+
+  battery_slots.total_e_cons[index] = e_cons;
+  battery_slots.min_level[index] = min_level;
+  battery_slots.max_level[index] = max_level;
+  if (batt_level > start_level){
+    battery_slots.type[index] = BATT_SLOT_CHARGING;
+  }else if (batt_level < start_level){
+    battery_slots.type[index] = BATT_SLOT_DISCHARGING;
+  }else{
+    battery_slots.type[index] = BATT_SLOT_CONSTANT;
+  }
+
+  return batt_level;
+}
+
+#if OPTSCHED_MAX_RESERVATIONS
+/**
+ * Reports the first reservation that overlaps a battery slot of the
+ * plan going below BATT_MIN.
+ */
+static void check_reservations()
+{
+  uint8_t r, i;
+  uint16_t end_slot;
+
+  for (r = 0; r < OPTSCHED_MAX_RESERVATIONS; r++){
+    if (reservations.length[r] == 0) continue;
+    end_slot = reservations.start[r] + reservations.length[r];
+    for (i = first_battery_slot; i < num_battery_slots; i++){
+      if (battery_slots.start_slot[i] >= end_slot) break;
+      if (battery_slots.start_slot[i] + battery_slots.length[i] > reservations.start[r] &&
+          battery_slots.min_level[i] < U_BATT_MIN){
+        PRINTF("Reservation %u cannot be met in battery slot %u\n", r, i);
+        status.reservation = r + 1;
+        return;
       }
     }
   }
+}
+#else
+#define check_reservations()
+#endif
 
-  return 0;
+/**
+ * Checks the plan from battery slot @first on, which starts at
+ * @batt_level, and replaces it with the fallback plan if it takes
+ * the battery below BATT_MIN.
+ *
+ * Returns the offset from @batt_end: from the fallback plan, or
+ * after the offset correction of the plan of the passes.
+ */
+static int32_t optsched_check_plan(uint8_t first,
+                                   uint32_t batt_level,
+                                   uint32_t batt_end,
+                                   uint32_t e_min,
+                                   int32_t batt_delta,
+                                   uint32_t *harvested)
+{
+  uint8_t index = find_overspent_slot(first);
+
+  if (index == num_battery_slots){
+    return optsched_offset_correction(first, batt_end, e_min, batt_delta);
+  }
+
+  report_error(OPTSCHED_ERR_OVERSPENT, index, PLAN_BATT_MIN - battery_slots.min_level[index]);
+  status.fallback = 1;
+  for (index = first; index < num_battery_slots; index++){
+    batt_level = fallback_battery_slot(index, batt_level, e_min, harvested);
+  }
+  return batt_end - batt_level;
 }
 
 int32_t optsched_run(uint32_t battery_start,
@@ -535,70 +1348,608 @@ int32_t optsched_run(uint32_t battery_start,
 
 
   battery_delta = 0;
+  first_battery_slot = 0;
+  reset_status();
+  battery_start = to_unit(battery_start);
+  set_margins(battery_start);
+  battery_end = min(to_unit(battery_end), PLAN_BATT_MAX);
+  min_e_cons = to_unit(min_e_cons);
 
   // run first pass
+  OPTSCHED_PROFILE(OPTSCHED_PASS_FIRST);
   optsched_first_pass(battery_start, min_e_cons, harvest_prediction);
 
   // run second pass
-  optsched_second_pass(&battery_delta, min_e_cons);
+  OPTSCHED_PROFILE(OPTSCHED_PASS_SECOND);
+  optsched_second_pass(0, &battery_delta, min_e_cons);
+
+  // correct the offset, or fall back
+  OPTSCHED_PROFILE(OPTSCHED_PASS_OFFSET);
+  battery_delta = optsched_check_plan(0, battery_start, battery_end, min_e_cons,
+                                      battery_delta, harvest_prediction);
+  OPTSCHED_PROFILE(OPTSCHED_PASS_DONE);
+
+  status.offset = from_unit(battery_delta);
+  check_reservations();
+  build_slot_table(0, battery_start, harvest_prediction);
+  publish_plan();
+  return status.offset;
+}
+
+#if OPTSCHED_SLICED
+void optsched_start(uint32_t battery_start,
+                    uint32_t battery_end,
+                    uint32_t min_e_cons,
+                    uint8_t correct_offset,
+                    uint32_t *harvest_prediction)
+{
+  first_battery_slot = 0;
+  reset_status();
+  sliced_battery_start = to_unit(battery_start);
+  set_margins(sliced_battery_start);
+  sliced_battery_end = min(to_unit(battery_end), PLAN_BATT_MAX);
+  optsched_first_pass_init(to_unit(battery_start), to_unit(min_e_cons), harvest_prediction);
+  sliced_pass = OPTSCHED_PASS_FIRST;
+}
+
+uint8_t optsched_step()
+{
+  switch (sliced_pass){
+    case OPTSCHED_PASS_FIRST:
+      if (OPTSCHED_HORIZON_SLOTS - fp.harv_i > OPTSCHED_SLICE){
+        optsched_first_pass_step(fp.harv_i + OPTSCHED_SLICE);
+        return OPTSCHED_BUSY;
+      }
+      optsched_first_pass_step(OPTSCHED_HORIZON_SLOTS);
+      optsched_first_pass_finish();
+      optsched_second_pass_init(0, 0, fp.e_min);
+      sliced_pass = OPTSCHED_PASS_SECOND;
+      return OPTSCHED_BUSY;
+    case OPTSCHED_PASS_SECOND:
+      if (optsched_second_pass_step()) return OPTSCHED_BUSY;
+      optsched_second_pass_finish();
+      sliced_pass = OPTSCHED_PASS_OFFSET;
+      return OPTSCHED_BUSY;
+    case OPTSCHED_PASS_OFFSET:
+      fp.batt_i = find_overspent_slot(0);
+      if (fp.batt_i < num_battery_slots){
+        // the fallback plan, a battery slot per step
+        report_error(OPTSCHED_ERR_OVERSPENT, fp.batt_i,
+                     PLAN_BATT_MIN - battery_slots.min_level[fp.batt_i]);
+        status.fallback = 1;
+        fp.batt_i = 0;
+        fp.crt_batt_level = sliced_battery_start;
+        sliced_pass = OPTSCHED_PASS_FALLBACK;
+        return OPTSCHED_BUSY;
+      }
+      status.offset = from_unit(optsched_offset_correction(0, sliced_battery_end,
+                                                           sp.e_min, sp.batt_delta));
+      check_reservations();
+      build_slot_table(0, sliced_battery_start, fp.harvested);
+      publish_plan();
+      return OPTSCHED_READY;
+    case OPTSCHED_PASS_FALLBACK:
+      fp.crt_batt_level = fallback_battery_slot(fp.batt_i, fp.crt_batt_level,
+                                                fp.e_min, fp.harvested);
+      if (++fp.batt_i < num_battery_slots) return OPTSCHED_BUSY;
+      status.offset = from_unit(sliced_battery_end - fp.crt_batt_level);
+      check_reservations();
+      build_slot_table(0, sliced_battery_start, fp.harvested);
+      publish_plan();
+      return OPTSCHED_READY;
+  }
+  return OPTSCHED_IDLE;
+}
+
+uint8_t optsched_busy()
+{
+  return sliced_pass != OPTSCHED_PASS_DONE;
+}
+#endif
+
+/**
+ * Finds the battery slot that contains harvesting slot @harv_slot,
+ * searching from the start of the horizon.
+ */
+static uint8_t find_battery_slot(uint16_t harv_slot)
+{
+  uint8_t i;
+  for (i = first_battery_slot; i < num_battery_slots - 1; i++){
+    if (harv_slot < battery_slots.start_slot[i] + battery_slots.length[i]) break;
+  }
+  return i;
+}
+
+/**
+ * Cuts the past off battery slot @index, so that it starts in
+ * harvesting slot @harv_slot at the measured level @batt_now,
+ * and recomputes its battery levels from the prediction.
+ * The consumption planned for the remainder is kept at the
+ * same rate per base period.
+ *
+ * Returns the change in the level at the end of the slot.
+ */
+static int32_t restart_battery_slot(uint8_t index,
+                                    uint16_t harv_slot,
+                                    uint32_t batt_now,
+                                    uint32_t *harvested)
+{
+  uint16_t end_slot, harv_i, past;
+  uint32_t e_cons_per_period, crt_batt_level, old_end;
+  uint32_t min_level, max_level;
 
-  // correct the offset
-  battery_delta = optsched_offset_correction(battery_end, min_e_cons, battery_delta);
+  end_slot = battery_slots.start_slot[index] + battery_slots.length[index];
+  if (battery_slots.type[index] == BATT_SLOT_CHARGING){
+    old_end = battery_slots.max_level[index];
+  }else{
+    old_end = battery_slots.min_level[index];
+  }
 
+  e_cons_per_period = battery_slots.total_e_cons[index]/
+                      batt_slot_duration(&battery_slots, index);
+  past = 0;
+  for (harv_i = battery_slots.start_slot[index]; harv_i < harv_slot; harv_i++){
+    past += harv_slot_duration(harv_i);
+  }
+  battery_slots.total_e_cons[index] -= e_cons_per_period*past;
+  battery_slots.start_slot[index] = harv_slot;
+  battery_slots.length[index] = end_slot - harv_slot;
+#if OPTSCHED_SLOT_GRID
+  battery_slots.duration[index] -= past;
+#endif
+
+  crt_batt_level = min_level = max_level = batt_now;
+  for (harv_i = harv_slot; harv_i < end_slot; harv_i++){
+    crt_batt_level += harvest(harvested, harv_i) - e_cons_per_period*harv_slot_duration(harv_i);
+    if (crt_batt_level < min_level) min_level = crt_batt_level;
+    if (crt_batt_level > max_level) max_level = crt_batt_level;
+  }
+  // rounding of the rate, it is consumed in the last harvesting slot
+  crt_batt_level -= battery_slots.total_e_cons[index] -
+                    e_cons_per_period*batt_slot_duration(&battery_slots, index);
+  battery_slots.min_level[index] = min(min_level, crt_batt_level);
+  battery_slots.max_level[index] = max_level;
+
+  return crt_batt_level - old_end;
+}
+
+int32_t optsched_replan(uint16_t harv_slot,
+                        uint32_t battery_now,
+                        uint32_t battery_end,
+                        uint32_t min_e_cons,
+                        uint32_t *harvest_prediction)
+{
+  int32_t battery_delta;
+  uint8_t index;
+
+#if OPTSCHED_SLICED
+  if (sliced_pass != OPTSCHED_PASS_DONE){
+    // cancel the run in progress, start again from the plan in service
+    memcpy(&battery_slots, &plan_slots, sizeof(battery_slots));
+    num_battery_slots = plan_num_battery_slots;
+    first_battery_slot = plan_first_battery_slot;
+    sliced_pass = OPTSCHED_PASS_DONE;
+  }
+#endif
+
+  if (num_battery_slots == 0 || harv_slot == 0 || harv_slot >= OPTSCHED_HORIZON_SLOTS){
+    return optsched_run(battery_now, battery_end,
+                        min_e_cons, 0, harvest_prediction);
+  }
+  reset_status();
+  battery_now = to_unit(battery_now);
+  // the margin of the run, from the measured level
+  apply_margins(battery_now);
+  battery_end = min(to_unit(battery_end), PLAN_BATT_MAX);
+  min_e_cons = to_unit(min_e_cons);
+
+  OPTSCHED_PROFILE(OPTSCHED_PASS_FIRST);
+  index = find_battery_slot(harv_slot);
+  first_battery_slot = index;
+
+  /*
+   * The slots after the current one have the levels of the old plan.
+   * Rather than shifting them here, hand the change over to the second
+   * pass as the pending battery delta, it only touches the slots it
+   * has to adjust. The current slot is moved to the old frame too, so
+   * that the pending delta brings it back to the measured levels.
+   */
+  battery_delta = restart_battery_slot(index, harv_slot, battery_now, harvest_prediction);
+  battery_slots.min_level[index] -= battery_delta;
+  battery_slots.max_level[index] -= battery_delta;
+
+  OPTSCHED_PROFILE(OPTSCHED_PASS_SECOND);
+  optsched_second_pass(index, &battery_delta, min_e_cons);
+
+  OPTSCHED_PROFILE(OPTSCHED_PASS_OFFSET);
+  battery_delta = optsched_check_plan(index, battery_now, battery_end, min_e_cons,
+                                      battery_delta, harvest_prediction);
+  OPTSCHED_PROFILE(OPTSCHED_PASS_DONE);
+
+  status.offset = from_unit(battery_delta);
+  check_reservations();
+  build_slot_table(harv_slot, battery_now, harvest_prediction);
+  publish_plan();
+  return status.offset;
+}
+
+#if OPTSCHED_MAX_RESERVATIONS
+int8_t optsched_reserve(uint16_t start_slot, uint16_t length, uint32_t energy)
+{
+  int8_t id;
+  uint8_t i, empty = 0;
+  uint16_t harv_slot;
+  uint32_t level, per_slot, held;
+  OptschedWhatIf what_if;
+
+  if (length == 0 || start_slot >= OPTSCHED_HORIZON_SLOTS ||
+      length > OPTSCHED_HORIZON_SLOTS - start_slot){
+    return OPTSCHED_RESERVE_INVALID;
+  }
+  for (id = 0; id < OPTSCHED_MAX_RESERVATIONS; id++){
+    if (reservations.length[id] == 0) break;
+  }
+  if (id == OPTSCHED_MAX_RESERVATIONS) return OPTSCHED_RESERVE_INVALID;
+
+  // what the plans will hold: the energy rounded up to whole slots
+  per_slot = to_unit(energy)/length + (to_unit(energy)%length != 0);
+
+  if (plan_num_battery_slots != 0){
+    // more than a full battery never fits, and would overflow below
+    if (energy > BATT_CAPACITY) return OPTSCHED_RESERVE_INFEASIBLE;
+    held = from_unit(per_slot*length);
+    /*
+     * From the level measured at the start of the plan in service, with
+     * the reservations held since, to the start of the window (or to the
+     * start of the plan, if the window began before it); a shortfall the
+     * plan has not absorbed yet shows up on the way.
+     */
+    harv_slot = max(start_slot, plan_start.harv_slot);
+    i = plan_first_battery_slot;
+    level = follow_plan(plan_start.harv_slot, &i, plan_start.level, harv_slot, 0, &empty);
+    if (empty) return OPTSCHED_RESERVE_INFEASIBLE;
+#if OPTSCHED_SLOT_TABLE
+    // the table rounds the expected levels down, by a step at most
+    held += from_unit(((uint32_t)1 << slot_table.level_shift) - 1);
+#endif
+    /*
+     * Spent all at once, as early as it can be: the rest of the plan
+     * must make up for it, with the allowances down to e_min, before
+     * any battery slot runs below BATT_MIN.
+     */
+    if (optsched_what_if(harv_slot, from_unit(level), held, &what_if, NULL, 0) < 0 ||
+        what_if.battery_slot != 0){
+      return OPTSCHED_RESERVE_INFEASIBLE;
+    }
+  }
+
+  reservations.start[id] = start_slot;
+  reservations.length[id] = length;
+  reservations.per_slot[id] = per_slot;
+  return id;
+}
+
+void optsched_cancel_reservation(int8_t id)
+{
+  if (id >= 0 && id < OPTSCHED_MAX_RESERVATIONS){
+    reservations.length[id] = 0;
+  }
+}
+
+void optsched_shift_reservations(uint16_t slots)
+{
+  uint8_t i;
+
+  for (i = 0; i < OPTSCHED_MAX_RESERVATIONS; i++){
+    if (reservations.length[i] == 0) continue;
+    if (reservations.start[i] >= slots){
+      reservations.start[i] -= slots;
+    }else if (reservations.start[i] + reservations.length[i] > slots){
+      // in progress, keep what is left of it
+      reservations.length[i] -= slots - reservations.start[i];
+      reservations.start[i] = 0;
+    }else{
+      reservations.length[i] = 0;
+    }
+  }
+}
+#endif
+
+#if OPTSCHED_MAX_RESERVATIONS && OPTSCHED_OFFLOAD
+uint32_t optsched_get_reservation(uint8_t id, uint16_t *start, uint16_t *length)
+{
+  *start = reservations.start[id];
+  *length = reservations.length[id];
+  return reservations.per_slot[id];
+}
+
+void optsched_set_reservation(uint8_t id, uint16_t start, uint16_t length,
+                              uint32_t per_slot)
+{
+  reservations.start[id] = start;
+  reservations.length[id] = length;
+  reservations.per_slot[id] = per_slot;
+}
+#endif
+
+#if OPTSCHED_LOAD
+static OPTSCHED_THREAD uint32_t load_battery_start;
+static OPTSCHED_THREAD uint16_t load_harv_slot;
+static OPTSCHED_THREAD uint8_t load_num_slots;
+
+const BatterySlots *optsched_get_plan_slots()
+{
+  return &plan_slots;
+}
+
+void optsched_load_start(uint32_t battery_start)
+{
+#if OPTSCHED_SLICED
+  // the plan being loaded replaces the run in progress
+  sliced_pass = OPTSCHED_PASS_DONE;
+#else
+  // no plan in service until it is loaded
+  num_battery_slots = 0;
+#endif
+  first_battery_slot = 0;
+  load_harv_slot = 0;
+  load_num_slots = 0;
+  reset_status();
+  load_battery_start = to_unit(battery_start);
+  set_margins(load_battery_start);
+}
+
+int8_t optsched_load_slot(uint16_t length, uint8_t type, uint32_t total_e_cons,
+                          uint32_t min_level, uint32_t max_level)
+{
+  uint8_t i = load_num_slots;
+#if OPTSCHED_SLOT_GRID
+  uint16_t harv_i;
+#endif
+
+  if (i == OPTSCHED_MAX_BATTERY_SLOTS || length == 0 ||
+      length > OPTSCHED_HORIZON_SLOTS - load_harv_slot ||
+      type > BATT_SLOT_DISCHARGING){
+    return -1;
+  }
+  battery_slots.start_slot[i] = load_harv_slot;
+  battery_slots.length[i] = length;
+  battery_slots.type[i] = type;
+  battery_slots.total_e_cons[i] = total_e_cons;
+  battery_slots.min_level[i] = min_level;
+  battery_slots.max_level[i] = max_level;
+#if OPTSCHED_SLOT_GRID
+  battery_slots.duration[i] = 0;
+  for (harv_i = load_harv_slot; harv_i < load_harv_slot + length; harv_i++){
+    battery_slots.duration[i] += harv_slot_duration(harv_i);
+  }
+#endif
+  load_harv_slot += length;
+  load_num_slots++;
+  return 0;
+}
+
+int8_t optsched_load_finish(const OptschedStatus *result, uint32_t *harvest_prediction)
+{
+#if OPTSCHED_RISK
+  uint32_t margin = status.margin;
+#endif
+
+  if (load_harv_slot != OPTSCHED_HORIZON_SLOTS) return -1;
+  num_battery_slots = load_num_slots;
+  status = *result;
+#if OPTSCHED_RISK
+  status.margin = margin;
+#endif
+  status.reservation = 0;
+  check_reservations();
+  build_slot_table(0, load_battery_start, harvest_prediction);
+  publish_plan();
+  return 0;
+}
+#endif
+
+const OptschedStatus *optsched_get_status()
+{
+  return &plan_status;
+}
+
+#if OPTSCHED_SLOT_TABLE
+int8_t optsched_get_slot_plan(uint16_t harv_slot, OptschedSlotPlan *plan)
+{
+  uint8_t i;
+
+  if (plan_num_battery_slots == 0 || harv_slot >= OPTSCHED_HORIZON_SLOTS) return -1;
+  i = slot_table.battery_slot[harv_slot];
+  plan->battery_slot = i + 1;
+  plan->e_cons = from_unit(slot_table.e_cons[i]);
+  plan->battery = from_unit(U_BATT_MIN +
+                  ((uint32_t)slot_table.level[harv_slot] << slot_table.level_shift));
+  return 0;
+}
+#else
+int8_t optsched_get_slot_plan(uint16_t harv_slot, OptschedSlotPlan *plan)
+{
+  if (plan_num_battery_slots == 0 || harv_slot >= OPTSCHED_HORIZON_SLOTS ||
+      harv_slot < plan_start.harv_slot){
+    return -1;
+  }
+  // asked about an earlier slot, start over
+  if (harv_slot < slot_walk.harv_slot){
+    slot_walk.harv_slot = plan_start.harv_slot;
+    slot_walk.level = plan_start.level;
+    slot_walk.battery_slot = plan_first_battery_slot;
+  }
+  slot_walk.level = follow_plan(slot_walk.harv_slot, &slot_walk.battery_slot,
+                                slot_walk.level, harv_slot, 1, NULL);
+  slot_walk.harv_slot = harv_slot;
+
+  plan->battery_slot = slot_walk.battery_slot + 1;
+  plan->e_cons = from_unit(plan_slot_rate(slot_walk.battery_slot));
+  plan->battery = from_unit(slot_walk.level);
   return 0;
 }
+#endif
 
+uint16_t optsched_get_next_slots(uint16_t harv_slot, uint16_t n,
+                                 OptschedSlotPlan *plans)
+{
+  uint16_t i;
+
+  if (harv_slot >= OPTSCHED_HORIZON_SLOTS) return 0;
+  if (n > OPTSCHED_HORIZON_SLOTS - harv_slot) n = OPTSCHED_HORIZON_SLOTS - harv_slot;
+  for (i = 0; i < n; i++){
+    if (optsched_get_slot_plan(harv_slot + i, &plans[i])) break;
+  }
+  return i;
+}
+
+int16_t optsched_what_if(uint16_t harv_slot,
+                         uint32_t battery_now,
+                         int32_t extra,
+                         OptschedWhatIf *result,
+                         uint32_t *allowances,
+                         uint8_t n)
+{
+  uint8_t i, filled;
+  uint16_t harv_i, periods;
+  uint32_t e_min, allowance;
+  int32_t planned, deficit, energy, margin, u_extra;
+  OptschedSlotPlan slot;
+
+  // the slot table, or a walk over the battery slots without it
+  if (optsched_get_slot_plan(harv_slot, &slot)) return -1;
+
+  e_min = to_unit(E_CONS_MIN);
+  // the magnitude is shifted, a negative one would round the other way
+  u_extra = extra < 0 ? -(int32_t)to_unit(-(uint32_t)extra) : (int32_t)to_unit((uint32_t)extra);
+  i = slot.battery_slot - 1;
+
+  // periods left in the current battery slot
+  periods = batt_slot_duration(&plan_slots, i);
+  for (harv_i = plan_slots.start_slot[i]; harv_i < harv_slot; harv_i++){
+    periods -= harv_slot_duration(harv_i);
+  }
+
+  // energy below the expected level once @extra is spent
+  planned = to_unit(slot.battery);
+  deficit = planned - (int32_t)to_unit(battery_now) + u_extra;
+  // the battery holds no more than BATT_MAX, the rest of a surplus is wasted
+  if (deficit < planned - (int32_t)U_BATT_MAX) deficit = planned - (int32_t)U_BATT_MAX;
+
+  result->battery_slot = 0;
+  margin = planned - deficit - U_BATT_MIN;
+  filled = 0;
+  for (; i < plan_num_battery_slots; i++){
+    if (deficit > 0 && plan_slots.max_level[i] > U_BATT_MAX){
+      // the plan wastes harvest at BATT_MAX, the battery takes it instead
+      deficit -= min((uint32_t)deficit, plan_slots.max_level[i] - U_BATT_MAX);
+    }
+
+    // the levels of the slot are lower by the deficit at most
+    energy = (int32_t)(plan_slots.min_level[i] - U_BATT_MIN) - max(deficit, 0);
+    if (energy < margin) margin = energy;
+    if (energy < 0 && result->battery_slot == 0) result->battery_slot = i + 1;
+
+    if (deficit != 0){
+      // made up by the allowance of the slot, down to e_min
+      energy = (int32_t)(plan_slot_rate(i) * periods) - deficit;
+      if (energy < (int32_t)(periods * e_min)){
+        allowance = e_min;
+        deficit = periods * e_min - energy;
+      }else if (energy > (int32_t)(periods * U_E_CONS_MAX)){
+        // up to E_CONS_MAX, the rest of a surplus goes to the next slots
+        allowance = U_E_CONS_MAX;
+        deficit = (int32_t)(periods * U_E_CONS_MAX) - energy;
+      }else{
+        allowance = energy/periods;
+        deficit = 0;
+      }
+    }else{
+      allowance = plan_slot_rate(i);
+    }
+    if (filled == 0) result->allowance = from_unit(allowance);
+    if (allowances && filled < n) allowances[filled] = from_unit(allowance);
+    filled++;
+
+    if (i + 1 < plan_num_battery_slots){
+      periods = batt_slot_duration(&plan_slots, i + 1);
+    }
+  }
+  result->margin = (int32_t)from_unit(margin);
+
+  return allowances ? min(filled, n) : 0;
+}
 
 uint8_t get_number_of_battery_slots()
 {
-  return num_battery_slots;
+  return plan_num_battery_slots;
+}
+
+uint8_t get_current_battery_slot()
+{
+  return plan_first_battery_slot + 1;
+}
+
+optsched_slot_t get_battery_slot_start(uint8_t slot_number)
+{
+  if (slot_number > plan_num_battery_slots
+      || slot_number == 0) return 0;
+  else return plan_slots.start_slot[slot_number-1];
+}
+
+optsched_slot_t get_battery_slot_length(uint8_t slot_number)
+{
+  if (slot_number > plan_num_battery_slots
+      || slot_number == 0) return 0;
+  else return plan_slots.length[slot_number-1];
 }
 
-uint8_t get_battery_slot_length(uint8_t slot_number)
+uint16_t get_battery_slot_duration(uint8_t slot_number)
 {
-  if (slot_number > num_battery_slots
+  if (slot_number > plan_num_battery_slots
       || slot_number == 0) return 0;
-  else return battery_slots[slot_number-1].length;
+  else return batt_slot_duration(&plan_slots, slot_number-1);
 }
 
 uint32_t get_battery_slot_total_e_cons(uint8_t slot_number)
 {
-  if (slot_number > num_battery_slots
+  if (slot_number > plan_num_battery_slots
       || slot_number == 0) return 0;
-  else return battery_slots[slot_number-1].total_e_cons;
+  else return from_unit(plan_slots.total_e_cons[slot_number-1]);
 }
 
 uint8_t get_battery_slot_type(uint8_t slot_number)
 {
-  if (slot_number > num_battery_slots
+  if (slot_number > plan_num_battery_slots
       || slot_number == 0) return 255;
-  else return battery_slots[slot_number-1].type;
+  else return plan_slots.type[slot_number-1];
 }
 
 uint32_t get_battery_slot_end(uint8_t slot_number)
 {
-  if (slot_number > num_battery_slots
+  if (slot_number > plan_num_battery_slots
       || slot_number == 0) return 0;
-  switch (battery_slots[slot_number-1].type){
+  switch (plan_slots.type[slot_number-1]){
     case BATT_SLOT_CHARGING:
-      return battery_slots[slot_number-1].max_level;
+      return from_unit(plan_slots.max_level[slot_number-1]);
     case BATT_SLOT_DISCHARGING:
     case BATT_SLOT_CONSTANT:
-      return battery_slots[slot_number-1].min_level;
+      return from_unit(plan_slots.min_level[slot_number-1]);
   }
   return 0;
 }
 
 uint32_t get_battery_slot_start_level(uint8_t slot_number)
 {
-  if (slot_number > num_battery_slots
+  if (slot_number > plan_num_battery_slots
       || slot_number == 0) return 0;
-  switch (battery_slots[slot_number-1].type){
+  switch (plan_slots.type[slot_number-1]){
     case BATT_SLOT_CHARGING:
-      return battery_slots[slot_number-1].min_level;
+      return from_unit(plan_slots.min_level[slot_number-1]);
     case BATT_SLOT_DISCHARGING:
     case BATT_SLOT_CONSTANT:
-      return battery_slots[slot_number-1].max_level;
+      return from_unit(plan_slots.max_level[slot_number-1]);
   }
   return 0;
 }
@@ -2,30 +2,258 @@
 #define __OPT_SCHED_H
 
 #include "contiki-conf.h"
-
-/*
- * energy limits per EH slot in Watt-ticks
- * E_CONS_MIN is for when the node only sends its own packets
- * E_CONS_MAX is for when the radio is constanly on
- * TODO E_CONS_MIN should be dynamically defined
- */
-#define E_CONS_MIN  155  // defined for EH interval=1min, data=1pkt/min
-#define E_CONS_MAX  117964 // same as above
+// energy limits E_CONS_MIN/MAX, per base period with a slot grid
+#include "eh_sched_interface.h"
 
 #define BATT_MIN  __NODE_OFF_THRESHOLD
 #define BATT_MAX  __BATTERY_INIT_CAP
 #define BATT_CAPACITY (BATT_MAX - BATT_MIN)
 
-// this determines the length of arrays such as harvested or battery; < 255
+// this determines the length of arrays such as harvested
 #ifndef SLOTS_PER_DAY
 #error "Must define number of slots per day"
 #endif
 
+/*
+ * Planning horizon, in days. The plan runs over
+ * OPTSCHED_HORIZON_SLOTS harvesting slots and only has to reach
+ * battery_end at the end of the horizon, so energy can be carried
+ * over into the next days instead of the battery being drained to
+ * its end-of-day level. Battery slot lengths and start slots are
+ * 16 bit when the horizon is longer than 255 slots.
+ *
+ * The harvest prediction covers OPTSCHED_PREDICTION_DAYS days and
+ * is repeated to fill the horizon; by default it is the day of the
+ * predictor, set it to the horizon with a multi-day forecast.
+ */
+#ifdef OPTSCHED_CONF_HORIZON_DAYS
+#define OPTSCHED_HORIZON_DAYS OPTSCHED_CONF_HORIZON_DAYS
+#else
+#define OPTSCHED_HORIZON_DAYS 1
+#endif
+
+#ifdef OPTSCHED_CONF_PREDICTION_DAYS
+#define OPTSCHED_PREDICTION_DAYS OPTSCHED_CONF_PREDICTION_DAYS
+#else
+#define OPTSCHED_PREDICTION_DAYS 1
+#endif
+
+#define OPTSCHED_HORIZON_SLOTS (SLOTS_PER_DAY*OPTSCHED_HORIZON_DAYS)
+#define OPTSCHED_PREDICTION_SLOTS (SLOTS_PER_DAY*OPTSCHED_PREDICTION_DAYS)
+
+#if OPTSCHED_HORIZON_SLOTS > 65535
+#error "The planning horizon must be within 65535 slots"
+#elif OPTSCHED_HORIZON_SLOTS > 255
+typedef uint16_t optsched_slot_t;
+#else
+typedef uint8_t optsched_slot_t;
+#endif
+
+/*
+ * Unit of energy inside the scheduler, 2^OPTSCHED_ENERGY_SHIFT
+ * Watt-ticks. The battery levels are close to 2^30 Watt-ticks
+ * already, so the levels the first pass reaches over a sunny
+ * multi-day horizon don't fit in 32 bits unless they are scaled
+ * down. The API stays in Watt-ticks; the plan is rounded to the
+ * unit, so it should be well below E_CONS_MIN.
+ */
+#ifdef OPTSCHED_CONF_ENERGY_SHIFT
+#define OPTSCHED_ENERGY_SHIFT OPTSCHED_CONF_ENERGY_SHIFT
+#else
+#define OPTSCHED_ENERGY_SHIFT 0
+#endif
+
+/*
+ * Non-uniform harvesting slots: by default the SLOTS_PER_DAY slots
+ * all have the same length. With OPTSCHED_CONF_SLOT_GRID each slot
+ * lasts a number of base periods (the eh_update period) set with
+ * optsched_set_slot_grid(), eg long slots at night and short ones in
+ * daytime, and the energy consumption (E_CONS_MIN/MAX, min_e_cons,
+ * the allowance) is per base period. It is enabled by default when
+ * the predictor uses a grid (EH_PRED_CONF_SLOT_GRID).
+ */
+#ifdef OPTSCHED_CONF_SLOT_GRID
+#define OPTSCHED_SLOT_GRID OPTSCHED_CONF_SLOT_GRID
+#elif defined(EH_PRED_CONF_SLOT_GRID)
+#define OPTSCHED_SLOT_GRID 1
+#else
+#define OPTSCHED_SLOT_GRID 0
+#endif
+
+/*
+ * Time-sliced planning (optsched_start/optsched_step), so that a
+ * cooperative scheduler is not blocked for the whole run. The new
+ * plan is computed in a second battery slot table while the getters
+ * keep returning the previous one, so this doubles the RAM used by
+ * the battery slots.
+ */
+#ifdef OPTSCHED_CONF_SLICED
+#define OPTSCHED_SLICED OPTSCHED_CONF_SLICED
+#else
+#define OPTSCHED_SLICED 0
+#endif
+
+// harvesting slots of the first pass processed per optsched_step()
+#ifdef OPTSCHED_CONF_SLICE
+#define OPTSCHED_SLICE OPTSCHED_CONF_SLICE
+#else
+#define OPTSCHED_SLICE 16
+#endif
+
+/*
+ * Per harvesting slot table of the plan in service, filled in a walk
+ * over the horizon when the plan is published, so that the node can
+ * look up the consumption planned for a slot and the battery level
+ * expected at its start without divisions (optsched_get_slot_plan).
+ * The level is kept in 16 bits, with a resolution of the battery
+ * capacity / 2^16, and the battery slot index in 8 bits, so the table
+ * costs 3 bytes of RAM per harvesting slot of the horizon, plus 4 per
+ * battery slot. It is on by default up to 144 slots a day (432 bytes
+ * for a day); at 576 slots it would take 1.7 KB a day of horizon, and
+ * optsched_get_slot_plan() and optsched_what_if() follow the plan
+ * from the battery slots instead.
+ */
+#ifdef OPTSCHED_CONF_SLOT_TABLE
+#define OPTSCHED_SLOT_TABLE OPTSCHED_CONF_SLOT_TABLE
+#elif SLOTS_PER_DAY > 144
+#define OPTSCHED_SLOT_TABLE 0
+#else
+#define OPTSCHED_SLOT_TABLE 1
+#endif
+
+/*
+ * Energy reserved ahead for heavy jobs (optsched_reserve), eg a bulk
+ * offload or an over-the-air update. Runs take the reserved energy off
+ * the predicted harvest of the reserved slots, as a fixed consumption
+ * that the passes cannot move; the allowance only covers the rest.
+ * Costs 8 bytes of RAM per reservation, 0 leaves them out.
+ */
+#ifdef OPTSCHED_CONF_MAX_RESERVATIONS
+#define OPTSCHED_MAX_RESERVATIONS OPTSCHED_CONF_MAX_RESERVATIONS
+#else
+#define OPTSCHED_MAX_RESERVATIONS 4
+#endif
+
+/*
+ * Risk-aware planning (optsched_set_risk): runs keep a margin above
+ * BATT_MIN, below BATT_MAX or both, sized from the error of the
+ * prediction so that the battery stays within its limits with a
+ * given confidence even if the harvest falls short of (or exceeds)
+ * the prediction. The plan gives up the energy of the margin in
+ * exchange for fewer node shutdowns (or less wasted harvest).
+ * 0 leaves it out.
+ */
+#ifdef OPTSCHED_CONF_RISK
+#define OPTSCHED_RISK OPTSCHED_CONF_RISK
+#else
+#define OPTSCHED_RISK 1
+#endif
+
+/*
+ * Offloaded planning (optsched_offload.h): the node sends its
+ * prediction and battery level over the serial line, a host runs the
+ * same passes and sends the battery slots of the plan back, and the
+ * node loads them (optsched_load_start/_slot/_finish) instead of
+ * running the passes. 0 leaves it out.
+ */
+#ifdef OPTSCHED_CONF_OFFLOAD
+#define OPTSCHED_OFFLOAD OPTSCHED_CONF_OFFLOAD
+#else
+#define OPTSCHED_OFFLOAD 0
+#endif
+
+/*
+ * Checkpoints of the plan in flash (optsched_checkpoint.h): each new
+ * plan is saved, and put back in service with optsched_load_*() when
+ * the node restarts in the same day. 0 leaves them out.
+ */
+#ifdef OPTSCHED_CONF_CHECKPOINT
+#define OPTSCHED_CHECKPOINT OPTSCHED_CONF_CHECKPOINT
+#else
+#define OPTSCHED_CHECKPOINT 0
+#endif
+
+// plans put in service from outside, with optsched_load_*()
+#define OPTSCHED_LOAD (OPTSCHED_OFFLOAD || OPTSCHED_CHECKPOINT)
+
+// sides of the battery where optsched_set_risk() keeps a margin
+enum{
+  OPTSCHED_MARGIN_LOW = 1,  // above BATT_MIN, against shortfalls of the harvest
+  OPTSCHED_MARGIN_HIGH = 2, // below BATT_MAX, against surpluses
+};
+
+// optsched_reserve() errors
+enum{
+  OPTSCHED_RESERVE_INVALID = -1,    // window outside the horizon, or no room left
+  OPTSCHED_RESERVE_INFEASIBLE = -2, // the plan in service cannot hold it
+};
+
+// optsched_step() results
+enum{
+  OPTSCHED_IDLE = 0,  // no run in progress
+  OPTSCHED_BUSY,      // call again
+  OPTSCHED_READY,     // the new plan is in service
+};
+
+// passes of the algorithm, as reported to the profiling hook
+enum{
+  OPTSCHED_PASS_FIRST = 0,
+  OPTSCHED_PASS_SECOND,
+  OPTSCHED_PASS_OFFSET,
+  OPTSCHED_PASS_DONE,
+  OPTSCHED_PASS_FALLBACK, // time-sliced fallback plan, not reported
+};
+
+// optsched_get_status() errors
+enum{
+  OPTSCHED_OK = 0,
+  OPTSCHED_ERR_CAPACITY,  // a battery slot spans more than the battery capacity
+  OPTSCHED_ERR_WASTE,     // harvest wasted at BATT_MAX that could not be avoided
+  OPTSCHED_ERR_OVERSPENT, // the battery goes below BATT_MIN in the plan
+};
+
+/*
+ * Outcome of the last run (or replan) of the plan in service.
+ * Only the first error of the run is kept. When the passes leave
+ * the battery below BATT_MIN the plan is replaced by the fallback:
+ * each battery slot consumes at most what the first pass gave it,
+ * its own harvest within min_e_cons and E_CONS_MAX, and no faster
+ * than the battery and the harvest so far can sustain, so the battery
+ * only goes below BATT_MIN where min_e_cons alone takes it there.
+ * It takes two more walks over the harvesting slots.
+ */
+typedef struct optsched_status{
+  uint8_t error;          // an OPTSCHED_ERR_ value
+  uint8_t battery_slot;   // where it was found, numbered from 1
+  uint16_t harv_slot;     // first harvesting slot of that battery slot
+  uint32_t residual;      // the energy left over, in Watt-ticks
+  int32_t offset;         // battery_end minus the level reached
+  uint8_t fallback;       // the fallback plan is in service
+  uint8_t reservation;    // one the plan takes below BATT_MIN, from 1; 0 if none
+#if OPTSCHED_RISK
+  uint32_t margin;        // kept from the limits, see optsched_set_risk()
+#endif
+} OptschedStatus;
+
+// the plan in a harvesting slot, see optsched_get_slot_plan()
+typedef struct optsched_slot_plan{
+  uint32_t e_cons;        // planned consumption per base period
+  uint32_t battery;       // expected level at the start of the slot
+  uint8_t battery_slot;   // numbered from 1, as for the getters
+} OptschedSlotPlan;
+
+// outcome of a hypothetical consumption, see optsched_what_if()
+typedef struct optsched_what_if{
+  uint32_t allowance;     // per base period, until the end of the battery slot
+  int32_t margin;         // lowest level expected in the horizon, above BATT_MIN
+  uint8_t battery_slot;   // first one where BATT_MIN is reached, from 1; 0 if none
+} OptschedWhatIf;
 
 /**
  * Runs the optimal algorithm, given the starting battery value,
- * the desired end battery value and the expected amount of
- * harvested energy.
+ * the desired end battery value (at the end of the horizon) and
+ * the expected amount of harvested energy in the
+ * OPTSCHED_PREDICTION_SLOTS slots of the prediction.
  *
  * It keeps the minimum energy at min_e_cons.
  * If @correct_offset is true the algorithm will attempt to 
@@ -33,6 +261,7 @@
  *
  * Returns the difference between desired end battery and 
  * achieved end battery, battery_end - final_battery.
+ * Errors are reported by optsched_get_status().
  */
 int32_t optsched_run(uint32_t battery_start, 
                      uint32_t battery_end,
@@ -40,8 +269,234 @@ int32_t optsched_run(uint32_t battery_start,
                      uint8_t correct_offset,
                      uint32_t *harvest_prediction);
 
+#if OPTSCHED_SLOT_GRID
+/**
+ * Sets the length of each of the SLOTS_PER_DAY harvesting slots, in
+ * base periods, used by the following runs. The array is not copied.
+ * With NULL (the default) all the slots are one base period long.
+ */
+void optsched_set_slot_grid(const uint8_t *slot_duration);
+#endif
+
+#if OPTSCHED_SLICED
+/**
+ * Starts computing a new plan, with the same parameters as
+ * optsched_run(), without doing any of the work: that is done by
+ * optsched_step(). Until the new plan is ready the getters return
+ * the previous one.
+ *
+ * Calling optsched_run() or optsched_replan() cancels the run.
+ */
+void optsched_start(uint32_t battery_start,
+                    uint32_t battery_end,
+                    uint32_t min_e_cons,
+                    uint8_t correct_offset,
+                    uint32_t *harvest_prediction);
+
+/**
+ * Does a bounded amount of work on the plan started by
+ * optsched_start(): OPTSCHED_SLICE harvesting slots of the first
+ * pass, one battery slot of the second pass or of the fallback
+ * plan, or the offset correction.
+ *
+ * Returns OPTSCHED_BUSY while there is work left, OPTSCHED_READY
+ * when the new plan has replaced the previous one, and
+ * OPTSCHED_IDLE if there is no run in progress.
+ */
+uint8_t optsched_step();
+
+/**
+ * Returns non-zero while a time-sliced run is in progress.
+ */
+uint8_t optsched_busy();
+#endif
+
+/**
+ * Re-solves the remainder of the cycle, from harvesting slot
+ * @harv_slot and the measured battery level @battery_now, starting
+ * from the current plan (warm start).
+ *
+ * The battery slot that contains @harv_slot is cut so that it starts
+ * now and its harvesting slots walked again, the ones before it are
+ * left as they were, and the second pass and the offset correction
+ * run over the ones after it with the difference between the
+ * measured and the planned battery level. That is still a walk over
+ * the rest of the plan: on the host benchmark (optsched_bench -r) a
+ * replan takes 45 to 80% of the time of a run at 144 slots a day,
+ * 20 to 40% at 576.
+ * Changes in the prediction for future slots are not picked up,
+ * those need optsched_run().
+ *
+ * Falls back to optsched_run() in slot 0 or when there is no plan.
+ * Returns as optsched_run().
+ */
+int32_t optsched_replan(uint16_t harv_slot,
+                        uint32_t battery_now,
+                        uint32_t battery_end,
+                        uint32_t min_e_cons,
+                        uint32_t *harvest_prediction);
+
+#if OPTSCHED_MAX_RESERVATIONS
+/**
+ * Reserves @energy Watt-ticks over the @length harvesting slots from
+ * @start_slot of the horizon, spread evenly (rounded up) over the
+ * slots. It is taken into account from the next run or replan on.
+ *
+ * The reservation is rejected if, from the battery level measured at
+ * the start of the plan in service (the one its run or replan was
+ * given), with the reservations held since, the battery would run out
+ * before the window, or would go below BATT_MIN with the energy spent
+ * at its start, rounded up as the plans hold it, while the rest of the
+ * plan makes up for it with the allowances down to E_CONS_MIN (see
+ * optsched_what_if). With the slot table, whose levels are rounded
+ * down, a step of the table more is asked for. A reservation that is
+ * accepted can still turn out to be infeasible as the prediction
+ * changes; runs report it in optsched_get_status().
+ *
+ * Returns the reservation id, or an OPTSCHED_RESERVE_ error.
+ */
+int8_t optsched_reserve(uint16_t start_slot, uint16_t length, uint32_t energy);
+
+/**
+ * Cancels reservation @id, from the next run or replan on.
+ */
+void optsched_cancel_reservation(int8_t id);
+
+/**
+ * Moves the reservations @slots harvesting slots back, as the horizon
+ * moves on at the start of a cycle, and drops the ones that are over.
+ */
+void optsched_shift_reservations(uint16_t slots);
+#endif
+
+#if OPTSCHED_RISK
+/**
+ * Sets the risk the following runs take with the prediction:
+ * @deviation is the mean absolute error of the prediction of each of
+ * the OPTSCHED_PREDICTION_SLOTS slots, in Watt-ticks (the array is not
+ * copied, see eh_pred_get_cycle_deviation), and @margins the
+ * OPTSCHED_MARGIN_ sides to protect.
+ *
+ * Taking the errors of the slots as independent and normal, each run
+ * keeps the battery a margin of z times the standard deviation of the
+ * harvest over the horizon away from the limits, with z the one-sided
+ * quantile of @confidence percent (none up to 50%, 3.1 above 99%).
+ * The margin is capped at a quarter of the battery capacity, the high
+ * one at the room left above the starting level. A start below the
+ * low margin gets the fallback plan, which refills the margin first.
+ * The replans keep the margin of the run. NULL or no margins (the
+ * default) plan up to the limits.
+ *
+ * The slot table, optsched_what_if() and the reservations still
+ * check the plan against the limits themselves.
+ */
+void optsched_set_risk(uint8_t confidence, const uint32_t *deviation,
+                       uint8_t margins);
+#endif
+
+#if OPTSCHED_LOAD
+/**
+ * Puts in service a plan computed elsewhere, from @battery_start at
+ * the start of the horizon, as a run with the same prediction, margin
+ * and reservations would have: optsched_load_start() starts it,
+ * optsched_load_slot() adds each battery slot in order, and
+ * optsched_load_finish() puts it in service with the @status of the
+ * run. The levels and consumption of the battery slots are in the
+ * scheduler unit (see OPTSCHED_ENERGY_SHIFT).
+ *
+ * Only the slot table is built, in a walk over the horizon. Until
+ * the plan is loaded there is no plan in service, or the previous
+ * one with OPTSCHED_CONF_SLICED; loading cancels a time-sliced run.
+ *
+ * optsched_load_slot() returns -1 if the battery slot does not fit
+ * in the horizon or the table, optsched_load_finish() if they don't
+ * cover the horizon; the plan is not put in service.
+ */
+void optsched_load_start(uint32_t battery_start);
+int8_t optsched_load_slot(uint16_t length, uint8_t type, uint32_t total_e_cons,
+                          uint32_t min_level, uint32_t max_level);
+int8_t optsched_load_finish(const OptschedStatus *status,
+                            uint32_t *harvest_prediction);
+#endif
+
+/**
+ * Returns the outcome of the run that produced the plan in service.
+ */
+const OptschedStatus *optsched_get_status();
+
+/**
+ * Fills @plan with the plan in service for harvesting slot @harv_slot
+ * of the horizon, in constant time. The expected battery level follows
+ * the prediction and is kept within the battery limits, as the battery
+ * would be. Slots before the start of the last replan keep the values
+ * of the plan they were in.
+ *
+ * Without OPTSCHED_SLOT_TABLE the level is worked out from the battery
+ * slots, the prediction as it is at the time of the call and the
+ * reservations the plan was made with, a step per slot from the slot
+ * asked last (from the start of the plan when going back), and slots
+ * before the last replan are not kept.
+ *
+ * Returns 0, or -1 if there is no plan or @harv_slot is outside the
+ * horizon (or, without the table, before the last replan).
+ */
+int8_t optsched_get_slot_plan(uint16_t harv_slot, OptschedSlotPlan *plan);
+
+/**
+ * Fills @plans with the plan of (up to) @n harvesting slots from
+ * @harv_slot on, so that the work can be laid out ahead of time.
+ * Stops at the end of the horizon.
+ *
+ * Returns the number of slots filled in.
+ */
+uint16_t optsched_get_next_slots(uint16_t harv_slot, uint16_t n,
+                                 OptschedSlotPlan *plans);
+
+/**
+ * Evaluates spending @extra Watt-ticks (less if negative) at the
+ * start of harvesting slot @harv_slot, with the battery at
+ * @battery_now, against the plan in service, without changing it.
+ *
+ * The difference from the expected level is made up as eh_opt_sched
+ * does: spread over the rest of the battery slot, down to E_CONS_MIN
+ * (up to E_CONS_MAX for a surplus), and whatever is left over in the
+ * following battery slots, less the harvest the plan expects to waste
+ * at BATT_MAX.
+ *
+ * @result gets the allowance for the rest of the battery slot and the
+ * risk of reaching BATT_MIN; @allowances, if not NULL, the allowance
+ * per base period of up to @n battery slots from the current one.
+ * Takes a walk over the battery slots (and over the harvesting slots
+ * of the current one with a slot grid); without OPTSCHED_SLOT_TABLE
+ * the expected level is the one of optsched_get_slot_plan(), with its
+ * walk.
+ *
+ * Returns the number of allowances filled in, or -1 if there is no
+ * plan or @harv_slot is outside the horizon (or, without the table,
+ * before the last replan).
+ */
+int16_t optsched_what_if(uint16_t harv_slot,
+                         uint32_t battery_now,
+                         int32_t extra,
+                         OptschedWhatIf *result,
+                         uint32_t *allowances,
+                         uint8_t n);
+
 uint8_t get_number_of_battery_slots();
-uint8_t get_battery_slot_length(uint8_t slot_number);
+
+/**
+ * Returns the battery slot (numbered from 1, as for the getters
+ * below) where the current horizon starts; after optsched_replan()
+ * this is the slot that contains the current harvesting slot.
+ */
+uint8_t get_current_battery_slot();
+
+// first harvesting slot, in the horizon
+optsched_slot_t get_battery_slot_start(uint8_t slot_number);
+// length in harvesting slots
+optsched_slot_t get_battery_slot_length(uint8_t slot_number);
+// length in base periods, the same as above without a slot grid
+uint16_t get_battery_slot_duration(uint8_t slot_number);
 uint32_t get_battery_slot_total_e_cons(uint8_t slot_number);
 uint8_t get_battery_slot_type(uint8_t slot_number);
 uint32_t get_battery_slot_start_level(uint8_t slot_number);
@@ -17,14 +17,126 @@ enum{
   BATT_ERROR_UNSET=255,
 };
 
-typedef struct battery_slot{
-  uint8_t type;       // a BATT_SLOT_ type
-  uint8_t start_slot; // index of harvesting slot when this battery slot begins
-  uint8_t length;     // length (in harvesting slots)
-  uint32_t min_level;
-  uint32_t max_level;
-  uint32_t total_e_cons;  // amount of energy consumed in this slot
-} BatterySlot;
+/*
+ * Capacity of the battery slot table.
+ * A new battery slot starts whenever the harvest crosses E_CONS_MAX
+ * or e_min, so in theory there can be as many as harvesting slots, but
+ * in practice there are a handful per cycle. By default there is room
+ * for a quarter of the harvesting slots, within [8, 40] per day of the
+ * horizon: the worst synthetic days of the host benchmark (fragmented,
+ * alternating sun and cloud) take 36 at any resolution, so 40 is the
+ * capacity the table always had, in 15 bytes per slot instead of 16.
+ * Above 255 harvesting slots the indices take 16 bits and a slot 17
+ * bytes, 680 in all; the old table could not index those cycles.
+ * A time-sliced run (OPTSCHED_CONF_SLICED) keeps a second table.
+ * When a cycle needs more, the first pass merges neighbouring battery
+ * slots.
+ */
+#ifdef OPTSCHED_CONF_MAX_BATTERY_SLOTS
+#define OPTSCHED_MAX_BATTERY_SLOTS OPTSCHED_CONF_MAX_BATTERY_SLOTS
+#elif SLOTS_PER_DAY/4 < 8
+#define OPTSCHED_MAX_BATTERY_SLOTS (8*OPTSCHED_HORIZON_DAYS)
+#elif SLOTS_PER_DAY/4 > 40
+#define OPTSCHED_MAX_BATTERY_SLOTS (40*OPTSCHED_HORIZON_DAYS)
+#else
+#define OPTSCHED_MAX_BATTERY_SLOTS (SLOTS_PER_DAY/4*OPTSCHED_HORIZON_DAYS)
+#endif
+
+#if OPTSCHED_MAX_BATTERY_SLOTS < 2 || OPTSCHED_MAX_BATTERY_SLOTS > 255
+#error "OPTSCHED_MAX_BATTERY_SLOTS must be in [2, 255]"
+#endif
+
+/*
+ * Energy in the scheduler unit (see OPTSCHED_ENERGY_SHIFT): the
+ * limits, and conversion of Watt-ticks in and out.
+ */
+#define to_unit(E)    ((uint32_t)(E) >> OPTSCHED_ENERGY_SHIFT)
+#define from_unit(E)  ((uint32_t)(E) << OPTSCHED_ENERGY_SHIFT)
+
+#define U_BATT_MIN      to_unit(BATT_MIN)
+#define U_BATT_MAX      to_unit(BATT_MAX)
+#define U_BATT_CAPACITY (U_BATT_MAX - U_BATT_MIN)
+#define U_E_CONS_MAX    to_unit(E_CONS_MAX)
+
+/*
+ * Qualifier of the state of the scheduler (the plan, the passes, the
+ * reservations...), which is kept in static variables. Host builds
+ * that run a scheduler per thread define OPTSCHED_CONF_THREAD to
+ * __thread; on the motes it is empty.
+ */
+#ifdef OPTSCHED_CONF_THREAD
+#define OPTSCHED_THREAD OPTSCHED_CONF_THREAD
+#else
+#define OPTSCHED_THREAD
+#endif
+
+/*
+ * Limits the passes plan within: the battery limits, less the
+ * margins of the run (see optsched_set_risk).
+ */
+#if OPTSCHED_RISK
+extern OPTSCHED_THREAD uint32_t optsched_margin_low, optsched_margin_high;
+#define PLAN_BATT_MIN   (U_BATT_MIN + optsched_margin_low)
+#define PLAN_BATT_MAX   (U_BATT_MAX - optsched_margin_high)
+#else
+#define PLAN_BATT_MIN   U_BATT_MIN
+#define PLAN_BATT_MAX   U_BATT_MAX
+#endif
+#define PLAN_BATT_CAPACITY (PLAN_BATT_MAX - PLAN_BATT_MIN)
+
+/*
+ * Keep an index of the suffix minima of the distance from the
+ * battery limits, so that adjusting the energy is linear in the
+ * number of battery slots instead of quadratic. Costs 4 bytes of
+ * RAM per battery slot. Off by default: it only shortens the second
+ * pass, which is a small part of a run even on fragmented days
+ * (make compare-min-delta in tools/mallec_host).
+ */
+#ifdef OPTSCHED_CONF_MIN_DELTA_INDEX
+#define OPTSCHED_MIN_DELTA_INDEX OPTSCHED_CONF_MIN_DELTA_INDEX
+#else
+#define OPTSCHED_MIN_DELTA_INDEX 0
+#endif
+
+/*
+ * Profiling hook, called at the start of each pass of the algorithm
+ * and when optsched_run() completes (see OPTSCHED_PASS_*).
+ * Host builds define OPTSCHED_CONF_PROFILE to the name of a function
+ * that timestamps the passes; on the motes it compiles to nothing.
+ */
+#ifdef OPTSCHED_CONF_PROFILE
+void OPTSCHED_CONF_PROFILE(uint8_t pass);
+#define OPTSCHED_PROFILE(PASS) OPTSCHED_CONF_PROFILE(PASS)
+#else
+#define OPTSCHED_PROFILE(PASS)
+#endif
+
+/*
+ * The battery slots, stored as one array per field so that
+ * the 8 bit fields don't need padding. Energy is in the
+ * scheduler unit.
+ */
+typedef struct battery_slots{
+  uint32_t min_level[OPTSCHED_MAX_BATTERY_SLOTS];
+  uint32_t max_level[OPTSCHED_MAX_BATTERY_SLOTS];
+  uint32_t total_e_cons[OPTSCHED_MAX_BATTERY_SLOTS];  // amount of energy consumed in the slot
+  uint8_t type[OPTSCHED_MAX_BATTERY_SLOTS];       // a BATT_SLOT_ type
+  optsched_slot_t start_slot[OPTSCHED_MAX_BATTERY_SLOTS]; // index of harvesting slot when the battery slot begins
+  optsched_slot_t length[OPTSCHED_MAX_BATTERY_SLOTS];     // length (in harvesting slots)
+#if OPTSCHED_SLOT_GRID
+  uint16_t duration[OPTSCHED_MAX_BATTERY_SLOTS];  // length (in base periods)
+#endif
+} BatterySlots;
+
+/*
+ * Length of battery slot @I in base periods, the unit of the
+ * energy consumption rates.
+ */
+#if OPTSCHED_SLOT_GRID
+#define batt_slot_duration(S, I) ((S)->duration[I])
+#else
+#define batt_slot_duration(S, I) ((S)->length[I])
+#endif
 
 #define max(A, B) ((A)>=(B)?(A):(B))
 #define min(A, B) ((A)<(B)?(A):(B))
@@ -32,19 +144,19 @@ typedef struct battery_slot{
 
 /**
  * This determines the maximum error (overcharge or depletion)
- * for a battery slot, given a certain battery delta @delta_b
+ * for battery slot @i, given a certain battery delta @delta_b
  */
-inline uint32_t get_batt_error(BatterySlot *slot, int32_t delta_b){
+static inline uint32_t get_batt_error(BatterySlots *slots, uint8_t i, int32_t delta_b){
   int32_t wasted, missed;
-  wasted = slot->max_level - BATT_MAX;
-  missed = BATT_MIN - slot->min_level;
+  wasted = slots->max_level[i] - PLAN_BATT_MAX;
+  missed = PLAN_BATT_MIN - slots->min_level[i];
   return max(0, max(wasted+delta_b, missed - delta_b));
 }
 
-inline uint8_t get_batt_error_type(BatterySlot *slot, int32_t delta_b){
+static inline uint8_t get_batt_error_type(BatterySlots *slots, uint8_t i, int32_t delta_b){
   int32_t wasted, missed;
-  wasted = slot->max_level - BATT_MAX;
-  missed = BATT_MIN - slot->min_level;
+  wasted = slots->max_level[i] - PLAN_BATT_MAX;
+  missed = PLAN_BATT_MIN - slots->min_level[i];
 
   if (wasted + delta_b > 0) return BATT_SLOT_CHARGING;
   else if (missed - delta_b > 0) return BATT_SLOT_DISCHARGING;
@@ -53,24 +165,76 @@ inline uint8_t get_batt_error_type(BatterySlot *slot, int32_t delta_b){
 }
 
 /**
- * Determines how much extra energy can be consumed in this slot
+ * Determines how much extra energy can be consumed in slot @i
  */
-inline uint32_t get_slot_max_e_increase(BatterySlot *slot){
-  return slot->length*E_CONS_MAX - slot->total_e_cons;
+static inline uint32_t get_slot_max_e_increase(BatterySlots *slots, uint8_t i){
+  return batt_slot_duration(slots, i)*U_E_CONS_MAX - slots->total_e_cons[i];
 }
 
 /**
- * Determines how much extra energy can be saved in this slot
+ * Determines how much extra energy can be saved in slot @i
  */
-inline uint32_t get_slot_max_e_decrease(BatterySlot *slot, uint32_t e_min){
-  return slot->total_e_cons - slot->length*e_min;
+static inline uint32_t get_slot_max_e_decrease(BatterySlots *slots, uint8_t i, uint32_t e_min){
+  return slots->total_e_cons[i] - batt_slot_duration(slots, i)*e_min;
 }
 
-#define batt_slot_capacity(S) ((S)->max_level - (S)->min_level)
-#define batt_slot_wasted_e(S) ((S)->max_level - BATT_MAX)
-#define batt_slot_missing_e(S) (BATT_MIN - (S)->min_level)
+/*
+ * Hooks for the batched first pass of the host tools
+ * (tools/mallec_host/optsched_batch.c), which has to stay
+ * bit-identical to the one here.
+ */
+#ifdef OPTSCHED_CONF_BATCH
+#define OPTSCHED_BATCH OPTSCHED_CONF_BATCH
+#else
+#define OPTSCHED_BATCH 0
+#endif
+
+#if OPTSCHED_BATCH
+// merge_battery_slots() on the table @slots
+void optsched_merge_battery_slots(BatterySlots *slots, uint8_t num);
+/*
+ * Runs the first pass alone, as optsched_run() does, and copies its
+ * battery slots to @slots and the status to @run_status.
+ * Returns the number of battery slots.
+ */
+uint8_t optsched_first_pass_only(uint32_t battery_start, uint32_t min_e_cons,
+                                 uint32_t *harvest_prediction,
+                                 BatterySlots *slots, OptschedStatus *run_status);
+#endif
+
+#if OPTSCHED_LOAD
+/*
+ * The battery slots of the plan in service, in the scheduler unit,
+ * to save or ship it and load it back with optsched_load_*().
+ */
+const BatterySlots *optsched_get_plan_slots();
+#endif
+
+#if OPTSCHED_OFFLOAD
+/*
+ * The state a run depends on besides its arguments, for the offload
+ * (optsched_offload.c) to ship between the node and the host. Energy
+ * is in the scheduler unit, but for the margin.
+ */
+#if OPTSCHED_RISK
+// the margin of a run now, and the OPTSCHED_MARGIN_ sides in @margins
+uint32_t optsched_get_margin(uint8_t *margins);
+// the margin of the next runs, instead of the one optsched_set_risk() sets
+void optsched_fix_margin(uint32_t margin, uint8_t margins);
+#endif
+#if OPTSCHED_MAX_RESERVATIONS
+// energy per slot of reservation @id, length 0 if it is free
+uint32_t optsched_get_reservation(uint8_t id, uint16_t *start, uint16_t *length);
+void optsched_set_reservation(uint8_t id, uint16_t start, uint16_t length,
+                              uint32_t per_slot);
+#endif
+#endif
+
+#define batt_slot_capacity(S, I) ((S)->max_level[I] - (S)->min_level[I])
+#define batt_slot_wasted_e(S, I) ((S)->max_level[I] - PLAN_BATT_MAX)
+#define batt_slot_missing_e(S, I) (PLAN_BATT_MIN - (S)->min_level[I])
 
-#define is_increasing(SLOT) ((SLOT)->type == BATT_SLOT_CONSTANT || (SLOT)->type == BATT_SLOT_CHARGING)
-#define is_decreasing(SLOT) ((SLOT)->type == BATT_SLOT_CONSTANT || (SLOT)->type == BATT_SLOT_DISCHARGING)
+#define is_increasing(S, I) ((S)->type[I] == BATT_SLOT_CONSTANT || (S)->type[I] == BATT_SLOT_CHARGING)
+#define is_decreasing(S, I) ((S)->type[I] == BATT_SLOT_CONSTANT || (S)->type[I] == BATT_SLOT_DISCHARGING)
 
 #endif
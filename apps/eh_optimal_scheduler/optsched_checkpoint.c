@@ -0,0 +1,149 @@
+/**
+ * Checkpoints of the plan, see optsched_checkpoint.h
+ *
+ * A file holds a header, the level the plan was run from, the status
+ * of the run, the battery slots (in the scheduler unit) and an end
+ * mark, as Coffee takes the last byte that is not 0 as the end of a
+ * file. The plan is written to the file the last one is not in, and
+ * the last one is removed once it is complete.
+ */
+#include <string.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+
+// in the sources of the app, but only built with the checkpoints
+#if OPTSCHED_CHECKPOINT
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+#include "lib/crc16.h"
+#include "optsched_checkpoint.h"
+
+#define PRINTF(FORMAT, args...) while(0){}
+//#define PRINTF printf
+
+#define CHECKPOINT_MAGIC 0xEC02
+#define END_MARK 0x5A
+
+struct checkpoint_header{
+  uint16_t magic;
+  uint16_t day;
+  uint16_t slots;   // battery slots
+  uint16_t crc;     // of the rest, the end mark aside
+};
+
+struct saved_slot{
+  uint32_t total_e_cons;
+  uint32_t min_level;
+  uint32_t max_level;
+  uint16_t length;
+  uint8_t type;
+  uint8_t unused;
+};
+
+static const char *file_name[2] = {"plan.0", "plan.1"};
+static int8_t last = -1;      // file of the last plan saved or restored
+
+static void slot_of(const BatterySlots *s, uint8_t i, struct saved_slot *slot)
+{
+  slot->total_e_cons = s->total_e_cons[i];
+  slot->min_level = s->min_level[i];
+  slot->max_level = s->max_level[i];
+  slot->length = s->length[i];
+  slot->type = s->type[i];
+  slot->unused = 0;
+}
+
+void optsched_checkpoint_save(uint16_t day, uint32_t battery_start)
+{
+  const BatterySlots *s = optsched_get_plan_slots();
+  const OptschedStatus *status = optsched_get_status();
+  struct checkpoint_header header;
+  struct saved_slot slot;
+  uint8_t i, end = END_MARK;
+  int8_t file = last == 0 ? 1 : 0;
+  int fd, ok;
+
+  header.magic = CHECKPOINT_MAGIC;
+  header.day = day;
+  header.slots = get_number_of_battery_slots();
+  header.crc = crc16_data((const unsigned char *)&battery_start, sizeof(battery_start), 0);
+  header.crc = crc16_data((const unsigned char *)status, sizeof(*status), header.crc);
+  for (i = 0; i < header.slots; i++){
+    slot_of(s, i, &slot);
+    header.crc = crc16_data((const unsigned char *)&slot, sizeof(slot), header.crc);
+  }
+
+  cfs_remove(file_name[file]);
+  cfs_coffee_reserve(file_name[file], sizeof(header) + sizeof(battery_start) +
+                     sizeof(*status) + header.slots*sizeof(slot) + 1);
+  fd = cfs_open(file_name[file], CFS_WRITE);
+  ok = fd >= 0 && cfs_write(fd, &header, sizeof(header)) == sizeof(header) &&
+       cfs_write(fd, &battery_start, sizeof(battery_start)) == sizeof(battery_start) &&
+       cfs_write(fd, status, sizeof(*status)) == sizeof(*status);
+  for (i = 0; i < header.slots && ok; i++){
+    slot_of(s, i, &slot);
+    ok = cfs_write(fd, &slot, sizeof(slot)) == sizeof(slot);
+  }
+  ok = ok && cfs_write(fd, &end, 1) == 1;
+  if (fd >= 0) cfs_close(fd);
+  if (!ok){
+    PRINTF("Plan checkpoint: write failed\n");
+    cfs_remove(file_name[file]);
+    return;
+  }
+  cfs_remove(file_name[file == 0 ? 1 : 0]);
+  last = file;
+}
+
+/**
+ * Loads the plan of day @day from file @file as it reads it, and
+ * puts it in service if it is whole. Returns 0 on success.
+ */
+static int8_t load_file(uint8_t file, uint16_t day, uint32_t *harvest_prediction)
+{
+  struct checkpoint_header header;
+  struct saved_slot slot;
+  OptschedStatus status;
+  uint32_t battery_start;
+  uint16_t crc;
+  uint8_t i, end;
+  int fd, ok;
+
+  fd = cfs_open(file_name[file], CFS_READ);
+  if (fd < 0) return -1;
+  ok = cfs_read(fd, &header, sizeof(header)) == sizeof(header) &&
+       header.magic == CHECKPOINT_MAGIC && header.day == day &&
+       header.slots <= OPTSCHED_MAX_BATTERY_SLOTS &&
+       cfs_read(fd, &battery_start, sizeof(battery_start)) == sizeof(battery_start) &&
+       cfs_read(fd, &status, sizeof(status)) == sizeof(status);
+  if (!ok){
+    cfs_close(fd);
+    return -1;
+  }
+  crc = crc16_data((const unsigned char *)&battery_start, sizeof(battery_start), 0);
+  crc = crc16_data((const unsigned char *)&status, sizeof(status), crc);
+
+  // nothing is in service until optsched_load_finish()
+  optsched_load_start(battery_start);
+  for (i = 0; i < header.slots && ok; i++){
+    ok = cfs_read(fd, &slot, sizeof(slot)) == sizeof(slot) &&
+         optsched_load_slot(slot.length, slot.type, slot.total_e_cons,
+                            slot.min_level, slot.max_level) == 0;
+    crc = crc16_data((const unsigned char *)&slot, sizeof(slot), crc);
+  }
+  ok = ok && cfs_read(fd, &end, 1) == 1 && end == END_MARK && crc == header.crc;
+  cfs_close(fd);
+  if (!ok || optsched_load_finish(&status, harvest_prediction)) return -1;
+  last = file;
+  return 0;
+}
+
+int8_t optsched_checkpoint_restore(uint16_t day, uint32_t *harvest_prediction)
+{
+  // both are only there after a restart between a write and a removal
+  if (load_file(0, day, harvest_prediction) == 0) return 0;
+  if (load_file(1, day, harvest_prediction) == 0) return 0;
+  return -1;
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef __OPTSCHED_CHECKPOINT_H
+#define __OPTSCHED_CHECKPOINT_H
+
+#include "optimal_scheduler.h"
+
+/*
+ * Checkpoints of the plan in Coffee (CFS), so that a node that
+ * restarts in the middle of a day gets its plan back instead of
+ * waiting for the next one. The plan in service is saved once, when
+ * it comes in service, with the day it is for; the replans of the
+ * day are not saved, the node replans from its battery level once
+ * the plan is back. Two files take turns, so that a restart while
+ * one is written leaves the other.
+ */
+
+#if !OPTSCHED_CHECKPOINT
+#error "The checkpoints need OPTSCHED_CONF_CHECKPOINT"
+#endif
+
+/**
+ * Saves the plan in service, run from @battery_start at the start of
+ * the horizon, as the plan of day @day.
+ */
+void optsched_checkpoint_save(uint16_t day, uint32_t battery_start);
+
+/**
+ * Puts the plan saved for day @day back in service, its slot table
+ * built from @harvest_prediction. Returns 0 on success, -1 if there
+ * is none.
+ */
+int8_t optsched_checkpoint_restore(uint16_t day, uint32_t *harvest_prediction);
+
+#endif
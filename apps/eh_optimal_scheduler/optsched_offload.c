@@ -0,0 +1,249 @@
+/**
+ * Offloaded planning, see optsched_offload.h
+ */
+#include <stdio.h>
+#include <string.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+
+// in the sources of the app, but only built with the offload
+#if OPTSCHED_OFFLOAD
+#include "optsched_offload.h"
+
+#define PRINTF(FORMAT, args...) while(0){}
+//#define PRINTF printf
+
+enum{
+  OFFLOAD_IDLE = 0,   // no frame expected
+  OFFLOAD_WAIT,       // for the reply (node) or a request (host)
+  OFFLOAD_READ,       // in the body of a frame
+};
+
+// the node end: the last request, and the reply being loaded
+static struct{
+  uint8_t state;
+  uint16_t seq;
+  uint32_t battery_start;
+  uint8_t slots;            // battery slots left in the reply
+  OptschedStatus status;
+} node;
+
+/**
+ * Parses up to @n decimal numbers separated by spaces, with an
+ * optional minus sign, from @line into @values.
+ * Returns how many, or -1 if the line holds anything else.
+ */
+static int8_t parse_numbers(const char *line, uint32_t *values, uint8_t n)
+{
+  uint8_t count = 0, negative;
+  uint32_t value;
+
+  while (*line){
+    if (*line == ' ' || *line == '\r' || *line == '\n'){
+      line++;
+      continue;
+    }
+    if (count == n) return -1;
+    negative = *line == '-';
+    if (negative) line++;
+    if (*line < '0' || *line > '9') return -1;
+    for (value = 0; *line >= '0' && *line <= '9'; line++){
+      value = value*10 + (*line - '0');
+    }
+    values[count++] = negative ? -value : value;
+  }
+  return count;
+}
+
+static uint8_t is_eof(const char *line)
+{
+  return strncmp(line, "EOF", 3) == 0 &&
+         (line[3] == 0 || line[3] == '\r' || line[3] == '\n');
+}
+
+void optsched_offload_request(uint16_t seq,
+                              uint32_t battery_start,
+                              uint32_t battery_end,
+                              uint32_t min_e_cons,
+                              uint32_t *harvest_prediction)
+{
+  uint32_t margin = 0;
+  uint8_t margins = 0;
+  uint16_t i;
+#if OPTSCHED_MAX_RESERVATIONS
+  uint16_t start, length;
+  uint32_t per_slot;
+#endif
+
+#if OPTSCHED_RISK
+  margin = optsched_get_margin(&margins);
+#endif
+  node.seq = seq;
+  node.battery_start = battery_start;
+  node.state = OFFLOAD_WAIT;
+
+  OFFLOAD_PRINTF("SOF REQ %u %lu %lu %lu %lu %u\n", seq,
+      (unsigned long)battery_start, (unsigned long)battery_end,
+      (unsigned long)min_e_cons, (unsigned long)margin, margins);
+#if OPTSCHED_MAX_RESERVATIONS
+  for (i = 0; i < OPTSCHED_MAX_RESERVATIONS; i++){
+    per_slot = optsched_get_reservation(i, &start, &length);
+    if (length != 0){
+      OFFLOAD_PRINTF("R %u %u %u %lu\n", i, start, length, (unsigned long)per_slot);
+    }
+  }
+#endif
+  for (i = 0; i < OPTSCHED_PREDICTION_SLOTS; i++){
+    OFFLOAD_PRINTF("H %lu\n", (unsigned long)harvest_prediction[i]);
+  }
+  OFFLOAD_PRINTF("EOF\n");
+}
+
+void optsched_offload_cancel()
+{
+  node.state = OFFLOAD_IDLE;
+}
+
+uint8_t optsched_offload_input(const char *line, uint32_t *harvest_prediction)
+{
+  uint32_t v[9];
+
+  if (node.state == OFFLOAD_IDLE) return OPTSCHED_OFFLOAD_IGNORED;
+
+  if (strncmp(line, "SOF PLAN ", 9) == 0){
+    if (parse_numbers(line + 9, v, 9) != 9 || v[1] == 0){
+      PRINTF("Offload: bad header\n");
+      node.state = OFFLOAD_IDLE;
+      return OPTSCHED_OFFLOAD_ERROR;
+    }
+    if ((uint16_t)v[0] != node.seq){
+      // the reply to an earlier request
+      node.state = OFFLOAD_WAIT;
+      return OPTSCHED_OFFLOAD_IGNORED;
+    }
+    node.slots = v[1];
+    node.status.offset = v[2];
+    node.status.error = v[3];
+    node.status.battery_slot = v[4];
+    node.status.harv_slot = v[5];
+    node.status.residual = v[6];
+    node.status.fallback = v[7];
+    node.status.reservation = v[8];
+    optsched_load_start(node.battery_start);
+    node.state = OFFLOAD_READ;
+    return OPTSCHED_OFFLOAD_MORE;
+  }
+  if (node.state != OFFLOAD_READ) return OPTSCHED_OFFLOAD_IGNORED;
+
+  if (is_eof(line)){
+    node.state = OFFLOAD_IDLE;
+    if (node.slots != 0 ||
+        optsched_load_finish(&node.status, harvest_prediction)){
+      PRINTF("Offload: bad plan\n");
+      return OPTSCHED_OFFLOAD_ERROR;
+    }
+    return OPTSCHED_OFFLOAD_READY;
+  }
+  // the logs of the node in between
+  if (line[0] != 'P' || line[1] != ' ') return OPTSCHED_OFFLOAD_IGNORED;
+
+  if (node.slots == 0 || parse_numbers(line + 2, v, 5) != 5 ||
+      optsched_load_slot(v[0], v[1], v[2], v[3], v[4])){
+    PRINTF("Offload: bad battery slot %s\n", line);
+    node.state = OFFLOAD_IDLE;
+    return OPTSCHED_OFFLOAD_ERROR;
+  }
+  node.slots--;
+  return OPTSCHED_OFFLOAD_MORE;
+}
+
+#if OPTSCHED_OFFLOAD_SERVER
+// the host end: the request being read
+static struct{
+  uint8_t state;
+  uint16_t seq;
+  uint32_t battery_start;
+  uint32_t battery_end;
+  uint32_t min_e_cons;
+  uint16_t values;
+  uint32_t prediction[OPTSCHED_PREDICTION_SLOTS];
+} server;
+
+static void send_plan()
+{
+  const BatterySlots *slots = optsched_get_plan_slots();
+  const OptschedStatus *status = optsched_get_status();
+  uint8_t i, n = get_number_of_battery_slots();
+
+  OFFLOAD_PRINTF("SOF PLAN %u %u %ld %u %u %u %lu %u %u\n", server.seq, n,
+      (long)status->offset, status->error, status->battery_slot,
+      status->harv_slot, (unsigned long)status->residual,
+      status->fallback, status->reservation);
+  for (i = 0; i < n; i++){
+    OFFLOAD_PRINTF("P %u %u %lu %lu %lu\n", slots->length[i], slots->type[i],
+        (unsigned long)slots->total_e_cons[i],
+        (unsigned long)slots->min_level[i], (unsigned long)slots->max_level[i]);
+  }
+  OFFLOAD_PRINTF("EOF\n");
+}
+
+uint8_t optsched_offload_serve(const char *line)
+{
+  uint32_t v[6];
+#if OPTSCHED_MAX_RESERVATIONS
+  uint8_t i;
+#endif
+
+  if (strncmp(line, "SOF REQ ", 8) == 0){
+    server.state = OFFLOAD_IDLE;
+    if (parse_numbers(line + 8, v, 6) != 6) return OPTSCHED_OFFLOAD_ERROR;
+    server.seq = v[0];
+    server.battery_start = v[1];
+    server.battery_end = v[2];
+    server.min_e_cons = v[3];
+#if OPTSCHED_RISK
+    optsched_fix_margin(v[4], v[5]);
+#endif
+#if OPTSCHED_MAX_RESERVATIONS
+    // only the ones of the node
+    for (i = 0; i < OPTSCHED_MAX_RESERVATIONS; i++){
+      optsched_set_reservation(i, 0, 0, 0);
+    }
+#endif
+    server.values = 0;
+    server.state = OFFLOAD_READ;
+    return OPTSCHED_OFFLOAD_MORE;
+  }
+  if (server.state != OFFLOAD_READ) return OPTSCHED_OFFLOAD_IGNORED;
+
+  if (is_eof(line)){
+    server.state = OFFLOAD_IDLE;
+    if (server.values != OPTSCHED_PREDICTION_SLOTS) return OPTSCHED_OFFLOAD_ERROR;
+    optsched_run(server.battery_start, server.battery_end, server.min_e_cons,
+                 0, server.prediction);
+    send_plan();
+    return OPTSCHED_OFFLOAD_READY;
+  }
+  if (line[0] == 'R' && line[1] == ' '){
+#if OPTSCHED_MAX_RESERVATIONS
+    if (parse_numbers(line + 2, v, 4) == 4 && v[0] < OPTSCHED_MAX_RESERVATIONS){
+      optsched_set_reservation(v[0], v[1], v[2], v[3]);
+      return OPTSCHED_OFFLOAD_MORE;
+    }
+#endif
+    server.state = OFFLOAD_IDLE;
+    return OPTSCHED_OFFLOAD_ERROR;
+  }
+  // the logs of the node in between
+  if (line[0] != 'H' || line[1] != ' ') return OPTSCHED_OFFLOAD_IGNORED;
+
+  if (server.values == OPTSCHED_PREDICTION_SLOTS || parse_numbers(line + 2, v, 1) != 1){
+    server.state = OFFLOAD_IDLE;
+    return OPTSCHED_OFFLOAD_ERROR;
+  }
+  server.prediction[server.values++] = v[0];
+  return OPTSCHED_OFFLOAD_MORE;
+}
+#endif
+#endif
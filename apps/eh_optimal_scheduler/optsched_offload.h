@@ -0,0 +1,99 @@
+#ifndef __OPTSCHED_OFFLOAD_H
+#define __OPTSCHED_OFFLOAD_H
+
+#include "optimal_scheduler.h"
+
+/*
+ * Offloaded planning: the node ships what a run of MAllEC depends on
+ * to a host (or the sink) over the serial line, the host runs the
+ * same code (OPTSCHED_CONF_OFFLOAD_SERVER) and ships the plan back as
+ * a run of harvesting slots per battery slot, which the node loads
+ * with optsched_load_*(). Everything is a newline terminated line of
+ * decimal numbers, framed as in serial_dummy_eh_pred:
+ *
+ * request, node to host:
+ *   SOF REQ <seq> <battery_start> <battery_end> <min_e_cons> <margin> <margins>
+ *   R <id> <start> <length> <per_slot>         one per reservation
+ *   H <harvest>                                OPTSCHED_PREDICTION_SLOTS values
+ *   EOF
+ *
+ * reply, host to node:
+ *   SOF PLAN <seq> <battery_slots> <offset> <error> <battery_slot> <harv_slot> <residual> <fallback> <reservation>
+ *   P <length> <type> <total_e_cons> <min_level> <max_level>   one per battery slot
+ *   EOF
+ *
+ * The reservations and the battery slots are in the scheduler unit,
+ * the rest in Watt-ticks. Both ends have to be built with the same
+ * SLOTS_PER_DAY, horizon, energy unit and slot grid. Lines that are
+ * not part of a frame are left alone, also between the lines of one,
+ * which are all tagged, so the frames can share the serial line with
+ * the logs of the node.
+ */
+
+#if !OPTSCHED_OFFLOAD
+#error "The offload needs OPTSCHED_CONF_OFFLOAD"
+#endif
+
+// the host end, to build a planning service out of the scheduler
+#ifdef OPTSCHED_CONF_OFFLOAD_SERVER
+#define OPTSCHED_OFFLOAD_SERVER OPTSCHED_CONF_OFFLOAD_SERVER
+#else
+#define OPTSCHED_OFFLOAD_SERVER 0
+#endif
+
+/*
+ * Output of the frames. Host builds define OPTSCHED_CONF_OFFLOAD_PRINTF
+ * to the name of a printf-like function that writes them where the
+ * other end reads; on the motes it is printf, to the serial line.
+ */
+#ifdef OPTSCHED_CONF_OFFLOAD_PRINTF
+int OPTSCHED_CONF_OFFLOAD_PRINTF(const char *format, ...);
+#define OFFLOAD_PRINTF OPTSCHED_CONF_OFFLOAD_PRINTF
+#else
+#define OFFLOAD_PRINTF printf
+#endif
+
+// optsched_offload_input() and optsched_offload_serve() results
+enum{
+  OPTSCHED_OFFLOAD_IGNORED = 0, // not part of a frame
+  OPTSCHED_OFFLOAD_MORE,        // part of a frame, feed the next line
+  OPTSCHED_OFFLOAD_READY,       // the frame is complete and handled
+  OPTSCHED_OFFLOAD_ERROR,       // the frame is broken and dropped
+};
+
+/**
+ * Sends the request for a plan, with the arguments of optsched_run()
+ * (without offset correction) and the margin and reservations the
+ * run would take. The reply has to carry @seq.
+ */
+void optsched_offload_request(uint16_t seq,
+                              uint32_t battery_start,
+                              uint32_t battery_end,
+                              uint32_t min_e_cons,
+                              uint32_t *harvest_prediction);
+
+/**
+ * Feeds a line received on the serial line to the node end. When the
+ * reply to the last request is complete its plan is put in service,
+ * from the battery level and the prediction of the request.
+ *
+ * Returns an OPTSCHED_OFFLOAD_ result: READY once the plan is in
+ * service, ERROR if the reply is broken (or the plan doesn't load).
+ */
+uint8_t optsched_offload_input(const char *line, uint32_t *harvest_prediction);
+
+// drops the last request, a late reply is then ignored
+void optsched_offload_cancel();
+
+#if OPTSCHED_OFFLOAD_SERVER
+/**
+ * Feeds a line from the node to the host end. When a request is
+ * complete the plan is computed with optsched_run() and the reply is
+ * sent (with OFFLOAD_PRINTF).
+ *
+ * Returns an OPTSCHED_OFFLOAD_ result, READY once the reply is sent.
+ */
+uint8_t optsched_offload_serve(const char *line);
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+/**
+ * Checkpoints of the prediction in Coffee, see eh_pred_checkpoint.h
+ *
+ * A checkpoint is a header, the regions of the state of eh_pred_core.c
+ * and an end mark, followed by a record per slot taken in since:
+ *
+ *   header   magic, size of the state, day, slot of the first record,
+ *            CRC of the state
+ *   state    the regions of eh_pred_get_state(), in order
+ *   0x5A
+ *   records  harvest (4 bytes, little endian), slot (2), CRC (1), 0x5A
+ *
+ * Coffee takes the last byte that is not 0 as the end of a file,
+ * hence the marks. Each file is reserved with room for a day of
+ * records, so the appends never move it. The state is only written
+ * whole once a day, to the other file, and the old one is removed
+ * once the new one is complete: a restart in the middle of a write
+ * finds the previous checkpoint and its records. Coffee places new
+ * files after the old ones, which spreads the erases over the flash.
+ */
+#include <string.h>
+
+#include "contiki.h"
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+#include "lib/crc16.h"
+#include "eh_predictor.h"
+#include "eh_pred_core.h"
+#include "eh_pred_checkpoint.h"
+
+// in the sources of the app, but only built with the checkpoints
+#if EH_PRED_CHECKPOINT
+
+#define PRINTF(FORMAT, args...) while(0){}
+//#define PRINTF printf
+
+#define CHECKPOINT_MAGIC 0xEC01
+#define END_MARK 0x5A
+#define RECORD_SIZE 8
+
+struct checkpoint_header{
+  uint16_t magic;
+  uint16_t size;    // of the state, the checkpoints of other builds are dropped
+  uint16_t day;
+  uint16_t slot;    // of the first record
+  uint16_t crc;     // of the state
+};
+
+static const char *file_name[2] = {"ehpred.0", "ehpred.1"};
+static int8_t current = -1;     // file of the checkpoint, -1 if none
+static uint16_t next_slot;      // slot of the next record
+static uint16_t records;        // in the current file
+
+static uint16_t state_size(const EhPredRegion *regions, uint8_t n)
+{
+  uint16_t size = 0;
+
+  while (n--) size += regions[n].size;
+  return size;
+}
+
+/**
+ * Writes a whole checkpoint of day @day, whose first record will be
+ * slot @slot, to the file the current one is not in.
+ * Returns 0 on success.
+ */
+static int8_t write_checkpoint(uint16_t day, uint16_t slot)
+{
+  EhPredRegion regions[EH_PRED_MAX_REGIONS];
+  struct checkpoint_header header;
+  uint8_t i, n = eh_pred_get_state(regions);
+  uint8_t end = END_MARK;
+  int8_t file = current == 0 ? 1 : 0;
+  int fd, ok;
+
+  header.magic = CHECKPOINT_MAGIC;
+  header.size = state_size(regions, n);
+  header.day = day;
+  header.slot = slot;
+  header.crc = 0;
+  for (i = 0; i < n; i++){
+    header.crc = crc16_data(regions[i].data, regions[i].size, header.crc);
+  }
+
+  cfs_remove(file_name[file]);
+  cfs_coffee_reserve(file_name[file], sizeof(header) + header.size + 1 +
+                     (uint32_t)SLOTS_PER_DAY*RECORD_SIZE);
+  fd = cfs_open(file_name[file], CFS_WRITE);
+  ok = fd >= 0 && cfs_write(fd, &header, sizeof(header)) == sizeof(header);
+  for (i = 0; i < n && ok; i++){
+    ok = cfs_write(fd, regions[i].data, regions[i].size) == regions[i].size;
+  }
+  ok = ok && cfs_write(fd, &end, 1) == 1;
+  if (fd >= 0) cfs_close(fd);
+  if (!ok){
+    // the previous checkpoint still holds, try again on the next slot
+    PRINTF("Checkpoint: write failed\n");
+    cfs_remove(file_name[file]);
+    records = SLOTS_PER_DAY;
+    return -1;
+  }
+  if (current >= 0) cfs_remove(file_name[current]);
+  current = file;
+  next_slot = slot;
+  records = 0;
+  return 0;
+}
+
+static void append_record(uint16_t slot, uint32_t eharv)
+{
+  uint8_t r[RECORD_SIZE];
+  int fd;
+
+  r[0] = eharv;
+  r[1] = eharv >> 8;
+  r[2] = eharv >> 16;
+  r[3] = eharv >> 24;
+  r[4] = slot;
+  r[5] = slot >> 8;
+  r[6] = crc16_data(r, 6, 0);
+  r[7] = END_MARK;
+  fd = cfs_open(file_name[current], CFS_WRITE | CFS_APPEND);
+  if (fd < 0 || cfs_write(fd, r, RECORD_SIZE) != RECORD_SIZE){
+    // a whole checkpoint on the next slot
+    PRINTF("Checkpoint: append failed\n");
+    records = SLOTS_PER_DAY;
+  }
+  if (fd >= 0) cfs_close(fd);
+  next_slot = (slot + 1)%SLOTS_PER_DAY;
+  records ++;
+}
+
+void eh_pred_checkpoint_insert(uint16_t slot, uint32_t eharv, uint16_t day)
+{
+  uint16_t next = (slot + 1)%SLOTS_PER_DAY;
+
+  if (current < 0 || next == 0 || slot != next_slot || records >= SLOTS_PER_DAY){
+    // the state is already past @slot
+    if (write_checkpoint(day, next) == 0) return;
+  }
+  if (current >= 0 && slot == next_slot) append_record(slot, eharv);
+}
+
+/**
+ * Reads the header of the checkpoint in file @file into @header and
+ * checks the state against it. Returns 0 if it is valid.
+ */
+static int8_t check_file(uint8_t file, struct checkpoint_header *header, uint16_t size)
+{
+  uint8_t buf[32];
+  uint16_t crc = 0, left = size, len;
+  int fd, ok;
+
+  fd = cfs_open(file_name[file], CFS_READ);
+  if (fd < 0) return -1;
+  ok = cfs_read(fd, header, sizeof(*header)) == sizeof(*header) &&
+       header->magic == CHECKPOINT_MAGIC && header->size == size &&
+       header->slot < SLOTS_PER_DAY;
+  while (ok && left > 0){
+    len = left < sizeof(buf) ? left : sizeof(buf);
+    ok = cfs_read(fd, buf, len) == len;
+    crc = crc16_data(buf, len, crc);
+    left -= len;
+  }
+  ok = ok && cfs_read(fd, buf, 1) == 1 && buf[0] == END_MARK && crc == header->crc;
+  cfs_close(fd);
+  return ok ? 0 : -1;
+}
+
+int16_t eh_pred_checkpoint_restore(uint16_t *day)
+{
+  EhPredRegion regions[EH_PRED_MAX_REGIONS];
+  struct checkpoint_header header, other;
+  uint8_t i, n = eh_pred_get_state(regions);
+  uint16_t size = state_size(regions, n);
+  uint8_t r[RECORD_SIZE];
+  int8_t file = -1;
+  uint16_t slot;
+  int fd;
+
+  if (check_file(0, &header, size) == 0) file = 0;
+  if (check_file(1, &other, size) == 0 &&
+      (file < 0 || (int16_t)(other.day - header.day) > 0)){
+    file = 1;
+    header = other;
+  }
+  if (file < 0) return -1;
+
+  fd = cfs_open(file_name[file], CFS_READ);
+  if (fd < 0) return -1;
+  cfs_seek(fd, sizeof(header), CFS_SEEK_SET);
+  for (i = 0; i < n; i++){
+    cfs_read(fd, regions[i].data, regions[i].size);
+  }
+  cfs_read(fd, r, 1);
+  eh_pred_state_loaded();
+
+  // the slots taken in since, up to the first broken record
+  slot = header.slot;
+  while (cfs_read(fd, r, RECORD_SIZE) == RECORD_SIZE){
+    if (r[7] != END_MARK || r[6] != (uint8_t)crc16_data(r, 6, 0) ||
+        (r[4] | (uint16_t)r[5] << 8) != slot){
+      break;
+    }
+    eh_pred_insert(slot, r[0] | (uint32_t)r[1] << 8 | (uint32_t)r[2] << 16 |
+                   (uint32_t)r[3] << 24);
+    slot = (slot + 1)%SLOTS_PER_DAY;
+    // past a checkpoint that could not be written
+    if (slot == 0) header.day ++;
+  }
+  cfs_close(fd);
+  PRINTF("Checkpoint: day %u, slot %u\n", header.day, slot);
+
+  // the next records go after a whole checkpoint, not a broken record
+  current = file;
+  write_checkpoint(header.day, slot);
+  next_slot = slot;
+  *day = header.day;
+  return slot;
+}
+#endif
@@ -0,0 +1,25 @@
+#ifndef __EH_PRED_CHECKPOINT_H
+#define __EH_PRED_CHECKPOINT_H
+
+/*
+ * Checkpoints of the prediction in flash, see EH_PRED_CONF_CHECKPOINT
+ * in eh_predictor.h. Include after eh_predictor.h.
+ */
+
+#if EH_PRED_CHECKPOINT
+/**
+ * Reads the newest valid checkpoint back into the prediction and
+ * replays the slots recorded after it. Returns the slot the node was
+ * in, and its day in @day, or -1 if there is no checkpoint.
+ */
+int16_t eh_pred_checkpoint_restore(uint16_t *day);
+
+/**
+ * Records the harvest @eharv of slot @slot, which has just been taken
+ * in: a whole checkpoint when the day @day starts, or when there is
+ * none to add to, and otherwise just the slot.
+ */
+void eh_pred_checkpoint_insert(uint16_t slot, uint32_t eharv, uint16_t day);
+#endif
+
+#endif
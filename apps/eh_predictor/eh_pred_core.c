@@ -0,0 +1,524 @@
+#include <string.h>
+
+#include "contiki.h"
+#include "eh_predictor.h"
+#include "eh_pred_core.h"
+
+static uint32_t cycle_prediction[SLOTS_PER_DAY];
+#if EH_PRED_ALGORITHM == EH_PRED_EWMA
+static uint8_t exp_weight = 100; // EWMA alpha * 100
+#endif
+
+#ifdef EH_PRED_CONF_SLOT_GRID
+static const uint8_t slot_duration[SLOTS_PER_DAY] = EH_PRED_CONF_SLOT_GRID;
+#define SLOT_DURATION(I) slot_duration[I]
+#else
+#define SLOT_DURATION(I) 1
+#endif
+
+#if EH_PRED_DEVIATION
+// mean absolute error of the prediction of each slot
+static uint32_t cycle_deviation[SLOTS_PER_DAY];
+#endif
+
+#if EH_PRED_FORECAST
+/*
+ * The prediction published by the getters, the one of cycle_prediction
+ * blended with the forecast of the slots that have one.
+ */
+static uint32_t cycle_output[SLOTS_PER_DAY];
+#define OUTPUT cycle_output
+
+// percent of the prediction forecast for each slot
+#define FORECAST_NONE 255
+static uint8_t forecast[SLOTS_PER_DAY];
+
+/*
+ * Mean absolute errors of the prediction and of the forecast on the
+ * slots with a forecast, weight 2^-FORECAST_ERROR_SHIFT for the latest
+ */
+#define FORECAST_ERROR_SHIFT 3
+static uint32_t history_error;
+static uint32_t forecast_error;
+static uint8_t forecast_weight;  // percent, from the errors
+
+// values of a line of the forecast, at most
+#define FORECAST_LINE_VALUES 24
+#else
+#define OUTPUT cycle_prediction
+#endif
+
+// the current slot, first of the day that the prediction covers
+static uint16_t window_start = 0;
+
+#if EH_PRED_PREFIX
+/*
+ * Running sum of the predictions from window_start on, a ring of
+ * SLOTS_PER_DAY + 1 entries: entry prefix_base + i (mod the ring)
+ * is the sum of the first i slots plus a base, so the sum of slots
+ * i to j - 1 is the difference of entries j and i. When the
+ * current slot ends it goes to the end of the day, its entry
+ * becoming the next one of the sum.
+ */
+#define PREFIX_LEN (SLOTS_PER_DAY + 1)
+static uint32_t prefix[PREFIX_LEN];
+static uint16_t prefix_base = 0;
+
+// entry of the sum of the first @i slots of the day
+static uint32_t prefix_at(uint16_t i)
+{
+  i += prefix_base;
+  return prefix[i < PREFIX_LEN ? i : i - PREFIX_LEN];
+}
+
+// sums the whole day again, from window_start
+static void prefix_rebuild()
+{
+  uint16_t i, slot = window_start;
+
+  prefix_base = 0;
+  prefix[0] = 0;
+  for (i = 0; i < SLOTS_PER_DAY; i++){
+    prefix[i+1] = prefix[i] + OUTPUT[slot];
+    if (++slot == SLOTS_PER_DAY) slot = 0;
+  }
+}
+
+/**
+ * Moves the day on by one slot: the current one, now predicted as
+ * @last, goes to the end, and the next one, which has become
+ * @first from @first_before, starts the day.
+ */
+static void prefix_advance(uint32_t last, uint32_t first_before, uint32_t first)
+{
+  uint16_t end = prefix_base ? prefix_base - 1 : PREFIX_LEN - 1;
+
+  // the entry of the slot that ended is the one after the last
+  prefix[prefix_base] = prefix[end] + last;
+  if (++prefix_base == PREFIX_LEN) prefix_base = 0;
+  // a change of the first slot only moves the base of the sums
+  prefix[prefix_base] -= first - first_before;
+}
+#endif
+
+#if EH_PRED_ALGORITHM == EH_PRED_WCMA
+#if EH_PRED_QUANTIZE
+typedef uint16_t history_t;
+#define STORE(V) eh_pred_encode(V)
+#define LOAD(C) eh_pred_decode(C)
+#else
+typedef uint32_t history_t;
+#define STORE(V) (V)
+#define LOAD(C) (C)
+#endif
+
+// harvest of each slot on the last EH_PRED_WCMA_DAYS days, a ring of
+// days with today in row history_day
+static history_t history[EH_PRED_WCMA_DAYS][SLOTS_PER_DAY];
+static uint8_t history_day = 0;
+static uint8_t history_days = 0;  // whole days recorded
+
+// the GAP factor has 8 fractional bits, and is kept below 4
+#define GAP_ONE 256
+#define GAP_MAX (4*GAP_ONE)
+#endif
+
+uint8_t eh_pred_get_slot_duration(uint16_t slot)
+{
+  return SLOT_DURATION(slot % SLOTS_PER_DAY);
+}
+
+const uint8_t *eh_pred_get_slot_grid()
+{
+#ifdef EH_PRED_CONF_SLOT_GRID
+  return slot_duration;
+#else
+  return NULL;
+#endif
+}
+
+uint32_t eh_pred_get_slot(uint16_t slot)
+{
+  return OUTPUT[slot % SLOTS_PER_DAY];
+}
+
+uint32_t *eh_pred_get_cycle_prediction()
+{
+  return OUTPUT;
+}
+
+uint32_t eh_pred_get_range(uint16_t slot, uint16_t count)
+{
+  // position of @slot in the day from window_start
+  uint16_t first = slot % SLOTS_PER_DAY;
+  first = first >= window_start ? first - window_start : first + SLOTS_PER_DAY - window_start;
+#if EH_PRED_PREFIX
+  if (first + count <= SLOTS_PER_DAY){
+    return prefix_at(first + count) - prefix_at(first);
+  }
+  // the rest from the start of the day again
+  return prefix_at(SLOTS_PER_DAY) - prefix_at(first) +
+         prefix_at(first + count - SLOTS_PER_DAY) - prefix_at(0);
+#else
+  uint32_t sum = 0;
+  slot %= SLOTS_PER_DAY;
+  while (count--){
+    sum += OUTPUT[slot];
+    if (++slot == SLOTS_PER_DAY) slot = 0;
+  }
+  return sum;
+#endif
+}
+
+uint32_t eh_pred_get_horizon(uint16_t count)
+{
+  return eh_pred_get_range(window_start, count);
+}
+
+#if EH_PRED_DEVIATION
+uint32_t *eh_pred_get_cycle_deviation()
+{
+  return cycle_deviation;
+}
+
+/**
+ * Updates the mean absolute error of slot @slot with the
+ * harvest @eharv, that had been predicted as @predicted.
+ */
+static void update_deviation(uint16_t slot, uint32_t predicted, uint32_t eharv)
+{
+  uint32_t error;
+
+  if (eharv > predicted){
+    error = eharv - predicted;
+  }else{
+    error = predicted - eharv;
+  }
+  if (error > cycle_deviation[slot]){
+    cycle_deviation[slot] += (error - cycle_deviation[slot]) >> EH_PRED_DEVIATION_SHIFT;
+  }else{
+    cycle_deviation[slot] -= (cycle_deviation[slot] - error) >> EH_PRED_DEVIATION_SHIFT;
+  }
+}
+#else
+#define update_deviation(SLOT, PREDICTED, EHARV)
+#endif
+
+#if EH_PRED_ALGORITHM == EH_PRED_WCMA
+// harvest of slot @slot added over the rows, those not written yet are 0
+static uint32_t wcma_sum(uint16_t slot)
+{
+  uint32_t sum = 0;
+  uint8_t d;
+
+  for (d = 0; d < EH_PRED_WCMA_DAYS; d++){
+    sum += LOAD(history[d][slot]);
+  }
+  return sum;
+}
+
+/**
+ * Mean harvest of slot @slot over the days recorded, today included
+ * if @today (the slot is over).
+ */
+static uint32_t wcma_mean(uint16_t slot, uint8_t today)
+{
+  uint8_t days = history_days + today;
+
+  if (days > EH_PRED_WCMA_DAYS) days = EH_PRED_WCMA_DAYS;
+  return days ? wcma_sum(slot)/days : 0;
+}
+
+/**
+ * GAP factor of WCMA: how the harvest of the last EH_PRED_WCMA_SLOTS
+ * slots of today, up to @slot, compares with their mean on the days
+ * before, the latest slot weighing the most. Slots without history
+ * (night, first day) are left out, and without any the factor is 1.
+ */
+static uint16_t wcma_gap(uint16_t slot)
+{
+  uint32_t gap = 0, e, past;
+  uint16_t weights = 0;
+  uint8_t k, days;
+
+  days = history_days < EH_PRED_WCMA_DAYS - 1 ? history_days : EH_PRED_WCMA_DAYS - 1;
+  if (days == 0) return GAP_ONE;
+  for (k = 0; k < EH_PRED_WCMA_SLOTS && k <= slot; k++){
+    e = LOAD(history[history_day][slot - k]);
+    past = (wcma_sum(slot - k) - e)/days;
+    // keep e << 8 in 32 bits
+    while (e >= (1UL << 23)){
+      e >>= 1;
+      past >>= 1;
+    }
+    if (past == 0) continue;
+    e = (e << 8)/past;
+    gap += (EH_PRED_WCMA_SLOTS - k)*(e < GAP_MAX ? e : GAP_MAX);
+    weights += EH_PRED_WCMA_SLOTS - k;
+  }
+  return weights ? gap/weights : GAP_ONE;
+}
+
+/**
+ * Records the harvest @eharv of slot @slot, which has just ended.
+ * The slot is predicted as its mean for tomorrow, and the next one,
+ * now in progress, from @eharv and its own mean.
+ */
+static void wcma_insert(uint16_t slot, uint32_t eharv)
+{
+  uint16_t next = (slot+1)%SLOTS_PER_DAY;
+  uint64_t e = eharv;
+  uint16_t gap;
+
+  history[history_day][slot] = STORE(eharv);
+  cycle_prediction[slot] = wcma_mean(slot, 1);
+  gap = wcma_gap(slot);
+  if (next == 0){
+    history_day = (history_day+1)%EH_PRED_WCMA_DAYS;
+    if (history_days < EH_PRED_WCMA_DAYS) history_days ++;
+  }
+
+#ifdef EH_PRED_CONF_SLOT_GRID
+  // the harvest of the slot, at the length of the next one
+  e = e*SLOT_DURATION(next)/SLOT_DURATION(slot);
+#endif
+  if (history_days == 0){
+    // nothing to condition yet, the next slot as this one
+    cycle_prediction[next] = e;
+  }else{
+    cycle_prediction[next] = (EH_PRED_WCMA_ALPHA*e +
+        (100 - EH_PRED_WCMA_ALPHA)*((wcma_mean(next, 0)*(uint64_t)gap) >> 8))/100;
+  }
+}
+#define PREDICTED(SLOT) wcma_mean(SLOT, 0)
+#else
+#define PREDICTED(SLOT) cycle_prediction[SLOT]
+#endif
+
+#if EH_PRED_FORECAST
+uint8_t eh_pred_get_forecast_weight()
+{
+  return forecast_weight;
+}
+
+static uint32_t abs_diff(uint32_t a, uint32_t b)
+{
+  return a > b ? a - b : b - a;
+}
+
+static void update_error(uint32_t *error, uint32_t e)
+{
+  if (e > *error){
+    *error += (e - *error) >> FORECAST_ERROR_SHIFT;
+  }else{
+    *error -= (*error - e) >> FORECAST_ERROR_SHIFT;
+  }
+}
+
+/**
+ * The slot ended with @eharv, predicted as @predicted and forecast as
+ * @percent of it: the errors and the weight of the forecast.
+ */
+static void forecast_score(uint32_t predicted, uint8_t percent, uint32_t eharv)
+{
+  uint32_t h, f;
+
+  update_error(&history_error, abs_diff(predicted, eharv));
+  update_error(&forecast_error, abs_diff((uint64_t)predicted*percent/100, eharv));
+  // weight 1/error each, the forecast gets h/(h+f)
+  h = history_error;
+  f = forecast_error;
+  while ((h | f) >= (1UL << 24)){
+    h >>= 1;
+    f >>= 1;
+  }
+  forecast_weight = h + f ? 100*h/(h + f) : 50;
+}
+
+// the prediction of slot @slot, with its forecast if it has one
+static void forecast_blend(uint16_t slot)
+{
+  int32_t factor;
+
+  if (forecast[slot] == FORECAST_NONE){
+    cycle_output[slot] = cycle_prediction[slot];
+    return;
+  }
+  // in 1/10000
+  factor = 10000 + (int32_t)forecast_weight*((int32_t)forecast[slot] - 100);
+  cycle_output[slot] = (uint64_t)cycle_prediction[slot]*factor/10000;
+}
+
+static void forecast_blend_all()
+{
+  uint16_t i;
+
+  for (i = 0; i < SLOTS_PER_DAY; i++){
+    forecast_blend(i);
+  }
+#if EH_PRED_PREFIX
+  prefix_rebuild();
+#endif
+}
+
+// the numbers of @line, at most @n, -1 if there is anything else
+static int8_t parse_numbers(const char *line, uint32_t *values, uint8_t n)
+{
+  uint8_t count = 0;
+  uint32_t value;
+
+  while (*line){
+    if (*line == ' ' || *line == '\r' || *line == '\n'){
+      line++;
+      continue;
+    }
+    if (count == n || *line < '0' || *line > '9') return -1;
+    for (value = 0; *line >= '0' && *line <= '9'; line++){
+      // saturates, the long numbers are out of range anyway
+      value = value < 100000000UL ? value*10 + (*line - '0') : 0xFFFFFFFFUL;
+    }
+    values[count++] = value;
+  }
+  return count;
+}
+
+uint8_t eh_pred_forecast_input(const char *line)
+{
+  uint32_t v[FORECAST_LINE_VALUES];
+  int8_t count, i;
+  uint16_t slot;
+
+  if (strncmp(line, "fc ", 3) != 0) return EH_PRED_FORECAST_IGNORED;
+  line += 3;
+  if (strncmp(line, "end", 3) == 0 &&
+      (line[3] == 0 || line[3] == '\r' || line[3] == '\n')){
+    return EH_PRED_FORECAST_READY;
+  }
+  count = parse_numbers(line, v, FORECAST_LINE_VALUES);
+  if (count < 2 || v[0] >= SLOTS_PER_DAY) return EH_PRED_FORECAST_ERROR;
+  for (i = 1; i < count; i++){
+    if (v[i] >= FORECAST_NONE) return EH_PRED_FORECAST_ERROR;
+  }
+  slot = v[0];
+  for (i = 1; i < count; i++){
+    forecast[slot] = v[i];
+    forecast_blend(slot);
+    if (++slot == SLOTS_PER_DAY) slot = 0;
+  }
+#if EH_PRED_PREFIX
+  prefix_rebuild();
+#endif
+  return EH_PRED_FORECAST_PART;
+}
+#endif
+
+#if EH_PRED_CHECKPOINT
+#define REGION(V) do{ \
+    regions[n].data = &(V); \
+    regions[n++].size = sizeof(V); \
+  }while(0)
+
+uint8_t eh_pred_get_state(EhPredRegion *regions)
+{
+  uint8_t n = 0;
+
+  REGION(cycle_prediction);
+#if EH_PRED_DEVIATION
+  REGION(cycle_deviation);
+#endif
+#if EH_PRED_ALGORITHM == EH_PRED_WCMA
+  REGION(history);
+  REGION(history_day);
+  REGION(history_days);
+#endif
+#if EH_PRED_FORECAST
+  // the forecasts themselves are dropped, not how good they were
+  REGION(history_error);
+  REGION(forecast_error);
+  REGION(forecast_weight);
+#endif
+  REGION(window_start);
+  return n;
+}
+
+void eh_pred_state_loaded()
+{
+#if EH_PRED_FORECAST
+  memset(forecast, FORECAST_NONE, SLOTS_PER_DAY);
+  forecast_blend_all();
+#elif EH_PRED_PREFIX
+  prefix_rebuild();
+#endif
+}
+#endif
+
+void eh_pred_reset()
+{
+  memset(cycle_prediction, 0, 4*SLOTS_PER_DAY);
+#if EH_PRED_DEVIATION
+  memset(cycle_deviation, 0, 4*SLOTS_PER_DAY);
+#endif
+#if EH_PRED_ALGORITHM == EH_PRED_WCMA
+  history_day = 0;
+  history_days = 0;
+  memset(history, 0, sizeof(history));
+#endif
+#if EH_PRED_FORECAST
+  memset(cycle_output, 0, 4*SLOTS_PER_DAY);
+  memset(forecast, FORECAST_NONE, SLOTS_PER_DAY);
+  history_error = 0;
+  forecast_error = 0;
+  forecast_weight = 50;
+#endif
+  window_start = 0;
+#if EH_PRED_PREFIX
+  prefix_rebuild();
+#endif
+}
+
+void eh_pred_insert(uint16_t slot, uint32_t eharv)
+{
+  uint16_t next = (slot+1)%SLOTS_PER_DAY;
+#if EH_PRED_PREFIX
+  uint32_t next_before = OUTPUT[next];
+#endif
+#if EH_PRED_FORECAST
+  uint8_t scored = forecast[slot] != FORECAST_NONE;
+
+  if (scored){
+    // the forecast of the slot is over
+    forecast_score(cycle_prediction[slot], forecast[slot], eharv);
+    forecast[slot] = FORECAST_NONE;
+  }
+#endif
+
+  update_deviation(slot, PREDICTED(slot), eharv);
+#if EH_PRED_ALGORITHM == EH_PRED_WCMA
+  wcma_insert(slot, eharv);
+#else
+  cycle_prediction[slot] = ((100-exp_weight) * cycle_prediction[slot] + exp_weight*eharv)/100;
+#endif
+
+#if EH_PRED_FORECAST
+  if (scored){
+    // the weight has changed, all the forecasts are blended again
+    window_start = next;
+    forecast_blend_all();
+    return;
+  }
+  forecast_blend(slot);
+  forecast_blend(next);
+#endif
+#if EH_PRED_PREFIX
+  if (slot == window_start){
+    window_start = next;
+    prefix_advance(OUTPUT[slot], next_before, OUTPUT[next]);
+  }else{
+    // out of turn, eg the first slot after a restart
+    window_start = next;
+    prefix_rebuild();
+  }
+#else
+  window_start = next;
+#endif
+}
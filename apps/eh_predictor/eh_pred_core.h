@@ -0,0 +1,97 @@
+#ifndef __EH_PRED_CORE_H
+#define __EH_PRED_CORE_H
+
+/*
+ * The prediction itself, without the process that cuts the harvest
+ * into slots (eh_predictor.c), so that it can be run on the host.
+ * Include after contiki.h and eh_predictor.h.
+ */
+
+// the 16 bit codes of EH_PRED_QUANTIZE
+#define EH_PRED_MANTISSA_BITS 11
+#define EH_PRED_MANTISSA_MASK ((1U << EH_PRED_MANTISSA_BITS) - 1)
+
+/**
+ * Encodes @value to 16 bits, rounding to the nearest code.
+ */
+static inline uint16_t eh_pred_encode(uint32_t value)
+{
+  uint8_t shift = 0;
+  uint32_t m;
+
+  if (value <= EH_PRED_MANTISSA_MASK) return value;
+  // shift the leading one to bit EH_PRED_MANTISSA_BITS
+  while ((value >> shift) >> (EH_PRED_MANTISSA_BITS + 1)) shift ++;
+  // rounding half up, without overflowing
+  m = shift ? ((value >> (shift - 1)) + 1) >> 1 : value;
+  if (m >> (EH_PRED_MANTISSA_BITS + 1)){
+    // rounded up to the next power of two
+    m >>= 1;
+    shift ++;
+    if (shift + EH_PRED_MANTISSA_BITS == 32){
+      return (uint16_t)(shift << EH_PRED_MANTISSA_BITS) | EH_PRED_MANTISSA_MASK;
+    }
+  }
+  return (uint16_t)((shift + 1) << EH_PRED_MANTISSA_BITS) | (m & EH_PRED_MANTISSA_MASK);
+}
+
+/**
+ * Decodes @code, with a shift and no division.
+ */
+static inline uint32_t eh_pred_decode(uint16_t code)
+{
+  uint8_t e = code >> EH_PRED_MANTISSA_BITS;
+  uint32_t m = code & EH_PRED_MANTISSA_MASK;
+
+  return e ? (m | (1UL << EH_PRED_MANTISSA_BITS)) << (e - 1) : m;
+}
+
+/**
+ * Clears the prediction, the history and the deviation.
+ */
+void eh_pred_reset();
+
+/**
+ * Takes in @eharv, the harvest of slot @slot, which has just ended.
+ */
+void eh_pred_insert(uint16_t slot, uint32_t eharv);
+
+#if EH_PRED_CHECKPOINT
+// a piece of the state of the prediction
+typedef struct eh_pred_region{
+  void *data;
+  uint16_t size;
+} EhPredRegion;
+
+#define EH_PRED_MAX_REGIONS 10
+
+/**
+ * Fills @regions with the memory that holds the state of the
+ * prediction, for the checkpoints, and returns how many there are.
+ */
+uint8_t eh_pred_get_state(EhPredRegion *regions);
+
+/**
+ * Works out the rest of the state once the regions have been read
+ * back from a checkpoint.
+ */
+void eh_pred_state_loaded();
+#endif
+
+#if EH_PRED_FORECAST
+// result of eh_pred_forecast_input()
+enum{
+  EH_PRED_FORECAST_IGNORED = 0, // not a forecast line
+  EH_PRED_FORECAST_PART,        // taken in, more to come
+  EH_PRED_FORECAST_READY,       // the forecast is complete
+  EH_PRED_FORECAST_ERROR,       // broken line, dropped
+};
+
+/**
+ * Takes in a line of a forecast (see eh_predictor.h), read on the
+ * serial line.
+ */
+uint8_t eh_pred_forecast_input(const char *line);
+#endif
+
+#endif
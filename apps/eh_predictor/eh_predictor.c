@@ -1,49 +1,103 @@
 #include "contiki.h"
 #include "eh_sim.h"
+#include "dev/serial-line.h"
 #include "eh_predictor.h"
+#include "eh_pred_core.h"
+#include "eh_pred_checkpoint.h"
+
+#define PRINTF(FORMAT, args...) while(0){}
+//#define PRINTF printf
 
 PROCESS(eh_pred, "Prediction for energy harvesting");
 AUTOSTART_PROCESSES(&eh_pred);
 
 
-static uint32_t cycle_prediction[SLOTS_PER_DAY];
-static uint8_t slot_id = 0;
-static uint8_t exp_weight = 100; // EWMA alpha * 100
+static uint16_t slot_id = 0;
+static uint8_t slot_offset = 0;       // periods gone by in slot_id
+static uint32_t slot_harvested = 0;   // harvest of those periods
+#if EH_PRED_CHECKPOINT
+static uint16_t day = 0;
+#endif
 
 uint32_t eh_pred_get_next_slot()
 {
-  return cycle_prediction[(slot_id+1)%SLOTS_PER_DAY];
+  return eh_pred_get_slot(slot_id+1);
 }
 
-uint8_t eh_pred_get_slot_number()
+uint16_t eh_pred_get_slot_number()
 {
   return slot_id;
 }
 
-uint32_t eh_pred_get_slot(uint8_t slot)
+uint8_t eh_pred_get_slot_offset()
 {
-  return cycle_prediction[slot_id % SLOTS_PER_DAY];
+  return slot_offset;
 }
 
-uint32_t *eh_pred_get_cycle_prediction()
+#if EH_PRED_CHECKPOINT
+uint16_t eh_pred_get_day()
 {
-  return cycle_prediction;
+  return day;
 }
+#endif
 
 PROCESS_THREAD(eh_pred, ev, data)
 {
   PROCESS_BEGIN();
   slot_id = 0;
-  memset(cycle_prediction, 0, 4*SLOTS_PER_DAY);
+  slot_offset = 0;
+  slot_harvested = 0;
+  eh_pred_reset();
+#if EH_PRED_CHECKPOINT
+  {
+    // carry on from the last checkpoint, if any
+    int16_t slot = eh_pred_checkpoint_restore(&day);
+    if (slot >= 0){
+      slot_id = slot;
+      PRINTF("Prediction restored, day %u slot %u\n", day, slot_id);
+    }
+  }
+#endif
+#if EH_PRED_FORECAST
+  eh_pred_forecast_event = process_alloc_event();
+#endif
 
   while (1){
     PROCESS_WAIT_EVENT();
 
+#if EH_PRED_FORECAST
+    if (ev == serial_line_event_message && data != NULL){
+      switch (eh_pred_forecast_input(data)){
+        case EH_PRED_FORECAST_READY:
+          PRINTF("Forecast in, weight %u%%\n", eh_pred_get_forecast_weight());
+          process_post(PROCESS_BROADCAST, eh_pred_forecast_event, NULL);
+          break;
+        case EH_PRED_FORECAST_ERROR:
+          PRINTF("Forecast: bad line\n");
+          break;
+      }
+      continue;
+    }
+#endif
+
     if (ev == eh_update_event){
       uint32_t eharv;
       eharv = *(uint32_t*)data;
+      slot_harvested += eharv;
+      slot_offset ++;
+      if (slot_offset < eh_pred_get_slot_duration(slot_id)){
+        // the slot isn't over yet
+        continue;
+      }
+      eharv = slot_harvested;
+      slot_harvested = 0;
+      slot_offset = 0;
       // insert the value in the predictor
-      cycle_prediction[slot_id] = ((100-exp_weight) * cycle_prediction[slot_id] + exp_weight*eharv)/100;
+      eh_pred_insert(slot_id, eharv);
+#if EH_PRED_CHECKPOINT
+      if (slot_id == SLOTS_PER_DAY - 1) day ++;
+      eh_pred_checkpoint_insert(slot_id, eharv, day);
+#endif
       slot_id = (slot_id+1)%SLOTS_PER_DAY;
     }
   }
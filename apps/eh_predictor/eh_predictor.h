@@ -2,6 +2,21 @@
 #define __EH_PRED_H
 
 PROCESS_NAME(eh_pred);
+
+/*
+ * Slot grid. By default every slot is one eh_update period long.
+ * EH_PRED_CONF_SLOT_GRID can give the length of each of the
+ * SLOTS_PER_DAY slots, in eh_update periods (at most 255), as an
+ * array initialiser, eg long slots at night and short ones around
+ * dawn, dusk and midday (1 minute periods, so they add up to 1440):
+ *
+ * #define SLOTS_PER_DAY 10
+ * #define EH_PRED_CONF_SLOT_GRID {240, 120, 60, 120, 120, 60, 120, 240, 240, 120}
+ *
+ * The harvest of all the periods in a slot is added up, so the
+ * predictions are per slot, whatever its length.
+ */
+
 /**
  * Returns the prediction for the next 
  * time slot.
@@ -11,17 +26,216 @@ uint32_t eh_pred_get_next_slot();
 /**
  * Returns the prediction for slot number
  */
-uint32_t eh_pred_get_slot(uint8_t slot);
+uint32_t eh_pred_get_slot(uint16_t slot);
 
 /**
  * Retrieves the number of the slot in the
  * day (0 -> SLOTS_PER_DAY)
  */
-uint8_t eh_pred_get_slot_number();
+uint16_t eh_pred_get_slot_number();
+
+/**
+ * Returns the number of eh_update periods of the current
+ * slot that have already gone by, 0 when it has just started.
+ */
+uint8_t eh_pred_get_slot_offset();
+
+/**
+ * Returns the length of slot @slot in eh_update periods.
+ */
+uint8_t eh_pred_get_slot_duration(uint16_t slot);
+
+/**
+ * Returns the lengths of all the slots in eh_update
+ * periods, or NULL if they are all one period long.
+ */
+const uint8_t *eh_pred_get_slot_grid();
 
 /**
  * Returns a pointer to the prediction for
  * the entire cycle
  */
 uint32_t *eh_pred_get_cycle_prediction();
+
+/**
+ * Returns the predicted harvest of the @count slots from slot @slot
+ * on, wrapping past midnight (@count at most SLOTS_PER_DAY). The
+ * slots behind the current one are tomorrow's, and the day repeats
+ * after that, as in the schedulers. The sums wrap at 2^32, as the
+ * predictions do.
+ */
+uint32_t eh_pred_get_range(uint16_t slot, uint16_t count);
+
+/**
+ * Returns the predicted harvest of the @count slots from the current
+ * one on, this one included whole.
+ */
+uint32_t eh_pred_get_horizon(uint16_t count);
+
+/*
+ * External forecasts, EH_PRED_CONF_FORECAST: a gateway with a weather
+ * forecast sends, over the serial line, how much of the prediction
+ * the coming slots should harvest, in percent (0 to 254, eg 40 for a
+ * heavy overcast):
+ *
+ * fc <slot> <percent> <percent> ...    from slot <slot> on, as many
+ *                                      lines as needed
+ * fc end                               the forecast is complete
+ *
+ * The slots are the next ones with those numbers: today's ahead of the
+ * current one, tomorrow's behind it. A forecast lasts until its slot
+ * ends. The prediction of a slot with a forecast is blended with the
+ * forecast one, weighted by how close each of them came to the
+ * harvest of the slots with a forecast so far (the inverse of their
+ * mean absolute errors, evenly at first). The history-based
+ * prediction is kept apart (4 bytes per slot, 1 more for the
+ * forecast), and the getters return the blended one.
+ *
+ * eh_pred_forecast_event is posted to all the processes once the
+ * forecast is in, for the schedulers to plan again.
+ */
+#ifdef EH_PRED_CONF_FORECAST
+#define EH_PRED_FORECAST EH_PRED_CONF_FORECAST
+#else
+#define EH_PRED_FORECAST 0
+#endif
+
+#if EH_PRED_FORECAST
+process_event_t eh_pred_forecast_event;
+
+/**
+ * Returns the weight of the forecast in the blend, in percent.
+ */
+uint8_t eh_pred_get_forecast_weight();
+#endif
+
+/*
+ * Checkpoints in flash, EH_PRED_CONF_CHECKPOINT: the state of the
+ * prediction and the slot are kept in Coffee (CFS), so that a node
+ * that restarts, eg after a brown-out, predicts as before right away.
+ * A whole checkpoint is written once a day, in the other one of two
+ * files, and each slot then only appends its harvest to it, 8 bytes;
+ * on boot the newest valid checkpoint is read back and its slots
+ * replayed (see eh_pred_checkpoint.c). The time the node was off is
+ * not known: it carries on from the slot it was in, and forecasts
+ * are dropped.
+ */
+#ifdef EH_PRED_CONF_CHECKPOINT
+#define EH_PRED_CHECKPOINT EH_PRED_CONF_CHECKPOINT
+#else
+#define EH_PRED_CHECKPOINT 0
+#endif
+
+#if EH_PRED_CHECKPOINT
+/**
+ * Returns the number of the current day, counted over the restarts
+ */
+uint16_t eh_pred_get_day();
+#endif
+
+/*
+ * Prefix sums of the prediction for eh_pred_get_range(), kept up to
+ * date a slot at a time: the queries take constant time, for
+ * 4 * (SLOTS_PER_DAY + 1) bytes of RAM. 0 leaves them out and the
+ * queries add up the slots. On by default up to 144 slots a day (580
+ * bytes); with finer slots the table no longer fits beside the rest
+ * on a 10 KB node such as the Sky (2.3 KB at 576 slots).
+ */
+#ifdef EH_PRED_CONF_PREFIX
+#define EH_PRED_PREFIX EH_PRED_CONF_PREFIX
+#elif SLOTS_PER_DAY > 144
+#define EH_PRED_PREFIX 0
+#else
+#define EH_PRED_PREFIX 1
+#endif
+
+/*
+ * Prediction algorithm, EH_PRED_CONF_ALGORITHM:
+ *
+ * EH_PRED_EWMA  each slot is an exponentially weighted average of
+ *               its harvest on the previous days. The weight of the
+ *               latest day is 100%, so tomorrow repeats today.
+ * EH_PRED_WCMA  weather-conditioned moving average (Piorno et al.):
+ *               each slot is the mean of its harvest over the last
+ *               EH_PRED_WCMA_DAYS days, kept in a ring buffer of
+ *               4 * EH_PRED_WCMA_DAYS * SLOTS_PER_DAY bytes (2 with
+ *               EH_PRED_QUANTIZE). The
+ *               slot in progress is then predicted from the one that
+ *               just ended (weight EH_PRED_WCMA_ALPHA percent) and
+ *               from its mean, scaled by how the last
+ *               EH_PRED_WCMA_SLOTS slots compare with their means
+ *               (the GAP factor), so that a cloudy day only pulls
+ *               the next days down by 1/EH_PRED_WCMA_DAYS.
+ */
+#define EH_PRED_EWMA 0
+#define EH_PRED_WCMA 1
+
+#ifdef EH_PRED_CONF_ALGORITHM
+#define EH_PRED_ALGORITHM EH_PRED_CONF_ALGORITHM
+#else
+#define EH_PRED_ALGORITHM EH_PRED_EWMA
+#endif
+
+#ifdef EH_PRED_CONF_WCMA_DAYS
+#define EH_PRED_WCMA_DAYS EH_PRED_CONF_WCMA_DAYS
+#else
+#define EH_PRED_WCMA_DAYS 4
+#endif
+
+#ifdef EH_PRED_CONF_WCMA_SLOTS
+#define EH_PRED_WCMA_SLOTS EH_PRED_CONF_WCMA_SLOTS
+#else
+#define EH_PRED_WCMA_SLOTS 3
+#endif
+
+#ifdef EH_PRED_CONF_WCMA_ALPHA
+#define EH_PRED_WCMA_ALPHA EH_PRED_CONF_WCMA_ALPHA
+#else
+#define EH_PRED_WCMA_ALPHA 50
+#endif
+
+/*
+ * Days of history kept in 16 bits per slot, a float with 11 bits of
+ * mantissa and 5 of exponent: relative error at most 2^-12 (0.025%),
+ * values below 2048 exact. Only the WCMA ring is stored this way,
+ * halving it; cycle_prediction[] is read in place by the schedulers
+ * and stays 32 bits.
+ */
+#ifdef EH_PRED_CONF_QUANTIZE
+#define EH_PRED_QUANTIZE EH_PRED_CONF_QUANTIZE
+#else
+#define EH_PRED_QUANTIZE 0
+#endif
+
+/*
+ * Uncertainty of the prediction: the mean absolute error of the
+ * prediction of each slot, an exponentially weighted average with
+ * weight 2^-EH_PRED_CONF_DEVIATION_SHIFT for the latest error. The
+ * standard deviation of the error is about 1.25 times as large. It
+ * costs 4 bytes of RAM per slot, 0 leaves it out; it is on by
+ * default up to 144 slots a day, as EH_PRED_PREFIX. With EH_PRED_WCMA
+ * the error is the one of the mean of the slot, the prediction made
+ * a day ahead.
+ */
+#ifdef EH_PRED_CONF_DEVIATION
+#define EH_PRED_DEVIATION EH_PRED_CONF_DEVIATION
+#elif SLOTS_PER_DAY > 144
+#define EH_PRED_DEVIATION 0
+#else
+#define EH_PRED_DEVIATION 1
+#endif
+
+#ifdef EH_PRED_CONF_DEVIATION_SHIFT
+#define EH_PRED_DEVIATION_SHIFT EH_PRED_CONF_DEVIATION_SHIFT
+#else
+#define EH_PRED_DEVIATION_SHIFT 2
+#endif
+
+#if EH_PRED_DEVIATION
+/**
+ * Returns a pointer to the mean absolute error of the
+ * prediction of each slot of the cycle
+ */
+uint32_t *eh_pred_get_cycle_deviation();
+#endif
 #endif
@@ -0,0 +1,125 @@
+/**
+ * Budget arbiter, see eh_budget.h
+ */
+
+#include "contiki.h"
+#include "lib/list.h"
+#include "sys/energest.h"
+#include "battery_sim.h"
+#include "eh_budget.h"
+
+#include <stdio.h>
+
+// kept in order of decreasing priority
+LIST(consumers);
+
+void eh_budget_register(struct eh_consumer *c)
+{
+  struct eh_consumer *prev = NULL, *next;
+
+  // no limit until the first allowance, as eh_sched_get_max_allowed()
+  c->budget = -1;
+  c->last_used = 0;
+  c->debt = 0;
+  c->total_used = 0;
+  c->cpu = c->transmit = c->listen = 0;
+  c->active = 0;
+
+  for (next = list_head(consumers); next != NULL; next = list_item_next(next)){
+    if (next->priority < c->priority) break;
+    prev = next;
+  }
+  list_insert(consumers, prev, c);
+}
+
+void eh_budget_unregister(struct eh_consumer *c)
+{
+  list_remove(consumers, c);
+}
+
+uint32_t eh_budget_get(const struct eh_consumer *c)
+{
+  return c->budget;
+}
+
+void eh_budget_begin(struct eh_consumer *c)
+{
+  energest_flush();
+  c->start_cpu = energest_type_time(ENERGEST_TYPE_CPU);
+  c->start_transmit = energest_type_time(ENERGEST_TYPE_TRANSMIT);
+  c->start_listen = energest_type_time(ENERGEST_TYPE_LISTEN);
+  c->active = 1;
+}
+
+void eh_budget_end(struct eh_consumer *c)
+{
+  if (!c->active) return;
+  energest_flush();
+  c->cpu += energest_type_time(ENERGEST_TYPE_CPU) - c->start_cpu;
+  c->transmit += energest_type_time(ENERGEST_TYPE_TRANSMIT) - c->start_transmit;
+  c->listen += energest_type_time(ENERGEST_TYPE_LISTEN) - c->start_listen;
+  c->active = 0;
+}
+
+/**
+ * Turns the Energest ticks of @c in the period that is over into
+ * energy, and carries any use over its budget into its debt.
+ */
+static void close_period(struct eh_consumer *c)
+{
+  c->last_used = battery_energy(c->cpu, 0, c->transmit, c->listen);
+  c->cpu = c->transmit = c->listen = 0;
+  c->total_used += c->last_used;
+  if (c->last_used > c->budget){
+    c->debt += c->last_used - c->budget;
+  }
+}
+
+void eh_budget_split(uint32_t allowed)
+{
+  struct eh_consumer *c;
+  uint32_t left = allowed, surplus, share;
+  uint16_t weights = 0;
+
+  // the minimum needs, highest priority first
+  for (c = list_head(consumers); c != NULL; c = list_item_next(c)){
+    close_period(c);
+    c->budget = c->min_need < left ? c->min_need : left;
+    left -= c->budget;
+    weights += c->weight;
+  }
+
+  // the surplus, in proportion to the weights
+  surplus = left;
+  for (c = list_head(consumers); c != NULL && weights != 0; c = list_item_next(c)){
+    if (c->weight == 0) continue;
+    share = (uint64_t)surplus * c->weight / weights;
+    if (share > left) share = left;
+    left -= share;
+    if (c->debt > share){
+      c->debt -= share;
+      share = 0;
+    }else{
+      share -= c->debt;
+      c->debt = 0;
+    }
+    c->budget += share;
+  }
+
+  for (c = list_head(consumers); c != NULL; c = list_item_next(c)){
+    if (c->process != NULL){
+      process_post(c->process, eh_budget_event, c);
+    }
+  }
+}
+
+void eh_budget_print()
+{
+  struct eh_consumer *c;
+
+  for (c = list_head(consumers); c != NULL; c = list_item_next(c)){
+    printf("Consumer %s: budget %lu, used %lu (%lu in all), debt %lu\n",
+        c->name, (unsigned long)c->budget, (unsigned long)c->last_used,
+        (unsigned long)c->total_used, (unsigned long)c->debt);
+  }
+}
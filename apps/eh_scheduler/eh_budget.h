@@ -0,0 +1,81 @@
+#ifndef __EH_BUDGET_H
+#define __EH_BUDGET_H
+
+#include "contiki.h"
+
+/*
+ * Budget arbiter: splits the allowance of the scheduler in service
+ * between the processes that consume energy (sending, sensing,
+ * forwarding, logging...) each time it is computed.
+ *
+ * Each consumer registers with a priority, a minimum need and a
+ * weight. The minimum needs are met first, from the highest priority
+ * down until the allowance runs out; what is left is shared out in
+ * proportion to the weights. A consumer that used more than its
+ * share in the previous period (as measured by Energest between
+ * eh_budget_begin() and eh_budget_end()) has the excess taken off
+ * its next share, above its minimum need.
+ *
+ * The new share is posted to the process of each consumer in an
+ * eh_budget_event, with the consumer as data, after the mallec_event.
+ */
+struct eh_consumer{
+  struct eh_consumer *next;   // for the list of consumers
+  const char *name;
+  struct process *process;    // gets the eh_budget_event, can be NULL
+  uint8_t priority;           // minimum needs are met highest first
+  uint8_t weight;             // share of the surplus, 0 for none
+  uint32_t min_need;          // Watt-ticks per eh_update period
+
+  // set by the arbiter
+  uint32_t budget;            // share of the current allowance
+  uint32_t last_used;         // measured in the previous period
+  uint32_t debt;              // use over budget not yet taken off
+  uint64_t total_used;        // measured since it registered
+
+  /*
+   * Energest times when eh_budget_begin() was called, and the ticks
+   * counted since the allowance was split. They are only turned
+   * into energy once per period, a single burst is often shorter
+   * than the resolution of the battery model.
+   */
+  unsigned long start_cpu, start_transmit, start_listen;
+  unsigned long cpu, transmit, listen;
+  uint8_t active;
+};
+
+process_event_t eh_budget_event;
+
+/**
+ * Adds @c to the consumers, from the next allowance on. The caller
+ * sets name, process, priority, weight and min_need; the consumer
+ * has to stay in memory until it is unregistered.
+ */
+void eh_budget_register(struct eh_consumer *c);
+
+void eh_budget_unregister(struct eh_consumer *c);
+
+/**
+ * Returns the share of @c of the current allowance, in Watt-ticks
+ * per eh_update period; the maximum until the first allowance.
+ */
+uint32_t eh_budget_get(const struct eh_consumer *c);
+
+/**
+ * Brackets the work of @c, so that the energy it uses (CPU, radio
+ * transmit and listen) is measured through Energest and counted
+ * against its budget. They don't nest.
+ */
+void eh_budget_begin(struct eh_consumer *c);
+void eh_budget_end(struct eh_consumer *c);
+
+/**
+ * Splits @allowed between the consumers and notifies them.
+ * Called by eh_sched_set_max_allowed().
+ */
+void eh_budget_split(uint32_t allowed);
+
+// prints the share and the use of each consumer
+void eh_budget_print();
+
+#endif
@@ -0,0 +1,170 @@
+/**
+ * Registry of the energy consumption schedulers, see eh_sched_interface.h
+ */
+
+#include "contiki.h"
+#include "dev/serial-line.h"
+#include "eh_sched_interface.h"
+#include "eh_budget.h"
+
+#include <stdio.h>
+#include <string.h>
+
+PROCESS(eh_sched_process, "Energy harvesting scheduler");
+
+#ifdef EH_SCHED_CONF_SERIAL
+#define EH_SCHED_SERIAL EH_SCHED_CONF_SERIAL
+#else
+#define EH_SCHED_SERIAL 1
+#endif
+
+#if EH_SCHED_WITH_ACT_PRED
+extern const struct eh_sched_driver eh_act_pred_driver;
+#endif
+#if EH_SCHED_WITH_OPTIMAL
+extern const struct eh_sched_driver eh_optimal_sched_driver;
+#endif
+#if EH_SCHED_WITH_WATER_FILLING
+extern const struct eh_sched_driver eh_water_sched_driver;
+#endif
+
+static const struct eh_sched_driver *const drivers[] = {
+#if EH_SCHED_WITH_OPTIMAL
+  &eh_optimal_sched_driver,
+#endif
+#if EH_SCHED_WITH_ACT_PRED
+  &eh_act_pred_driver,
+#endif
+#if EH_SCHED_WITH_WATER_FILLING
+  &eh_water_sched_driver,
+#endif
+};
+
+#define NUM_DRIVERS (sizeof(drivers)/sizeof(drivers[0]))
+
+#if !EH_SCHED_WITH_OPTIMAL && !EH_SCHED_WITH_ACT_PRED && !EH_SCHED_WITH_WATER_FILLING
+#error "No scheduler backend, add one to APPS"
+#endif
+
+static struct eh_sched_stats stats[NUM_DRIVERS];
+static uint8_t current = NUM_DRIVERS;
+
+static uint32_t crt_max_allowed = -1;
+static uint8_t crt_max_allowed_8bit;
+
+uint32_t eh_sched_get_max_allowed()
+{
+  return crt_max_allowed;
+}
+
+uint8_t eh_sched_get_max_allowed_8bit()
+{
+  return (crt_max_allowed-E_CONS_MIN)*21/10000; // resolution is 461W-ticks
+}
+
+void eh_sched_set_max_allowed(uint32_t allowed, rtimer_clock_t start)
+{
+  struct eh_sched_stats *s;
+
+  crt_max_allowed = allowed;
+  crt_max_allowed_8bit = eh_sched_get_max_allowed_8bit();
+
+  if (current < NUM_DRIVERS){
+    s = &stats[current];
+    s->cpu += (rtimer_clock_t)(RTIMER_NOW() - start);
+    s->updates ++;
+    s->allowed += allowed;
+  }
+
+  process_post(PROCESS_BROADCAST, mallec_event, &crt_max_allowed_8bit);
+  eh_budget_split(allowed);
+}
+
+static void print_stats(uint8_t index)
+{
+  const struct eh_sched_stats *s = &stats[index];
+
+  printf("Scheduler %s: %lu updates, %lu ticks, allowed %lu on average\n",
+      drivers[index]->name, s->updates, s->cpu,
+      s->updates ? (uint32_t)(s->allowed/s->updates) : 0UL);
+}
+
+int eh_sched_select(const char *name)
+{
+  uint8_t i;
+
+  for (i = 0; i < NUM_DRIVERS; i++){
+    if (strcmp(drivers[i]->name, name) == 0) break;
+  }
+  if (i == NUM_DRIVERS){
+    return -1;
+  }
+  if (i == current){
+    return 0;
+  }
+
+  if (current < NUM_DRIVERS){
+    print_stats(current);
+    process_exit(drivers[current]->process);
+  }
+  current = i;
+  printf("Scheduler %s in service\n", drivers[current]->name);
+  process_start(drivers[current]->process, NULL);
+  return 0;
+}
+
+const struct eh_sched_driver *eh_sched_current()
+{
+  return current < NUM_DRIVERS ? drivers[current] : NULL;
+}
+
+uint8_t eh_sched_num_drivers()
+{
+  return NUM_DRIVERS;
+}
+
+const struct eh_sched_driver *eh_sched_get_driver(uint8_t index)
+{
+  return index < NUM_DRIVERS ? drivers[index] : NULL;
+}
+
+const struct eh_sched_stats *eh_sched_get_stats(uint8_t index)
+{
+  return index < NUM_DRIVERS ? &stats[index] : NULL;
+}
+
+PROCESS_THREAD(eh_sched_process, ev, data)
+{
+  PROCESS_BEGIN();
+
+  mallec_event = process_alloc_event();
+  eh_budget_event = process_alloc_event();
+
+#ifdef EH_SCHED_CONF_DEFAULT
+  if (eh_sched_select(EH_SCHED_CONF_DEFAULT))
+#endif
+  {
+    eh_sched_select(drivers[0]->name);
+  }
+
+  while (1){
+    PROCESS_WAIT_EVENT();
+
+#if EH_SCHED_SERIAL
+    // "sched <name>" switches scheduler, the harvester ignores it
+    if (ev == serial_line_event_message && data != NULL &&
+        strncmp(data, "sched ", 6) == 0){
+      if (eh_sched_select((char *)data + 6)){
+        printf("No scheduler %s\n", (char *)data + 6);
+      }
+    }
+    // "budget" prints the share of each consumer
+    if (ev == serial_line_event_message && data != NULL &&
+        strcmp(data, "budget") == 0){
+      eh_budget_print();
+    }
+#endif
+  }
+
+  PROCESS_END();
+}
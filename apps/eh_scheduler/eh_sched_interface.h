@@ -0,0 +1,73 @@
+#ifndef __EH_SCHED_IFACE
+#define __EH_SCHED_IFACE
+
+#include "contiki.h"
+
+/*
+ * energy limits per eh_update period in Watt-ticks, for all the schedulers
+ * E_CONS_MIN is for when the node only sends its own packets
+ * E_CONS_MAX is for when the radio is constanly on
+ * TODO E_CONS_MIN should be dynamically defined
+ */
+#define E_CONS_MIN  155  // defined for EH interval=1min, data=1pkt/min
+#define E_CONS_MAX  117964 // same as above
+
+/*
+ * Scheduler backends. Each scheduler is a process that computes the
+ * allowed energy consumption and hands it over with
+ * eh_sched_set_max_allowed(); only the one in service runs, it is
+ * started when selected and exited when another one is selected.
+ *
+ * The backends in APPS are all compiled in: their Makefile sets
+ * EH_SCHED_WITH_<backend>, and eh_sched_process starts the one named
+ * by EH_SCHED_CONF_DEFAULT, or the first one. Another one can be
+ * selected at any time with eh_sched_select(), or with a
+ * "sched <name>" line on the serial port.
+ *
+ * The allowance is shared out between the processes that consume
+ * energy by the budget arbiter, see eh_budget.h.
+ */
+struct eh_sched_driver{
+  const char *name;
+  struct process *process;
+};
+
+// what each backend did while in service
+struct eh_sched_stats{
+  uint32_t updates;     // allowances computed
+  uint32_t cpu;         // rtimer ticks spent computing them
+  uint64_t allowed;     // sum of the allowances, Watt-ticks per period
+};
+
+PROCESS_NAME(eh_sched_process);
+
+/*
+ * Posted (broadcast) with the allowance scaled down to 8 bits
+ * (eh_sched_get_max_allowed_8bit) each time it is computed,
+ * whatever the backend.
+ */
+process_event_t mallec_event;
+
+uint32_t eh_sched_get_max_allowed();
+uint8_t eh_sched_get_max_allowed_8bit();
+
+/**
+ * Called by the backend in service with its new allowance @allowed,
+ * in Watt-ticks per eh_update period. @start is RTIMER_NOW() from
+ * when it started working on it, for the statistics.
+ */
+void eh_sched_set_max_allowed(uint32_t allowed, rtimer_clock_t start);
+
+/**
+ * Puts the backend called @name in service, in place of the
+ * current one. Returns 0, or -1 if there is no such backend.
+ */
+int eh_sched_select(const char *name);
+
+// backend in service, NULL before eh_sched_process has started
+const struct eh_sched_driver *eh_sched_current();
+
+uint8_t eh_sched_num_drivers();
+const struct eh_sched_driver *eh_sched_get_driver(uint8_t index);
+const struct eh_sched_stats *eh_sched_get_stats(uint8_t index);
+#endif
@@ -0,0 +1,197 @@
+/**
+ * Water-filling energy consumption scheduler.
+ *
+ * At the start of every harvesting slot the energy left for the rest
+ * of the cycle (the battery above its level at the end of the cycle,
+ * BATT_MAX, plus the predicted harvest) is poured over the predicted
+ * harvest rates of the remaining slots:
+ *  - if there is more than the harvest, the node consumes the harvest
+ *    and fills the slots below a water level w from the battery,
+ *    e(i) = max(w, h(i));
+ *  - if there is less, the battery has to be charged: the node stores
+ *    the harvest above the level w, e(i) = min(w, h(i)).
+ * All rates are per eh_update period and kept within E_CONS_MIN and
+ * E_CONS_MAX. Either way, as long as the harvest is within those
+ * limits, the battery only moves one way, from its level now to the
+ * target, so it can't go flat or overflow; harvest above E_CONS_MAX
+ * goes into the battery, and is wasted if it is full. The level is
+ * found by sorting the rates, O(n log n) in the remaining slots.
+ */
+
+#include "contiki.h"
+#include <eh_sim.h>
+#include <battery_sim.h>
+#include <eh_predictor.h>
+#include "eh_water_sched.h"
+#include "eh_sched_interface.h"
+
+#include <stdio.h>
+
+PROCESS(eh_water_sched, "Water-filling energy scheduler");
+
+// started by eh_sched_process when selected
+const struct eh_sched_driver eh_water_sched_driver = {"water", &eh_water_sched};
+
+// target at the end of the cycle
+#define WATER_BATT_END __BATTERY_INIT_CAP
+
+#ifdef EH_PRED_CONF_SLOT_GRID
+#define WATER_SLOT_GRID 1
+#else
+#define WATER_SLOT_GRID 0
+#endif
+
+/*
+ * Harvest rates of the remaining slots, clamped to the consumption
+ * limits, and their lengths with a slot grid. Only the multiset
+ * matters, they are sorted in place.
+ */
+static uint32_t rate[SLOTS_PER_DAY];
+#if WATER_SLOT_GRID
+static uint8_t duration[SLOTS_PER_DAY];
+#define water_duration(I) duration[I]
+#else
+#define water_duration(I) 1
+#endif
+
+static uint32_t water_level;
+static uint8_t filling;   // 1 if e(i) = max(w, h(i)), 0 if min(w, h(i))
+static uint32_t crt_max_allowed = -1;
+
+uint32_t eh_water_sched_get_level()
+{
+  return water_level;
+}
+
+static void swap(uint16_t a, uint16_t b)
+{
+  uint32_t r = rate[a];
+  rate[a] = rate[b];
+  rate[b] = r;
+#if WATER_SLOT_GRID
+  {
+    uint8_t d = duration[a];
+    duration[a] = duration[b];
+    duration[b] = d;
+  }
+#endif
+}
+
+static void sift_down(uint16_t root, uint16_t n)
+{
+  uint16_t child;
+
+  while ((child = 2*root + 1) < n){
+    if (child + 1 < n && rate[child + 1] > rate[child]) child++;
+    if (rate[root] >= rate[child]) return;
+    swap(root, child);
+    root = child;
+  }
+}
+
+/*
+ * Heapsort, ascending: in place and without recursion,
+ * the stack is small on the motes.
+ */
+static void sort_rates(uint16_t n)
+{
+  uint16_t i;
+
+  for (i = n/2; i > 0; i--){
+    sift_down(i - 1, n);
+  }
+  for (i = n; i > 1; i--){
+    swap(0, i - 1);
+    sift_down(0, i - 1);
+  }
+}
+
+/**
+ * Computes the water level for the slots from @slot_id to the end
+ * of the cycle, starting at the battery level @battery.
+ */
+static void plan(uint16_t slot_id, uint32_t battery)
+{
+  uint32_t *prediction = eh_pred_get_cycle_prediction();
+  int64_t budget = (int64_t)battery - WATER_BATT_END;
+  int64_t fixed = 0;    // energy of the slots that consume their harvest
+  uint32_t periods = 0; // periods of the slots at the water level
+  uint16_t n = SLOTS_PER_DAY - slot_id;
+  int64_t level;
+  uint16_t i, j;
+
+  for (i = 0; i < n; i++){
+    uint8_t d = eh_pred_get_slot_duration(slot_id + i);
+    uint32_t r = prediction[slot_id + i]/d;
+    budget += prediction[slot_id + i];
+    if (r < E_CONS_MIN) r = E_CONS_MIN;
+    if (r > E_CONS_MAX) r = E_CONS_MAX;
+    rate[i] = r;
+#if WATER_SLOT_GRID
+    duration[i] = d;
+#endif
+    fixed += (int64_t)r*d;
+  }
+  sort_rates(n);
+
+  /*
+   * The energy consumed at level w is piecewise linear in w, with a
+   * corner at each rate: walk the sorted rates away from the side the
+   * level starts on until the energy at the next rate overshoots the
+   * budget, the level is between that rate and the previous one.
+   */
+  filling = budget >= fixed;
+  for (j = 0; j < n; j++){
+    i = filling ? j : n - 1 - j;
+    if (filling ? (int64_t)rate[i]*periods + fixed >= budget :
+                  (int64_t)rate[i]*periods + fixed <= budget){
+      break;
+    }
+    periods += water_duration(i);
+    fixed -= (int64_t)rate[i]*water_duration(i);
+  }
+  level = periods ? (budget - fixed)/periods : E_CONS_MIN;
+  if (level < E_CONS_MIN) level = E_CONS_MIN;
+  if (level > E_CONS_MAX) level = E_CONS_MAX;
+  water_level = level;
+}
+
+PROCESS_THREAD(eh_water_sched, ev, data)
+{
+  PROCESS_BEGIN();
+
+  while (1){
+    PROCESS_WAIT_EVENT();
+
+#if EH_PRED_FORECAST
+    if (ev == eh_pred_forecast_event){
+      // planned again with the forecast at the next update
+      crt_max_allowed = -1;
+      continue;
+    }
+#endif
+
+    if (ev == eh_update_event){
+      rtimer_clock_t start = RTIMER_NOW();
+      uint16_t slot_id = eh_pred_get_slot_number();
+
+      if (eh_pred_get_slot_offset() == 0 || crt_max_allowed == -1){
+        uint32_t r;
+
+        plan(slot_id, battery_get());
+        r = eh_pred_get_cycle_prediction()[slot_id]/eh_pred_get_slot_duration(slot_id);
+        if (filling){
+          crt_max_allowed = r > water_level ? r : water_level;
+        }else{
+          crt_max_allowed = r < water_level ? r : water_level;
+        }
+        if (crt_max_allowed < E_CONS_MIN) crt_max_allowed = E_CONS_MIN;
+        if (crt_max_allowed > E_CONS_MAX) crt_max_allowed = E_CONS_MAX;
+        printf("Water level %lu, allowed %lu\n", water_level, crt_max_allowed);
+      }
+      eh_sched_set_max_allowed(crt_max_allowed, start);
+    }
+  }
+
+  PROCESS_END();
+}
@@ -0,0 +1,12 @@
+#ifndef __EH_WATER_SCHED_H
+#define __EH_WATER_SCHED_H
+
+PROCESS_NAME(eh_water_sched);
+
+/**
+ * Returns the water level of the current plan, the allowance
+ * in Watt-ticks per eh_update period away from the harvest.
+ */
+uint32_t eh_water_sched_get_level();
+
+#endif
@@ -2,6 +2,7 @@
 #include "net/rime/rime.h"
 #include "eh_sim.h"
 #include "eh_sched_interface.h"
+#include "eh_budget.h"
 
 #include <stdio.h>
 
@@ -9,9 +10,25 @@
 
 PROCESS(periodic_sender, "Periodically broadcasts packets");
 
+// the share of the allowance for the packets, minimum 1 packet/min
+static struct eh_consumer consumer = {
+  .name = "sender",
+  .process = &periodic_sender,
+  .priority = 1,
+  .weight = 1,
+  .min_need = E_CONS_MIN,
+};
+
+// the MAC sends the packet later on, measure until it is done
+static void sent(struct broadcast_conn *c, int status, int num_tx)
+{
+  eh_budget_end(&consumer);
+}
+
 static struct etimer et;
-static struct broadcast_callbacks cbacks = {};
+static struct broadcast_callbacks cbacks = {NULL, sent};
 static struct broadcast_conn broadcast;
+
 PROCESS_THREAD(periodic_sender, ev, data)
 {
   static uint32_t period;
@@ -20,12 +37,14 @@ PROCESS_THREAD(periodic_sender, ev, data)
   PROCESS_BEGIN();
 
   broadcast_open(&broadcast, 129, &cbacks);
+  eh_budget_register(&consumer);
   etimer_set(&et, PERIOD);
 
   while (1){
     PROCESS_WAIT_EVENT();
 
     if (ev == PROCESS_EVENT_TIMER){
+      eh_budget_begin(&consumer);
       packetbuf_copyfrom("Hello", 6);
       broadcast_send(&broadcast);
       printf(">\n");
@@ -37,8 +56,8 @@ PROCESS_THREAD(periodic_sender, ev, data)
       etimer_stop(&et);
       etimer_set(&et, CLOCK_SECOND);
 
-      // determine max allowed econs
-      max_allowed_econs = eh_sched_get_max_allowed();
+      // determine max allowed econs, our share of it
+      max_allowed_econs = eh_budget_get(&consumer);
 
       // convert to period
       if (max_allowed_econs <= 2887){
@@ -71,12 +71,12 @@ uint32_t eh_pred_get_next_slot()
   return cycle_prediction[1];
 }
 
-uint8_t eh_pred_get_slot_number()
+uint16_t eh_pred_get_slot_number()
 {
   return 0;
 }
 
-uint32_t eh_pred_get_slot(uint8_t slot)
+uint32_t eh_pred_get_slot(uint16_t slot)
 {
   return cycle_prediction[0];
 }
@@ -0,0 +1,222 @@
+/*
+ * Throughput of the batched first pass (optsched_batch.c) against the
+ * scalar one of the scheduler, on the host.
+ *
+ * Every cycle of the input is a node, with its own starting battery
+ * level and rate floor. The first pass of all the nodes is run one
+ * node at a time (optsched_first_pass_only()) and then
+ * OPTSCHED_BATCH_LANES nodes at a time, the best of -n runs of each
+ * is reported, and the battery slots and status of every node have to
+ * be bit-identical.
+ *
+ * The scheduler is compiled once per SLOTS_PER_DAY value, see the
+ * Makefile; the binary is named after it (optsched_batch_<slots>).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "optsched_batch.h"
+#include "harvest_source.h"
+
+#define DEFAULT_NODES       10000
+#define DEFAULT_ITERATIONS  5
+#define DEFAULT_PEAK        (3*E_CONS_MAX)
+
+// profiling hook of the scheduler, not used here
+void optsched_bench_profile(uint8_t pass)
+{
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Node @n of @batch, as the scalar first pass left it in @slots,
+ * @num and @status. Returns 0 if they are the same.
+ */
+static int compare_node(const OptschedBatch *batch, uint32_t n, const BatterySlots *slots,
+                        uint8_t num, const OptschedStatus *status)
+{
+  const BatterySlots *b = &batch->slots[n];
+  const OptschedStatus *s = &batch->status[n];
+  uint8_t i;
+
+  if (batch->num_battery_slots[n] != num) return -1;
+  for (i = 0; i < num; i++){
+    if (b->type[i] != slots->type[i] || b->start_slot[i] != slots->start_slot[i] ||
+        b->length[i] != slots->length[i] || b->min_level[i] != slots->min_level[i] ||
+        b->max_level[i] != slots->max_level[i] ||
+        b->total_e_cons[i] != slots->total_e_cons[i]){
+      return -1;
+    }
+  }
+  if (s->error != status->error || s->battery_slot != status->battery_slot ||
+      s->harv_slot != status->harv_slot || s->residual != status->residual){
+    return -1;
+  }
+  return 0;
+}
+
+static int bench_set(const HarvestSet *set, uint32_t iterations)
+{
+  OptschedBatch batch;
+  uint32_t *harvest;
+  BatterySlots *slots;
+  OptschedStatus *status;
+  uint8_t *num;
+  uint64_t start, scalar_ns = -1, batch_ns = -1, t;
+  uint32_t n, it, mismatches = 0, errors = 0, merged = 0;
+  uint16_t i;
+
+  if (set->num_cycles == 0) return 0;
+  slots = malloc((size_t)set->num_cycles*sizeof(BatterySlots));
+  status = malloc((size_t)set->num_cycles*sizeof(OptschedStatus));
+  num = malloc(set->num_cycles);
+  // the scalar pass reads the harvest of each node in a row
+  harvest = malloc((size_t)set->num_cycles*OPTSCHED_PREDICTION_SLOTS*sizeof(uint32_t));
+  if (!slots || !status || !num || !harvest || optsched_batch_alloc(&batch, set->num_cycles)){
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  // the nodes start anywhere in the battery, with different floors
+  for (n = 0; n < set->num_cycles; n++){
+    batch.battery_start[n] = BATT_MIN + (uint64_t)BATT_CAPACITY*(n*37 % 101)/100;
+    batch.min_e_cons[n] = E_CONS_MIN*(1 + n % 3);
+    for (i = 0; i < OPTSCHED_PREDICTION_SLOTS; i++){
+      batch_harvest(&batch, i, n) = harvest[(size_t)n*OPTSCHED_PREDICTION_SLOTS + i] =
+          harvest_cycle(set, (n + i/SLOTS_PER_DAY) % set->num_cycles)[i % SLOTS_PER_DAY];
+    }
+  }
+
+  for (it = 0; it < iterations; it++){
+    start = now_ns();
+    for (n = 0; n < set->num_cycles; n++){
+      num[n] = optsched_first_pass_only(batch.battery_start[n], batch.min_e_cons[n],
+                                        harvest + (size_t)n*OPTSCHED_PREDICTION_SLOTS,
+                                        &slots[n], &status[n]);
+    }
+    t = now_ns() - start;
+    if (t < scalar_ns) scalar_ns = t;
+
+    start = now_ns();
+    optsched_batch_first_pass(&batch);
+    t = now_ns() - start;
+    if (t < batch_ns) batch_ns = t;
+  }
+
+  for (n = 0; n < set->num_cycles; n++){
+    if (compare_node(&batch, n, &slots[n], num[n], &status[n])){
+      if (mismatches == 0) printf("# %s: node %lu differs\n", set->name, (unsigned long)n);
+      mismatches ++;
+    }
+    errors += status[n].error != OPTSCHED_OK;
+    merged += num[n] == OPTSCHED_MAX_BATTERY_SLOTS;
+  }
+  printf("# %s: %lu nodes, %lu with capacity errors, %lu with a full table, %lu mismatches\n",
+      set->name, (unsigned long)set->num_cycles, (unsigned long)errors,
+      (unsigned long)merged, (unsigned long)mismatches);
+  printf("#   scalar %.1f ns/node, batch %.1f ns/node (%u lanes), %.2fx, %.0f Mslots/s\n",
+      (double)scalar_ns/set->num_cycles, (double)batch_ns/set->num_cycles,
+      OPTSCHED_BATCH_LANES, (double)scalar_ns/batch_ns,
+      (double)set->num_cycles*OPTSCHED_HORIZON_SLOTS*1000/batch_ns);
+
+  optsched_batch_free(&batch);
+  free(slots);
+  free(status);
+  free(num);
+  free(harvest);
+  return mismatches != 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-N nodes] [-n iterations] [-s seed] [-p peak] [-P profile]\n"
+      "          [-t trace.csv] [-c cycles.txt] ...\n"
+      " every cycle is a node: -N synthetic ones of each profile, or\n"
+      " those of the -t/-c files\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t nodes = DEFAULT_NODES;
+  uint32_t iterations = DEFAULT_ITERATIONS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  int profile = -1;
+  uint8_t have_files = 0;
+  int i, err = 0;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'N': nodes = strtoul(argv[++i], NULL, 0); break;
+      case 'n': iterations = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'P':
+        i++;
+        for (profile = 0; harvest_synthetic_name(profile); profile++){
+          if (strcmp(harvest_synthetic_name(profile), argv[i]) == 0) break;
+        }
+        if (harvest_synthetic_name(profile) == NULL){
+          fprintf(stderr, "unknown profile %s\n", argv[i]);
+          return 1;
+        }
+        break;
+      case 't':
+      case 'c':
+        have_files = 1;
+        i++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (iterations == 0) iterations = 1;
+  printf("# SLOTS_PER_DAY %u, horizon %u slots, battery slots %u\n",
+      SLOTS_PER_DAY, OPTSCHED_HORIZON_SLOTS, OPTSCHED_MAX_BATTERY_SLOTS);
+
+  if (have_files){
+    for (i = 1; i < argc; i++){
+      HarvestSet set;
+      if (argv[i][1] != 't' && argv[i][1] != 'c'){
+        i++;
+        continue;
+      }
+      if (argv[i][1] == 't'){
+        err = harvest_load_trace(&set, argv[i+1], HARVEST_TRACE_PERIOD, SLOTS_PER_DAY);
+      }else{
+        err = harvest_load_cycles(&set, argv[i+1], SLOTS_PER_DAY);
+      }
+      i++;
+      if (err) return 1;
+      err |= bench_set(&set, iterations);
+      harvest_free(&set);
+    }
+  }else{
+    uint8_t p;
+    for (p = 0; p < HARVEST_SYNTH_NUM; p++){
+      HarvestSet set;
+      if (profile >= 0 && p != profile) continue;
+      if (harvest_synthetic(&set, p, nodes, SLOTS_PER_DAY, peak, seed)) return 1;
+      err |= bench_set(&set, iterations);
+      harvest_free(&set);
+    }
+  }
+  return err;
+}
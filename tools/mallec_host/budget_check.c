@@ -0,0 +1,308 @@
+/*
+ * Host checks of the budget arbiter (apps/eh_scheduler/eh_budget.c).
+ *
+ * The use of each consumer is what it is made to measure between
+ * eh_budget_begin() and eh_budget_end(): Energest is the one of this
+ * file, and battery_energy() counts a Watt-tick per tick.
+ *
+ * Split: random consumers, allowances under and over their minimum
+ * needs. When the allowance covers them every consumer gets its
+ * minimum need and the rest is shared out in proportion to the
+ * weights, rounded down; when it does not, the highest priorities get
+ * theirs first (in the order they registered within a priority), one
+ * gets what is left and the others nothing. Every consumer with a
+ * process is notified once per split, with itself as data.
+ *
+ * Debt: a consumer that used more than its share has the excess taken
+ * off its next shares, above its minimum need, until it is paid off,
+ * without the others getting more or less; using less earns nothing,
+ * and a consumer without weight keeps its minimum need whatever it
+ * owes.
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "contiki.h"
+#include "sys/energest.h"
+#include "eh_budget.h"
+#include "check.h"
+
+#define DEFAULT_ROUNDS  10000
+#define MAX_CONSUMERS   8
+#define EVENT           42
+
+/*
+ * What eh_budget.c measures, and posts.
+ */
+static unsigned long energest_times[ENERGEST_TYPE_MAX];
+static uint8_t posts[MAX_CONSUMERS];
+static uint8_t bad_posts;
+static struct eh_consumer consumers[MAX_CONSUMERS];
+// stand-ins for the processes, only their addresses are used
+static char processes[MAX_CONSUMERS];
+
+void energest_flush(void)
+{
+}
+
+unsigned long energest_type_time(int type)
+{
+  return energest_times[type];
+}
+
+unsigned long battery_energy(unsigned long cpu, unsigned long lpm,
+                             unsigned long transmit, unsigned long listen)
+{
+  return cpu + lpm + transmit + listen;
+}
+
+int process_post(struct process *p, process_event_t ev, void *data)
+{
+  struct eh_consumer *c = data;
+  int i = c - consumers;
+
+  if (ev != eh_budget_event || i < 0 || i >= MAX_CONSUMERS ||
+      p != (struct process *)&processes[i]){
+    bad_posts++;
+  }else{
+    posts[i]++;
+  }
+  return 0;
+}
+
+// @c uses @cpu, @transmit and @listen ticks, a Watt-tick each
+static void use(struct eh_consumer *c, unsigned long cpu, unsigned long transmit,
+                unsigned long listen)
+{
+  eh_budget_begin(c);
+  energest_times[ENERGEST_TYPE_CPU] += cpu;
+  energest_times[ENERGEST_TYPE_TRANSMIT] += transmit;
+  energest_times[ENERGEST_TYPE_LISTEN] += listen;
+  eh_budget_end(c);
+}
+
+static void add(uint8_t i, uint8_t priority, uint8_t weight, uint32_t min_need, uint8_t notify)
+{
+  struct eh_consumer *c = &consumers[i];
+
+  memset(c, 0, sizeof(*c));
+  c->name = "consumer";
+  c->process = notify ? (struct process *)&processes[i] : NULL;
+  c->priority = priority;
+  c->weight = weight;
+  c->min_need = min_need;
+  eh_budget_register(c);
+}
+
+static void remove_all(uint8_t n)
+{
+  while (n--) eh_budget_unregister(&consumers[n]);
+}
+
+/**
+ * Splits @allowed between the @n consumers registered in order, none
+ * of them in debt, and checks the shares.
+ */
+static void check_split(uint8_t n, uint32_t allowed)
+{
+  uint64_t needs = 0, given = 0;
+  uint32_t weights = 0, left, surplus, want;
+  uint8_t i, k, order[MAX_CONSUMERS], notify;
+
+  memset(posts, 0, sizeof(posts));
+  eh_budget_split(allowed);
+  for (i = 0; i < n; i++){
+    needs += consumers[i].min_need;
+    weights += consumers[i].weight;
+    given += consumers[i].budget;
+    notify = consumers[i].process != NULL;
+    check(posts[i] == notify, "notified once, if it has a process", posts[i]);
+  }
+  check(given <= allowed, "shares within the allowance", (long)(given - allowed));
+
+  if (needs <= allowed){
+    surplus = allowed - needs;
+    for (i = 0; i < n; i++){
+      want = consumers[i].min_need;
+      if (weights) want += (uint64_t)surplus*consumers[i].weight/weights;
+      check(consumers[i].budget == want, "share of a covered allowance",
+            (long)consumers[i].budget - (long)want);
+    }
+    // all of it, but less than a Watt-tick per consumer the rounding down leaves
+    if (weights){
+      check(allowed - given < n, "covered allowance shared out", (long)(allowed - given));
+    }else{
+      check(given == needs, "covered allowance without weights", (long)(allowed - given));
+    }
+    return;
+  }
+
+  // by priority, in the order of registration within one
+  for (i = 0; i < n; i++) order[i] = i;
+  for (i = 1; i < n; i++){
+    for (k = i; k > 0 && consumers[order[k-1]].priority < consumers[order[k]].priority; k--){
+      uint8_t t = order[k];
+      order[k] = order[k-1];
+      order[k-1] = t;
+    }
+  }
+  left = allowed;
+  for (i = 0; i < n; i++){
+    struct eh_consumer *c = &consumers[order[i]];
+    want = c->min_need < left ? c->min_need : left;
+    left -= want;
+    check(c->budget == want, "share of a short allowance", (long)c->budget - (long)want);
+  }
+  check(given == allowed, "short allowance shared out", (long)(allowed - given));
+}
+
+static void check_splits(uint32_t rounds, uint32_t *state)
+{
+  uint32_t checks_before = checks, failed_before = failed;
+  uint32_t r, needs, over = 0;
+  uint8_t i, n;
+
+  for (r = 0; r < rounds; r++){
+    n = 1 + xorshift(state) % MAX_CONSUMERS;
+    needs = 0;
+    for (i = 0; i < n; i++){
+      add(i, xorshift(state) % 4, xorshift(state) % 4 ? xorshift(state) % 8 : 0,
+          xorshift(state) % 1000, xorshift(state) % 2);
+      needs += consumers[i].min_need;
+    }
+    check(eh_budget_get(&consumers[0]) == (uint32_t)-1, "no limit before the first split",
+          eh_budget_get(&consumers[0]));
+    // half of them short of the needs
+    if (xorshift(state) % 2 && needs){
+      check_split(n, xorshift(state) % needs);
+      over++;
+    }else{
+      check_split(n, needs + xorshift(state) % 5000);
+    }
+    // the largest allowance, the shares must not overflow
+    check_split(n, 0xFFFFFFFFUL);
+    remove_all(n);
+  }
+  check(bad_posts == 0, "posts with the event, to the process of the consumer", bad_posts);
+  printf("# split: %lu checks, %lu failed (%lu rounds, %lu short)\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before),
+      (unsigned long)rounds, (unsigned long)over);
+}
+
+static void check_debt()
+{
+  uint32_t checks_before = checks, failed_before = failed;
+  struct eh_consumer *a = &consumers[0], *b = &consumers[1], *c = &consumers[2];
+
+  // a: weight 0; b and c: the same weight, shares of 100 above 50
+  add(0, 3, 0, 20, 1);
+  add(1, 2, 1, 50, 1);
+  add(2, 2, 1, 50, 0);
+  eh_budget_split(320);
+  check(b->budget == 150 && c->budget == 150, "shares without debt", c->budget);
+
+  // c uses 300 over its 150, in two brackets and on all the counters
+  use(c, 200, 100, 50);
+  use(c, 100, 0, 0);
+  eh_budget_split(320);
+  check(c->last_used == 450, "use of a period", c->last_used);
+  check(c->debt == 200 && c->budget == 50, "share taken by the debt", c->debt);
+  check(b->budget == 150, "share of the others with a debt", b->budget);
+
+  // 30 more over it while in debt, added to what is left of the debt
+  use(c, 80, 0, 0);
+  eh_budget_split(320);
+  check(c->debt == 130 && c->budget == 50, "debt carried over", c->debt);
+
+  // it now keeps within its minimum need, the debt goes down by its share
+  use(c, 50, 0, 0);
+  eh_budget_split(320);
+  check(c->debt == 30 && c->budget == 50, "debt carried over again", c->debt);
+  use(c, 50, 0, 0);
+  eh_budget_split(320);
+  check(c->debt == 0 && c->budget == 120, "debt paid off by a share", c->budget);
+  use(c, 120, 0, 0);
+  eh_budget_split(320);
+  check(c->debt == 0 && c->budget == 150, "share once the debt is paid", c->budget);
+  check(c->total_used == 750, "use since it registered", (long)c->total_used);
+
+  // a debt smaller than the share, and no credit for using less
+  use(c, 170, 0, 0);
+  use(b, 10, 0, 0);
+  eh_budget_split(320);
+  check(c->debt == 0 && c->budget == 130, "share less a small debt", c->budget);
+  check(b->debt == 0 && b->budget == 150, "no credit for using less", b->budget);
+
+  // without weight the minimum need is kept, the debt is never paid
+  use(a, 120, 0, 0);
+  eh_budget_split(320);
+  use(a, 20, 0, 0);
+  eh_budget_split(320);
+  check(a->budget == 20 && a->debt == 100, "minimum need with a debt", a->debt);
+
+  // a short allowance only meets the minimum needs, the debts wait
+  use(b, 250, 0, 0);
+  eh_budget_split(100);
+  check(a->budget == 20 && b->budget == 50 && c->budget == 30, "short allowance with debts",
+        c->budget);
+  check(b->debt == 100, "debt kept through a short allowance", b->debt);
+  eh_budget_split(320);
+  check(b->budget == 50 && b->debt == 0, "debt paid after a short allowance", b->debt);
+
+  // a bracket that was not begun counts nothing
+  eh_budget_end(c);
+  energest_times[ENERGEST_TYPE_CPU] += 1000;
+  eh_budget_end(c);
+  eh_budget_split(320);
+  check(c->last_used == 0, "use without eh_budget_begin()", c->last_used);
+
+  // unregistered, it gets no share and no event, the others share out all
+  eh_budget_unregister(b);
+  memset(posts, 0, sizeof(posts));
+  b->budget = 1;
+  eh_budget_split(320);
+  check(b->budget == 1 && posts[1] == 0, "unregistered consumer left out", posts[1]);
+  check(a->budget == 20 && c->budget == 300, "share of the consumers left", c->budget);
+  eh_budget_unregister(a);
+  eh_budget_unregister(c);
+
+  printf("# debt: %lu checks, %lu failed\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before));
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-r rounds] [-s seed]\n"
+      " splits between random consumers, then the debts of three\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t rounds = DEFAULT_ROUNDS;
+  uint32_t seed = 1;
+  int i;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'r': rounds = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (seed == 0) seed = 1;
+
+  eh_budget_event = EVENT;
+  check_splits(rounds, &seed);
+  check_debt();
+  return failed != 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __CHECK_H
+#define __CHECK_H
+
+/*
+ * Counters and helpers of the host checks (make check). Every check
+ * that fails is printed, up to CHECK_MAX_PRINTED, the others are only
+ * counted; the checks exit with status 1 if any failed.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef CHECK_MAX_PRINTED
+#define CHECK_MAX_PRINTED UINT32_MAX
+#endif
+
+static uint32_t checks, failed;
+
+static inline void check(int ok, const char *what, long got)
+{
+  checks++;
+  if (!ok){
+    failed++;
+    if (failed <= CHECK_MAX_PRINTED) printf("FAIL: %s (%ld)\n", what, got);
+  }
+}
+
+// pseudo-random numbers, the same for a seed on every host
+static inline uint32_t xorshift(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * Host checks of the checkpoints in flash, the predictor ones
+ * (eh_pred_checkpoint.c, EH_PRED_CONF_CHECKPOINT=1) and the plan ones
+ * (optsched_checkpoint.c, OPTSCHED_CONF_CHECKPOINT=1), against the CFS
+ * of host_cfs.c: the files are in a directory of the host, read as
+ * Coffee does, and the checks cut the power or break them there.
+ *
+ * Prediction: the synthetic days are taken in a slot at a time as the
+ * eh_pred process does, and the node is restarted (the state reset,
+ * then restored) now and then. The restored state has to be the one
+ * before the restart, byte for byte, with its slot and day, after a
+ * midnight and after a restore too. A record torn by a power cut or
+ * broken is dropped, the state is the one of the slot before; a
+ * checkpoint of another version or state size is dropped; a daily
+ * checkpoint that fails, or is cut short, leaves the previous one and
+ * its records; of two valid checkpoints the newest one is restored,
+ * the other one if the newest is not valid.
+ *
+ * Plan: a plan saved for a day comes back in service identical, and
+ * only for that day; the previous file is removed once the next is
+ * complete; a file cut short at any point, or of another version, or
+ * broken, is not loaded and leaves the plan in service as it was, the
+ * previous one still loading.
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "contiki.h"
+#include "eh_predictor.h"
+#include "eh_pred_core.h"
+#include "eh_pred_checkpoint.h"
+#include "optimal_scheduler.h"
+#include "optsched_checkpoint.h"
+#include "cfs/cfs.h"
+#include "host_cfs.h"
+#include "harvest_source.h"
+#include "check.h"
+
+#define DEFAULT_DAYS    8
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+#define DEFAULT_DIR     "cfs"
+
+// the files of the checkpoints, see eh_pred_checkpoint.c and optsched_checkpoint.c
+#define PRED_FILE(I)    ((I) ? "ehpred.1" : "ehpred.0")
+#define PLAN_FILE(I)    ((I) ? "plan.1" : "plan.0")
+// offsets in the header of the predictor checkpoints
+#define PRED_MAGIC_AT   0
+#define PRED_SIZE_AT    2
+// and of the plan ones
+#define PLAN_MAGIC_AT   0
+#define PLAN_SLOTS_AT   4
+// a battery slot saved, struct saved_slot
+#define PLAN_SLOT_SIZE  16
+
+// the library is built with OPTSCHED_CONF_PROFILE=optsched_bench_profile
+void optsched_bench_profile(uint8_t pass)
+{
+}
+
+/*
+ * Files as the host has them, to break them and put them back.
+ */
+typedef struct file_copy{
+  uint8_t data[32768];
+  long size;
+} FileCopy;
+
+static int copy_file(const char *name, FileCopy *copy)
+{
+  FILE *f = fopen(host_cfs_path(name), "rb");
+
+  copy->size = 0;
+  if (!f) return -1;
+  copy->size = fread(copy->data, 1, sizeof(copy->data), f);
+  fclose(f);
+  return 0;
+}
+
+static void put_file(const char *name, const FileCopy *copy)
+{
+  FILE *f = fopen(host_cfs_path(name), "wb");
+
+  if (!f) return;
+  if (fwrite(copy->data, 1, copy->size, f) != (size_t)copy->size) perror(name);
+  fclose(f);
+}
+
+// xors byte @at of file @name with @mask, from the end if @at < 0
+static void flip_byte(const char *name, long at, uint8_t mask)
+{
+  FileCopy copy;
+  long end;
+
+  if (copy_file(name, &copy)) return;
+  if (at < 0){
+    // from the end for Coffee, the last byte that is not 0
+    for (end = copy.size; end > 0 && copy.data[end - 1] == 0; end--);
+    at += end;
+  }
+  copy.data[at] ^= mask;
+  put_file(name, &copy);
+}
+
+static int file_exists(const char *name)
+{
+  return access(host_cfs_path(name), F_OK) == 0;
+}
+
+static void remove_files()
+{
+  uint8_t i;
+
+  for (i = 0; i < 2; i++){
+    unlink(host_cfs_path(PRED_FILE(i)));
+    unlink(host_cfs_path(PLAN_FILE(i)));
+  }
+}
+
+/*
+ * The prediction, taken in as by the eh_pred process.
+ */
+static const HarvestSet *days;
+static uint16_t slot_id, day;
+static uint8_t *saved_state;
+static uint16_t state_size;
+static uint16_t saved_slot, saved_day;
+
+static void take_in()
+{
+  uint32_t eharv = harvest_cycle(days, day % days->num_cycles)[slot_id];
+
+  eh_pred_insert(slot_id, eharv);
+  if (slot_id == SLOTS_PER_DAY - 1) day ++;
+  eh_pred_checkpoint_insert(slot_id, eharv, day);
+  slot_id = (slot_id + 1)%SLOTS_PER_DAY;
+}
+
+static void take_in_slots(uint32_t n)
+{
+  while (n--) take_in();
+}
+
+// up to slot @slot, the next one to take in
+static void take_in_to(uint16_t slot)
+{
+  while (slot_id != slot) take_in();
+}
+
+static void save_state()
+{
+  EhPredRegion regions[EH_PRED_MAX_REGIONS];
+  uint8_t i, n = eh_pred_get_state(regions);
+  uint16_t at = 0;
+
+  for (i = 0; i < n; i++){
+    memcpy(saved_state + at, regions[i].data, regions[i].size);
+    at += regions[i].size;
+  }
+  saved_slot = slot_id;
+  saved_day = day;
+}
+
+/**
+ * Restarts the node, checks that it restores the state saved, with
+ * its slot and day.
+ */
+static void check_restart(const char *what)
+{
+  EhPredRegion regions[EH_PRED_MAX_REGIONS];
+  uint8_t i, n;
+  uint16_t at = 0, wrong = 0, k;
+  int16_t slot;
+  char msg[128];
+
+  eh_pred_reset();
+  slot = eh_pred_checkpoint_restore(&day);
+  snprintf(msg, sizeof(msg), "restored slot, %s", what);
+  check(slot == saved_slot, msg, slot);
+  snprintf(msg, sizeof(msg), "restored day, %s", what);
+  check(day == saved_day, msg, day);
+  n = eh_pred_get_state(regions);
+  for (i = 0; i < n; i++){
+    for (k = 0; k < regions[i].size; k++){
+      wrong += ((uint8_t *)regions[i].data)[k] != saved_state[at + k];
+    }
+    at += regions[i].size;
+  }
+  snprintf(msg, sizeof(msg), "restored state, %s", what);
+  check(wrong == 0, msg, wrong);
+  if (slot >= 0) slot_id = slot;
+}
+
+// the file of the checkpoint in use, the only one
+static const char *pred_file()
+{
+  return file_exists(PRED_FILE(1)) ? PRED_FILE(1) : PRED_FILE(0);
+}
+
+static void check_pred_checkpoints()
+{
+  uint32_t checks_before = checks, failed_before = failed;
+  EhPredRegion regions[EH_PRED_MAX_REGIONS];
+  FileCopy copy, old;
+  const char *name;
+  uint8_t i, n;
+  uint16_t d;
+
+  n = eh_pred_get_state(regions);
+  for (state_size = 0, i = 0; i < n; i++) state_size += regions[i].size;
+  saved_state = malloc(state_size);
+  if (!saved_state) return;
+
+  eh_pred_reset();
+  check(eh_pred_checkpoint_restore(&d) == -1, "restore without a checkpoint", 0);
+
+  take_in_slots(2*SLOTS_PER_DAY + SLOTS_PER_DAY/2);
+  save_state();
+  check_restart("in the third day");
+  take_in_slots(3*SLOTS_PER_DAY/4);
+  save_state();
+  check_restart("past midnight after a restore");
+
+  // the power cut in the middle of the record, or the record broken
+  take_in_slots(5);
+  save_state();
+  host_cfs_power_cut(3);
+  take_in();
+  host_cfs_power_cut(-1);
+  check_restart("after a torn record");
+  take_in_slots(5);
+  save_state();
+  take_in();
+  flip_byte(pred_file(), -8, 0x01);
+  check_restart("after a broken record");
+
+  // checkpoints of another version or state size are dropped
+  take_in_slots(3);
+  save_state();
+  name = pred_file();
+  copy_file(name, &copy);
+  flip_byte(name, PRED_MAGIC_AT, 0x01);
+  eh_pred_reset();
+  check(eh_pred_checkpoint_restore(&d) == -1, "restore of another version", 0);
+  put_file(name, &copy);
+  flip_byte(name, PRED_SIZE_AT, 0x04);
+  eh_pred_reset();
+  check(eh_pred_checkpoint_restore(&d) == -1, "restore of another state size", 0);
+  put_file(name, &copy);
+  check_restart("once the checkpoint is back");
+
+  // the daily checkpoint fails, the next slots go on the previous one
+  take_in_to(SLOTS_PER_DAY - 1);
+  host_cfs_fail_writes(20);
+  take_in();
+  host_cfs_fail_writes(-1);
+  take_in_slots(10);
+  save_state();
+  check_restart("after a failed daily checkpoint");
+
+  // the power cut while the daily checkpoint is written
+  take_in_to(SLOTS_PER_DAY - 1);
+  save_state();
+  host_cfs_power_cut(20);
+  take_in();
+  host_cfs_power_cut(-1);
+  check_restart("after a torn daily checkpoint");
+
+  /*
+   * Restarted between the daily checkpoint and the removal of the one
+   * before: the newest one, unless it is not valid.
+   */
+  take_in_to(SLOTS_PER_DAY - 1);
+  name = pred_file();
+  copy_file(name, &old);
+  take_in();
+  save_state();
+  check(!file_exists(name), "previous checkpoint removed", 0);
+  put_file(name, &old);
+  check_restart("with the previous checkpoint left");
+  take_in_to(SLOTS_PER_DAY - 1);
+  save_state();
+  name = pred_file();
+  copy_file(name, &old);
+  take_in();
+  flip_byte(pred_file(), PRED_SIZE_AT, 0x04);
+  put_file(name, &old);
+  check_restart("with the newest checkpoint broken");
+
+  free(saved_state);
+  printf("# prediction: %lu checks, %lu failed (state %u bytes)\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before),
+      state_size);
+}
+
+/*
+ * The plan.
+ */
+// FNV-1a of the plan in service, slot by slot
+static uint32_t plan_hash()
+{
+  OptschedSlotPlan plan;
+  uint32_t h = 2166136261UL, v[3];
+  uint8_t k, *b = (uint8_t *)v;
+  uint16_t i;
+
+  for (i = 0; i < SLOTS_PER_DAY; i++){
+    optsched_get_slot_plan(i, &plan);
+    v[0] = plan.e_cons;
+    v[1] = plan.battery;
+    v[2] = plan.battery_slot | (uint32_t)get_number_of_battery_slots() << 16;
+    for (k = 0; k < sizeof(v); k++){
+      h ^= b[k];
+      h *= 16777619UL;
+    }
+  }
+  return h ^ optsched_get_status()->offset;
+}
+
+// the Coffee size of file @name
+static long file_size(const char *name)
+{
+  int fd = cfs_open(name, CFS_READ);
+  long size;
+
+  if (fd < 0) return -1;
+  size = cfs_seek(fd, 0, CFS_SEEK_END);
+  cfs_close(fd);
+  return size;
+}
+
+static void check_plan_checkpoints(uint32_t *harvest)
+{
+  uint32_t checks_before = checks, failed_before = failed;
+  const uint32_t level = BATT_MIN + (BATT_MAX - BATT_MIN)/2;
+  uint32_t saved, other;
+  FileCopy copy;
+  const char *name;
+  long size, cut;
+  int8_t got;
+
+  optsched_run(BATT_MIN, BATT_MIN, E_CONS_MIN, 1, harvest);
+  other = plan_hash();
+  check(optsched_checkpoint_restore(7, harvest) == -1, "plan restore without a file", 0);
+
+  optsched_run(level, level, E_CONS_MIN, 1, harvest);
+  saved = plan_hash();
+  check(saved != other, "plans to tell apart", 0);
+  optsched_checkpoint_save(7, level);
+  optsched_run(BATT_MIN, BATT_MIN, E_CONS_MIN, 1, harvest);
+  check(optsched_checkpoint_restore(6, harvest) == -1, "plan restore of another day", 0);
+  check(plan_hash() == other, "plan in service after another day", 0);
+  check(optsched_checkpoint_restore(7, harvest) == 0, "plan restore", 0);
+  check(plan_hash() == saved, "restored plan", 0);
+
+  // the next one goes to the other file, the first one removed
+  optsched_checkpoint_save(8, level);
+  check(optsched_checkpoint_restore(7, harvest) == -1, "plan restore of the day before", 0);
+  check(optsched_checkpoint_restore(8, harvest) == 0, "plan restore of the next day", 0);
+  name = file_exists(PLAN_FILE(0)) ? PLAN_FILE(0) : PLAN_FILE(1);
+  size = file_size(name);
+
+  // cut short anywhere, the end mark last, the file before is left
+  for (cut = 0; cut < size; cut = cut < 16 || cut + size/8 >= size ? cut + 1 : cut + size/8){
+    optsched_run(BATT_MIN, BATT_MIN, E_CONS_MIN, 1, harvest);
+    host_cfs_power_cut(cut);
+    optsched_checkpoint_save(9, level);
+    host_cfs_power_cut(-1);
+    got = optsched_checkpoint_restore(9, harvest);
+    check(got == -1, "plan restore of a torn file", cut);
+    check(plan_hash() == other, "plan in service after a torn file", cut);
+    check(optsched_checkpoint_restore(8, harvest) == 0, "plan restore after a torn file", cut);
+    check(plan_hash() == saved, "restored plan after a torn file", cut);
+  }
+
+  // a failed write removes its file
+  host_cfs_fail_writes(10);
+  optsched_checkpoint_save(9, level);
+  host_cfs_fail_writes(-1);
+  check(optsched_checkpoint_restore(9, harvest) == -1, "plan restore of a failed write", 0);
+  check(optsched_checkpoint_restore(8, harvest) == 0, "plan restore after a failed write", 0);
+
+  // another version, too many battery slots, a broken slot
+  name = file_exists(PLAN_FILE(0)) ? PLAN_FILE(0) : PLAN_FILE(1);
+  copy_file(name, &copy);
+  optsched_run(BATT_MIN, BATT_MIN, E_CONS_MIN, 1, harvest);
+  flip_byte(name, PLAN_MAGIC_AT, 0x01);
+  check(optsched_checkpoint_restore(8, harvest) == -1, "plan restore of another version", 0);
+  put_file(name, &copy);
+  flip_byte(name, PLAN_SLOTS_AT + 1, 0x80);
+  check(optsched_checkpoint_restore(8, harvest) == -1, "plan restore of too many slots", 0);
+  put_file(name, &copy);
+  // the energy of the last one, only the CRC tells
+  flip_byte(name, -1 - PLAN_SLOT_SIZE, 0x01);
+  check(optsched_checkpoint_restore(8, harvest) == -1, "plan restore of a broken slot", 0);
+  check(plan_hash() == other, "plan in service after a broken file", 0);
+  put_file(name, &copy);
+  check(optsched_checkpoint_restore(8, harvest) == 0, "plan restore once the file is back", 0);
+  check(plan_hash() == saved, "restored plan once the file is back", 0);
+
+  printf("# plan: %lu checks, %lu failed (%ld bytes, %u battery slots)\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before),
+      size, get_number_of_battery_slots());
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-d days] [-s seed] [-p peak] [-f dir]\n"
+      " checks against the synthetic mixed days, the CFS files in dir\n"
+      " (default " DEFAULT_DIR ")\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t num_days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  const char *dir = DEFAULT_DIR;
+  HarvestSet set;
+  int i;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'd': num_days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'f': dir = argv[++i]; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (host_cfs_init(dir)) return 1;
+  remove_files();
+  if (harvest_synthetic(&set, HARVEST_SYNTH_MIXED, num_days, SLOTS_PER_DAY, peak, seed)){
+    fprintf(stderr, "cannot make the cycles\n");
+    return 1;
+  }
+  printf("# %u slots a day, CFS files in %s\n", SLOTS_PER_DAY, dir);
+  days = &set;
+  check_pred_checkpoints();
+  check_plan_checkpoints(harvest_cycle(&set, 0));
+  remove_files();
+  harvest_free(&set);
+  return failed != 0;
+}
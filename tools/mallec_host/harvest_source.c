@@ -0,0 +1,445 @@
+#include "harvest_source.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECONDS_PER_DAY 86400UL
+
+/*
+ * Sun/cloud blocks in a fragmented day. Each block is one battery
+ * slot, plus the two nights, so this stays within the battery slots
+ * the scheduler can hold.
+ */
+#define FRAGMENTED_BLOCKS 34
+
+// these match EHTrace in tools/sim_eh_source/eh_trace.py
+#define PANEL_AREA    729     // cm^2
+#define TICKS_PER_SEC 32768
+
+static const char *synth_names[HARVEST_SYNTH_NUM] = {
+  "clear", "overcast", "broken", "mixed", "fragmented",
+};
+
+/*
+ * Small xorshift generator, so the synthetic cycles are
+ * identical on every host for a given seed.
+ */
+static uint32_t rnd_state;
+
+static uint32_t rnd_next()
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 17;
+  rnd_state ^= rnd_state << 5;
+  return rnd_state;
+}
+
+// uniform in [0, 1)
+static double rnd_unit()
+{
+  return (rnd_next() >> 8) / 16777216.0;
+}
+
+static int set_alloc(HarvestSet *set, const char *name,
+                     uint32_t num_cycles, uint16_t slots)
+{
+  snprintf(set->name, sizeof(set->name), "%s", name);
+  set->slots = slots;
+  set->num_cycles = num_cycles;
+  set->cycles = calloc((size_t)num_cycles*slots, sizeof(uint32_t));
+  return set->cycles == NULL ? -1 : 0;
+}
+
+static uint32_t cap(double energy)
+{
+  if (energy <= 0) return 0;
+  if (energy >= EH_MAX_LIMIT) return EH_MAX_LIMIT;
+  return (uint32_t)energy;
+}
+
+static uint16_t min_u16(uint16_t a, uint16_t b)
+{
+  return a < b ? a : b;
+}
+
+static const char *base_name(const char *file)
+{
+  const char *b = strrchr(file, '/');
+  return b ? b+1 : file;
+}
+
+int harvest_load_trace(HarvestSet *set, const char *file,
+                       uint32_t period, uint16_t slots)
+{
+  FILE *f;
+  char line[256];
+  double *irr = NULL;
+  size_t num = 0, size = 0;
+  uint32_t samples_per_day, samples_per_slot, days, d, s, k;
+
+  if (period == 0 || (SECONDS_PER_DAY/period) % slots){
+    fprintf(stderr, "%u slots do not divide the trace period\n", slots);
+    return -1;
+  }
+  samples_per_day = SECONDS_PER_DAY/period;
+  samples_per_slot = samples_per_day/slots;
+
+  f = fopen(file, "r");
+  if (f == NULL){
+    perror(file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)){
+    char *value = strchr(line, ',');
+    if (value == NULL) continue;
+    if (num == size){
+      size = size ? 2*size : 4096;
+      irr = realloc(irr, size*sizeof(double));
+      if (irr == NULL){
+        fclose(f);
+        return -1;
+      }
+    }
+    irr[num++] = atof(value+1);
+  }
+  fclose(f);
+
+  days = num/samples_per_day;
+  if (days == 0 || set_alloc(set, base_name(file), days, slots)){
+    fprintf(stderr, "%s: no complete cycle\n", file);
+    free(irr);
+    return -1;
+  }
+
+  for (d = 0; d < days; d++){
+    uint32_t *cycle = harvest_cycle(set, d);
+    for (s = 0; s < slots; s++){
+      double energy = 0;
+      for (k = 0; k < samples_per_slot; k++){
+        // EHTrace truncates the readings to integers
+        energy += (double)(long)irr[(size_t)d*samples_per_day + s*samples_per_slot + k]
+                  * period;
+      }
+      cycle[s] = cap(energy*PANEL_AREA*TICKS_PER_SEC/1000000);
+    }
+  }
+
+  free(irr);
+  return 0;
+}
+
+int harvest_load_cycles(HarvestSet *set, const char *file, uint16_t slots)
+{
+  FILE *f;
+  char line[64];
+  uint32_t *values = NULL;
+  size_t num = 0, size = 0;
+
+  f = fopen(file, "r");
+  if (f == NULL){
+    perror(file);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)){
+    char *end;
+    unsigned long v = strtoul(line, &end, 10);
+    if (end == line || (*end != '\n' && *end != '\r' && *end != 0)) continue;
+    if (num == size){
+      size = size ? 2*size : 4096;
+      values = realloc(values, size*sizeof(uint32_t));
+      if (values == NULL){
+        fclose(f);
+        return -1;
+      }
+    }
+    values[num++] = cap(v);
+  }
+  fclose(f);
+
+  if (num < slots || set_alloc(set, base_name(file), num/slots, slots)){
+    fprintf(stderr, "%s: no complete cycle\n", file);
+    free(values);
+    return -1;
+  }
+  memcpy(set->cycles, values, (size_t)set->num_cycles*slots*sizeof(uint32_t));
+  free(values);
+  return 0;
+}
+
+/*
+ * Clear sky harvest: half a sine wave between 6:00 and 18:00.
+ */
+static double clear_sky(uint16_t slot, uint16_t slots)
+{
+  double t = (double)slot/slots;
+  if (t < 0.25 || t >= 0.75) return 0;
+  return sin((t - 0.25)*2*M_PI);
+}
+
+int harvest_synthetic(HarvestSet *set, uint8_t profile, uint32_t days,
+                      uint16_t slots, uint32_t peak, uint32_t seed)
+{
+  uint32_t d;
+  uint16_t s;
+
+  if (profile >= HARVEST_SYNTH_NUM) return -1;
+  if (set_alloc(set, synth_names[profile], days, slots)) return -1;
+
+  rnd_state = seed ? seed : 1;
+  for (d = 0; d < days; d++){
+    uint32_t *cycle = harvest_cycle(set, d);
+    uint8_t day_profile = profile;
+    double attenuation = 1;
+    uint16_t cloud_left = 0;
+
+    if (profile == HARVEST_SYNTH_MIXED){
+      day_profile = rnd_next() % HARVEST_SYNTH_MIXED;
+    }
+    if (day_profile == HARVEST_SYNTH_FRAGMENTED){
+      // flat blocks between 6:00 and 18:00, so each has a single slot type
+      uint16_t day_start = slots/4, day_len = slots/2, blocks;
+      blocks = min_u16(FRAGMENTED_BLOCKS, day_len);
+      for (s = 0; s < day_len; s++){
+        uint16_t block = (uint32_t)s*blocks/day_len;
+        cycle[day_start + s] = cap((block & 1) ? peak*(0.05 + 0.1*rnd_unit()) : peak);
+      }
+      continue;
+    }
+    for (s = 0; s < slots; s++){
+      double energy = clear_sky(s, slots)*peak;
+      switch (day_profile){
+        case HARVEST_SYNTH_OVERCAST:
+          energy *= 0.15 + 0.05*rnd_unit();
+          break;
+        case HARVEST_SYNTH_BROKEN:
+          // clouds come and go every few slots, independently of resolution
+          if (cloud_left == 0){
+            attenuation = (rnd_next() & 1) ? 1 : 0.05 + 0.2*rnd_unit();
+            cloud_left = 1 + rnd_next() % (slots/48 + 3);
+          }
+          cloud_left --;
+          energy *= attenuation;
+          break;
+      }
+      cycle[s] = cap(energy);
+    }
+  }
+  return 0;
+}
+
+// a slot is dark if no cycle harvests anything in it
+static uint8_t is_dark(const HarvestSet *set, uint16_t slot)
+{
+  uint32_t c;
+  for (c = 0; c < set->num_cycles; c++){
+    if (harvest_cycle(set, c)[slot]) return 0;
+  }
+  return 1;
+}
+
+int harvest_make_grid(const HarvestSet *set, uint16_t grid_slots,
+                      uint8_t *duration)
+{
+  uint16_t *run_start, *run_len, *run_grid;
+  uint16_t num_runs = 0, light = 0, dark = 0, used = 0, s, r, g;
+  int err = -1;
+
+  run_start = calloc(set->slots, sizeof(uint16_t));
+  run_len = calloc(set->slots, sizeof(uint16_t));
+  run_grid = calloc(set->slots, sizeof(uint16_t));
+  if (!run_start || !run_len || !run_grid) goto out;
+
+  for (s = 0; s < set->slots; s++){
+    if (!is_dark(set, s)){
+      light ++;
+      continue;
+    }
+    if (s == 0 || !is_dark(set, s-1)){
+      run_start[num_runs++] = s;
+    }
+    run_len[num_runs-1] ++;
+    dark ++;
+  }
+  if (grid_slots < light + num_runs || grid_slots > set->slots) goto out;
+
+  // every night gets at least one grid slot, and slots of at most 255
+  for (r = 0; r < num_runs; r++){
+    run_grid[r] = (uint32_t)(grid_slots - light)*run_len[r]/dark;
+    if (run_grid[r] < (run_len[r] + 254)/255) run_grid[r] = (run_len[r] + 254)/255;
+    if (run_grid[r] == 0) run_grid[r] = 1;
+    used += run_grid[r];
+  }
+  if (light + used > grid_slots) goto out;
+  // hand out what is left to the nights with the longest grid slots
+  while (light + used < grid_slots){
+    uint16_t best = num_runs;
+    for (r = 0; r < num_runs; r++){
+      if (run_grid[r] == run_len[r]) continue;
+      if (best == num_runs ||
+          (uint32_t)run_len[r]*run_grid[best] > (uint32_t)run_len[best]*run_grid[r]){
+        best = r;
+      }
+    }
+    run_grid[best] ++;
+    used ++;
+  }
+
+  for (s = 0, g = 0, r = 0; s < set->slots; ){
+    if (r < num_runs && s == run_start[r]){
+      // split the night as evenly as possible
+      uint16_t k;
+      for (k = 0; k < run_grid[r]; k++){
+        duration[g++] = (uint32_t)run_len[r]*(k+1)/run_grid[r] -
+                        (uint32_t)run_len[r]*k/run_grid[r];
+      }
+      s += run_len[r];
+      r ++;
+    }else{
+      duration[g++] = 1;
+      s ++;
+    }
+  }
+  err = 0;
+
+out:
+  free(run_start);
+  free(run_len);
+  free(run_grid);
+  return err;
+}
+
+int harvest_regrid(HarvestSet *set, const uint8_t *duration, uint16_t grid_slots)
+{
+  uint32_t *cycles, c;
+  uint16_t g, s;
+
+  cycles = calloc((size_t)set->num_cycles*grid_slots, sizeof(uint32_t));
+  if (cycles == NULL) return -1;
+  for (c = 0; c < set->num_cycles; c++){
+    uint32_t *in = harvest_cycle(set, c), *out = cycles + (size_t)c*grid_slots;
+    for (g = 0, s = 0; g < grid_slots; g++){
+      uint8_t k;
+      for (k = 0; k < duration[g]; k++){
+        out[g] += in[s++];
+      }
+    }
+  }
+  free(set->cycles);
+  set->cycles = cycles;
+  set->slots = grid_slots;
+  return 0;
+}
+
+int harvest_shading_make(HarvestShading *shading, uint32_t nodes,
+                         uint32_t shaders, double area, uint32_t seed)
+{
+  uint32_t i;
+
+  rnd_state = seed ? seed : 1;
+  shading->num_nodes = nodes;
+  shading->num_shaders = shaders;
+  shading->node_x = malloc(nodes*sizeof(double));
+  shading->node_y = malloc(nodes*sizeof(double));
+  shading->shaders = malloc((shaders + 1)*sizeof(HarvestShader));
+  if (!shading->node_x || !shading->node_y || !shading->shaders){
+    harvest_shading_free(shading);
+    return -1;
+  }
+
+  for (i = 0; i < nodes; i++){
+    shading->node_x[i] = rnd_unit()*area;
+    shading->node_y[i] = rnd_unit()*area;
+  }
+  for (i = 0; i < shaders; i++){
+    HarvestShader *s = &shading->shaders[i];
+    s->x = rnd_unit()*area;
+    s->y = rnd_unit()*area;
+    s->size = (0.1 + rnd_unit()*0.3)*area;
+    s->start = (6 + (uint32_t)(rnd_unit()*10))*3600;
+    s->end = s->start + (3 + (uint32_t)(rnd_unit()*3))*3600;
+    s->attenuation = rnd_unit();
+  }
+  return 0;
+}
+
+/**
+ * Mean attenuation of shader @s over [@start, @end) at node @n.
+ */
+static double shader_attenuation(const HarvestShading *shading, const HarvestShader *s,
+                                 uint32_t n, uint32_t start, uint32_t end)
+{
+  uint32_t from, to;
+
+  if (shading->node_x[n] < s->x || shading->node_x[n] > s->x + s->size ||
+      shading->node_y[n] < s->y || shading->node_y[n] > s->y + s->size){
+    return 1;
+  }
+  from = start > s->start ? start : s->start;
+  to = end < s->end ? end : s->end;
+  if (from >= to) return 1;
+  return ((end - start) - (1 - s->attenuation)*(to - from))/(end - start);
+}
+
+void harvest_shading_node(const HarvestShading *shading, uint32_t node,
+                          uint16_t slots, double *attenuation)
+{
+  uint32_t i, k, start, end;
+  double a;
+
+  for (i = 0; i < slots; i++){
+    start = i*SECONDS_PER_DAY/slots;
+    end = (i + 1)*SECONDS_PER_DAY/slots;
+    attenuation[i] = 1;
+    for (k = 0; k < shading->num_shaders; k++){
+      a = shader_attenuation(shading, &shading->shaders[k], node, start, end);
+      if (a < attenuation[i]) attenuation[i] = a;
+    }
+  }
+}
+
+int harvest_shade(HarvestSet *set, const HarvestSet *base,
+                  const HarvestShading *shading, uint32_t node)
+{
+  char name[sizeof(set->name)];
+  double *attenuation;
+  uint32_t c;
+  uint16_t i;
+
+  snprintf(name, sizeof(name), "%.50s/%lu", base->name, (unsigned long)node);
+  attenuation = malloc(base->slots*sizeof(double));
+  if (attenuation == NULL || set_alloc(set, name, base->num_cycles, base->slots)){
+    free(attenuation);
+    return -1;
+  }
+  harvest_shading_node(shading, node, base->slots, attenuation);
+  for (c = 0; c < base->num_cycles; c++){
+    for (i = 0; i < base->slots; i++){
+      harvest_cycle(set, c)[i] = (uint32_t)(harvest_cycle(base, c)[i]*attenuation[i]);
+    }
+  }
+  free(attenuation);
+  return 0;
+}
+
+void harvest_shading_free(HarvestShading *shading)
+{
+  free(shading->node_x);
+  free(shading->node_y);
+  free(shading->shaders);
+  memset(shading, 0, sizeof(*shading));
+}
+
+const char *harvest_synthetic_name(uint8_t profile)
+{
+  if (profile >= HARVEST_SYNTH_NUM) return NULL;
+  return synth_names[profile];
+}
+
+void harvest_free(HarvestSet *set)
+{
+  free(set->cycles);
+  set->cycles = NULL;
+  set->num_cycles = 0;
+}
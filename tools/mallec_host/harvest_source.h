@@ -0,0 +1,144 @@
+#ifndef __HARVEST_SOURCE_H
+#define __HARVEST_SOURCE_H
+
+#include <stdint.h>
+
+/*
+ * Harvest cycles for the host tools.
+ *
+ * A set holds num_cycles consecutive cycles of @slots harvesting
+ * slots each, in Watt-ticks per slot, exactly as the predictor would
+ * hand them to optsched_run() on the node.
+ */
+
+// cap on the energy harvested in a slot, same as in eh_sim
+#ifndef EH_MAX_LIMIT
+#define EH_MAX_LIMIT 10048575UL
+#endif
+
+// sampling period of the EHTrace irradiance files (seconds)
+#define HARVEST_TRACE_PERIOD  30
+
+enum{
+  HARVEST_SYNTH_CLEAR = 0,  // clear sky, smooth bell
+  HARVEST_SYNTH_OVERCAST,   // low, smooth harvest
+  HARVEST_SYNTH_BROKEN,     // broken clouds, many transitions
+  HARVEST_SYNTH_MIXED,      // a random mix of the above, day by day
+  HARVEST_SYNTH_FRAGMENTED, // alternating sun and cloud, ~36 battery slots
+  HARVEST_SYNTH_NUM,
+};
+
+typedef struct harvest_set{
+  char name[64];
+  uint16_t slots;       // harvesting slots per cycle
+  uint32_t num_cycles;
+  uint32_t *cycles;     // num_cycles x slots values
+} HarvestSet;
+
+#define harvest_cycle(SET, I) ((SET)->cycles + (size_t)(I)*(SET)->slots)
+
+/**
+ * Loads an EHTrace irradiance file (one "time,uW/cm^2" reading
+ * every @period seconds, starting at midnight) and integrates it into
+ * slots, using the same panel and units as tools/sim_eh_source.
+ * Only complete cycles are kept.
+ *
+ * Returns 0 on success.
+ */
+int harvest_load_trace(HarvestSet *set, const char *file,
+                       uint32_t period, uint16_t slots);
+
+/**
+ * Loads a file with one harvested energy value (Watt-ticks) per line,
+ * the same values the serial_dummy_eh_pred example reads between
+ * SOF and EOF. Lines that are not numbers are ignored, so these
+ * serial logs can be used directly.
+ *
+ * Returns 0 on success.
+ */
+int harvest_load_cycles(HarvestSet *set, const char *file, uint16_t slots);
+
+/**
+ * Generates @days synthetic cycles of the given HARVEST_SYNTH_ profile,
+ * with a peak harvest of @peak Watt-ticks per slot.
+ *
+ * Returns 0 on success.
+ */
+int harvest_synthetic(HarvestSet *set, uint8_t profile, uint32_t days,
+                      uint16_t slots, uint32_t peak, uint32_t seed);
+
+/**
+ * Builds a non-uniform grid of @grid_slots slots over the slots of
+ * @set: the slots where some cycle harvests energy are kept as they
+ * are, the runs of slots where none does (the nights) share the rest
+ * of the grid slots, in proportion to their length.
+ * @duration receives the number of set slots in each grid slot.
+ *
+ * Returns 0 on success, -1 if @grid_slots can't cover the set that
+ * way (too few for the daylight slots, or more than the set slots).
+ */
+int harvest_make_grid(const HarvestSet *set, uint16_t grid_slots,
+                      uint8_t *duration);
+
+/**
+ * Adds up the slots of every cycle of @set into the @grid_slots
+ * slots of the grid @duration, as a predictor using the grid would.
+ *
+ * Returns 0 on success.
+ */
+int harvest_regrid(HarvestSet *set, const uint8_t *duration, uint16_t grid_slots);
+
+/*
+ * Daily shades over an area, as the CyclicShadingPattern of
+ * tools/sim_eh_source: the harvest of the nodes under a shader is
+ * multiplied by its attenuation between start and end, seconds from
+ * midnight, the strongest shader winning as in EnergyManager.
+ */
+typedef struct harvest_shader{
+  double x, y, size;
+  uint32_t start, end;
+  double attenuation;
+} HarvestShader;
+
+typedef struct harvest_shading{
+  uint32_t num_nodes;
+  uint32_t num_shaders;
+  double *node_x, *node_y;
+  HarvestShader *shaders;
+} HarvestShading;
+
+/**
+ * Places @nodes nodes and @shaders shaders in an @area x @area square,
+ * with the parameters of generate_cyclic_shaders() (shader.py): a
+ * side of 10-40% of the area, from 6 AM-4 PM for 3-6 hours.
+ *
+ * Returns 0 on success.
+ */
+int harvest_shading_make(HarvestShading *shading, uint32_t nodes,
+                         uint32_t shaders, double area, uint32_t seed);
+
+/**
+ * Fills @attenuation with the attenuation of each of the @slots slots
+ * of the day at node @node.
+ */
+void harvest_shading_node(const HarvestShading *shading, uint32_t node,
+                          uint16_t slots, double *attenuation);
+
+/**
+ * The cycles of @base as node @node sees them under @shading.
+ *
+ * Returns 0 on success.
+ */
+int harvest_shade(HarvestSet *set, const HarvestSet *base,
+                  const HarvestShading *shading, uint32_t node);
+
+void harvest_shading_free(HarvestShading *shading);
+
+/**
+ * Name of a HARVEST_SYNTH_ profile, or NULL.
+ */
+const char *harvest_synthetic_name(uint8_t profile);
+
+void harvest_free(HarvestSet *set);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __HOST_CFS_COFFEE_H
+#define __HOST_CFS_COFFEE_H
+
+#include "cfs/cfs.h"
+
+/* Stand-in for the Coffee extensions, see host_cfs.c */
+int cfs_coffee_reserve(const char *name, cfs_offset_t size);
+
+#endif
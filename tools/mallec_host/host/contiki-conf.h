@@ -0,0 +1,11 @@
+#ifndef __HOST_CONTIKI_CONF_H
+#define __HOST_CONTIKI_CONF_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Same time bases as the Sky platform */
+#define CLOCK_SECOND  128
+#define RTIMER_SECOND 32768UL
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __HOST_CONTIKI_H
+#define __HOST_CONTIKI_H
+
+/*
+ * Minimal stand-in for contiki.h so that the platform independent
+ * parts of the apps (the MAllEC scheduler, the predictor maths) can
+ * be compiled and run on the host, without Contiki.
+ *
+ * Only what the headers of those apps reference is provided here.
+ */
+
+#include "contiki-conf.h"
+
+struct process;
+#define PROCESS_NAME(name) extern struct process name
+
+typedef unsigned char process_event_t;
+typedef unsigned short rtimer_clock_t;
+
+/* defined by the program, for the apps that notify processes */
+int process_post(struct process *p, process_event_t ev, void *data);
+
+#endif
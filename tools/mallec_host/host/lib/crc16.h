@@ -0,0 +1,28 @@
+#ifndef __HOST_CRC16_H
+#define __HOST_CRC16_H
+
+/*
+ * The CRC-16 of Contiki (lib/crc16.c, CCITT, reflected), so that the
+ * checkpoints written on the host are the ones of the node.
+ */
+
+static inline unsigned short crc16_add(unsigned char b, unsigned short acc)
+{
+  acc ^= b;
+  acc  = (acc >> 8) | (acc << 8);
+  acc ^= (acc & 0xff00) << 4;
+  acc ^= (acc >> 8) >> 4;
+  acc ^= (acc & 0xff00) >> 5;
+  return acc;
+}
+
+static inline unsigned short crc16_data(const unsigned char *data, int len,
+                                        unsigned short acc)
+{
+  while (len-- > 0){
+    acc = crc16_add(*data++, acc);
+  }
+  return acc;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __HOST_LIST_H
+#define __HOST_LIST_H
+
+/*
+ * The linked lists of Contiki (lib/list.c), for the apps that keep
+ * their items in one: each item starts with its next pointer.
+ */
+
+#define LIST_CONCAT2(s1, s2) s1##s2
+#define LIST_CONCAT(s1, s2) LIST_CONCAT2(s1, s2)
+
+#define LIST(name) \
+  static void *LIST_CONCAT(name,_list) = NULL; \
+  static list_t name = (list_t)&LIST_CONCAT(name,_list)
+
+typedef void ** list_t;
+
+struct list{
+  struct list *next;
+};
+
+static inline void *list_head(list_t list)
+{
+  return *list;
+}
+
+static inline void *list_item_next(void *item)
+{
+  return item == NULL ? NULL : ((struct list *)item)->next;
+}
+
+static inline void list_remove(list_t list, void *item)
+{
+  struct list *l, *r = NULL;
+
+  for (l = *list; l != NULL; r = l, l = l->next){
+    if (l == item){
+      if (r == NULL){
+        *list = l->next;
+      }else{
+        r->next = l->next;
+      }
+      l->next = NULL;
+      return;
+    }
+  }
+}
+
+static inline void list_push(list_t list, void *item)
+{
+  list_remove(list, item);
+  ((struct list *)item)->next = *list;
+  *list = item;
+}
+
+static inline void list_insert(list_t list, void *previtem, void *newitem)
+{
+  if (previtem == NULL){
+    list_push(list, newitem);
+  }else{
+    ((struct list *)newitem)->next = ((struct list *)previtem)->next;
+    ((struct list *)previtem)->next = newitem;
+  }
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __HOST_ENERGEST_H
+#define __HOST_ENERGEST_H
+
+/*
+ * Stand-in for Energest: the times are those of the program that uses
+ * it, which defines these functions, so it decides what is measured.
+ */
+
+enum{
+  ENERGEST_TYPE_CPU,
+  ENERGEST_TYPE_LPM,
+  ENERGEST_TYPE_TRANSMIT,
+  ENERGEST_TYPE_LISTEN,
+  ENERGEST_TYPE_MAX,
+};
+
+void energest_flush(void);
+unsigned long energest_type_time(int type);
+
+#endif
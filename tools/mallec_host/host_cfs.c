@@ -0,0 +1,173 @@
+#include "host_cfs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+
+#define MAX_FDS 4
+
+struct host_fd{
+  FILE *file;
+  cfs_offset_t offset;
+  int flags;
+};
+
+static char dir_name[200] = ".";
+static char path[256];
+static struct host_fd fds[MAX_FDS];
+static long power_left = -1;    // bytes, -1 while the power is on
+static long writes_left = -1;
+
+int host_cfs_init(const char *dir)
+{
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST){
+    perror(dir);
+    return -1;
+  }
+  snprintf(dir_name, sizeof(dir_name), "%s", dir);
+  return 0;
+}
+
+const char *host_cfs_path(const char *name)
+{
+  snprintf(path, sizeof(path), "%s/%s", dir_name, name);
+  return path;
+}
+
+void host_cfs_power_cut(long bytes)
+{
+  power_left = bytes;
+}
+
+void host_cfs_fail_writes(long bytes)
+{
+  writes_left = bytes;
+}
+
+static int power_off()
+{
+  return power_left == 0;
+}
+
+// the end of the file for Coffee, after its last byte that is not 0
+static cfs_offset_t coffee_end(FILE *file)
+{
+  unsigned char buf[256];
+  long end, n;
+
+  fseek(file, 0, SEEK_END);
+  end = ftell(file);
+  while (end > 0){
+    n = end < (long)sizeof(buf) ? end : (long)sizeof(buf);
+    fseek(file, end - n, SEEK_SET);
+    if (fread(buf, 1, n, file) != (size_t)n) return end;
+    for (; n > 0 && buf[n-1] == 0; n--) end--;
+    if (n > 0) break;
+  }
+  return end;
+}
+
+int cfs_open(const char *name, int flags)
+{
+  FILE *file;
+  int fd;
+
+  for (fd = 0; fd < MAX_FDS && fds[fd].file; fd++);
+  if (fd == MAX_FDS) return -1;
+  file = fopen(host_cfs_path(name), flags & CFS_WRITE ? "r+b" : "rb");
+  if (!file && (flags & CFS_WRITE) && !power_off()){
+    file = fopen(host_cfs_path(name), "w+b");
+  }
+  if (!file) return -1;
+  fds[fd].file = file;
+  fds[fd].flags = flags;
+  fds[fd].offset = flags & CFS_APPEND ? coffee_end(file) : 0;
+  return fd;
+}
+
+void cfs_close(int fd)
+{
+  if (fd < 0 || fd >= MAX_FDS || !fds[fd].file) return;
+  fclose(fds[fd].file);
+  fds[fd].file = NULL;
+}
+
+int cfs_read(int fd, void *buf, unsigned int len)
+{
+  struct host_fd *f = &fds[fd];
+  cfs_offset_t left;
+
+  if (fd < 0 || fd >= MAX_FDS || !f->file) return -1;
+  left = coffee_end(f->file) - f->offset;
+  if (left <= 0) return 0;
+  if (len > left) len = left;
+  fseek(f->file, f->offset, SEEK_SET);
+  len = fread(buf, 1, len, f->file);
+  f->offset += len;
+  return len;
+}
+
+int cfs_write(int fd, const void *buf, unsigned int len)
+{
+  struct host_fd *f = &fds[fd];
+  unsigned int kept;
+
+  if (fd < 0 || fd >= MAX_FDS || !f->file || !(f->flags & CFS_WRITE)) return -1;
+  if (writes_left >= 0){
+    if (len > writes_left) len = writes_left;
+    writes_left -= len;
+  }
+  // what is past the power cut never reaches the flash, unknown to the node
+  kept = len;
+  if (power_left >= 0){
+    if (kept > power_left) kept = power_left;
+    power_left -= kept;
+  }
+  fseek(f->file, f->offset, SEEK_SET);
+  if (fwrite(buf, 1, kept, f->file) != kept) return -1;
+  fflush(f->file);
+  f->offset += len;
+  return len;
+}
+
+cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence)
+{
+  struct host_fd *f = &fds[fd];
+
+  if (fd < 0 || fd >= MAX_FDS || !f->file) return -1;
+  if (whence == CFS_SEEK_CUR){
+    offset += f->offset;
+  }else if (whence == CFS_SEEK_END){
+    offset += coffee_end(f->file);
+  }
+  if (offset < 0) return -1;
+  return f->offset = offset;
+}
+
+int cfs_remove(const char *name)
+{
+  if (power_off()) return 0;
+  return unlink(host_cfs_path(name)) == 0 ? 0 : -1;
+}
+
+// the file all 0, so empty, as erased flash
+int cfs_coffee_reserve(const char *name, cfs_offset_t size)
+{
+  FILE *file;
+
+  if (power_off()) return 0;
+  if (access(host_cfs_path(name), F_OK) == 0) return -1;
+  file = fopen(host_cfs_path(name), "wb");
+  if (!file) return -1;
+  if (size > 0 && (fseek(file, size - 1, SEEK_SET) != 0 || fputc(0, file) == EOF)){
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
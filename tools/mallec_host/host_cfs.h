@@ -0,0 +1,34 @@
+#ifndef __HOST_CFS_H_
+#define __HOST_CFS_H_
+
+/*
+ * The Contiki File System on the host, for the checkpoints: each CFS
+ * file is a file of a directory, read as Coffee does, the last byte
+ * that is not 0 being the end of the file. The flash can be made to
+ * fail, as a node loses its power or a write fails.
+ */
+
+/**
+ * Keeps the files in directory @dir, created if needed.
+ * Returns 0 on success.
+ */
+int host_cfs_init(const char *dir);
+
+/**
+ * Returns the host file of CFS file @name, valid until the next call.
+ */
+const char *host_cfs_path(const char *name);
+
+/**
+ * Cuts the power after @bytes more bytes are written: the flash then
+ * stays as it is, the writes and removals doing nothing while they
+ * seem to succeed, until the power is back (-1).
+ */
+void host_cfs_power_cut(long bytes);
+
+/**
+ * Makes the writes fail, short, after @bytes more bytes, until -1.
+ */
+void host_cfs_fail_writes(long bytes);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Planning service for nodes built with OPTSCHED_CONF_OFFLOAD.
+ *
+ * Reads the requests of a node (see optsched_offload.h) on stdin, runs
+ * MAllEC on them and writes the plans on stdout. Other lines, the logs
+ * of the node, are skipped (or copied to stderr with -v). In Cooja the
+ * serial port of the node can be opened as a server socket and wired
+ * to this tool with socat, see the README.
+ *
+ * With -l it checks the offload in loopback instead: each cycle is
+ * planned locally, then through a request and a reply written to
+ * memory and fed to both ends between lines of logs, and the plans
+ * have to be the same.
+ *
+ * The scheduler is compiled once per SLOTS_PER_DAY value, see the
+ * Makefile; the binary is named after it (optsched_offload_<slots>),
+ * and has to match the build of the node.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "optsched_offload.h"
+#include "harvest_source.h"
+
+#define DEFAULT_DAYS    100
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+
+#define LINE_LEN        128
+#define FRAME_LEN       (OPTSCHED_PREDICTION_SLOTS*16 + 2048)
+
+/*
+ * Output of the frames (OPTSCHED_CONF_OFFLOAD_PRINTF): stdout, or the
+ * frame buffer in loopback.
+ */
+static char frame[FRAME_LEN];
+static size_t frame_len;
+static uint8_t to_frame;
+
+int offload_printf(const char *format, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, format);
+  if (to_frame){
+    n = vsnprintf(frame + frame_len, FRAME_LEN - frame_len, format, ap);
+    if (n > 0) frame_len += n;
+    if (frame_len >= FRAME_LEN) frame_len = FRAME_LEN - 1;
+  }else{
+    n = vprintf(format, ap);
+  }
+  va_end(ap);
+  return n;
+}
+
+// profiling hook of the scheduler, not used here
+void optsched_bench_profile(uint8_t pass)
+{
+}
+
+/*
+ * FNV-1a over the battery slots and the slot table, what the node
+ * reads back from the plan
+ */
+static uint32_t plan_hash()
+{
+  uint32_t h = 2166136261UL, v[4];
+  uint16_t i, n, k;
+  OptschedSlotPlan slot;
+  uint8_t *b = (uint8_t *)v;
+
+  n = get_number_of_battery_slots();
+  for (i = 1; i <= n + OPTSCHED_HORIZON_SLOTS; i++){
+    if (i <= n){
+      v[0] = get_battery_slot_duration(i) | (uint32_t)get_battery_slot_type(i) << 16;
+      v[1] = get_battery_slot_total_e_cons(i);
+      v[2] = get_battery_slot_start_level(i);
+      v[3] = i;
+    }else{
+      optsched_get_slot_plan(i - n - 1, &slot);
+      v[0] = slot.e_cons;
+      v[1] = slot.battery;
+      v[2] = slot.battery_slot;
+      v[3] = i;
+    }
+    for (k = 0; k < sizeof(v); k++){
+      h ^= b[k];
+      h *= 16777619UL;
+    }
+  }
+  return h;
+}
+
+// logs of the node, fed between the lines of the frames
+static const char *logs[] = {"fc 12 3401 3377", "sched", "budget 2 118", "4096"};
+
+/**
+ * Feeds the lines of @text to the node end, with @prediction, or to
+ * the host end if it is NULL, each after a line of the logs of the
+ * node, which has to be ignored.
+ * Returns the result for the last line, ERROR if a log was not ignored.
+ */
+static uint8_t feed_frame(char *text, uint32_t *prediction)
+{
+  char *line = text, *end;
+  uint8_t result = OPTSCHED_OFFLOAD_IGNORED, log;
+  uint16_t n = 0;
+
+  while (*line){
+    end = strchr(line, '\n');
+    if (end) *end = 0;
+    if (n++){
+      log = prediction ? optsched_offload_input(logs[n % 4], prediction) :
+                         optsched_offload_serve(logs[n % 4]);
+      if (log != OPTSCHED_OFFLOAD_IGNORED) return OPTSCHED_OFFLOAD_ERROR;
+    }
+    result = prediction ? optsched_offload_input(line, prediction) :
+                          optsched_offload_serve(line);
+    if (!end) break;
+    line = end + 1;
+  }
+  return result;
+}
+
+static uint32_t count_lines(const char *text)
+{
+  uint32_t n = 0;
+
+  for (; *text; text++) n += *text == '\n';
+  return n;
+}
+
+/*
+ * Plans each cycle of @set locally and through the offload, and
+ * compares the plans. Every other cycle has a reservation, and with
+ * @confidence a margin is kept against a deviation of a quarter of
+ * the harvest.
+ */
+static int loopback_set(HarvestSet *set, uint32_t batt_start, uint8_t confidence)
+{
+  static uint32_t empty[OPTSCHED_PREDICTION_SLOTS];
+  static char request[FRAME_LEN];
+#if OPTSCHED_RISK
+  static uint32_t deviation[OPTSCHED_PREDICTION_SLOTS];
+#endif
+  uint64_t request_bytes = 0, reply_bytes = 0, request_lines = 0, reply_lines = 0;
+  uint32_t c, local, loaded, mismatches = 0, failures = 0;
+  OptschedStatus status;
+  uint16_t i;
+
+  for (c = 0; c < set->num_cycles; c++){
+    uint32_t *harvested = harvest_cycle(set, c);
+    int8_t id = -1;
+
+#if OPTSCHED_RISK
+    for (i = 0; i < OPTSCHED_PREDICTION_SLOTS; i++) deviation[i] = harvested[i]/4;
+    optsched_set_risk(confidence, confidence ? deviation : NULL, OPTSCHED_MARGIN_LOW);
+#endif
+#if OPTSCHED_MAX_RESERVATIONS
+    if (c & 1){
+      id = optsched_reserve(SLOTS_PER_DAY/2, SLOTS_PER_DAY/12, 8*E_CONS_MAX);
+    }
+#endif
+    optsched_run(batt_start, BATT_MAX, E_CONS_MIN, 0, harvested);
+    local = plan_hash();
+    status = *optsched_get_status();
+
+    // the node end asks, the host end answers
+    to_frame = 1;
+    frame_len = 0;
+    optsched_offload_request(c, batt_start, BATT_MAX, E_CONS_MIN, harvested);
+    memcpy(request, frame, frame_len + 1);
+    request_bytes += frame_len;
+    request_lines += count_lines(request);
+    frame_len = 0;
+    frame[0] = 0;
+    feed_frame(request, NULL);
+    reply_bytes += frame_len;
+    reply_lines += count_lines(frame);
+
+    // some other plan in service until the reply is loaded
+    optsched_run(batt_start, BATT_MAX, E_CONS_MIN, 0, empty);
+    if (feed_frame(frame, harvested) != OPTSCHED_OFFLOAD_READY){
+      failures ++;
+    }else{
+      loaded = plan_hash();
+      if (loaded != local ||
+          optsched_get_status()->error != status.error ||
+          optsched_get_status()->fallback != status.fallback ||
+          optsched_get_status()->offset != status.offset){
+        mismatches ++;
+        printf("# cycle %lu: local plan %08lx, offloaded %08lx\n",
+            (unsigned long)c, (unsigned long)local, (unsigned long)loaded);
+      }
+    }
+    to_frame = 0;
+#if OPTSCHED_MAX_RESERVATIONS
+    if (id >= 0) optsched_cancel_reservation(id);
+#endif
+  }
+  printf("# %s: %lu cycles, %lu mismatches, %lu failed\n", set->name,
+      (unsigned long)set->num_cycles, (unsigned long)mismatches,
+      (unsigned long)failures);
+  if (set->num_cycles){
+    printf("# %s: request %lu B in %lu lines, reply %lu B in %lu lines (mean)\n",
+        set->name,
+        (unsigned long)(request_bytes/set->num_cycles),
+        (unsigned long)(request_lines/set->num_cycles),
+        (unsigned long)(reply_bytes/set->num_cycles),
+        (unsigned long)(reply_lines/set->num_cycles));
+  }
+  return mismatches || failures;
+}
+
+static int serve(uint8_t verbose)
+{
+  char line[LINE_LEN];
+  uint8_t result;
+
+  while (fgets(line, sizeof(line), stdin)){
+    result = optsched_offload_serve(line);
+    if (result == OPTSCHED_OFFLOAD_READY){
+      fflush(stdout);
+      if (verbose){
+        fprintf(stderr, "# plan sent, %u battery slots\n",
+            get_number_of_battery_slots());
+      }
+    }else if (result == OPTSCHED_OFFLOAD_ERROR){
+      fprintf(stderr, "# broken request, dropped at: %s", line);
+    }else if (result == OPTSCHED_OFFLOAD_IGNORED && verbose){
+      fputs(line, stderr);
+    }
+  }
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-v]\n"
+      "       %s -l [-d days] [-s seed] [-b start%%] [-p peak] [-z confidence]\n"
+      "          [-t trace.csv] [-c cycles.txt] ...\n"
+      " serves the requests read on stdin, the plans go to stdout\n"
+      " -v  copy the other lines (the logs of the node) to stderr\n"
+      " -l  loopback check: plan the cycles locally and through the\n"
+      "     offload, and compare the plans\n"
+      " -t  EHTrace irradiance file (%us period), repeatable\n"
+      " -c  harvested energy values, one per line, repeatable\n"
+      " without -t/-c the synthetic profiles are used\n"
+      " -z  keep a margin with this confidence (percent), against a\n"
+      "     deviation of a quarter of the harvest\n",
+      name, name, HARVEST_TRACE_PERIOD);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  uint32_t batt_start = BATT_MAX;
+  uint8_t confidence = 0;
+  uint8_t verbose = 0;
+  uint8_t loopback = 0;
+  uint8_t have_files = 0;
+  int i, err = 0;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-'){
+      usage(argv[0]);
+      return 1;
+    }
+    if (argv[i][1] == 'v'){
+      verbose = 1;
+      continue;
+    }
+    if (argv[i][1] == 'l'){
+      loopback = 1;
+      continue;
+    }
+    if (i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'z': confidence = strtoul(argv[++i], NULL, 0); break;
+      case 'b':
+        batt_start = BATT_MIN + (uint64_t)BATT_CAPACITY*strtoul(argv[++i], NULL, 0)/100;
+        break;
+      case 't':
+      case 'c':
+        have_files = 1;
+        i++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (!loopback) return serve(verbose);
+
+  printf("# SLOTS_PER_DAY %u, BATT_MIN %lu, BATT_MAX %lu, start %lu\n",
+      SLOTS_PER_DAY, (unsigned long)BATT_MIN, (unsigned long)BATT_MAX,
+      (unsigned long)batt_start);
+  if (have_files){
+    for (i = 1; i < argc; i++){
+      HarvestSet set;
+      if (argv[i][1] != 't' && argv[i][1] != 'c'){
+        if (argv[i][1] != 'v' && argv[i][1] != 'l') i++;
+        continue;
+      }
+      if (argv[i][1] == 't'){
+        err = harvest_load_trace(&set, argv[i+1], HARVEST_TRACE_PERIOD, SLOTS_PER_DAY);
+      }else{
+        err = harvest_load_cycles(&set, argv[i+1], SLOTS_PER_DAY);
+      }
+      i++;
+      if (err) return 1;
+      err |= loopback_set(&set, batt_start, confidence);
+      harvest_free(&set);
+    }
+  }else{
+    uint8_t p;
+    for (p = 0; p < HARVEST_SYNTH_NUM; p++){
+      HarvestSet set;
+      if (harvest_synthetic(&set, p, days, SLOTS_PER_DAY, peak, seed)) return 1;
+      err |= loopback_set(&set, batt_start, confidence);
+      harvest_free(&set);
+    }
+  }
+  return err;
+}
@@ -0,0 +1,190 @@
+/**
+ * Batched first pass, see optsched_batch.h
+ */
+#include <stdlib.h>
+#include <string.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "optsched_batch.h"
+
+#if !OPTSCHED_BATCH
+#error "The batch kernel needs OPTSCHED_CONF_BATCH"
+#endif
+#if OPTSCHED_SLOT_GRID
+#error "The batch kernel only handles uniform slots"
+#endif
+
+typedef uint32_t v_u32 __attribute__((vector_size(4*OPTSCHED_BATCH_LANES)));
+typedef int32_t v_i32 __attribute__((vector_size(4*OPTSCHED_BATCH_LANES)));
+
+// lanes of @a where @m is all ones, of @b elsewhere
+#define select(M, A, B) (((A) & (M)) | ((B) & ~(M)))
+
+#define prediction_slot(I) ((I) % OPTSCHED_PREDICTION_SLOTS)
+
+static void *alloc_zero(size_t size)
+{
+  void *p;
+  // a whole number of vectors, aligned for them
+  size = (size + 31) & ~(size_t)31;
+  if (posix_memalign(&p, 32, size)) return NULL;
+  memset(p, 0, size);
+  return p;
+}
+
+int optsched_batch_alloc(OptschedBatch *batch, uint32_t nodes)
+{
+  memset(batch, 0, sizeof(*batch));
+  batch->nodes = nodes;
+  batch->stride = (nodes + OPTSCHED_BATCH_LANES - 1)/OPTSCHED_BATCH_LANES*OPTSCHED_BATCH_LANES;
+  batch->battery_start = alloc_zero(batch->stride*sizeof(uint32_t));
+  batch->min_e_cons = alloc_zero(batch->stride*sizeof(uint32_t));
+  batch->harvest = alloc_zero((size_t)OPTSCHED_PREDICTION_SLOTS*batch->stride*sizeof(uint32_t));
+  batch->num_battery_slots = alloc_zero(nodes);
+  batch->slots = alloc_zero((size_t)nodes*sizeof(BatterySlots));
+  batch->status = alloc_zero((size_t)nodes*sizeof(OptschedStatus));
+  if (!batch->battery_start || !batch->min_e_cons || !batch->harvest ||
+      !batch->num_battery_slots || !batch->slots || !batch->status){
+    optsched_batch_free(batch);
+    return -1;
+  }
+  return 0;
+}
+
+void optsched_batch_free(OptschedBatch *batch)
+{
+  free(batch->battery_start);
+  free(batch->min_e_cons);
+  free(batch->harvest);
+  free(batch->num_battery_slots);
+  free(batch->slots);
+  free(batch->status);
+  memset(batch, 0, sizeof(*batch));
+}
+
+static uint8_t any_lane(v_u32 m)
+{
+  uint32_t r = 0;
+  uint8_t k;
+
+  for (k = 0; k < OPTSCHED_BATCH_LANES; k++) r |= m[k];
+  return r != 0;
+}
+
+/**
+ * Writes the battery slot that ends at @harv_i to the table of @node,
+ * as optsched_first_pass_step() does: the capacity check, then the
+ * next entry, merging if the table is full.
+ */
+static void close_slot(OptschedBatch *batch, uint32_t node, uint8_t *batt_i,
+                       uint16_t harv_i, uint8_t type, uint16_t start,
+                       uint32_t min_level, uint32_t max_level, uint32_t total_e_cons)
+{
+  BatterySlots *s = &batch->slots[node];
+  OptschedStatus *status = &batch->status[node];
+  uint8_t i = *batt_i;
+
+  s->type[i] = type;
+  s->start_slot[i] = start;
+  s->min_level[i] = min_level;
+  s->max_level[i] = max_level;
+  s->total_e_cons[i] = total_e_cons;
+  if (batt_slot_capacity(s, i) > PLAN_BATT_CAPACITY && status->error == OPTSCHED_OK){
+    status->error = OPTSCHED_ERR_CAPACITY;
+    status->battery_slot = i + 1;
+    status->harv_slot = start;
+    status->residual = from_unit(batt_slot_capacity(s, i) - PLAN_BATT_CAPACITY);
+  }
+  s->length[i] = harv_i - start;
+
+  if (i + 1 == OPTSCHED_MAX_BATTERY_SLOTS){
+    optsched_merge_battery_slots(s, i + 1);
+  }else{
+    (*batt_i) ++;
+  }
+}
+
+/**
+ * The first pass of the OPTSCHED_BATCH_LANES nodes from @first on.
+ * The state of the battery slot in progress of each node is kept in
+ * a lane of the vectors.
+ */
+static void first_pass_lanes(OptschedBatch *batch, uint32_t first)
+{
+  const v_u32 cons_max = (v_u32){} + U_E_CONS_MAX;
+  const v_u32 charging = (v_u32){} + BATT_SLOT_CHARGING;
+  const v_u32 constant = (v_u32){} + BATT_SLOT_CONSTANT;
+  const v_u32 discharging = (v_u32){} + BATT_SLOT_DISCHARGING;
+  v_u32 level, min_level, max_level, total, type, start;
+  v_u32 e_min, h, e_cons, t, charge, discharge, changed;
+  uint8_t batt_i[OPTSCHED_BATCH_LANES];
+  uint8_t k, lanes = OPTSCHED_BATCH_LANES;
+  uint16_t harv_i;
+
+  if (batch->nodes - first < lanes) lanes = batch->nodes - first;
+  memset(batt_i, 0, sizeof(batt_i));
+  memset(&batch->status[first], 0, lanes*sizeof(OptschedStatus));
+
+  memcpy(&level, batch->battery_start + first, sizeof(level));
+  memcpy(&e_min, batch->min_e_cons + first, sizeof(e_min));
+  level >>= OPTSCHED_ENERGY_SHIFT;
+  e_min >>= OPTSCHED_ENERGY_SHIFT;
+  min_level = max_level = level;
+  total = start = type = (v_u32){};
+
+  for (harv_i = 0; harv_i < OPTSCHED_HORIZON_SLOTS; harv_i ++){
+    memcpy(&h, &batch_harvest(batch, prediction_slot(harv_i), first), sizeof(h));
+    h >>= OPTSCHED_ENERGY_SHIFT;
+
+    // the type and consumption of the slot, compared as int32_t
+    charge = (v_u32)((v_i32)h >= (v_i32)cons_max);
+    discharge = (v_u32)((v_i32)h <= (v_i32)e_min);
+    e_cons = select(charge, cons_max, select(discharge, e_min, h));
+    t = select(charge, charging, select(discharge, discharging, constant));
+
+    if (harv_i == 0) type = t;
+    changed = (v_u32)(t != type);
+    if (any_lane(changed)){
+      for (k = 0; k < lanes; k++){
+        if (!changed[k]) continue;
+        close_slot(batch, first + k, &batt_i[k], harv_i, type[k], start[k],
+                   min_level[k], max_level[k], total[k]);
+      }
+      min_level = select(changed, level, min_level);
+      max_level = select(changed, level, max_level);
+      total = select(changed, (v_u32){}, total);
+      start = select(changed, (v_u32){} + harv_i, start);
+      type = t;
+    }
+
+    // the running sum of the levels, wrapping as the uint32_t one
+    level += h - e_cons;
+    min_level = select((v_u32)(level < min_level), level, min_level);
+    max_level = select((v_u32)(level > max_level), level, max_level);
+    total += e_cons;
+  }
+
+  // the last battery slot runs to the end of the horizon
+  for (k = 0; k < lanes; k++){
+    BatterySlots *s = &batch->slots[first + k];
+    uint8_t i = batt_i[k];
+
+    s->type[i] = type[k];
+    s->start_slot[i] = start[k];
+    s->length[i] = OPTSCHED_HORIZON_SLOTS - start[k];
+    s->min_level[i] = min_level[k];
+    s->max_level[i] = max_level[k];
+    s->total_e_cons[i] = total[k];
+    batch->num_battery_slots[first + k] = i + 1;
+  }
+}
+
+void optsched_batch_first_pass(OptschedBatch *batch)
+{
+  uint32_t first;
+
+  for (first = 0; first < batch->nodes; first += OPTSCHED_BATCH_LANES){
+    first_pass_lanes(batch, first);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef __OPTSCHED_BATCH_H
+#define __OPTSCHED_BATCH_H
+
+/*
+ * First pass of MAllEC for many nodes at once, on the host.
+ *
+ * The harvest of the nodes is laid out in groups of
+ * OPTSCHED_BATCH_LANES nodes, slot by slot within a group (structure
+ * of arrays, one group after the other), so that each slot of a group
+ * is one vector, next to the one of the following slot: the slots are
+ * classified (CHARGING, CONSTANT, DISCHARGING) with vector compares,
+ * the consumption picked with selects and the battery level of every
+ * lane integrated as a running sum. A lane only leaves the vectors
+ * when its battery slot ends, to write it to the table of its node
+ * (and merge when the table is full, a few times a day at most).
+ *
+ * The battery slots and the status are bit-identical to the first
+ * pass of optsched_run() (optsched_first_pass_only()), for uniform
+ * slots, without reservations and with the margins of the thread
+ * (none unless optsched_set_risk() was called). Include after
+ * optimal_scheduler_private.h, built with OPTSCHED_CONF_BATCH.
+ */
+
+// nodes per vector, 8 x 32 bits, one AVX2 register
+#ifndef OPTSCHED_BATCH_LANES
+#define OPTSCHED_BATCH_LANES 8
+#endif
+
+typedef struct optsched_batch{
+  uint32_t nodes;
+  uint32_t stride;          // nodes, rounded up to a multiple of the lanes
+
+  // inputs, Watt-ticks
+  uint32_t *battery_start;  // [stride]
+  uint32_t *min_e_cons;     // [stride]
+  uint32_t *harvest;        // [stride/lanes][OPTSCHED_PREDICTION_SLOTS][lanes]
+
+  // outputs, as the first pass leaves them (scheduler unit)
+  uint8_t *num_battery_slots;   // [nodes]
+  BatterySlots *slots;          // [nodes]
+  OptschedStatus *status;       // [nodes]
+} OptschedBatch;
+
+// harvest of @node in prediction slot @slot
+#define batch_harvest(B, SLOT, NODE) \
+  ((B)->harvest[((size_t)(NODE)/OPTSCHED_BATCH_LANES*OPTSCHED_PREDICTION_SLOTS + (SLOT))* \
+                OPTSCHED_BATCH_LANES + (NODE)%OPTSCHED_BATCH_LANES])
+
+/**
+ * Allocates a batch of @nodes nodes, with the inputs zeroed.
+ * Returns 0, or -1 if out of memory.
+ */
+int optsched_batch_alloc(OptschedBatch *batch, uint32_t nodes);
+
+void optsched_batch_free(OptschedBatch *batch);
+
+/**
+ * Runs the first pass for every node of @batch.
+ */
+void optsched_batch_first_pass(OptschedBatch *batch);
+
+#endif
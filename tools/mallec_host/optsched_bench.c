@@ -0,0 +1,530 @@
+/*
+ * Host benchmark for the MAllEC scheduler.
+ *
+ * Replays harvest cycles (EHTrace files, serial logs or synthetic
+ * cycles) through optsched_run() and reports, for every cycle, the
+ * time spent in each pass, the number of battery slots and a hash of
+ * the resulting plan. The plan hash changes whenever the output of the
+ * algorithm changes, the timings catch performance regressions.
+ *
+ * With -r the receding-horizon mode is measured as well: each cycle
+ * is planned as the prediction for the day, the next cycle is what is
+ * actually harvested, and optsched_replan() runs in every harvesting
+ * slot against the simulated battery level.
+ *
+ * With -S the time-sliced run (optsched_start/optsched_step) is
+ * checked against optsched_run() and the longest step is reported,
+ * which is how long the node's other processes may have to wait.
+ *
+ * With -D the cycles are run as consecutive days, each one starting
+ * from the battery level the previous one left, and the energy
+ * consumed, wasted (battery full) and missing (battery empty) is
+ * reported; this is where a multi-day horizon
+ * (optsched_bench_h<days>_<slots>, OPTSCHED_CONF_HORIZON_DAYS) shows.
+ *
+ * With -z (and -D) the days are not known in advance: each one is
+ * planned from the previous day, as the predictor of the node does,
+ * with the mean absolute error of each slot so far as the deviation
+ * of the prediction, keeping the margin above BATT_MIN of the given
+ * confidence (optsched_set_risk). -z 50 plans without a margin.
+ *
+ * With -g the input is read at a finer resolution and the scheduler
+ * runs on a non-uniform grid of SLOTS_PER_DAY slots built from it,
+ * coarse at night (optsched_bench_grid_<slots>, OPTSCHED_CONF_SLOT_GRID).
+ *
+ * The scheduler is compiled once per SLOTS_PER_DAY value, see the
+ * Makefile; the binary is named after it (optsched_bench_<slots>).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "harvest_source.h"
+#include "plan_sim.h"
+
+#define DEFAULT_ITERATIONS  20
+#define DEFAULT_DAYS        30
+#define DEFAULT_PEAK        (3*E_CONS_MAX)
+
+static uint64_t pass_marks[OPTSCHED_PASS_DONE+1];
+
+#if OPTSCHED_SLOT_GRID
+// slots of the input per grid slot, with -g
+static uint8_t grid[SLOTS_PER_DAY];
+static uint16_t grid_base;
+#define grid_duration(I) (grid_base ? grid[I] : 1)
+#else
+#define grid_duration(I) 1
+#endif
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Called by optimal_scheduler.c at the start of each pass
+ * (OPTSCHED_CONF_PROFILE=optsched_bench_profile).
+ */
+void optsched_bench_profile(uint8_t pass)
+{
+  pass_marks[pass] = now_ns();
+}
+
+typedef struct pass_times{
+  uint64_t first, second, offset, total;
+} PassTimes;
+
+typedef struct set_summary{
+  PassTimes sum;
+  PassTimes max;
+  uint32_t cycles;
+  uint32_t max_batt_slots;
+  uint64_t sum_batt_slots;
+  uint64_t replan_sum;    // over all the replanned harvesting slots
+  uint64_t replan_max;
+  uint32_t replans;
+  uint64_t step_max;      // longest optsched_step()
+  uint64_t steps;
+  uint32_t sliced_mismatch;
+  uint32_t errors[OPTSCHED_ERR_OVERSPENT+1]; // first error of each run
+  uint32_t fallbacks;
+} SetSummary;
+
+/*
+ * FNV-1a over everything the node reads back from the plan
+ */
+static uint32_t plan_hash()
+{
+  uint32_t h = 2166136261UL;
+  uint8_t i, n;
+  n = get_number_of_battery_slots();
+  for (i = 1; i <= n; i++){
+    uint32_t v[4];
+    uint8_t k, *b;
+    v[0] = get_battery_slot_duration(i) | (uint32_t)get_battery_slot_type(i) << 16;
+    v[1] = get_battery_slot_total_e_cons(i);
+    v[2] = get_battery_slot_start_level(i);
+    v[3] = i;
+    b = (uint8_t *)v;
+    for (k = 0; k < sizeof(v); k++){
+      h ^= b[k];
+      h *= 16777619UL;
+    }
+  }
+  return h;
+}
+
+static uint64_t pass_total()
+{
+  return pass_marks[OPTSCHED_PASS_DONE] - pass_marks[OPTSCHED_PASS_FIRST];
+}
+
+/*
+ * Runs a day with replanning in every harvesting slot, the node
+ * consuming what the current battery slot allows.
+ */
+static void bench_replan(SetSummary *summary, uint32_t *predicted,
+                         uint32_t *actual, uint32_t batt_start)
+{
+  uint16_t harv_i;
+  int64_t battery = batt_start;
+
+  optsched_run(batt_start, BATT_MAX, E_CONS_MIN, 0, predicted);
+  for (harv_i = 0; harv_i < SLOTS_PER_DAY; harv_i++){
+    uint8_t crt;
+    if (harv_i > 0){
+      optsched_replan(harv_i, battery, BATT_MAX, E_CONS_MIN, predicted);
+      summary->replan_sum += pass_total();
+      summary->replan_max = max(summary->replan_max, pass_total());
+      summary->replans ++;
+    }
+    crt = get_current_battery_slot();
+    battery += actual[harv_i];
+    battery -= get_battery_slot_total_e_cons(crt)/get_battery_slot_duration(crt)*
+               grid_duration(harv_i);
+    if (battery > BATT_MAX) battery = BATT_MAX;
+    if (battery < 0) battery = 0;
+  }
+}
+
+/*
+ * Runs the cycle again in slices and compares the plan with the one
+ * from optsched_run(), which must be in service at this point.
+ */
+static void bench_sliced(SetSummary *summary, uint32_t *harvested, uint32_t batt_start)
+{
+  uint32_t expected = plan_hash();
+  uint8_t result;
+
+  optsched_start(batt_start, BATT_MAX, E_CONS_MIN, 0, harvested);
+  do{
+    uint64_t start = now_ns(), duration;
+    result = optsched_step();
+    duration = now_ns() - start;
+    summary->step_max = max(summary->step_max, duration);
+    summary->steps ++;
+    // the previous plan stays in service until the new one is ready
+    if (result == OPTSCHED_BUSY && plan_hash() != expected) summary->sliced_mismatch ++;
+  }while (result == OPTSCHED_BUSY);
+
+  if (result != OPTSCHED_READY || plan_hash() != expected) summary->sliced_mismatch ++;
+}
+
+#if OPTSCHED_SLOT_GRID
+/*
+ * Moves a set read at grid_base slots per cycle to a grid of
+ * SLOTS_PER_DAY slots built for it.
+ */
+static int regrid_set(HarvestSet *set)
+{
+  uint16_t i, longest = 0;
+
+  if (harvest_make_grid(set, SLOTS_PER_DAY, grid) ||
+      harvest_regrid(set, grid, SLOTS_PER_DAY)){
+    fprintf(stderr, "%s: can't fit %u slots into a grid of %u\n",
+        set->name, grid_base, SLOTS_PER_DAY);
+    return -1;
+  }
+  for (i = 0; i < SLOTS_PER_DAY; i++) longest = max(longest, grid[i]);
+  printf("# %s: grid of %u slots over %u, longest %u\n",
+      set->name, SLOTS_PER_DAY, grid_base, longest);
+  optsched_set_slot_grid(grid);
+  return 0;
+}
+#else
+#define regrid_set(SET) 0
+#endif
+
+#if OPTSCHED_RISK
+// confidence of the plans with -z, -1 if the days are known
+static int risk_confidence = -1;
+static uint32_t day_prediction[OPTSCHED_PREDICTION_SLOTS];
+static uint32_t day_deviation[OPTSCHED_PREDICTION_SLOTS];
+
+/**
+ * Takes the day @harvested into the deviation of the prediction, as
+ * eh_predictor does, and makes it the prediction of the next days.
+ */
+static void predict_day(const uint32_t *harvested)
+{
+  uint16_t i;
+
+  for (i = 0; i < OPTSCHED_PREDICTION_SLOTS; i++){
+    uint32_t actual = harvested[i % SLOTS_PER_DAY];
+    uint32_t error = actual > day_prediction[i] ? actual - day_prediction[i] :
+                                                  day_prediction[i] - actual;
+    if (error > day_deviation[i]){
+      day_deviation[i] += (error - day_deviation[i]) >> 2;
+    }else{
+      day_deviation[i] -= (day_deviation[i] - error) >> 2;
+    }
+    day_prediction[i] = actual;
+  }
+}
+#endif
+
+/*
+ * Runs the cycles as consecutive days, the harvest being as
+ * predicted, the node consuming what the plan allows and the next
+ * day being planned from the resulting battery level. With a
+ * multi-day prediction the following cycles are the forecast.
+ */
+static void bench_days(HarvestSet *set, uint32_t batt_start)
+{
+  PlanEnergy energy;
+  int64_t battery = batt_start;
+  uint8_t *day_grid = NULL;
+  uint64_t margins = 0;
+  uint32_t c, days = 0;
+
+#if OPTSCHED_SLOT_GRID
+  if (grid_base) day_grid = grid;
+#endif
+  memset(&energy, 0, sizeof(energy));
+  // with a multi-day prediction the last cycles are only forecast
+  if (set->num_cycles >= OPTSCHED_PREDICTION_DAYS){
+    days = set->num_cycles + 1 - OPTSCHED_PREDICTION_DAYS;
+  }
+#if OPTSCHED_RISK
+  if (risk_confidence >= 0){
+    // a node that has seen the first day, without errors so far
+    days = set->num_cycles;
+    memset(day_deviation, 0, sizeof(day_deviation));
+    for (c = 0; c < OPTSCHED_PREDICTION_SLOTS; c++){
+      day_prediction[c] = harvest_cycle(set, 0)[c % SLOTS_PER_DAY];
+    }
+    optsched_set_risk(risk_confidence, day_deviation, OPTSCHED_MARGIN_LOW);
+  }
+#endif
+  for (c = 0; c < days; c++){
+#if OPTSCHED_RISK
+    if (risk_confidence >= 0){
+      optsched_run(battery, BATT_MAX, E_CONS_MIN, 0, day_prediction);
+      margins += optsched_get_status()->margin;
+      plan_run_cycle(harvest_cycle(set, c), day_grid, &battery, &energy);
+      predict_day(harvest_cycle(set, c));
+      continue;
+    }
+#endif
+    optsched_run(battery, BATT_MAX, E_CONS_MIN, 0, harvest_cycle(set, c));
+    plan_run_cycle(harvest_cycle(set, c), day_grid, &battery, &energy);
+  }
+#if OPTSCHED_RISK
+  optsched_set_risk(50, NULL, 0);
+#endif
+  if (c == 0) return;
+  printf("#   %u days: consumed %llu wasted %llu missing %llu Watt-ticks, end %u%%\n",
+      c, (unsigned long long)energy.consumed, (unsigned long long)energy.wasted,
+      (unsigned long long)energy.missing,
+      (unsigned)((battery - BATT_MIN)*100/BATT_CAPACITY));
+  printf("#   %u empty slots, mean margin %llu Watt-ticks\n",
+      energy.empty, (unsigned long long)(margins/c));
+}
+
+static void bench_set(HarvestSet *set, uint32_t batt_start, uint32_t iterations,
+                      uint8_t verbose, uint8_t replan, uint8_t sliced)
+{
+  SetSummary summary;
+  uint32_t c, it;
+
+  memset(&summary, 0, sizeof(summary));
+  // with a multi-day prediction the last cycles are only forecast
+  for (c = 0; c + OPTSCHED_PREDICTION_DAYS <= set->num_cycles; c++){
+    PassTimes best;
+    int32_t result = 0;
+    uint8_t n;
+
+    memset(&best, 0xff, sizeof(best));
+    // keep the fastest run of each pass, it is the least disturbed by the host
+    for (it = 0; it < iterations; it++){
+      result = optsched_run(batt_start, BATT_MAX, E_CONS_MIN, 0,
+                            harvest_cycle(set, c));
+      best.first = min(best.first, pass_marks[OPTSCHED_PASS_SECOND] - pass_marks[OPTSCHED_PASS_FIRST]);
+      best.second = min(best.second, pass_marks[OPTSCHED_PASS_OFFSET] - pass_marks[OPTSCHED_PASS_SECOND]);
+      best.offset = min(best.offset, pass_marks[OPTSCHED_PASS_DONE] - pass_marks[OPTSCHED_PASS_OFFSET]);
+      best.total = min(best.total, pass_marks[OPTSCHED_PASS_DONE] - pass_marks[OPTSCHED_PASS_FIRST]);
+    }
+    n = get_number_of_battery_slots();
+    summary.errors[optsched_get_status()->error] ++;
+    summary.fallbacks += optsched_get_status()->fallback;
+
+    if (verbose){
+      printf("%u,%s,%u,%u,%llu,%llu,%llu,%llu,%ld,%08x\n",
+          SLOTS_PER_DAY, set->name, c, n,
+          (unsigned long long)best.first, (unsigned long long)best.second,
+          (unsigned long long)best.offset, (unsigned long long)best.total,
+          (long)result, plan_hash());
+    }
+
+    summary.cycles ++;
+    summary.sum.first += best.first;
+    summary.sum.second += best.second;
+    summary.sum.offset += best.offset;
+    summary.sum.total += best.total;
+    summary.max.first = max(summary.max.first, best.first);
+    summary.max.second = max(summary.max.second, best.second);
+    summary.max.offset = max(summary.max.offset, best.offset);
+    summary.max.total = max(summary.max.total, best.total);
+    summary.sum_batt_slots += n;
+    summary.max_batt_slots = max(summary.max_batt_slots, n);
+
+    if (sliced){
+      bench_sliced(&summary, harvest_cycle(set, c), batt_start);
+    }
+
+    if (replan){
+      // the next cycle is what actually happens, the last one wraps around
+      bench_replan(&summary, harvest_cycle(set, c),
+                   harvest_cycle(set, (c+1) % set->num_cycles), batt_start);
+    }
+  }
+
+  if (summary.cycles == 0) return;
+  printf("# %s: %u cycles, battery slots avg %.1f max %u\n"
+         "#   mean ns: first %llu second %llu offset %llu total %llu\n"
+         "#   max ns:  first %llu second %llu offset %llu total %llu\n",
+      set->name, summary.cycles,
+      (double)summary.sum_batt_slots/summary.cycles, summary.max_batt_slots,
+      (unsigned long long)(summary.sum.first/summary.cycles),
+      (unsigned long long)(summary.sum.second/summary.cycles),
+      (unsigned long long)(summary.sum.offset/summary.cycles),
+      (unsigned long long)(summary.sum.total/summary.cycles),
+      (unsigned long long)summary.max.first, (unsigned long long)summary.max.second,
+      (unsigned long long)summary.max.offset, (unsigned long long)summary.max.total);
+  printf("#   errors: capacity %u waste %u overspent %u, %u fallback plans\n",
+      summary.errors[OPTSCHED_ERR_CAPACITY], summary.errors[OPTSCHED_ERR_WASTE],
+      summary.errors[OPTSCHED_ERR_OVERSPENT], summary.fallbacks);
+  if (summary.replans){
+    // against the mean run, the replans walk the rest of the plan too
+    printf("#   replan ns: mean %llu max %llu (%u replans), %llu%% of a run\n",
+        (unsigned long long)(summary.replan_sum/summary.replans),
+        (unsigned long long)summary.replan_max, summary.replans,
+        (unsigned long long)(100*summary.replan_sum/summary.replans*summary.cycles/
+                             max(summary.sum.total, 1)));
+  }
+  if (summary.steps){
+    printf("#   sliced: %llu steps per cycle, longest %llu ns, %u plan mismatches\n",
+        (unsigned long long)(summary.steps/summary.cycles),
+        (unsigned long long)summary.step_max, summary.sliced_mismatch);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-n iterations] [-d days] [-s seed] [-b start%%]\n"
+      "          [-p peak] [-P profile] [-q] [-r] [-S] [-D] [-z confidence]\n"
+      "          [-t trace.csv] [-c cycles.txt] ...\n"
+      " -t  EHTrace irradiance file (%us period), repeatable\n"
+      " -c  harvested energy values, one per line, repeatable\n"
+      " without -t/-c the synthetic profiles are used, or only -P\n"
+      " -q  only print the per-set summaries\n"
+      " -r  also time optsched_replan() in every slot\n"
+      " -S  also run time-sliced and check the plans are the same\n"
+      " -D  also run the cycles as consecutive days and report the energy use\n"
+      " -z  with -D, plan each day from the previous one with this\n"
+      "     confidence (percent) of not reaching BATT_MIN\n"
+      " -g  read the input at this many slots per cycle and run on a\n"
+      "     grid of SLOTS_PER_DAY slots, coarse at night (grid builds)\n",
+      name, HARVEST_TRACE_PERIOD);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t iterations = DEFAULT_ITERATIONS;
+  uint32_t days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  uint32_t batt_start = BATT_MAX;
+  uint8_t verbose = 1;
+  uint8_t replan = 0;
+  uint8_t sliced = 0;
+  uint8_t days_run = 0;
+  int profile = -1;
+  uint8_t have_files = 0;
+  uint16_t input_slots = SLOTS_PER_DAY;
+  int i;
+
+  // options first, so they apply to all the files
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0){
+      usage(argv[0]);
+      return 1;
+    }
+    if (argv[i][1] == 'q'){
+      verbose = 0;
+      continue;
+    }
+    if (argv[i][1] == 'r'){
+      replan = 1;
+      continue;
+    }
+    if (argv[i][1] == 'S'){
+      sliced = 1;
+      continue;
+    }
+    if (argv[i][1] == 'D'){
+      days_run = 1;
+      continue;
+    }
+    if (i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'n': iterations = strtoul(argv[++i], NULL, 0); break;
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'P':
+        i++;
+        for (profile = 0; harvest_synthetic_name(profile); profile++){
+          if (strcmp(harvest_synthetic_name(profile), argv[i]) == 0) break;
+        }
+        if (harvest_synthetic_name(profile) == NULL){
+          fprintf(stderr, "unknown profile %s\n", argv[i]);
+          return 1;
+        }
+        break;
+      case 'z':
+#if OPTSCHED_RISK
+        risk_confidence = strtoul(argv[++i], NULL, 0);
+        break;
+#else
+        fprintf(stderr, "-z needs OPTSCHED_CONF_RISK\n");
+        return 1;
+#endif
+      case 'b':
+        batt_start = BATT_MIN + (uint64_t)BATT_CAPACITY*strtoul(argv[++i], NULL, 0)/100;
+        break;
+      case 'g':
+        input_slots = strtoul(argv[++i], NULL, 0);
+#if OPTSCHED_SLOT_GRID
+        grid_base = input_slots;
+        break;
+#else
+        fprintf(stderr, "-g needs a grid build (optsched_bench_grid_<slots>)\n");
+        return 1;
+#endif
+      case 't':
+      case 'c':
+        have_files = 1;
+        i++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (iterations == 0) iterations = 1;
+  printf("# SLOTS_PER_DAY %u, BATT_MIN %lu, BATT_MAX %lu, start %lu\n",
+      SLOTS_PER_DAY, (unsigned long)BATT_MIN, (unsigned long)BATT_MAX,
+      (unsigned long)batt_start);
+  printf("# horizon %u days, prediction %u days, energy unit %lu Watt-ticks\n",
+      OPTSCHED_HORIZON_DAYS, OPTSCHED_PREDICTION_DAYS, (unsigned long)from_unit(1));
+  if (verbose){
+    printf("slots,source,cycle,battery_slots,first_ns,second_ns,offset_ns,total_ns,result,plan_hash\n");
+  }
+
+  if (have_files){
+    for (i = 1; i < argc; i++){
+      HarvestSet set;
+      int err;
+      if (argv[i][1] != 't' && argv[i][1] != 'c'){
+        if (argv[i][1] != 'q' && argv[i][1] != 'r' && argv[i][1] != 'S' &&
+            argv[i][1] != 'D') i++;
+        continue;
+      }
+      if (argv[i][1] == 't'){
+        err = harvest_load_trace(&set, argv[i+1], HARVEST_TRACE_PERIOD, input_slots);
+      }else{
+        err = harvest_load_cycles(&set, argv[i+1], input_slots);
+      }
+      i++;
+      if (err) return 1;
+      if (input_slots != SLOTS_PER_DAY && regrid_set(&set)) return 1;
+      bench_set(&set, batt_start, iterations, verbose, replan, sliced);
+      if (days_run) bench_days(&set, batt_start);
+      harvest_free(&set);
+    }
+  }else{
+    uint8_t p;
+    for (p = 0; p < HARVEST_SYNTH_NUM; p++){
+      HarvestSet set;
+      if (profile >= 0 && p != profile) continue;
+      if (harvest_synthetic(&set, p, days, input_slots, peak, seed)) return 1;
+      if (input_slots != SLOTS_PER_DAY && regrid_set(&set)) return 1;
+      bench_set(&set, batt_start, iterations, verbose, replan, sliced);
+      if (days_run) bench_days(&set, batt_start);
+      harvest_free(&set);
+    }
+  }
+
+  return 0;
+}
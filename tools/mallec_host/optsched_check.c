@@ -0,0 +1,409 @@
+/*
+ * Host checks of the calls the node makes on the plan in service,
+ * against the scheduler library (liboptsched_<slots>.a), so with the
+ * slot table up to 144 slots a day and without it above.
+ *
+ * Reservations (optsched_reserve): the window is checked, a
+ * reservation is accepted up to the energy the plan can hold and
+ * rejected past it, also when the battery is already short of the
+ * plan because of a reservation taken since the run, or measured
+ * lower by a replan; reservations that are over are dropped by
+ * optsched_shift_reservations() and the ones in progress cut down.
+ * The largest reservation accepted in a window is held by the next
+ * run, without an error.
+ *
+ * What if (optsched_what_if): the allowances stay
+ * within [E_CONS_MIN, E_CONS_MAX], a deficit takes off what a replan
+ * with the energy spent does, and a surplus gives no more than it is
+ * or than fits below BATT_MAX.
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "harvest_source.h"
+#include "check.h"
+
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+// low enough for the battery to bound the reservations at night
+#define START_LEVEL     (BATT_MIN + SLOTS_PER_DAY*E_CONS_MAX/2)
+// close enough to BATT_MAX for the plan to spend the harvest by day
+#define FULL_LEVEL      (BATT_MAX - SLOTS_PER_DAY*E_CONS_MAX/2)
+// windows of a day where the largest reservation is checked
+#define HELD_WINDOWS    24
+
+// the library is built with OPTSCHED_CONF_PROFILE=optsched_bench_profile
+void optsched_bench_profile(uint8_t pass)
+{
+}
+
+static void cancel_all()
+{
+  int8_t id;
+
+  for (id = 0; id < OPTSCHED_MAX_RESERVATIONS; id++){
+    optsched_cancel_reservation(id);
+  }
+}
+
+// FNV-1a of the battery slots of the plan in service and its @offset
+static uint32_t plan_hash(int32_t offset)
+{
+  uint32_t h = 2166136261UL, v[2];
+  uint8_t i, k, *b = (uint8_t *)v;
+
+  for (i = 0; i <= get_number_of_battery_slots(); i++){
+    v[0] = i ? get_battery_slot_length(i) : (uint32_t)offset;
+    v[1] = i ? get_battery_slot_total_e_cons(i) : 0;
+    for (k = 0; k < sizeof(v); k++){
+      h ^= b[k];
+      h *= 16777619UL;
+    }
+  }
+  return h;
+}
+
+static uint32_t plan(uint32_t *harvested)
+{
+  return plan_hash(optsched_run(START_LEVEL, BATT_MAX, E_CONS_MIN, 0, harvested));
+}
+
+/**
+ * Largest energy optsched_reserve() accepts over @length slots from
+ * @start_slot, leaving no reservation behind.
+ */
+static uint32_t largest_reservation(uint16_t start_slot, uint16_t length)
+{
+  uint32_t lo = 0, hi = 2*(BATT_MAX - BATT_MIN), mid;
+  int8_t id;
+
+  while (hi - lo > 1){
+    mid = lo + (hi - lo)/2;
+    id = optsched_reserve(start_slot, length, mid);
+    if (id >= 0){
+      optsched_cancel_reservation(id);
+      lo = mid;
+    }else{
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void check_reservations(uint32_t *harvested)
+{
+  uint16_t half = OPTSCHED_HORIZON_SLOTS/2;
+  uint32_t most, p0, p;
+  int8_t id, ids[OPTSCHED_MAX_RESERVATIONS];
+  uint8_t i;
+
+  cancel_all();
+
+  // windows outside the horizon
+  check(optsched_reserve(0, 0, 1) == OPTSCHED_RESERVE_INVALID, "empty window", 0);
+  check(optsched_reserve(OPTSCHED_HORIZON_SLOTS, 1, 1) == OPTSCHED_RESERVE_INVALID,
+        "window after the horizon", 0);
+  check(optsched_reserve(OPTSCHED_HORIZON_SLOTS - 1, 2, 1) == OPTSCHED_RESERVE_INVALID,
+        "window past the end of the horizon", 0);
+
+  // no plan yet, nothing to check it against
+  id = optsched_reserve(1, 1, 2*(BATT_MAX - BATT_MIN));
+  check(id >= 0, "reservation without a plan", id);
+  cancel_all();
+
+  p0 = plan(harvested);
+  most = largest_reservation(2, 1);
+  check(most > 0 && most < BATT_MAX - BATT_MIN, "largest reservation at night", most);
+  id = optsched_reserve(2, 1, most);
+  check(id >= 0, "reservation the plan can hold", id);
+  optsched_cancel_reservation(id);
+  id = optsched_reserve(2, 1, most + most/8 + 1);
+  check(id == OPTSCHED_RESERVE_INFEASIBLE, "reservation past what the plan holds", id);
+  check(plan(harvested) == p0, "plan after the reservations were cancelled", 0);
+
+  /*
+   * A reservation taken since the run is not in the plan yet, the
+   * battery is short of it when the next window starts.
+   */
+  id = optsched_reserve(1, 1, most/2);
+  check(id >= 0, "first of two reservations", id);
+  check(optsched_reserve(2, 1, most/2 + most/8) == OPTSCHED_RESERVE_INFEASIBLE,
+        "second reservation after the shortfall of the first", 0);
+  id = optsched_reserve(2, 1, most/4);
+  check(id >= 0, "second reservation within what is left", id);
+  cancel_all();
+
+  // measured lower by a replan, from its slot on
+  plan(harvested);
+  optsched_replan(2, START_LEVEL - most/2, BATT_MAX, E_CONS_MIN, harvested);
+  check(optsched_reserve(0, 4, most/2 + most/4) == OPTSCHED_RESERVE_INFEASIBLE,
+        "reservation short of the level of the replan", 0);
+  id = optsched_reserve(0, 4, most/4);
+  check(id >= 0, "reservation within the level of the replan", id);
+  cancel_all();
+
+  // no room left, until some are over
+  plan(harvested);
+  for (i = 0; i < OPTSCHED_MAX_RESERVATIONS; i++){
+    ids[i] = optsched_reserve(i < 2 ? i : half + i, 1, 1);
+    check(ids[i] >= 0, "small reservation", ids[i]);
+  }
+  check(optsched_reserve(half, 1, 1) == OPTSCHED_RESERVE_INVALID, "reservation table full", 0);
+  optsched_shift_reservations(half);
+  for (i = 0; i < 2; i++){
+    ids[i] = optsched_reserve(half, 1, 1);
+    check(ids[i] >= 0, "reservation in the room of one that is over", ids[i]);
+  }
+  check(optsched_reserve(half, 1, 1) == OPTSCHED_RESERVE_INVALID,
+        "reservation table full after the shift", 0);
+  cancel_all();
+
+  /*
+   * The part of a reservation that is over is dropped: one of 4 slots
+   * shifted by 2 reserves what one of its last 2 slots does.
+   */
+  p0 = plan(harvested);
+  id = optsched_reserve(0, 2, 2*(most/4));
+  check(id >= 0, "reservation of 2 slots", id);
+  p = plan(harvested);
+  check(p != p0, "plan with a reservation", 0);
+  cancel_all();
+  plan(harvested);
+  id = optsched_reserve(2, 4, 4*(most/4));
+  check(id >= 0, "reservation of 4 slots", id);
+  optsched_shift_reservations(4);
+  check(plan(harvested) == p, "plan with a reservation in progress", 0);
+  optsched_shift_reservations(2);
+  check(plan(harvested) == p0, "plan once the reservation is over", 0);
+  cancel_all();
+
+  printf("# reservations: %lu checks, %lu failed (largest at night %lu)\n",
+      (unsigned long)checks, (unsigned long)failed, (unsigned long)most);
+}
+
+/*
+ * The largest reservation accepted in each window of a day, and 90% of
+ * it, on days the plan holds without errors: a run with the reservation
+ * has to hold it too, with no error and none reported.
+ */
+static void check_held_reservations(uint32_t peak, uint32_t seed)
+{
+  const uint8_t profiles[] = {HARVEST_SYNTH_CLEAR, HARVEST_SYNTH_BROKEN,
+                              HARVEST_SYNTH_FRAGMENTED};
+  const uint16_t length = SLOTS_PER_DAY/HELD_WINDOWS;
+  uint32_t checks_before = checks, failed_before = failed, held = 0;
+  uint32_t most, *harvested;
+  const OptschedStatus *status;
+  HarvestSet set;
+  uint16_t start;
+  uint8_t p, w, part;
+  int8_t id;
+
+  cancel_all();
+  for (p = 0; p < sizeof(profiles); p++){
+    if (harvest_synthetic(&set, profiles[p], OPTSCHED_HORIZON_DAYS,
+                          SLOTS_PER_DAY, peak, seed)){
+      check(0, "cycles of the profile", p);
+      continue;
+    }
+    harvested = harvest_cycle(&set, 0);
+    plan(harvested);
+    check(optsched_get_status()->error == OPTSCHED_OK, "plan without reservations",
+          optsched_get_status()->error);
+
+    for (w = 0; w < HELD_WINDOWS; w++){
+      start = w*length;
+      plan(harvested);
+      most = largest_reservation(start, length);
+      // all of it, then 90%
+      for (part = 10; part >= 9; part--){
+        plan(harvested);
+        id = optsched_reserve(start, length, (uint64_t)most*part/10);
+        check(id >= 0, "largest reservation accepted again", start);
+        if (id < 0) continue;
+        plan(harvested);
+        status = optsched_get_status();
+        check(status->error == OPTSCHED_OK && status->reservation == 0,
+              "reservation accepted held by the plan", start);
+        optsched_cancel_reservation(id);
+        held++;
+      }
+    }
+    harvest_free(&set);
+  }
+  printf("# reservations held: %lu checks, %lu failed (%lu reservations)\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before),
+      (unsigned long)held);
+}
+
+/**
+ * Energy the allowances @allowances of what_if at @harv_slot give to
+ * the rest of the horizon, following the battery slots of the plan.
+ */
+static uint64_t what_if_energy(uint16_t harv_slot, const uint32_t *allowances)
+{
+  OptschedSlotPlan slot;
+  uint64_t energy = 0;
+  uint8_t first;
+  uint16_t h;
+
+  optsched_get_slot_plan(harv_slot, &slot);
+  first = slot.battery_slot;
+  for (h = harv_slot; h < OPTSCHED_HORIZON_SLOTS; h++){
+    optsched_get_slot_plan(h, &slot);
+    energy += allowances[slot.battery_slot - first];
+  }
+  return energy;
+}
+
+// energy the plan in service gives to the rest of the horizon
+static uint64_t plan_energy(uint16_t harv_slot)
+{
+  OptschedSlotPlan slot;
+  uint64_t energy = 0;
+  uint16_t h;
+
+  for (h = harv_slot; h < OPTSCHED_HORIZON_SLOTS; h++){
+    optsched_get_slot_plan(h, &slot);
+    energy += slot.e_cons;
+  }
+  return energy;
+}
+
+/*
+ * What if @extra is spent at a few slots of a day that starts close to
+ * BATT_MAX, so the plan spends the harvest by day. The energy what_if
+ * takes off the rest of the horizon for a deficit has to be what a
+ * replan with the deficit takes off (both from what they give with no
+ * deficit, which differs a little); a surplus can't give more than it
+ * is, nor more than fits below BATT_MAX. Replans without an offset
+ * correction bank a surplus rather than spend it, so those are not
+ * compared.
+ */
+static void check_what_if(uint32_t *harvested)
+{
+  const uint16_t at[] = {1, SLOTS_PER_DAY/4, SLOTS_PER_DAY/2, 3*SLOTS_PER_DAY/4,
+                         SLOTS_PER_DAY - 2};
+  const int32_t extras[] = {E_CONS_MAX, 20*E_CONS_MAX, -E_CONS_MAX,
+                            -20*E_CONS_MAX, -(int32_t)(SLOTS_PER_DAY*E_CONS_MAX)};
+  uint32_t allowances[OPTSCHED_MAX_BATTERY_SLOTS];
+  uint32_t checks_before = checks, failed_before = failed;
+  int64_t e_what_if, e_replan, e_what_if_0, e_replan_0, level, room, slack;
+  OptschedSlotPlan slot, reserved;
+  OptschedWhatIf what_if, spent;
+  uint8_t a, x;
+  int16_t n, k;
+  int8_t id;
+
+  for (a = 0; a < sizeof(at)/sizeof(at[0]); a++){
+    // as planned, and planned again from there
+    optsched_run(FULL_LEVEL, BATT_MAX, E_CONS_MIN, 0, harvested);
+    optsched_get_slot_plan(at[a], &slot);
+    n = optsched_what_if(at[a], slot.battery, 0, &what_if,
+                         allowances, OPTSCHED_MAX_BATTERY_SLOTS);
+    check(n > 0 && what_if.allowance == slot.e_cons, "what if nothing is spent",
+          what_if.allowance);
+    e_what_if_0 = what_if_energy(at[a], allowances);
+    optsched_replan(at[a], slot.battery, BATT_MAX, E_CONS_MIN, harvested);
+    e_replan_0 = plan_energy(at[a]);
+    // rounding, and the replan of the plan itself differs a little
+    slack = SLOTS_PER_DAY + llabs(e_what_if_0 - e_replan_0);
+
+    for (x = 0; x < sizeof(extras)/sizeof(extras[0]); x++){
+      optsched_run(FULL_LEVEL, BATT_MAX, E_CONS_MIN, 0, harvested);
+      n = optsched_what_if(at[a], slot.battery, extras[x], &what_if,
+                           allowances, OPTSCHED_MAX_BATTERY_SLOTS);
+      for (k = 0; k < n; k++){
+        check(allowances[k] >= E_CONS_MIN && allowances[k] <= E_CONS_MAX,
+              "what if allowance within the consumption bounds", allowances[k]);
+      }
+      e_what_if = what_if_energy(at[a], allowances) - e_what_if_0;
+
+      if (extras[x] < 0){
+        room = min(-(int64_t)extras[x], (int64_t)BATT_MAX - slot.battery);
+        check(e_what_if >= 0 && e_what_if <= room + SLOTS_PER_DAY,
+              "what if surplus within what the battery holds", e_what_if);
+        continue;
+      }
+
+      level = (int64_t)slot.battery - extras[x];
+      if (level < BATT_MIN) level = BATT_MIN;
+      optsched_replan(at[a], level, BATT_MAX, E_CONS_MIN, harvested);
+      e_replan = plan_energy(at[a]) - e_replan_0;
+      if (what_if.battery_slot == 0 && optsched_get_status()->error == OPTSCHED_OK &&
+          !optsched_get_status()->fallback){
+        check(llabs(e_what_if - e_replan) <= slack, "what if deficit as replanned",
+              e_what_if - e_replan);
+      }
+    }
+  }
+
+  /*
+   * A reservation taken since the run is not in the plan: the levels
+   * expected stay those of the plan, and a battery short of it is
+   * what spending it there would leave.
+   */
+  optsched_run(FULL_LEVEL, BATT_MAX, E_CONS_MIN, 0, harvested);
+  optsched_get_slot_plan(SLOTS_PER_DAY/2, &slot);
+  optsched_what_if(SLOTS_PER_DAY/2, slot.battery, 20*E_CONS_MAX, &spent, NULL, 0);
+  id = optsched_reserve(1, 1, 20*E_CONS_MAX);
+  check(id >= 0, "reservation taken since the run", id);
+  // from the start of the plan, past the reservation
+  optsched_get_slot_plan(0, &reserved);
+  optsched_get_slot_plan(SLOTS_PER_DAY/2, &reserved);
+  check(reserved.battery == slot.battery, "level expected with a reservation taken since",
+        (long)reserved.battery - (long)slot.battery);
+  optsched_what_if(SLOTS_PER_DAY/2, slot.battery - 20*E_CONS_MAX, 0, &what_if, NULL, 0);
+  check(what_if.allowance == spent.allowance && what_if.margin == spent.margin,
+        "what if short of a reservation taken since", (long)what_if.margin - spent.margin);
+  optsched_cancel_reservation(id);
+
+  printf("# what if: %lu checks, %lu failed\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before));
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-s seed] [-p peak]\n"
+      " checks against a synthetic clear day\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  HarvestSet set;
+  int i;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (harvest_synthetic(&set, HARVEST_SYNTH_CLEAR, OPTSCHED_HORIZON_DAYS,
+                        SLOTS_PER_DAY, peak, seed)){
+    fprintf(stderr, "cannot make the cycles\n");
+    return 1;
+  }
+  printf("# %u slots a day, slot table %s\n", SLOTS_PER_DAY,
+      OPTSCHED_SLOT_TABLE ? "on" : "off");
+  check_reservations(harvest_cycle(&set, 0));
+  check_held_reservations(peak, seed);
+  check_what_if(harvest_cycle(&set, 0));
+  harvest_free(&set);
+  return failed != 0;
+}
@@ -0,0 +1,189 @@
+#include "optsched_dp.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * With b the battery level in steps above batt_min, net[i] the harvest
+ * of slot i minus its e_min and room[i] its e_max - e_min, both in
+ * steps, the node consumes e_min plus x in [0, room[i]] and
+ *   b' = min(top, b + net[i] - x), b' >= 0
+ * V[i][b] is the most x that can be consumed from slot i on, starting
+ * at b, and still end at the target. As b' = b + net[i] - x when
+ * there is no waste,
+ *   V[i][b] = b + net[i] + max(V[i+1][b'] - b')
+ * over the window b + net[i] - room[i] <= b' <= b + net[i], which only
+ * moves up with b: a sliding window maximum, so each slot is linear
+ * in the number of levels.
+ */
+
+#define UNREACHABLE INT64_MIN/4
+
+typedef struct dp_state{
+  int64_t value;    // V, in steps
+  int64_t wasted;   // along the best path, in steps
+  int32_t end;      // level at the end of the best path
+} DpState;
+
+typedef struct dp_work{
+  int32_t *net;
+  int32_t *room;
+  DpState *cur, *next;
+  int32_t *deque;
+} DpWork;
+
+static int32_t min_level(double level, int32_t top)
+{
+  return level > top ? top : (int32_t)level;
+}
+
+static double duration_of(const DpProblem *p, uint16_t i)
+{
+  return p->duration ? p->duration[i] : 1;
+}
+
+/*
+ * Rounds the slots' energy to steps on the running sums, so that the
+ * rounding errors don't add up over the cycle.
+ */
+static void discretise(const DpProblem *p, DpWork *w)
+{
+  double net_sum = 0, room_sum = 0;
+  int64_t net_done = 0, room_done = 0;
+  uint16_t i;
+
+  for (i = 0; i < p->slots; i++){
+    net_sum += ((double)p->harvested[i] - (double)p->e_min*duration_of(p, i))/p->step;
+    room_sum += ((double)p->e_max - p->e_min)*duration_of(p, i)/p->step;
+    w->net[i] = (int64_t)llround(net_sum) - net_done;
+    w->room[i] = (int64_t)llround(room_sum) - room_done;
+    net_done += w->net[i];
+    room_done += w->room[i];
+  }
+}
+
+static void solve_slot(const DpProblem *p, DpWork *w, uint16_t i)
+{
+  int32_t top = p->levels - 1, head = 0, tail = 0, pushed = -1, b;
+  const DpState *next = w->next;
+
+  for (b = 0; b <= top; b++){
+    int64_t y = (int64_t)b + w->net[i];
+    int64_t lo = y - w->room[i], hi = y;
+    DpState *s = &w->cur[b];
+
+    if (hi < 0){
+      // the battery goes flat even at e_min
+      s->value = UNREACHABLE;
+      continue;
+    }
+    if (lo > top){
+      // full whatever is consumed, consume as much as possible
+      s->value = next[top].value == UNREACHABLE ?
+                   UNREACHABLE : w->room[i] + next[top].value;
+      s->wasted = next[top].wasted + lo - top;
+      s->end = next[top].end;
+      continue;
+    }
+    if (lo < 0) lo = 0;
+    if (hi > top) hi = top;
+
+    while (pushed < hi){
+      int64_t v;
+      pushed++;
+      v = next[pushed].value - pushed;
+      while (tail > head &&
+             next[w->deque[tail-1]].value - w->deque[tail-1] <= v) tail--;
+      w->deque[tail++] = pushed;
+    }
+    while (tail > head && w->deque[head] < lo) head++;
+
+    if (next[w->deque[head]].value == UNREACHABLE){
+      s->value = UNREACHABLE;
+    }else{
+      int32_t best = w->deque[head];
+      s->value = y - best + next[best].value;
+      // whatever is left above top when there is no room to consume it
+      s->wasted = next[best].wasted + (y - w->room[i] > top ? y - w->room[i] - top : 0);
+      s->end = next[best].end;
+    }
+  }
+}
+
+static int32_t solve_all(const DpProblem *p, DpWork *w, int32_t target, int32_t start)
+{
+  int32_t b;
+  int i;
+
+  for (b = 0; b < (int32_t)p->levels; b++){
+    w->next[b].value = b >= target ? 0 : UNREACHABLE;
+    w->next[b].wasted = 0;
+    w->next[b].end = b;
+  }
+  for (i = p->slots - 1; i >= 0; i--){
+    DpState *t;
+    solve_slot(p, w, i);
+    t = w->next;
+    w->next = w->cur;
+    w->cur = t;
+  }
+  // w->next now holds the first slot
+  return w->next[start].value == UNREACHABLE ? -1 : 0;
+}
+
+int dp_solve(DpProblem *p, DpResult *result)
+{
+  DpWork w;
+  int32_t top, start, target;
+  uint16_t i;
+  int err = -1;
+
+  if (p->levels < 2 || p->batt_max <= p->batt_min) return -1;
+  p->step = (p->batt_max - p->batt_min)/(p->levels - 1);
+  if (p->step == 0) return -1;
+  top = p->levels - 1;
+
+  w.net = malloc(sizeof(int32_t)*p->slots);
+  w.room = malloc(sizeof(int32_t)*p->slots);
+  w.cur = malloc(sizeof(DpState)*p->levels);
+  w.next = malloc(sizeof(DpState)*p->levels);
+  w.deque = malloc(sizeof(int32_t)*p->levels);
+  if (!w.net || !w.room || !w.cur || !w.next || !w.deque) goto out;
+
+  discretise(p, &w);
+  start = p->batt_start <= p->batt_min ? 0 :
+            min_level(llround((double)(p->batt_start - p->batt_min)/p->step), top);
+  target = p->batt_end <= p->batt_min ? 0 :
+            min_level(ceil((double)(p->batt_end - p->batt_min)/p->step), top);
+
+  if (solve_all(p, &w, target, start)){
+    // aim for the highest level that can be reached instead
+    int64_t b = start;
+    for (i = 0; i < p->slots; i++){
+      b += w.net[i];
+      if (b < 0) goto out;
+      if (b > top) b = top;
+    }
+    target = b;
+    if (solve_all(p, &w, target, start)) goto out;
+  }
+
+  memset(result, 0, sizeof(*result));
+  result->consumed = (uint64_t)w.next[start].value*p->step;
+  for (i = 0; i < p->slots; i++){
+    result->consumed += (uint64_t)(p->e_min*duration_of(p, i));
+  }
+  result->wasted = (uint64_t)w.next[start].wasted*p->step;
+  result->battery_end = p->batt_min + (uint64_t)w.next[start].end*p->step;
+  result->battery_end_target = p->batt_min + (uint64_t)target*p->step;
+  err = 0;
+
+out:
+  free(w.net);
+  free(w.room);
+  free(w.cur);
+  free(w.next);
+  free(w.deque);
+  return err;
+}
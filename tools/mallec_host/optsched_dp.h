@@ -0,0 +1,54 @@
+#ifndef __OPTSCHED_DP_H
+#define __OPTSCHED_DP_H
+
+#include <stdint.h>
+
+/*
+ * Reference for MAllEC on the host: dynamic programming over the
+ * battery level, discretised in @levels steps between the limits. It
+ * is not exact, see below.
+ *
+ * In every slot the node consumes between e_min and e_max (times the
+ * slot duration), the battery level at the end of each slot must not
+ * be below batt_min, and whatever is above batt_max is wasted, the
+ * same model the scheduler plans with. The solver finds the plan that
+ * consumes the most energy and ends the cycle at batt_end or above.
+ *
+ * Energy is counted in steps of the battery grid. The harvest net of
+ * e_min and the room between e_min and e_max are rounded on their
+ * running sums, so a slot is off by less than a step but the cycle
+ * as a whole is within a few steps of the true optimum, either way:
+ * MAllEC consumes up to about two steps more than the reference on
+ * some synthetic days (make gap).
+ */
+
+typedef struct dp_problem{
+  const uint32_t *harvested;
+  const uint8_t *duration;  // base periods per slot, NULL for all 1
+  uint16_t slots;
+  uint32_t batt_min, batt_max;
+  uint32_t e_min, e_max;    // per base period
+  uint32_t batt_start;
+  uint32_t batt_end;        // the level the cycle must end at, or above
+  uint32_t levels;          // battery levels of the grid
+  uint32_t step;            // set by dp_solve: Watt-ticks per level
+} DpProblem;
+
+typedef struct dp_result{
+  uint64_t consumed;
+  uint64_t wasted;
+  uint32_t battery_end;
+  uint32_t battery_end_target;  // batt_end, or the highest reachable level
+} DpResult;
+
+/**
+ * Solves @problem. If batt_end can't be reached, even consuming e_min
+ * throughout, the highest reachable level is the target instead.
+ * Takes O(slots x levels) time and O(slots + levels) memory.
+ *
+ * Returns 0 on success, -1 if memory runs out or the problem has no
+ * solution (the battery goes below batt_min at e_min).
+ */
+int dp_solve(DpProblem *problem, DpResult *result);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * MAllEC for a whole network on the host, for capacity planning.
+ *
+ * Every node gets its own harvest series: the base cycles (synthetic
+ * or an EHTrace file) attenuated by the shading patterns that cover
+ * its position, as EnergyManager.get_energy() does for the Cooja nodes
+ * in tools/sim_eh_source with daily (cyclic) shaders. Each node is
+ * planned and run day after day with optsched_run() and plan_sim.h,
+ * the battery carrying over from one day to the next.
+ *
+ * The nodes are shared out between threads, each with its own
+ * scheduler (built with OPTSCHED_CONF_THREAD=__thread, see the
+ * Makefile). A thread plans the nodes of its range and, once it is
+ * out of work, steals half of what is left in the range of another.
+ * The days of a node are planned in order by the same thread, since
+ * each one starts from the battery level the previous one left.
+ *
+ * One CSV line is streamed per node and day, the lines of a node
+ * together (the order of the nodes depends on the threads), then a
+ * summary of the fleet.
+ *
+ * The scheduler is compiled once per SLOTS_PER_DAY value, see the
+ * Makefile; the binary is named after it (optsched_fleet_<slots>).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "harvest_source.h"
+#include "plan_sim.h"
+
+#define DEFAULT_NODES   1000
+#define DEFAULT_DAYS    30
+#define DEFAULT_SHADERS 4
+#define DEFAULT_AREA    100
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+
+typedef struct node_result{
+  PlanEnergy energy;
+  uint32_t days_error;      // plans with an error
+  uint32_t days_fallback;   // fallback plans
+  uint32_t battery_slots;   // over all the days
+  uint32_t end_pc;          // battery level at the end, percent
+} NodeResult;
+
+typedef struct worker{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  uint32_t head, tail;      // nodes [head, tail) still to plan
+  uint32_t nodes;           // planned
+  uint32_t steals;
+  uint64_t ns;              // busy planning
+} Worker;
+
+// the fleet, read only while the workers run
+static HarvestSet base;
+static HarvestShading shading;
+static uint32_t num_shaders;
+static uint32_t num_nodes;
+static uint32_t days = DEFAULT_DAYS;
+static uint32_t batt_start;
+static uint8_t yesterday;   // plan from the previous day, not the day itself
+static uint8_t print_plans;
+static uint8_t quiet;
+
+static NodeResult *results;
+static Worker *workers;
+static uint32_t num_workers;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// profiling hook of the scheduler, not used here
+void optsched_bench_profile(uint8_t pass)
+{
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void node_day(const double *attenuation, uint32_t day, uint32_t *harvest)
+{
+  const uint32_t *cycle = harvest_cycle(&base, day % base.num_cycles);
+  uint16_t i;
+
+  for (i = 0; i < SLOTS_PER_DAY; i++){
+    harvest[i] = (uint32_t)(cycle[i]*attenuation[i]);
+  }
+}
+
+/**
+ * Plans and runs the days of node @n, writing its lines to @out.
+ */
+static void plan_node(uint32_t n, FILE *out)
+{
+  uint32_t harvest[SLOTS_PER_DAY], prediction[SLOTS_PER_DAY];
+  double attenuation[SLOTS_PER_DAY];
+  NodeResult *r = &results[n];
+  const OptschedStatus *status;
+  int64_t battery = batt_start;
+  uint32_t d;
+  uint8_t b, num;
+
+  harvest_shading_node(&shading, n, SLOTS_PER_DAY, attenuation);
+  if (yesterday) node_day(attenuation, 0, prediction);
+  for (d = 0; d < days; d++){
+    PlanEnergy energy;
+
+    memset(&energy, 0, sizeof(energy));
+    node_day(attenuation, d, harvest);
+    optsched_run(battery, BATT_MAX, E_CONS_MIN, 0, yesterday ? prediction : harvest);
+    plan_run_cycle(harvest, NULL, &battery, &energy);
+    if (yesterday) memcpy(prediction, harvest, sizeof(prediction));
+
+    status = optsched_get_status();
+    num = get_number_of_battery_slots();
+    r->energy.consumed += energy.consumed;
+    r->energy.wasted += energy.wasted;
+    r->energy.missing += energy.missing;
+    r->energy.empty += energy.empty;
+    r->days_error += status->error != OPTSCHED_OK;
+    r->days_fallback += status->fallback;
+    r->battery_slots += num;
+    if (quiet) continue;
+
+    fprintf(out, "%lu,%lu,%u,%llu,%llu,%llu,%lu,%u,%u,%u", (unsigned long)n,
+        (unsigned long)d, num, (unsigned long long)energy.consumed,
+        (unsigned long long)energy.wasted, (unsigned long long)energy.missing,
+        (unsigned long)energy.empty, (unsigned)((battery - BATT_MIN)*100/BATT_CAPACITY),
+        status->error, status->fallback);
+    if (print_plans){
+      for (b = 1; b <= num; b++){
+        fprintf(out, "%c%u:%u:%lu", b == 1 ? ',' : ';', get_battery_slot_length(b),
+            get_battery_slot_type(b),
+            (unsigned long)(get_battery_slot_total_e_cons(b)/get_battery_slot_duration(b)));
+      }
+    }
+    fputc('\n', out);
+  }
+  r->end_pc = (battery - BATT_MIN)*100/BATT_CAPACITY;
+}
+
+/**
+ * Takes the next node of worker @w, stealing half of the nodes left
+ * to another worker when it has none. Returns 0 when all are taken.
+ */
+static int next_node(Worker *w, uint32_t *n)
+{
+  uint32_t i, count;
+  Worker *v;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->head < w->tail){
+    *n = w->head++;
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  for (i = 1; i < num_workers; i++){
+    v = &workers[(w - workers + i) % num_workers];
+    pthread_mutex_lock(&v->lock);
+    count = (v->tail - v->head)/2;
+    if (count == 0 && v->tail > v->head) count = 1;
+    if (count == 0){
+      pthread_mutex_unlock(&v->lock);
+      continue;
+    }
+    v->tail -= count;
+    *n = v->tail;
+    pthread_mutex_unlock(&v->lock);
+    // one lock at a time, the range of w is empty meanwhile
+    pthread_mutex_lock(&w->lock);
+    w->head = *n + 1;
+    w->tail = *n + count;
+    w->steals ++;
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+  }
+  return 0;
+}
+
+static void *worker_run(void *arg)
+{
+  Worker *w = arg;
+  char *text = NULL;
+  size_t size = 0;
+  uint64_t start;
+  uint32_t n;
+  FILE *out;
+
+  while (next_node(w, &n)){
+    out = open_memstream(&text, &size);
+    if (out == NULL) break;
+    start = now_ns();
+    plan_node(n, out);
+    w->ns += now_ns() - start;
+    w->nodes ++;
+    fclose(out);
+    // the lines of a node are kept together
+    pthread_mutex_lock(&output_lock);
+    fwrite(text, 1, size, stdout);
+    pthread_mutex_unlock(&output_lock);
+    free(text);
+    text = NULL;
+  }
+  return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_summary(uint64_t wall_ns)
+{
+  uint64_t consumed = 0, wasted = 0, missing = 0, *per_day;
+  uint32_t n, empty = 0, nodes_empty = 0, errors = 0, fallbacks = 0, slots = 0;
+  uint64_t node_days = (uint64_t)num_nodes*days;
+  uint32_t i;
+
+  per_day = malloc(num_nodes*sizeof(uint64_t));
+  for (n = 0; n < num_nodes; n++){
+    NodeResult *r = &results[n];
+    consumed += r->energy.consumed;
+    wasted += r->energy.wasted;
+    missing += r->energy.missing;
+    empty += r->energy.empty;
+    nodes_empty += r->energy.empty != 0;
+    errors += r->days_error;
+    fallbacks += r->days_fallback;
+    slots += r->battery_slots;
+    if (per_day) per_day[n] = r->energy.consumed/days;
+  }
+  printf("# %lu nodes x %lu days, %lu shaders, base %s\n", (unsigned long)num_nodes,
+      (unsigned long)days, (unsigned long)num_shaders, base.name);
+  printf("# consumed %llu wasted %llu missing %llu Watt-ticks, battery slots avg %.1f\n",
+      (unsigned long long)consumed, (unsigned long long)wasted,
+      (unsigned long long)missing, (double)slots/node_days);
+  printf("# %lu empty slots on %lu nodes, %lu plans with errors, %lu fallback plans\n",
+      (unsigned long)empty, (unsigned long)nodes_empty, (unsigned long)errors,
+      (unsigned long)fallbacks);
+  if (per_day){
+    qsort(per_day, num_nodes, sizeof(uint64_t), cmp_u64);
+    printf("# consumed per node and day: min %llu p10 %llu median %llu p90 %llu max %llu\n",
+        (unsigned long long)per_day[0], (unsigned long long)per_day[num_nodes/10],
+        (unsigned long long)per_day[num_nodes/2], (unsigned long long)per_day[num_nodes*9/10],
+        (unsigned long long)per_day[num_nodes - 1]);
+    free(per_day);
+  }
+  printf("# %lu threads, %.3f s, %.0f node-days/s\n", (unsigned long)num_workers,
+      wall_ns/1e9, node_days/(wall_ns/1e9));
+  for (i = 0; i < num_workers; i++){
+    printf("#   thread %lu: %lu nodes, %lu steals, %.3f s busy\n", (unsigned long)i,
+        (unsigned long)workers[i].nodes, (unsigned long)workers[i].steals,
+        workers[i].ns/1e9);
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-N nodes] [-d days] [-j threads] [-S shaders] [-a area]\n"
+      "          [-s seed] [-b start%%] [-p peak] [-P profile] [-y] [-l] [-q]\n"
+      "          [-t trace.csv]\n"
+      " -t  EHTrace irradiance file (%us period) for the base cycles, the\n"
+      "     days wrap around it; without it the synthetic -P profile (mixed)\n"
+      " -y  plan each day from the harvest of the previous one, instead\n"
+      "     of the day itself\n"
+      " -l  add the battery slots of the plans (length:type:rate;...)\n"
+      " -q  only print the summary\n",
+      name, HARVEST_TRACE_PERIOD);
+}
+
+int main(int argc, char **argv)
+{
+  const char *trace = NULL;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  double area = DEFAULT_AREA;
+  int profile = HARVEST_SYNTH_MIXED;
+  uint64_t start;
+  uint32_t i, share;
+  int err;
+
+  num_nodes = DEFAULT_NODES;
+  num_shaders = DEFAULT_SHADERS;
+  num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  batt_start = BATT_MIN + BATT_CAPACITY/2;
+  for (i = 1; i < (uint32_t)argc; i++){
+    if (argv[i][0] != '-'){
+      usage(argv[0]);
+      return 1;
+    }
+    if (argv[i][1] == 'y'){
+      yesterday = 1;
+      continue;
+    }
+    if (argv[i][1] == 'l'){
+      print_plans = 1;
+      continue;
+    }
+    if (argv[i][1] == 'q'){
+      quiet = 1;
+      continue;
+    }
+    if (i+1 == (uint32_t)argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'N': num_nodes = strtoul(argv[++i], NULL, 0); break;
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 'j': num_workers = strtoul(argv[++i], NULL, 0); break;
+      case 'S': num_shaders = strtoul(argv[++i], NULL, 0); break;
+      case 'a': area = strtod(argv[++i], NULL); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 't': trace = argv[++i]; break;
+      case 'P':
+        i++;
+        for (profile = 0; harvest_synthetic_name(profile); profile++){
+          if (strcmp(harvest_synthetic_name(profile), argv[i]) == 0) break;
+        }
+        if (harvest_synthetic_name(profile) == NULL){
+          fprintf(stderr, "unknown profile %s\n", argv[i]);
+          return 1;
+        }
+        break;
+      case 'b':
+        batt_start = BATT_MIN + (uint64_t)BATT_CAPACITY*strtoul(argv[++i], NULL, 0)/100;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (num_nodes == 0 || days == 0){
+    usage(argv[0]);
+    return 1;
+  }
+  if (num_workers == 0) num_workers = 1;
+  if (num_workers > num_nodes) num_workers = num_nodes;
+
+  if (trace){
+    err = harvest_load_trace(&base, trace, HARVEST_TRACE_PERIOD, SLOTS_PER_DAY);
+  }else{
+    err = harvest_synthetic(&base, profile, days, SLOTS_PER_DAY, peak, seed);
+  }
+  if (err || base.num_cycles == 0) return 1;
+  results = calloc(num_nodes, sizeof(NodeResult));
+  if (results == NULL || harvest_shading_make(&shading, num_nodes, num_shaders, area, seed)){
+    return 1;
+  }
+
+  printf("# SLOTS_PER_DAY %u, BATT_MIN %lu, BATT_MAX %lu, start %lu\n",
+      SLOTS_PER_DAY, (unsigned long)BATT_MIN, (unsigned long)BATT_MAX,
+      (unsigned long)batt_start);
+  if (!quiet){
+    printf("node,day,battery_slots,consumed,wasted,missing,empty_slots,end_pc,error,fallback%s\n",
+        print_plans ? ",plan" : "");
+  }
+
+  // contiguous ranges to start with, the stealing evens them out
+  workers = calloc(num_workers, sizeof(Worker));
+  if (workers == NULL) return 1;
+  share = num_nodes/num_workers;
+  for (i = 0; i < num_workers; i++){
+    pthread_mutex_init(&workers[i].lock, NULL);
+    workers[i].head = i*share;
+    workers[i].tail = i + 1 == num_workers ? num_nodes : (i + 1)*share;
+  }
+  start = now_ns();
+  for (i = 0; i < num_workers; i++){
+    if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])){
+      fprintf(stderr, "cannot start thread %lu\n", (unsigned long)i);
+      return 1;
+    }
+  }
+  for (i = 0; i < num_workers; i++) pthread_join(workers[i].thread, NULL);
+  print_summary(now_ns() - start);
+
+  harvest_free(&base);
+  return 0;
+}
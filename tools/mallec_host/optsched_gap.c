@@ -0,0 +1,237 @@
+/*
+ * Optimality gap of MAllEC on the host.
+ *
+ * Every cycle is planned by optsched_run() and the plan is run against
+ * the harvest it was planned for (a perfect prediction). The same
+ * cycle is then solved by dynamic programming (optsched_dp.c), with
+ * the same battery limits and consumption bounds, ending at the
+ * battery level the MAllEC plan ended at. The difference in the energy
+ * consumed is what the heuristic leaves unused, give or take the
+ * rounding of the reference to its battery grid: the gap of a day can
+ * be slightly negative, so the smallest one is reported as well.
+ *
+ * The scheduler is compiled once per SLOTS_PER_DAY value, see the
+ * Makefile; the binary is named after it (optsched_gap_<slots>).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// after the system headers, it redefines min/max/abs
+#include "optimal_scheduler_private.h"
+#include "harvest_source.h"
+#include "optsched_dp.h"
+#include "plan_sim.h"
+
+#define DEFAULT_DAYS    1000
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+#define DEFAULT_LEVELS  16384
+
+typedef struct gap_summary{
+  uint32_t days;
+  uint32_t failed;          // no DP solution
+  PlanEnergy mallec;
+  uint64_t dp_consumed;
+  uint64_t dp_wasted;
+  double min_gap, max_gap;  // percent of the reference, below 0 when MAllEC beats it
+  uint32_t days_over_1pc;
+  uint64_t dp_ns;
+} GapSummary;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// profiling hook of the scheduler, not used here
+void optsched_bench_profile(uint8_t pass)
+{
+}
+
+static void gap_set(HarvestSet *set, uint32_t batt_start, uint32_t levels, uint8_t verbose)
+{
+  GapSummary summary;
+  uint32_t c;
+
+  memset(&summary, 0, sizeof(summary));
+  for (c = 0; c < set->num_cycles; c++){
+    uint32_t *harvested = harvest_cycle(set, c);
+    PlanEnergy mallec;
+    DpProblem problem;
+    DpResult dp;
+    int64_t battery = batt_start;
+    uint64_t start;
+    double gap;
+
+    memset(&mallec, 0, sizeof(mallec));
+    optsched_run(batt_start, BATT_MAX, E_CONS_MIN, 0, harvested);
+    plan_run_cycle(harvested, NULL, &battery, &mallec);
+
+    problem.harvested = harvested;
+    problem.duration = NULL;
+    problem.slots = SLOTS_PER_DAY;
+    problem.batt_min = BATT_MIN;
+    problem.batt_max = BATT_MAX;
+    problem.e_min = E_CONS_MIN;
+    problem.e_max = E_CONS_MAX;
+    problem.batt_start = batt_start;
+    problem.batt_end = battery;
+    problem.levels = levels;
+    start = now_ns();
+    if (dp_solve(&problem, &dp)){
+      summary.failed ++;
+      if (verbose) printf("%u,%s,%u,,,,,,,,\n", SLOTS_PER_DAY, set->name, c);
+      continue;
+    }
+    summary.dp_ns += now_ns() - start;
+
+    gap = dp.consumed ? 100.0*((double)dp.consumed - mallec.consumed)/dp.consumed : 0;
+    if (verbose){
+      printf("%u,%s,%u,%llu,%llu,%llu,%lld,%llu,%llu,%u,%.2f\n",
+          SLOTS_PER_DAY, set->name, c,
+          (unsigned long long)mallec.consumed, (unsigned long long)mallec.wasted,
+          (unsigned long long)mallec.missing, (long long)battery,
+          (unsigned long long)dp.consumed, (unsigned long long)dp.wasted,
+          dp.battery_end, gap);
+    }
+    if (summary.days == 0 || gap < summary.min_gap) summary.min_gap = gap;
+    if (summary.days == 0 || gap > summary.max_gap) summary.max_gap = gap;
+    summary.days ++;
+    summary.mallec.consumed += mallec.consumed;
+    summary.mallec.wasted += mallec.wasted;
+    summary.mallec.missing += mallec.missing;
+    summary.dp_consumed += dp.consumed;
+    summary.dp_wasted += dp.wasted;
+    if (gap > 1) summary.days_over_1pc ++;
+  }
+
+  if (summary.days == 0) return;
+  printf("# %s: %u days (%u without a solution), battery step %lu Watt-ticks\n"
+         "#   consumed: mallec %llu reference %llu, gap %.2f%% (min %.2f%%, max %.2f%%, %u days over 1%%)\n"
+         "#   wasted: mallec %llu reference %llu; missing: mallec %llu\n"
+         "#   dp ms per day: %.2f\n",
+      set->name, summary.days, summary.failed,
+      (unsigned long)((BATT_MAX - BATT_MIN)/(levels - 1)),
+      (unsigned long long)summary.mallec.consumed, (unsigned long long)summary.dp_consumed,
+      summary.dp_consumed ?
+        100.0*((double)summary.dp_consumed - summary.mallec.consumed)/summary.dp_consumed : 0,
+      summary.min_gap, summary.max_gap, summary.days_over_1pc,
+      (unsigned long long)summary.mallec.wasted, (unsigned long long)summary.dp_wasted,
+      (unsigned long long)summary.mallec.missing,
+      summary.dp_ns/1e6/summary.days);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-d days] [-s seed] [-b start%%] [-p peak] [-P profile]\n"
+      "          [-Q levels] [-q] [-t trace.csv] [-c cycles.txt] ...\n"
+      " -t  EHTrace irradiance file (%us period), repeatable\n"
+      " -c  harvested energy values, one per line, repeatable\n"
+      " without -t/-c the synthetic profiles are used, or only -P\n"
+      " -Q  battery levels of the dynamic programming grid (%u)\n"
+      " -q  only print the per-set summaries\n",
+      name, HARVEST_TRACE_PERIOD, DEFAULT_LEVELS);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  uint32_t batt_start = BATT_MAX;
+  uint32_t levels = DEFAULT_LEVELS;
+  uint8_t verbose = 1;
+  int profile = -1;
+  uint8_t have_files = 0;
+  int i;
+
+  // options first, so they apply to all the files
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || argv[i][1] == 0 || argv[i][2] != 0){
+      usage(argv[0]);
+      return 1;
+    }
+    if (argv[i][1] == 'q'){
+      verbose = 0;
+      continue;
+    }
+    if (i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'Q': levels = strtoul(argv[++i], NULL, 0); break;
+      case 'P':
+        i++;
+        for (profile = 0; harvest_synthetic_name(profile); profile++){
+          if (strcmp(harvest_synthetic_name(profile), argv[i]) == 0) break;
+        }
+        if (harvest_synthetic_name(profile) == NULL){
+          fprintf(stderr, "unknown profile %s\n", argv[i]);
+          return 1;
+        }
+        break;
+      case 'b':
+        batt_start = BATT_MIN + (uint64_t)BATT_CAPACITY*strtoul(argv[++i], NULL, 0)/100;
+        break;
+      case 't':
+      case 'c':
+        have_files = 1;
+        i++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (levels < 2){
+    usage(argv[0]);
+    return 1;
+  }
+
+  printf("# SLOTS_PER_DAY %u, BATT_MIN %lu, BATT_MAX %lu, start %lu, %u levels\n",
+      SLOTS_PER_DAY, (unsigned long)BATT_MIN, (unsigned long)BATT_MAX,
+      (unsigned long)batt_start, levels);
+  if (verbose){
+    printf("slots,source,day,mallec_consumed,mallec_wasted,mallec_missing,mallec_end,"
+           "dp_consumed,dp_wasted,dp_end,gap_pc\n");
+  }
+
+  if (have_files){
+    for (i = 1; i < argc; i++){
+      HarvestSet set;
+      int err;
+      if (argv[i][1] != 't' && argv[i][1] != 'c'){
+        if (argv[i][1] != 'q') i++;
+        continue;
+      }
+      if (argv[i][1] == 't'){
+        err = harvest_load_trace(&set, argv[i+1], HARVEST_TRACE_PERIOD, SLOTS_PER_DAY);
+      }else{
+        err = harvest_load_cycles(&set, argv[i+1], SLOTS_PER_DAY);
+      }
+      i++;
+      if (err) return 1;
+      gap_set(&set, batt_start, levels, verbose);
+      harvest_free(&set);
+    }
+  }else{
+    uint8_t p;
+    for (p = 0; p < HARVEST_SYNTH_NUM; p++){
+      HarvestSet set;
+      if (profile >= 0 && p != profile) continue;
+      if (harvest_synthetic(&set, p, days, SLOTS_PER_DAY, peak, seed)) return 1;
+      gap_set(&set, batt_start, levels, verbose);
+      harvest_free(&set);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef __PLAN_SIM_H
+#define __PLAN_SIM_H
+
+/*
+ * Execution of the plan in service on the host, shared by the tools.
+ * Include after optimal_scheduler.h, it is compiled with the same
+ * SLOTS_PER_DAY and options as the scheduler.
+ */
+
+typedef struct plan_energy{
+  uint64_t consumed;
+  uint64_t wasted;    // harvested with the battery full
+  uint64_t missing;   // planned but not there, the battery being empty
+  uint32_t empty;     // slots that ran out, the node shutting down
+} PlanEnergy;
+
+/**
+ * Runs the first SLOTS_PER_DAY harvesting slots of the plan in
+ * service against the harvest @harvested, from the level @battery,
+ * which is updated. Each slot consumes its battery slot's rate, per
+ * base period of the grid @grid (NULL for one period per slot).
+ *
+ * The battery level is clipped at the end of each slot, as in the
+ * plan: consumption is cut at BATT_MIN, harvest is wasted above
+ * BATT_MAX. The energy is added to @energy.
+ */
+static void plan_run_cycle(const uint32_t *harvested, const uint8_t *grid,
+                           int64_t *battery, PlanEnergy *energy)
+{
+  uint16_t harv_i, end = 0;
+  uint32_t rate = 0;
+  uint8_t b = 0;
+
+  for (harv_i = 0; harv_i < SLOTS_PER_DAY; harv_i++){
+    int64_t e_cons;
+    if (harv_i == end){
+      b++;
+      rate = get_battery_slot_total_e_cons(b)/get_battery_slot_duration(b);
+      end += get_battery_slot_length(b);
+    }
+    e_cons = (int64_t)rate*(grid ? grid[harv_i] : 1);
+    *battery += harvested[harv_i];
+    if (*battery - e_cons < (int64_t)BATT_MIN){
+      energy->missing += BATT_MIN - (*battery - e_cons);
+      energy->empty ++;
+      e_cons = *battery > (int64_t)BATT_MIN ? *battery - BATT_MIN : 0;
+    }
+    *battery -= e_cons;
+    energy->consumed += e_cons;
+    if (*battery > (int64_t)BATT_MAX){
+      energy->wasted += *battery - BATT_MAX;
+      *battery = BATT_MAX;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Accuracy and cost of the predictor on the host.
+ *
+ * The cycles (synthetic, EHTrace files or serial logs) are replayed
+ * through eh_pred_core.c a slot at a time, as the eh_pred process
+ * does. Before each slot starts, the prediction of that slot and of
+ * the next few is taken, and compared with their harvest once they
+ * are over:
+ *
+ *   mape   mean absolute percentage error, over the slots that
+ *          harvest at least 1% of the peak of the set (not the nights)
+ *   nmae   absolute error over all the slots, relative to the harvest
+ *   bias   error (prediction - harvest), relative to the harvest
+ *
+ * one CSV line per set and horizon, horizon 0 being the slot about to
+ * start, SLOTS_PER_DAY - 1 a day ahead. The first -w days are left
+ * out, the history is empty then. With -N every set is replayed for
+ * as many nodes, each under its own shading (harvest_shade()), and
+ * the errors of all the nodes added up.
+ *
+ * Each eh_pred_insert() is timed with the time stamp counter, in
+ * host cycles (mean, median and 99th percentile): they only compare
+ * the variants, the mote takes many more. The RAM of each
+ * variant is the size of its eh_pred_core object, make pred-bench
+ * prints it.
+ *
+ * The predictor is compiled once per variant and SLOTS_PER_DAY value,
+ * see the Makefile; the binary is named after them
+ * (pred_bench_<variant>_<slots>).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles_now() __rdtsc()
+#else
+#define cycles_now() 0
+#endif
+
+#include "contiki.h"
+#include "eh_predictor.h"
+#include "eh_pred_core.h"
+#include "eh_sched_interface.h"
+#include "harvest_source.h"
+
+#define DEFAULT_DAYS    100
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+#define DEFAULT_WARMUP  1
+#define DEFAULT_SHADERS 4
+#define DEFAULT_AREA    100
+
+// 0, 1, 2, 4 ... and a day ahead
+#define MAX_HORIZONS    16
+
+// cycles per update are counted in buckets of 4, up to 16k
+#define COST_BUCKET     4
+#define COST_BUCKETS    4096
+
+// slots below this share of the peak are left out of the MAPE, percent
+#define MAPE_FLOOR_PC   1
+
+#if EH_PRED_ALGORITHM == EH_PRED_WCMA
+#define VARIANT (EH_PRED_QUANTIZE ? "wcma_q" : "wcma")
+#else
+#define VARIANT "ewma"
+#endif
+
+typedef struct error_sum{
+  uint64_t harvest;     // of the slots compared
+  uint64_t abs_err;
+  int64_t err;          // prediction - harvest
+  double ape;           // absolute percentage errors added up
+  uint32_t ape_slots;   // slots in ape
+} ErrorSum;
+
+typedef struct update_cost{
+  uint64_t updates;
+  uint64_t cycles;
+  uint64_t ns;
+  // the last bucket takes the longer ones, mostly the host at work
+  uint32_t histogram[COST_BUCKETS];
+} UpdateCost;
+
+static uint16_t horizons[MAX_HORIZONS];
+static uint8_t num_horizons;
+
+// prediction of each slot taken h slots before it starts, per horizon
+static uint32_t predicted[MAX_HORIZONS][SLOTS_PER_DAY];
+
+static ErrorSum by_horizon[MAX_HORIZONS];
+static ErrorSum by_slot[SLOTS_PER_DAY];     // horizon 0
+static UpdateCost cost;
+static uint64_t cycles_overhead;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void make_horizons()
+{
+  uint16_t h;
+
+  horizons[num_horizons++] = 0;
+  for (h = 1; h < SLOTS_PER_DAY - 1 && num_horizons < MAX_HORIZONS - 1; h *= 2){
+    horizons[num_horizons++] = h;
+  }
+  horizons[num_horizons++] = SLOTS_PER_DAY - 1;
+}
+
+// cost of reading the counter twice, taken off every update
+static void calibrate()
+{
+  uint64_t t, min = -1;
+  uint32_t i;
+
+  for (i = 0; i < 1000; i++){
+    t = cycles_now();
+    t = cycles_now() - t;
+    if (t < min) min = t;
+  }
+  cycles_overhead = min;
+}
+
+static void add_error(ErrorSum *sum, uint32_t p, uint32_t harvest, uint32_t floor)
+{
+  sum->harvest += harvest;
+  sum->abs_err += p > harvest ? p - harvest : harvest - p;
+  sum->err += (int64_t)p - harvest;
+  if (harvest >= floor && harvest > 0){
+    sum->ape += (p > harvest ? p - harvest : harvest - p)/(double)harvest;
+    sum->ape_slots ++;
+  }
+}
+
+static uint32_t set_peak(const HarvestSet *set)
+{
+  uint32_t c, peak = 0;
+  uint16_t s;
+
+  for (c = 0; c < set->num_cycles; c++){
+    for (s = 0; s < SLOTS_PER_DAY; s++){
+      if (harvest_cycle(set, c)[s] > peak) peak = harvest_cycle(set, c)[s];
+    }
+  }
+  return peak;
+}
+
+/**
+ * Replays @set, adding up the errors of the days after @warmup.
+ */
+static void replay_set(const HarvestSet *set, uint32_t warmup)
+{
+  uint32_t floor = (uint64_t)set_peak(set)*MAPE_FLOOR_PC/100;
+  uint32_t c, harvest;
+  uint64_t t, start, slot_index = 0;
+  uint16_t s;
+  uint8_t k;
+
+  eh_pred_reset();
+  for (c = 0; c < set->num_cycles; c++){
+    for (s = 0; s < SLOTS_PER_DAY; s++, slot_index++){
+      harvest = harvest_cycle(set, c)[s];
+      for (k = 0; k < num_horizons; k++){
+        predicted[k][(s + horizons[k]) % SLOTS_PER_DAY] = eh_pred_get_slot(s + horizons[k]);
+      }
+
+      // the slot is over, its predictions made h slots before it started
+      if (c >= warmup){
+        for (k = 0; k < num_horizons; k++){
+          if (slot_index < horizons[k]) continue;
+          add_error(&by_horizon[k], predicted[k][s], harvest, floor);
+        }
+        add_error(&by_slot[s], predicted[0][s], harvest, floor);
+      }
+
+      start = now_ns();
+      t = cycles_now();
+      eh_pred_insert(s, harvest);
+      t = cycles_now() - t;
+      cost.ns += now_ns() - start;
+      t = t > cycles_overhead ? t - cycles_overhead : 0;
+      cost.cycles += t;
+      cost.histogram[t/COST_BUCKET < COST_BUCKETS ? t/COST_BUCKET : COST_BUCKETS - 1] ++;
+      cost.updates ++;
+    }
+  }
+}
+
+static double pc(double a, double b)
+{
+  return b ? 100*a/b : 0;
+}
+
+// cycles that @permille of the updates took at most
+static uint32_t cost_quantile(uint32_t permille)
+{
+  uint64_t count = 0;
+  uint32_t b;
+
+  for (b = 0; b < COST_BUCKETS - 1; b++){
+    count += cost.histogram[b];
+    if (count*1000 >= cost.updates*permille) break;
+  }
+  return (b + 1)*COST_BUCKET;
+}
+
+static void print_errors(const char *name)
+{
+  uint8_t k;
+
+  for (k = 0; k < num_horizons; k++){
+    ErrorSum *e = &by_horizon[k];
+    printf("%s,%s,%u,%.2f,%.2f,%.2f\n", VARIANT, name, horizons[k],
+        e->ape_slots ? 100*e->ape/e->ape_slots : 0, pc(e->abs_err, e->harvest),
+        pc(e->err, e->harvest));
+  }
+}
+
+static void print_slots()
+{
+  uint16_t s;
+
+  printf("# slot,mape,nmae,bias (horizon 0)\n");
+  for (s = 0; s < SLOTS_PER_DAY; s++){
+    ErrorSum *e = &by_slot[s];
+    printf("# %u,%.2f,%.2f,%.2f\n", s, e->ape_slots ? 100*e->ape/e->ape_slots : 0,
+        pc(e->abs_err, e->harvest), pc(e->err, e->harvest));
+  }
+}
+
+/**
+ * Replays @base, for @nodes shaded nodes if any, and prints the errors.
+ */
+static int bench_set(const HarvestSet *base, uint32_t warmup, uint32_t nodes,
+                     const HarvestShading *shading, uint8_t verbose)
+{
+  uint32_t n;
+
+  memset(by_horizon, 0, sizeof(by_horizon));
+  memset(by_slot, 0, sizeof(by_slot));
+  if (nodes == 0){
+    replay_set(base, warmup);
+  }
+  for (n = 0; n < nodes; n++){
+    HarvestSet set;
+    if (harvest_shade(&set, base, shading, n)) return 1;
+    replay_set(&set, warmup);
+    harvest_free(&set);
+  }
+  print_errors(base->name);
+  if (verbose) print_slots();
+  return 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-d days] [-s seed] [-p peak] [-w warmup days] [-N nodes]\n"
+      "          [-S shaders] [-a area] [-v] [-t trace.csv] [-c cycles.txt] ...\n"
+      " -N  replay every set for as many nodes, each under its own shading\n"
+      "     (-S shaders over an -a x -a area, as optsched_fleet)\n"
+      " -v  add the errors of every slot of the day\n"
+      " without -t/-c the synthetic profiles are used\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  uint32_t warmup = DEFAULT_WARMUP;
+  uint32_t nodes = 0, shaders = DEFAULT_SHADERS;
+  double area = DEFAULT_AREA;
+  uint8_t have_files = 0, verbose = 0;
+  HarvestShading shading;
+  int i, err = 0;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-'){
+      usage(argv[0]);
+      return 1;
+    }
+    if (argv[i][1] == 'v'){
+      verbose = 1;
+      continue;
+    }
+    if (i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'w': warmup = strtoul(argv[++i], NULL, 0); break;
+      case 'N': nodes = strtoul(argv[++i], NULL, 0); break;
+      case 'S': shaders = strtoul(argv[++i], NULL, 0); break;
+      case 'a': area = strtod(argv[++i], NULL); break;
+      case 't':
+      case 'c':
+        have_files = 1;
+        i++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  memset(&shading, 0, sizeof(shading));
+  if (nodes && harvest_shading_make(&shading, nodes, shaders, area, seed)) return 1;
+  make_horizons();
+  calibrate();
+
+  printf("# SLOTS_PER_DAY %u, predictor %s, %lu warmup days, %lu nodes\n",
+      SLOTS_PER_DAY, VARIANT, (unsigned long)warmup, (unsigned long)nodes);
+  printf("variant,set,horizon,mape,nmae,bias\n");
+  if (have_files){
+    for (i = 1; i < argc; i++){
+      HarvestSet set;
+      int load;
+      if (argv[i][1] != 't' && argv[i][1] != 'c'){
+        if (argv[i][1] != 'v') i++;
+        continue;
+      }
+      if (argv[i][1] == 't'){
+        load = harvest_load_trace(&set, argv[i+1], HARVEST_TRACE_PERIOD, SLOTS_PER_DAY);
+      }else{
+        load = harvest_load_cycles(&set, argv[i+1], SLOTS_PER_DAY);
+      }
+      i++;
+      if (load) return 1;
+      err |= bench_set(&set, warmup, nodes, &shading, verbose);
+      harvest_free(&set);
+    }
+  }else{
+    uint8_t p;
+    for (p = 0; p < HARVEST_SYNTH_NUM; p++){
+      HarvestSet set;
+      if (harvest_synthetic(&set, p, days, SLOTS_PER_DAY, peak, seed)) return 1;
+      err |= bench_set(&set, warmup, nodes, &shading, verbose);
+      harvest_free(&set);
+    }
+  }
+  if (cost.updates){
+    printf("# %s update: mean %.0f cycles (%.0f ns), median %lu, 99%% %lu, %llu updates\n",
+        VARIANT, (double)cost.cycles/cost.updates, (double)cost.ns/cost.updates,
+        (unsigned long)cost_quantile(500), (unsigned long)cost_quantile(990),
+        (unsigned long long)cost.updates);
+  }
+  harvest_shading_free(&shading);
+  return err;
+}
@@ -0,0 +1,420 @@
+/*
+ * Host checks of the predictor (eh_pred_core.c), built with the prefix
+ * sums whatever SLOTS_PER_DAY is (EH_PRED_CONF_PREFIX=1) and with the
+ * external forecasts (EH_PRED_CONF_FORECAST=1).
+ *
+ * Ranges (eh_pred_get_range, eh_pred_get_horizon): the cycles are
+ * replayed a slot at a time, and after every slot the sums are
+ * compared with the ones added up, slot by slot, from the cycle
+ * prediction: the horizon for every count, random slots and counts,
+ * and a few times a day every slot and count, those that go past
+ * midnight included. Each slot moves the ring of the sums on by one
+ * entry, so a run of days goes round it as many times; every
+ * SKIP_EVERY days a slot is left out, as after a restart, and the
+ * next one sums the day again. The replay is done once more with
+ * clear days scaled up for the sums of a day to wrap at 2^32.
+ *
+ * Forecasts (eh_pred_forecast_input): lines that are not forecasts are
+ * ignored, the broken, short or too long ones, and those with a slot
+ * or a percent out of range, are dropped whole and leave the
+ * prediction as it was; the others blend the slots they cover, from
+ * their slot on and past midnight. Then the days are replayed with a
+ * forecast of the afternoon every morning, right or wrong: after each
+ * slot the prediction is the one of the same replay without forecasts,
+ * blended with the forecast of each slot until the slot ends, the sums
+ * follow it, and the weight of the forecast goes up when they are
+ * right and down when they are wrong.
+
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "contiki.h"
+#include "eh_predictor.h"
+#include "eh_pred_core.h"
+#include "eh_sched_interface.h"
+#include "harvest_source.h"
+// failures printed, the others are only counted
+#define CHECK_MAX_PRINTED 20
+#include "check.h"
+
+#define DEFAULT_DAYS    12
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+// clear days of the highest harvest scaled up by this much add up to
+// more than 2^32 a day, EH_PRED_WCMA_DAYS of a slot still fit in 32 bits
+#define WRAP_SCALE      80
+
+// days between the slots left out, the runs between go round the ring
+#define SKIP_EVERY      4
+// random ranges checked after each slot
+#define RANDOM_RANGES   64
+
+#if EH_PRED_FORECAST
+// days replayed with forecasts, the first one without
+#define FORECAST_DAYS   4
+// percents on a line after its slot, FORECAST_LINE_VALUES - 1 in eh_pred_core.c
+#define LINE_PERCENTS   23
+#define NO_FORECAST     255
+// a line of them, "fc <slot>" and up to 4 characters a percent
+#define LINE_SIZE       (LINE_PERCENTS*4 + 16)
+#endif
+
+// sums of the prediction from slot 0 on, over two days
+static uint32_t sums[2*SLOTS_PER_DAY + 1];
+static uint64_t day_sum, max_day_sum;
+
+static void sum_prediction()
+{
+  const uint32_t *p = eh_pred_get_cycle_prediction();
+  uint16_t i;
+
+  sums[0] = 0;
+  day_sum = 0;
+  for (i = 0; i < 2*SLOTS_PER_DAY; i++){
+    sums[i+1] = sums[i] + p[i % SLOTS_PER_DAY];
+    if (i < SLOTS_PER_DAY) day_sum += p[i];
+  }
+  if (day_sum > max_day_sum) max_day_sum = day_sum;
+}
+
+// the prediction of @count slots from @slot on, one slot at a time
+static uint32_t range_slots(uint16_t slot, uint16_t count)
+{
+  const uint32_t *p = eh_pred_get_cycle_prediction();
+  uint32_t sum = 0;
+
+  while (count--){
+    sum += p[slot];
+    if (++slot == SLOTS_PER_DAY) slot = 0;
+  }
+  return sum;
+}
+
+static uint32_t range_sums(uint16_t slot, uint16_t count)
+{
+  return sums[slot + count] - sums[slot];
+}
+
+/**
+ * Checks every range of the day, @next being the slot about to start.
+ * Returns the number of them that go past midnight.
+ */
+static uint32_t check_all_ranges(uint16_t next)
+{
+  uint32_t crossing = 0, got, want;
+  uint16_t slot, count;
+
+  for (count = 0; count <= SLOTS_PER_DAY; count++){
+    got = eh_pred_get_horizon(count);
+    want = range_sums(next, count);
+    check(got == want, "horizon", (long)(int32_t)(got - want));
+    for (slot = 0; slot < SLOTS_PER_DAY; slot++){
+      got = eh_pred_get_range(slot, count);
+      want = range_sums(slot, count);
+      check(got == want, "range", (long)(int32_t)(got - want));
+      crossing += slot + count > SLOTS_PER_DAY;
+    }
+  }
+  return crossing;
+}
+
+static void check_ranges(const HarvestSet *set, uint32_t *state)
+{
+  uint32_t checks_before = checks, failed_before = failed, crossing = 0;
+  uint32_t c, got, want;
+  uint16_t s, skip, slot, count, i;
+
+  eh_pred_reset();
+  max_day_sum = 0;
+  for (c = 0; c < set->num_cycles; c++){
+    uint32_t *cycle = harvest_cycle(set, c);
+    skip = c % SKIP_EVERY == SKIP_EVERY - 1 ? xorshift(state) % SLOTS_PER_DAY : SLOTS_PER_DAY;
+    for (s = 0; s < SLOTS_PER_DAY; s++){
+      if (s == skip) continue;
+      eh_pred_insert(s, cycle[s]);
+      sum_prediction();
+      if (s % (SLOTS_PER_DAY/4) == 0){
+        crossing += check_all_ranges((s + 1) % SLOTS_PER_DAY);
+        continue;
+      }
+      for (count = 0; count <= SLOTS_PER_DAY; count++){
+        got = eh_pred_get_horizon(count);
+        want = range_sums((s + 1) % SLOTS_PER_DAY, count);
+        check(got == want, "horizon", (long)(int32_t)(got - want));
+      }
+      for (i = 0; i < RANDOM_RANGES; i++){
+        slot = xorshift(state) % SLOTS_PER_DAY;
+        count = xorshift(state) % (SLOTS_PER_DAY + 1);
+        got = eh_pred_get_range(slot, count);
+        want = range_slots(slot, count);
+        check(got == want, "range", (long)(int32_t)(got - want));
+        crossing += slot + count > SLOTS_PER_DAY;
+      }
+    }
+  }
+  printf("# ranges, %s: %lu checks, %lu failed (%lu past midnight, day sums up to %llu)\n",
+      set->name, (unsigned long)(checks - checks_before),
+      (unsigned long)(failed - failed_before), (unsigned long)crossing,
+      (unsigned long long)max_day_sum);
+}
+
+#if EH_PRED_FORECAST
+// the forecast each slot should have, NO_FORECAST for none
+static uint8_t forecast_of[SLOTS_PER_DAY];
+
+static void check_input(const char *line, uint8_t want)
+{
+  uint8_t got = eh_pred_forecast_input(line);
+  char what[LINE_SIZE + 16];
+
+  snprintf(what, sizeof(what), "forecast line \"%s\"", line);
+  check(got == want, what, got);
+}
+
+/**
+ * Checks the prediction against @predicted, the one without the
+ * forecasts, blended with forecast_of[], and the sum of the day.
+ */
+static void check_blend(const uint32_t *predicted, const char *what)
+{
+  const uint32_t *p = eh_pred_get_cycle_prediction();
+  int32_t weight = eh_pred_get_forecast_weight();
+  uint32_t want, sum = 0, wrong = 0;
+  uint16_t k;
+
+  for (k = 0; k < SLOTS_PER_DAY; k++){
+    want = predicted[k];
+    if (forecast_of[k] != NO_FORECAST){
+      // the weight and the percents in 1/10000
+      want = (uint64_t)want*(10000 + weight*((int32_t)forecast_of[k] - 100))/10000;
+    }
+    wrong += p[k] != want;
+    sum += want;
+  }
+  check(wrong == 0, what, wrong);
+  check(eh_pred_get_horizon(SLOTS_PER_DAY) == sum, "sum of the blended day",
+        (long)(int32_t)(eh_pred_get_horizon(SLOTS_PER_DAY) - sum));
+  check(weight <= 100, "forecast weight", weight);
+}
+
+static void check_forecast_lines(const HarvestSet *set)
+{
+  uint32_t checks_before = checks, failed_before = failed;
+  uint32_t predicted[SLOTS_PER_DAY];
+  char line[LINE_SIZE];
+  uint16_t s, k;
+  int n;
+
+  // two days of history, the predictions are not all 0
+  eh_pred_reset();
+  for (k = 0; k < 2*SLOTS_PER_DAY; k++){
+    eh_pred_insert(k % SLOTS_PER_DAY, harvest_cycle(set, k/SLOTS_PER_DAY)[k % SLOTS_PER_DAY]);
+  }
+  memcpy(predicted, eh_pred_get_cycle_prediction(), sizeof(predicted));
+  memset(forecast_of, NO_FORECAST, sizeof(forecast_of));
+
+  check_input("", EH_PRED_FORECAST_IGNORED);
+  check_input("fc", EH_PRED_FORECAST_IGNORED);
+  check_input("fcx 3 50", EH_PRED_FORECAST_IGNORED);
+  check_input("FC 3 50", EH_PRED_FORECAST_IGNORED);
+  check_input("fc end", EH_PRED_FORECAST_READY);
+  check_input("fc end\r\n", EH_PRED_FORECAST_READY);
+  check_input("fc endx", EH_PRED_FORECAST_ERROR);
+  check_input("fc end 3", EH_PRED_FORECAST_ERROR);
+  check_input("fc ", EH_PRED_FORECAST_ERROR);
+  check_input("fc 3", EH_PRED_FORECAST_ERROR);
+  check_input("fc 3 -5", EH_PRED_FORECAST_ERROR);
+  check_input("fc 3 50,60", EH_PRED_FORECAST_ERROR);
+  check_input("fc 3 5x", EH_PRED_FORECAST_ERROR);
+  check_input("fc 3 50 255", EH_PRED_FORECAST_ERROR);
+  // 2^32 + 50 and 2^32 + 3
+  check_input("fc 3 4294967346", EH_PRED_FORECAST_ERROR);
+  check_input("fc 4294967299 50", EH_PRED_FORECAST_ERROR);
+  snprintf(line, sizeof(line), "fc %u 50", SLOTS_PER_DAY);
+  check_input(line, EH_PRED_FORECAST_ERROR);
+  n = snprintf(line, sizeof(line), "fc 3");
+  for (k = 0; k <= LINE_PERCENTS; k++) n += snprintf(line + n, sizeof(line) - n, " 50");
+  check_input(line, EH_PRED_FORECAST_ERROR);
+  check_blend(predicted, "prediction after the dropped lines");
+
+  check_input("fc 3 50", EH_PRED_FORECAST_PART);
+  forecast_of[3] = 50;
+  check_input("fc 0007 0", EH_PRED_FORECAST_PART);
+  forecast_of[7] = 0;
+  check_input("fc  9  254 \r\n", EH_PRED_FORECAST_PART);
+  forecast_of[9] = 254;
+  snprintf(line, sizeof(line), "fc %u 60 70 80", SLOTS_PER_DAY - 1);
+  check_input(line, EH_PRED_FORECAST_PART);
+  forecast_of[SLOTS_PER_DAY - 1] = 60;
+  forecast_of[0] = 70;
+  forecast_of[1] = 80;
+  n = snprintf(line, sizeof(line), "fc %u", SLOTS_PER_DAY/2);
+  for (k = 0; k < LINE_PERCENTS; k++){
+    s = (SLOTS_PER_DAY/2 + k) % SLOTS_PER_DAY;
+    forecast_of[s] = 100 + k;
+    n += snprintf(line + n, sizeof(line) - n, " %u", 100 + k);
+  }
+  check_input(line, EH_PRED_FORECAST_PART);
+  check_input("fc 3 40 255", EH_PRED_FORECAST_ERROR);
+  check_input("fc end", EH_PRED_FORECAST_READY);
+  check_blend(predicted, "prediction blended with the lines taken in");
+
+  printf("# forecast lines: %lu checks, %lu failed\n",
+      (unsigned long)(checks - checks_before), (unsigned long)(failed - failed_before));
+}
+
+/**
+ * Percent of its prediction @predicted that a slot harvests, @right,
+ * or far from it.
+ */
+static uint8_t forecast_percent(uint32_t predicted, uint32_t harvest, uint8_t right)
+{
+  uint64_t percent = predicted ? (100ULL*harvest + predicted/2)/predicted : 100;
+
+  if (percent > NO_FORECAST - 1) percent = NO_FORECAST - 1;
+  if (!right) percent = percent >= 100 ? 0 : NO_FORECAST - 1;
+  return percent;
+}
+
+/**
+ * Replays @set with a forecast of the afternoon every morning, @right
+ * or not, against @reference: the predictions after each slot of the
+ * same replay without forecasts.
+ */
+static void check_forecast_days(const HarvestSet *set, const uint32_t *reference, uint8_t right)
+{
+  uint32_t checks_before = checks, failed_before = failed;
+  const uint16_t morning = SLOTS_PER_DAY/4;
+  char line[LINE_SIZE];
+  const uint32_t *before;
+  uint32_t c;
+  uint16_t s, k, i;
+  int n;
+
+  eh_pred_reset();
+  memset(forecast_of, NO_FORECAST, sizeof(forecast_of));
+  for (c = 0; c < set->num_cycles; c++){
+    uint32_t *cycle = harvest_cycle(set, c);
+    for (s = 0; s < SLOTS_PER_DAY; s++){
+      eh_pred_insert(s, cycle[s]);
+      forecast_of[s] = NO_FORECAST;
+      before = reference + ((size_t)c*SLOTS_PER_DAY + s)*SLOTS_PER_DAY;
+      check_blend(before, "prediction with the forecasts");
+      if (c == 0 || s != morning) continue;
+      // slots morning + 1 on, each predicted as it ends as after the slot before
+      for (k = morning + 1; k <= morning + SLOTS_PER_DAY/2; k += i){
+        n = snprintf(line, sizeof(line), "fc %u", k);
+        for (i = 0; i < LINE_PERCENTS && k + i <= morning + SLOTS_PER_DAY/2; i++){
+          const uint32_t *ending = before + (size_t)(k + i - 1 - s)*SLOTS_PER_DAY;
+          forecast_of[k + i] = forecast_percent(ending[k + i], cycle[k + i], right);
+          n += snprintf(line + n, sizeof(line) - n, " %u", forecast_of[k + i]);
+        }
+        check_input(line, EH_PRED_FORECAST_PART);
+      }
+      check_input("fc end", EH_PRED_FORECAST_READY);
+      check_blend(before, "prediction with a new forecast");
+    }
+  }
+  if (right){
+    check(eh_pred_get_forecast_weight() > 50, "weight of right forecasts",
+          eh_pred_get_forecast_weight());
+  }else{
+    check(eh_pred_get_forecast_weight() < 50, "weight of wrong forecasts",
+          eh_pred_get_forecast_weight());
+  }
+  printf("# forecast days, %s ones: %lu checks, %lu failed (weight %u%%)\n",
+      right ? "right" : "wrong", (unsigned long)(checks - checks_before),
+      (unsigned long)(failed - failed_before), eh_pred_get_forecast_weight());
+}
+
+static int check_forecasts(uint32_t peak, uint32_t seed)
+{
+  uint32_t *reference, *p;
+  HarvestSet set;
+  uint32_t c;
+  uint16_t s;
+
+  if (harvest_synthetic(&set, HARVEST_SYNTH_MIXED, FORECAST_DAYS, SLOTS_PER_DAY, peak, seed)){
+    return 1;
+  }
+  check_forecast_lines(&set);
+  reference = malloc(sizeof(uint32_t)*SLOTS_PER_DAY*SLOTS_PER_DAY*set.num_cycles);
+  if (!reference){
+    harvest_free(&set);
+    return 1;
+  }
+  eh_pred_reset();
+  for (p = reference, c = 0; c < set.num_cycles; c++){
+    for (s = 0; s < SLOTS_PER_DAY; s++, p += SLOTS_PER_DAY){
+      eh_pred_insert(s, harvest_cycle(&set, c)[s]);
+      memcpy(p, eh_pred_get_cycle_prediction(), 4*SLOTS_PER_DAY);
+    }
+  }
+  check_forecast_days(&set, reference, 1);
+  check_forecast_days(&set, reference, 0);
+  free(reference);
+  harvest_free(&set);
+  return 0;
+}
+#endif
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-d days] [-s seed] [-p peak]\n"
+      " checks against the synthetic mixed days, and clear ones\n"
+      " scaled up for the sums to wrap\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  uint32_t state;
+  HarvestSet set;
+  size_t k;
+  int i;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  state = seed ? seed : 1;
+
+  printf("# %u slots a day, prefix sums %s, forecasts %s\n", SLOTS_PER_DAY,
+      EH_PRED_PREFIX ? "on" : "off", EH_PRED_FORECAST ? "on" : "off");
+  if (harvest_synthetic(&set, HARVEST_SYNTH_MIXED, days, SLOTS_PER_DAY, peak, seed)){
+    fprintf(stderr, "cannot make the cycles\n");
+    return 1;
+  }
+  check_ranges(&set, &state);
+  harvest_free(&set);
+  if (harvest_synthetic(&set, HARVEST_SYNTH_CLEAR, days, SLOTS_PER_DAY, EH_MAX_LIMIT, seed)){
+    fprintf(stderr, "cannot make the cycles\n");
+    return 1;
+  }
+  for (k = 0; k < (size_t)set.num_cycles*set.slots; k++) set.cycles[k] *= WRAP_SCALE;
+  snprintf(set.name, sizeof(set.name), "clear x%u", WRAP_SCALE);
+  check_ranges(&set, &state);
+  harvest_free(&set);
+#if EH_PRED_FORECAST
+  if (check_forecasts(peak, seed)){
+    fprintf(stderr, "cannot make the cycles\n");
+    return 1;
+  }
+#endif
+  return failed != 0;
+}
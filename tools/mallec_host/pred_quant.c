@@ -0,0 +1,203 @@
+/*
+ * Error added by the 16 bit history of the predictor
+ * (EH_PRED_CONF_QUANTIZE), on the host.
+ *
+ * The codes are checked first: every value below 2^24 and random ones
+ * above, against the relative error bound of 2^-12, and every code has
+ * to decode above the one before it.
+ *
+ * Then the cycles are replayed through the WCMA predictor
+ * (eh_pred_core.c), a slot at a time as the eh_pred process does, and
+ * the prediction of each slot, taken when it starts, is compared with
+ * its harvest. Built with the 32 bit history the predictions are
+ * written with -w; built with the 16 bit one (pred_quant_q_<slots>)
+ * they are read back with -r and compared. See make compare-quant.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "contiki.h"
+#include "eh_predictor.h"
+#include "eh_pred_core.h"
+#include "eh_sched_interface.h"
+#include "harvest_source.h"
+
+#define DEFAULT_DAYS    100
+#define DEFAULT_PEAK    (3*E_CONS_MAX)
+
+// predictions that may differ by more than the codes do, in ppm of the harvest
+#define MAX_ADDED_ERROR_PPM 1000
+
+static uint32_t xorshift(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static double max_code_err;
+static uint32_t code_errors;
+
+static void check_code(uint32_t v)
+{
+  uint32_t c = eh_pred_decode(eh_pred_encode(v));
+  double err;
+
+  if (v <= EH_PRED_MANTISSA_MASK && c != v) code_errors ++;
+  err = v ? (c > v ? (double)(c - v)/v : (double)(v - c)/v) : 0;
+  if (err > max_code_err) max_code_err = err;
+}
+
+static int check_codes()
+{
+  const double bound = 1.0/(1UL << (EH_PRED_MANTISSA_BITS + 1));
+  uint32_t v, state = 1;
+  uint16_t c;
+
+  for (v = 0; v < (1UL << 24); v++) check_code(v);
+  for (v = 0; v < 10000000; v++) check_code(xorshift(&state));
+  check_code(0xFFFFFFFFUL);
+
+  // the codes go up to the saturated one
+  for (c = 1; eh_pred_decode(c - 1) != 0xFFF00000UL; c++){
+    if (eh_pred_decode(c) <= eh_pred_decode(c - 1)) code_errors ++;
+  }
+  printf("# codes: %lu, max relative error %.3g (bound %.3g), %lu errors\n",
+      (unsigned long)c, max_code_err, bound, (unsigned long)code_errors);
+  return code_errors || max_code_err > bound;
+}
+
+/**
+ * Replays @set, writes the predictions to @out or compares them with
+ * those of @ref.
+ */
+static int replay_set(const HarvestSet *set, FILE *out, FILE *ref)
+{
+  uint64_t harvest = 0, abs_err = 0, added = 0;
+  uint32_t c, p, r, max_added = 0, diffs = 0;
+  uint16_t s;
+  int err = 0;
+
+  eh_pred_reset();
+  for (c = 0; c < set->num_cycles; c++){
+    uint32_t *cycle = harvest_cycle(set, c);
+    for (s = 0; s < SLOTS_PER_DAY; s++){
+      // the prediction of the slot as it starts
+      p = eh_pred_get_slot(s);
+      harvest += cycle[s];
+      abs_err += p > cycle[s] ? p - cycle[s] : cycle[s] - p;
+      if (out) fwrite(&p, sizeof(p), 1, out);
+      if (ref){
+        if (fread(&r, sizeof(r), 1, ref) != 1){
+          fprintf(stderr, "reference too short\n");
+          return 1;
+        }
+        r = p > r ? p - r : r - p;
+        added += r;
+        diffs += r != 0;
+        if (r > max_added) max_added = r;
+      }
+      eh_pred_insert(s, cycle[s]);
+    }
+  }
+  printf("# %s: %lu days, relative MAE %.4f", set->name,
+      (unsigned long)set->num_cycles, harvest ? (double)abs_err/harvest : 0);
+  if (ref){
+    printf(", %lu predictions differ, added error %.1f ppm of the harvest, max %lu",
+        (unsigned long)diffs, harvest ? 1e6*added/harvest : 0, (unsigned long)max_added);
+    err = harvest && 1e6*added/harvest > MAX_ADDED_ERROR_PPM;
+  }
+  printf("\n");
+  return err;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+      "usage: %s [-d days] [-s seed] [-p peak] [-w out.bin | -r ref.bin]\n"
+      "          [-t trace.csv] [-c cycles.txt] ...\n"
+      " -w  write the predictions (32 bit history build)\n"
+      " -r  compare the predictions with those written by -w\n"
+      " without -t/-c the synthetic profiles are used\n",
+      name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t days = DEFAULT_DAYS;
+  uint32_t seed = 1;
+  uint32_t peak = DEFAULT_PEAK;
+  uint8_t have_files = 0;
+  FILE *out = NULL, *ref = NULL;
+  int i, err;
+
+  for (i = 1; i < argc; i++){
+    if (argv[i][0] != '-' || i+1 == argc){
+      usage(argv[0]);
+      return 1;
+    }
+    switch (argv[i][1]){
+      case 'd': days = strtoul(argv[++i], NULL, 0); break;
+      case 's': seed = strtoul(argv[++i], NULL, 0); break;
+      case 'p': peak = strtoul(argv[++i], NULL, 0); break;
+      case 'w':
+        if ((out = fopen(argv[++i], "wb")) == NULL){
+          perror(argv[i]);
+          return 1;
+        }
+        break;
+      case 'r':
+        if ((ref = fopen(argv[++i], "rb")) == NULL){
+          perror(argv[i]);
+          return 1;
+        }
+        break;
+      case 't':
+      case 'c':
+        have_files = 1;
+        i++;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  printf("# SLOTS_PER_DAY %u, WCMA over %u days, %s history (%lu bytes)\n",
+      SLOTS_PER_DAY, EH_PRED_WCMA_DAYS, EH_PRED_QUANTIZE ? "16 bit" : "32 bit",
+      (unsigned long)EH_PRED_WCMA_DAYS*SLOTS_PER_DAY*(EH_PRED_QUANTIZE ? 2 : 4));
+  err = check_codes();
+
+  if (have_files){
+    for (i = 1; i < argc; i++){
+      HarvestSet set;
+      int load;
+      if (argv[i][1] != 't' && argv[i][1] != 'c'){
+        i++;
+        continue;
+      }
+      if (argv[i][1] == 't'){
+        load = harvest_load_trace(&set, argv[i+1], HARVEST_TRACE_PERIOD, SLOTS_PER_DAY);
+      }else{
+        load = harvest_load_cycles(&set, argv[i+1], SLOTS_PER_DAY);
+      }
+      i++;
+      if (load) return 1;
+      err |= replay_set(&set, out, ref);
+      harvest_free(&set);
+    }
+  }else{
+    uint8_t p;
+    for (p = 0; p < HARVEST_SYNTH_NUM; p++){
+      HarvestSet set;
+      if (harvest_synthetic(&set, p, days, SLOTS_PER_DAY, peak, seed)) return 1;
+      err |= replay_set(&set, out, ref);
+      harvest_free(&set);
+    }
+  }
+  if (out) fclose(out);
+  if (ref) fclose(ref);
+  return err;
+}